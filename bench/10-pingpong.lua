@@ -0,0 +1,59 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Round trips over socket.pair: one coroutine writes a message and
+-- waits for the echo, the other echoes it back. Measures the cost of a
+-- full cqueue:step, poll and resume cycle plus socket:read and
+-- socket:write for small and page-sized messages.
+--
+require"bench".export".*"
+
+local function pingpong(size, count)
+	local msg = string.rep("x", size)
+	local rtt = {}
+
+	local elapsed = run(function (cq)
+		local a, b = check(socket.pair())
+
+		a:setmode("bn", "bn")
+		b:setmode("bn", "bn")
+
+		cq:wrap(function ()
+			for _ = 1, count do
+				local data = check(b:read(size))
+
+				check(b:write(data))
+			end
+
+			b:close()
+		end)
+
+		for i = 1, count do
+			local began = monotime()
+
+			check(a:write(msg))
+			check(a:read(size))
+
+			rtt[i] = (monotime() - began) * 1e6
+		end
+
+		a:close()
+	end)
+
+	local q = quantiles(rtt)
+
+	report(string.format("%dB", size), {
+		count = count,
+		elapsed = elapsed,
+		rate = count / elapsed,
+		rtt_p50_us = q.p50,
+		rtt_p99_us = q.p99,
+		rtt_max_us = q.max,
+	})
+end
+
+pingpong(16, n(100000))
+pingpong(4096, n(50000))
@@ -0,0 +1,91 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- HTTP-like request parsing over socket.pair: a writer pipelines
+-- requests of a request line, ten headers and a blank line, and a
+-- reader takes them apart with the "*l" and "*h" formats. Exercises the
+-- line and MIME header scanners and buffer refills rather than
+-- polling.
+--
+require"bench".export".*"
+
+local request = table.concat({
+	"GET /index.html HTTP/1.1",
+	"Host: www.example.com",
+	"User-Agent: bench/1.0",
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+	"Accept-Language: en-US,en;q=0.5",
+	"Accept-Encoding: gzip, deflate",
+	"Connection: keep-alive",
+	"Cookie: session=0123456789abcdef0123456789abcdef",
+	"Cache-Control: max-age=0",
+	"X-Forwarded-For: 192.0.2.1,",
+	"	198.51.100.2",
+	"If-None-Match: \"5d8c72a5edda8d6a\"",
+	"",
+	"",
+}, "\r\n")
+
+local response = "HTTP/1.1 204 No Content\r\nServer: bench/1.0\r\n\r\n"
+
+--
+-- With lockstep each request waits for a response, which is parsed the
+-- same way, so every request costs a round trip through the
+-- controller; otherwise the writer pipelines as fast as it can.
+--
+local function headers(case, count, lockstep)
+	local nheader = 0
+
+	local elapsed = run(function (cq)
+		local a, b = check(socket.pair())
+
+		cq:wrap(function ()
+			for _ = 1, count do
+				check(a:write(request))
+
+				if lockstep then
+					check(a:flush())
+					check(a:read"*l")
+
+					for _ in a:lines"*h" do end
+
+					check(a:read"*l")
+				end
+			end
+
+			check(a:flush())
+			a:close()
+		end)
+
+		for _ = 1, count do
+			check(b:read"*l")
+
+			for _ in b:lines"*h" do
+				nheader = nheader + 1
+			end
+
+			check(b:read"*l")
+
+			if lockstep then
+				check(b:write(response))
+				check(b:flush())
+			end
+		end
+
+		b:close()
+	end)
+
+	report(case, {
+		count = count,
+		headers = nheader,
+		bytes = count * #request,
+		elapsed = elapsed,
+		rate = count / elapsed,
+	})
+end
+
+headers("pipelined", n(100000), false)
+headers("lockstep", n(50000), true)
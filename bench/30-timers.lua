@@ -0,0 +1,50 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Idle timer churn: many coroutines repeatedly sleeping for short,
+-- random intervals, as with per-connection idle timeouts. Reports
+-- wakeups per second and how late they fire, for both the timer tree
+-- and the timing wheel.
+--
+require"bench".export".*"
+
+local function churn(timers, count, rounds)
+	local late = {}
+
+	math.randomseed(1)
+
+	local elapsed = run(function (cq)
+		for _ = 1, count do
+			cq:wrap(function ()
+				for _ = 1, rounds do
+					local timeout = 0.001 + math.random() * 0.049
+					local deadline = monotime() + timeout
+
+					cqueues.sleep(timeout)
+
+					late[#late + 1] = (monotime() - deadline) * 1e6
+				end
+			end)
+		end
+	end, { timers = timers })
+
+	local q = quantiles(late)
+
+	report(string.format("%s/%d", timers, count), {
+		count = count,
+		wakeups = #late,
+		elapsed = elapsed,
+		rate = #late / elapsed,
+		late_p50_us = q.p50,
+		late_p99_us = q.p99,
+		late_max_us = q.max,
+	})
+end
+
+for _, timers in ipairs{ "tree", "wheel" } do
+	churn(timers, n(10000), 10)
+	churn(timers, n(100000), 3)
+end
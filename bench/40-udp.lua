@@ -0,0 +1,111 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- UDP flood over the loopback: a sender blasts datagrams at a bound
+-- socket and the receiver counts what arrives, either one at a time
+-- with socket:read and socket:write or in batches with
+-- socket:sendmany and socket:recvmany. The sender may run only WINDOW
+-- datagrams ahead so the rate reflects delivered rather than dropped
+-- packets; whatever is lost anyway ends the run after a short quiet
+-- period.
+--
+require"bench".export".*"
+
+local WINDOW = 256
+local BATCH = 32
+local QUIET = 0.25
+
+local function flood(size, count, batched)
+	local msg = string.rep("x", size)
+	local msgs = {}
+	local received, bytes, last = 0, 0, nil
+	local began
+
+	for i = 1, BATCH do
+		msgs[i] = msg
+	end
+
+	run(function (cq)
+		local srv = check(socket.listen{ host = "127.0.0.1", port = 0, type = socket.SOCK_DGRAM })
+		check(srv:listen())
+
+		local _, host, port = check(srv:localname())
+		local cli = check(socket.connect{ host = host, port = port, type = socket.SOCK_DGRAM })
+		local done = false
+
+		srv:setmode("bn", "bn")
+		cli:setmode("bn", "bn")
+		check(cli:connect())
+
+		cq:wrap(function ()
+			local batch = socket.batch(BATCH, math.max(size, 64))
+
+			while received < count do
+				if batched then
+					if not srv:recvmany(batch, QUIET) then
+						break
+					end
+
+					for i = 1, #batch do
+						bytes = bytes + batch:size(i)
+					end
+
+					received = received + #batch
+				else
+					local data = srv:xread("*a", QUIET)
+
+					if not data then
+						break
+					end
+
+					received = received + 1
+					bytes = bytes + #data
+				end
+
+				last = monotime()
+			end
+
+			done = true
+		end)
+
+		local sent = 0
+
+		began = monotime()
+
+		while sent < count and not done do
+			if sent - received >= WINDOW then
+				cqueues.poll(srv, 0.001)
+			elseif batched then
+				sent = sent + check(cli:sendmany(msgs))
+			else
+				check(cli:write(msg))
+				sent = sent + 1
+			end
+		end
+
+		while not done do
+			cqueues.sleep(QUIET / 2)
+		end
+
+		srv:close()
+		cli:close()
+	end)
+
+	local elapsed = (last or began) - began
+
+	report(string.format("%s/%dB", batched and "batch" or "single", size), {
+		count = count,
+		received = received,
+		bytes = bytes,
+		elapsed = elapsed,
+		rate = received / elapsed,
+	})
+end
+
+for _, batched in ipairs{ false, true } do
+	flood(64, n(200000), batched)
+	flood(1400, n(100000), batched)
+end
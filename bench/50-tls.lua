@@ -0,0 +1,50 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Full TLS handshakes per second over socket.pair, with the client and
+-- server taking turns in one controller, for RSA and EC certificates.
+-- Requires luaossl.
+--
+require"bench".export".*"
+
+local regress = require"regress"
+
+local function handshakes(keytype, count)
+	local srv_ctx = regress.getsslctx("TLS", true, keytype)
+	local cli_ctx = regress.getsslctx("TLS", false, false)
+	local latency = {}
+
+	local elapsed = run(function (cq)
+		for i = 1, count do
+			local a, b = check(socket.pair())
+			local began = monotime()
+
+			cq:wrap(function ()
+				check(b:starttls(srv_ctx))
+				b:close()
+			end)
+
+			check(a:starttls(cli_ctx))
+
+			latency[i] = (monotime() - began) * 1e6
+
+			a:close()
+		end
+	end)
+
+	local q = quantiles(latency)
+
+	report(keytype, {
+		count = count,
+		elapsed = elapsed,
+		rate = count / elapsed,
+		p50_us = q.p50,
+		p99_us = q.p99,
+	})
+end
+
+handshakes("RSA", n(1000))
+handshakes("EC", n(2000))
@@ -0,0 +1,47 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- cqueues.thread.start latency: time from starting a thread until its
+-- first message arrives over the thread's socket, and until it has
+-- been joined. Each thread loads a fresh Lua state and the cqueues
+-- modules, which dominates the cost.
+--
+require"bench".export".*"
+
+local function start(count)
+	local ready, joined = {}, {}
+
+	local elapsed = run(function ()
+		for i = 1, count do
+			local began = monotime()
+			local thr, con = check(thread.start(function (con)
+				con:write"ready\n"
+			end))
+
+			check(con:read"*l")
+			ready[i] = (monotime() - began) * 1e6
+
+			check(thr:join())
+			joined[i] = (monotime() - began) * 1e6
+
+			con:close()
+		end
+	end)
+
+	local r, j = quantiles(ready), quantiles(joined)
+
+	report("start", {
+		count = count,
+		elapsed = elapsed,
+		rate = count / elapsed,
+		ready_p50_us = r.p50,
+		ready_p99_us = r.p99,
+		join_p50_us = j.p50,
+		join_p99_us = j.p99,
+	})
+end
+
+start(n(500))
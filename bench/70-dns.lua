@@ -0,0 +1,95 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/bench.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Stub resolver lookups against a trivial nameserver on the loopback,
+-- which answers every A query with 127.0.0.1, so the network cost is
+-- one local round trip. Compares lookups answered by the server with
+-- lookups answered from the shared answer cache (see dns.setcache).
+--
+require"bench".export".*"
+
+local config = require"cqueues.dns.config"
+local resolver = require"cqueues.dns.resolver"
+
+--
+-- Build an answer by echoing the question and appending one A record
+-- which points back at it with a compression pointer. Any additional
+-- records in the query (e.g. EDNS) are dropped.
+--
+local function answer(query)
+	local p = 13
+
+	while query:byte(p) ~= 0 do
+		p = p + query:byte(p) + 1
+	end
+
+	local question = query:sub(13, p + 4)
+
+	return table.concat{
+		query:sub(1, 2), "\129\128", "\0\1\0\1\0\0\0\0", question,
+		"\192\12", "\0\1\0\1", "\0\0\14\16", "\0\4", "\127\0\0\1",
+	}
+end -- answer
+
+local function serve(cq)
+	local srv = check(socket.listen{ host = "127.0.0.1", port = 0, type = socket.SOCK_DGRAM })
+	check(srv:listen())
+	srv:setmode("bn", "bn")
+
+	local _, host, port = check(srv:localname())
+
+	cq:wrap(function ()
+		for query in srv:lines"*a" do
+			if #query > 12 then
+				srv:write(answer(query))
+			end
+		end
+	end)
+
+	return srv, string.format("[%s]:%d", host, port)
+end -- serve
+
+local function lookups(case, count, cache)
+	local latency = {}
+	local before, after
+
+	dns.setcache(cache)
+	dns.flushcache()
+
+	local elapsed = run(function (cq)
+		local srv, ns = serve(cq)
+		local res = check(resolver.new(config.stub{ nameserver = { ns }, search = {}, lookup = { "bind" } }))
+
+		before = dns.cachestats()
+
+		for i = 1, count do
+			local began = monotime()
+
+			check(res:query("www.bench.test.", "A", "IN", 5))
+
+			latency[i] = (monotime() - began) * 1e6
+		end
+
+		after = dns.cachestats()
+
+		res:close()
+		srv:close()
+	end)
+
+	local q = quantiles(latency)
+
+	report(case, {
+		count = count,
+		elapsed = elapsed,
+		rate = count / elapsed,
+		p50_us = q.p50,
+		p99_us = q.p99,
+		hits = (after.hits or 0) - (before.hits or 0),
+	})
+end
+
+lookups("uncached", n(20000), false)
+lookups("cached", n(100000), true)
@@ -0,0 +1,179 @@
+local require = require -- may be overloaded by bench.require
+local cqueues = require"cqueues"
+local auxlib = require"cqueues.auxlib"
+
+local bench = {
+	cqueues = cqueues,
+	dns = require"cqueues.dns",
+	socket = require"cqueues.socket",
+	thread = require"cqueues.thread",
+	errno = require"cqueues.errno",
+	condition = require"cqueues.condition",
+	auxlib = auxlib,
+	assert = auxlib.assert,
+	monotime = cqueues.monotime,
+	unpack = table.unpack or unpack,
+}
+
+local progname = os.getenv"REGRESS_PROGNAME" or "bench"
+local scale = tonumber(os.getenv"BENCH_SCALE" or 1)
+local output = os.getenv"BENCH_OUTPUT"
+
+--
+-- bench.n
+--
+-- Scale an iteration count by $BENCH_SCALE, so quick smoke runs and
+-- long, stable runs use the same scripts.
+--
+function bench.n(count)
+	return math.max(1, math.floor(count * scale + 0.5))
+end -- bench.n
+
+function bench.say(fmt, ...)
+	io.stderr:write(progname, ": ", string.format(fmt, ...), "\n")
+end -- bench.say
+
+function bench.panic(fmt, ...)
+	bench.say(fmt, ...)
+	os.exit(1)
+end -- bench.panic
+
+function bench.check(v, ...)
+	if v then
+		return v, ...
+	else
+		local why = select(1, ...)
+
+		if type(why) == "number" then
+			why = bench.errno.strerror(why)
+		end
+
+		bench.panic("%s", tostring(why or "?"))
+	end
+end -- bench.check
+
+function bench.require(modname)
+	local ok, module = pcall(require, modname)
+
+	bench.check(ok, string.format("module %s required", modname))
+
+	return module
+end -- bench.require
+
+--
+-- bench.run
+--
+-- Run f in a new controller until it and anything it spawned finish,
+-- returning the elapsed time. Errors abort the benchmark rather than
+-- producing a misleading number.
+--
+function bench.run(f, opts)
+	local cq = cqueues.new(opts)
+	local began = bench.monotime()
+
+	cq:wrap(f, cq)
+
+	for err in cq:errors() do
+		bench.panic("%s", tostring(err))
+	end
+
+	return bench.monotime() - began, cq
+end -- bench.run
+
+--
+-- bench.quantiles
+--
+-- Summarize an array of samples, which is sorted in place.
+--
+function bench.quantiles(t)
+	local function at(q)
+		return t[math.max(1, math.ceil(q * #t))]
+	end
+
+	if #t == 0 then
+		return {}
+	end
+
+	table.sort(t)
+
+	return { min = t[1], p50 = at(0.50), p90 = at(0.90), p99 = at(0.99), max = t[#t] }
+end -- bench.quantiles
+
+local function encode(v)
+	if type(v) == "table" then
+		local keys, out = {}, {}
+
+		for k in pairs(v) do
+			keys[#keys + 1] = k
+		end
+
+		table.sort(keys)
+
+		for _, k in ipairs(keys) do
+			out[#out + 1] = string.format("%q:%s", tostring(k), encode(v[k]))
+		end
+
+		return "{" .. table.concat(out, ",") .. "}"
+	elseif type(v) == "number" then
+		if v ~= v or v == math.huge or v == -math.huge then
+			return "null"
+		elseif v == math.floor(v) and math.abs(v) < 2^53 then
+			return string.format("%d", v)
+		else
+			return string.format("%.6g", v)
+		end
+	elseif type(v) == "boolean" then
+		return tostring(v)
+	else
+		return (string.format("%q", tostring(v)):gsub("\\\n", "\\n"))
+	end
+end -- encode
+
+--
+-- bench.report
+--
+-- Emit one result as a line of JSON on stdout, and append it to
+-- $BENCH_OUTPUT if set, so successive runs can be collected and
+-- compared. Each line names the script and case and records the
+-- environment it was measured in.
+--
+function bench.report(case, result)
+	local t = {
+		bench = progname,
+		case = case,
+		lua = _VERSION,
+		cqueues = cqueues.VERSION,
+		scale = scale,
+		time = os.time()
+	}
+
+	for k, v in pairs(result) do
+		t[k] = v
+	end
+
+	local line = encode(t)
+
+	io.stdout:write(line, "\n")
+	io.stdout:flush()
+
+	if output then
+		local fh = bench.check(io.open(output, "a"))
+
+		fh:write(line, "\n")
+		fh:close()
+	end
+end -- bench.report
+
+function bench.export(...)
+	for _, pat in ipairs{ ... } do
+		for k, v in pairs(bench) do
+			if string.match(k, pat) then
+				_G[k] = v
+			end
+		end
+	end
+
+	return bench
+end -- bench.export
+
+return bench
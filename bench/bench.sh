@@ -0,0 +1,13 @@
+#!/bin/sh
+#
+# Sourced by the benchmark scripts. Reuses the regression environment,
+# which builds and installs the modules under regress/.local, and adds
+# bench/ to the module path.
+#
+: ${CQUEUES_SRCDIR:="$(cd "${0%%/*}/.." && pwd -L)"}
+
+. "${CQUEUES_SRCDIR}/regress/regress.sh"
+
+export LUA_PATH="${CQUEUES_SRCDIR}/bench/?.lua;${LUA_PATH}"
+export LUA_PATH_5_2="${CQUEUES_SRCDIR}/bench/?.lua;${LUA_PATH_5_2}"
+export LUA_PATH_5_3="${CQUEUES_SRCDIR}/bench/?.lua;${LUA_PATH_5_3}"
@@ -0,0 +1,95 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Socket buffers are borrowed from a process-wide pool. Drained sockets
+-- must give their buffers back, and while the pool budget is exhausted
+-- reads and relays must wait, without spinning or hanging, until memory
+-- is returned, and be woken as soon as it is.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local a1, b1 = check(socket.pair())
+	local a2, b2 = check(socket.pair())
+	local a3, b3 = check(socket.pair())
+	local c, d = check(socket.pair())
+	local idle = socket.bufstats().inuse
+
+	-- drained sockets hold no buffers
+	check(a1:write"x")
+	check(a1:flush())
+	check(b1:read(1) == "x", "lost byte")
+	check(socket.bufstats().inuse == idle, "drained sockets kept their buffers")
+
+	-- b1 holds its input buffer while data is pending
+	check(a1:write(string.rep("y", 100)))
+	check(a1:flush())
+	check(b1:read(10))
+
+	local held = socket.bufstats().inuse
+	check(held > idle, "pending input holds no buffer")
+
+	local obudget = socket.setbudget(held)
+	local throttled = socket.bufstats().throttled
+	local got, relayed
+
+	-- output is never refused
+	check(a2:write"hello")
+	check(a2:flush())
+	check(a3:write"world")
+	check(a3:flush())
+
+	cq:wrap(function ()
+		got = check(b2:read(5))
+	end)
+
+	cq:wrap(function ()
+		relayed = check(b3:relay(c, 5))
+	end)
+
+	cqueues.sleep(0.2)
+
+	check(got == nil and relayed == nil, "read past the budget")
+	check(b2:throttled(), "read not throttled")
+	check(socket.bufstats().throttled > throttled, "throttling not counted")
+
+	-- hand back b1's buffer; the stalled read and relay proceed
+	local began = cqueues.monotime()
+
+	check(b1:read(90))
+
+	local deadline = cqueues.monotime() + 5
+
+	while not (got and relayed) and cqueues.monotime() < deadline do
+		cqueues.sleep(0.05)
+	end
+
+	check(got == "hello", "throttled read never resumed")
+	check(relayed == 5, "throttled relay never resumed")
+	check(cqueues.monotime() - began < 0.5, "throttled readers not woken when memory was returned")
+	check(c:flush())
+	check(d:read(5) == "world", "relayed data lost")
+
+	socket.setbudget(obudget)
+
+	-- buffers drained and refilled in turn come back from the cache
+	local reused = socket.bufstats().reused
+
+	for i = 1, 10 do
+		check(a1:write"z")
+		check(a1:flush())
+		check(b1:read(1) == "z", "lost byte")
+	end
+
+	check(socket.bufstats().reused >= reused + 10, "drained buffers not reused")
+end)
+
+check(cq:loop(10))
+check(cq:empty(), "coroutines left over")
+
+say"OK"
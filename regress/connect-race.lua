@@ -0,0 +1,86 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Connecting to a name with several addresses races them (RFC 8305).
+-- "localhost" usually resolves to both ::1 and 127.0.0.1; with a server
+-- listening only on 127.0.0.1 the connect must settle on the IPv4
+-- attempt, whichever was tried first, and report it as the winner. A
+-- race where every attempt is refused must fail promptly. Racing is
+-- opt-in, and there's nothing to race for a single address.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local srv = check(socket.listen{ host = "127.0.0.1", port = 0 })
+	check(srv:listen())
+
+	local _, _, port = check(fileresult(srv:localname()))
+
+	for _, race in ipairs{ 0.05, true, false } do
+		local con = check(socket.connect{ host = "localhost", port = port, race = race })
+
+		check(con:connect(5))
+		check(con:write"ping\n")
+		check(con:flush())
+
+		local peer = check(srv:accept(5))
+		check(peer:read"*l" == "ping", "lost data")
+
+		local st = con:stat().connect
+
+		check(st.winner and st.winner <= st.attempts, "no winning attempt")
+		info("race=%s attempts=%d winner=%d addr=%s", tostring(race), st.attempts, st.winner, tostring(st.addr))
+		check(st.family == socket.AF_INET and st.addr == "127.0.0.1", "wrong winner (%s)", tostring(st.addr))
+		check(st.port == port, "wrong winner port")
+		check(con:racetimeout() == nil, "race still running after connect")
+
+		peer:close()
+		con:close()
+	end
+
+	-- nobody listening any more
+	srv:close()
+
+	local began = cqueues.monotime()
+	local con = check(socket.connect{ host = "localhost", port = port, race = 0.05 })
+
+	con:onerror(function (_, _, why) return why end)
+
+	local ok = con:connect(5)
+
+	check(not ok, "connected to a closed port")
+	check(cqueues.monotime() - began < 4, "refused race took too long")
+	con:close()
+
+	-- a descriptor address isn't resolved, so it can't race
+	local path = os.tmpname()
+	os.remove(path)
+
+	local srv = check(socket.listen{ path = path, unlink = true })
+	check(srv:listen())
+
+	local con = check(socket.connect{ path = path, race = 0.05 })
+	check(con:racetimeout() == nil, "single address racing")
+	check(con:connect(5))
+	check(con:racetimeout() == nil, "single address racing")
+
+	check(srv:accept(5)):close()
+	con:close()
+	srv:close()
+	os.remove(path)
+
+	-- by default addresses are tried one at a time
+	local con = check(socket.connect{ host = "localhost", port = port })
+	check(con:racetimeout() == nil, "racing without being asked to")
+	con:close()
+end)
+
+check(cq:loop(10))
+check(cq:empty(), "coroutines left over")
+
+say"OK"
@@ -0,0 +1,71 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A controller with .busypoll must find events arriving during the spin
+-- without blocking, count its spins, and still honor the step timeout.
+-- The socket .busypoll option must either apply or fail cleanly.
+--
+require"regress".export".*"
+
+local monotime = cqueues.monotime
+
+-- no spinning unless asked for
+local cq = cqueues.new()
+check(cq:step(0.01))
+check(cq:stats().spins == 0, "spun without .busypoll")
+
+-- an event arriving from another thread during the spin
+cq = cqueues.new{ busypoll = 0.5 }
+
+local thr, pipe = check(thread.start(function (pipe)
+	local cqueues = require"cqueues"
+
+	for i = 1, 5 do
+		assert(pipe:read"*l" == "go")
+		cqueues.sleep(0.01)
+		assert(pipe:write"pong\n")
+		assert(pipe:flush())
+	end
+end))
+
+cq:wrap(function ()
+	for i = 1, 5 do
+		check(pipe:write"go\n")
+		check(pipe:flush())
+		check(pipe:read"*l" == "pong", "lost pong")
+	end
+end)
+
+check(cq:loop(10))
+check(thr:join(5))
+
+local stats = cq:stats()
+
+info("spins=%d spinhits=%d", stats.spins, stats.spinhits)
+check(stats.spins > 0, "no busy polling")
+check(stats.spinhits > 0, "no events found while busy polling")
+
+-- the step timeout bounds the spin
+local began = monotime()
+check(cq:step(0.05))
+local elapsed = monotime() - began
+check(elapsed >= 0.04 and elapsed < 0.4, "step with a 0.05s timeout took %.3fs", elapsed)
+
+-- SO_BUSY_POLL may need privileges or kernel support
+local con, why = socket.listen{ host = "127.0.0.1", port = 0, busypoll = 0.00005 }
+
+if con then
+	con:onerror(function (_, _, why) return why end)
+	why = select(2, con:listen())
+	con:close()
+end
+
+if why then
+	check(why == errno.EPERM or why == errno.EOPNOTSUPP or why == errno.ENOPROTOOPT, "socket .busypoll failed (%s)", errno.strerror(why))
+	info("socket .busypoll unavailable: %s", errno.strerror(why))
+end
+
+say"OK"
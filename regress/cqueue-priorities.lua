@@ -0,0 +1,113 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A step must resume ready coroutines high priority first and in FIFO
+-- order within a priority, stop once the .budget or .slice given to
+-- cqueues.new is used up, and run a coroutine woken by another one in
+-- the same step through the fast lane.
+--
+require"regress".export".*"
+
+local monotime = cqueues.monotime
+
+-- priority ordering
+do
+	local cq = cqueues.new()
+	local order = {}
+
+	local function mark(name)
+		order[#order + 1] = name
+	end
+
+	cq:wrap({ priority = "low" }, mark, "low")
+	cq:wrap(mark, "normal1")
+	cq:wrap({ priority = "high" }, mark, "high1")
+	cq:wrap({ priority = "normal" }, mark, "normal2")
+	cq:wrap({ priority = "high" }, mark, "high2")
+
+	check(cq:step(0))
+
+	local expect = { "high1", "high2", "normal1", "normal2", "low" }
+
+	check(#order == #expect, "expected %d resumes, got %d", #expect, #order)
+
+	for i = 1, #expect do
+		check(order[i] == expect[i], "resume %d was %s, expected %s", i, tostring(order[i]), expect[i])
+	end
+
+	check(not pcall(cq.wrap, cq, { priority = "urgent" }, mark), "bogus priority accepted")
+	check(cq:empty(), "coroutines left over")
+end
+
+-- budget preemption
+do
+	local cq = cqueues.new{ budget = 2 }
+	local ran = 0
+
+	for i = 1, 5 do
+		cq:wrap(function () ran = ran + 1 end)
+	end
+
+	for _, expect in ipairs{ 2, 4, 5 } do
+		check(cq:step(0))
+		check(ran == expect, "budget not honored (%d resumes, expected %d)", ran, expect)
+	end
+
+	check(cq:empty(), "coroutines left over")
+	check(cq:stats().preempted >= 2, "preempted steps not counted")
+end
+
+-- slice preemption
+do
+	local cq = cqueues.new{ slice = 0.05 }
+	local ran = 0
+
+	for i = 1, 3 do
+		cq:wrap(function ()
+			local deadline = monotime() + 0.1
+
+			repeat until monotime() >= deadline
+
+			ran = ran + 1
+		end)
+	end
+
+	check(cq:step(0))
+	check(ran == 1, "slice not honored (%d resumes, expected 1)", ran)
+	check(cq:stats().preempted >= 1, "preempted step not counted")
+
+	check(cq:loop(5))
+	check(ran == 3, "preempted coroutines lost (%d of 3 ran)", ran)
+end
+
+-- the fast lane
+do
+	local cq = cqueues.new()
+	local cv = condition.new()
+	local order = {}
+
+	cq:wrap(function ()
+		check(cv:wait())
+		order[#order + 1] = "woken"
+	end)
+
+	check(cq:step(0))
+	check(#order == 0, "waiter didn't wait")
+
+	local fastwakes = cq:stats().fastwakes
+
+	cq:wrap(function ()
+		cv:signal()
+		order[#order + 1] = "signaled"
+	end)
+
+	check(cq:step(0))
+	check(order[1] == "signaled" and order[2] == "woken", "woken coroutine didn't run in the same step")
+	check(cq:stats().fastwakes > fastwakes, "fast wakeup not counted")
+	check(cq:empty(), "coroutines left over")
+end
+
+say"OK"
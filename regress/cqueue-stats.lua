@@ -0,0 +1,80 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- With .stats set cqueue:stats must report consistent histograms of
+-- blocking, per-step and per-resume times, record the slowest resume
+-- past the .slow threshold, and clear it all on request.
+--
+require"regress".export".*"
+
+local monotime = cqueues.monotime
+
+check(cqueues.new():stats().resume == nil, "histograms recorded without .stats")
+
+local cq = cqueues.new{ stats = true, slow = 0.05 }
+
+-- a few quick resumes blocked on timers
+cq:wrap(function ()
+	for i = 1, 5 do
+		cqueues.sleep(0.01)
+	end
+end)
+
+-- one slow resume
+cq:wrap(function ()
+	local deadline = monotime() + 0.1
+
+	repeat until monotime() >= deadline
+
+	cqueues.sleep(0)
+end)
+
+check(cq:loop(5))
+
+local stats = cq:stats()
+
+local function checkhist(name, h)
+	check(type(h) == "table", "no %s histogram", name)
+	check(h.p50 <= h.p90 and h.p90 <= h.p99 and h.p99 <= h.p999 and h.p999 <= h.max, "%s quantiles out of order", name)
+
+	local n, last = 0, -1
+
+	for _, b in ipairs(h.buckets) do
+		check(b[1] > last, "%s buckets out of order", name)
+		last = b[1]
+		n = n + b[2]
+	end
+
+	check(n == h.count, "%s bucket counts sum to %d, not %d", name, n, h.count)
+end -- checkhist
+
+for _, name in ipairs{ "wait", "batch", "perstep", "process", "resume" } do
+	checkhist(name, stats[name])
+end
+
+info("resume: count=%d max=%.3f p50=%.6f", stats.resume.count, stats.resume.max, stats.resume.p50)
+check(stats.resume.count >= 8, "only %d resumes recorded", stats.resume.count)
+check(stats.resume.max >= 0.1, "slow resume not recorded (max %.3f)", stats.resume.max)
+check(stats.wait.count > 0 and stats.wait.sum >= 0.03, "time blocked on timers not recorded")
+check(stats.perstep.count == stats.process.count, "per-step histograms disagree")
+check(stats.process.sum >= 0.1, "processing time not recorded")
+
+check(stats.slow.threshold == 0.05, "slow threshold lost")
+check(stats.slow.count == 1, "%d slow resumes recorded, expected 1", stats.slow.count)
+check(stats.slow.max >= 0.1, "slow resume time not recorded")
+check(type(stats.slow.where) == "string", "slow resume has no traceback")
+
+-- reset clears histograms, not counters
+local resumes = stats.resumes
+
+cq:stats(true)
+stats = cq:stats()
+
+check(stats.resume.count == 0 and #stats.resume.buckets == 0, "histograms not reset")
+check(stats.slow.count == 0 and stats.slow.threshold == 0.05, "slow resume record not reset")
+check(stats.resumes == resumes, "counters reset")
+
+say"OK"
@@ -0,0 +1,111 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A DNS batch must match every answer to its query through a narrow
+-- window, report negative answers as packets, and take repeated
+-- questions from the answer cache. Records are decoded lazily and must
+-- stay valid after their packet has been collected.
+--
+require"regress".export".*"
+
+local batch = require"cqueues.dns.batch"
+local nameserver = require"nameserver"
+
+local count, unknown = 50, 5
+local zone = {}
+
+for i = 1, count do
+	zone[string.format("n%d.test.", i)] = string.format("10.1.0.%d", i)
+end
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local ns = nameserver(cq, zone)
+	local records = {}
+
+	dns.setcache(true)
+	dns.flushcache()
+
+	local function run(b, names)
+		local answers, pending = {}, 0
+
+		for tag, name in ipairs(names) do
+			check(b:submit(name, "A", "IN", tag))
+			pending = pending + 1
+		end
+
+		check(b:count() == pending, "wrong count of pending queries")
+
+		while pending > 0 do
+			local pkt, why, tag = b:fetch()
+
+			if pkt then -- the tag comes second on success
+				check(not answers[why], "query %d answered twice", why)
+				answers[why] = pkt
+				pending = pending - 1
+			elseif why == errno.EAGAIN then
+				cqueues.poll(b, 1)
+			else
+				panic("query %s failed: %s", tostring(tag), errno.strerror(why))
+			end
+		end
+
+		check(b:count() == 0, "queries left over")
+
+		return answers
+	end
+
+	local names = {}
+
+	for i = 1, count + unknown do
+		names[i] = string.format("%s%d.test.", (i <= count) and "n" or "x", i)
+	end
+
+	local b = check(batch.new({ nameserver = { ns.nameserver }, options = { timeout = 1, attempts = 2 } }, 8))
+	local answers = run(b, names)
+
+	for i, name in ipairs(names) do
+		local pkt = answers[i]
+		local addr
+
+		for rr in pkt:grep{ section = "answer", type = "A" } do
+			check(rr:name() == name, "answer for %s carries %s", name, rr:name())
+			addr = rr:addr()
+			records[name] = rr
+		end
+
+		if i <= count then
+			check(addr == zone[name], "wrong answer for %s", name)
+		else
+			check(addr == nil and pkt:flags().rcode == 3, "expected NXDOMAIN for %s", name)
+		end
+	end
+
+	-- decoded records outlive their packets
+	answers = nil
+	collectgarbage"collect"
+
+	for name, rr in pairs(records) do
+		check(rr:addr() == zone[name] and tostring(rr) == zone[name], "record for %s went stale", name)
+	end
+
+	local queries = ns.queries
+
+	check(queries >= count + unknown, "expected %d queries, got %d", count + unknown, queries)
+
+	-- asking again is answered from the cache
+	run(b, names)
+	check(ns.queries == queries, "repeated questions went to the network")
+
+	b:close()
+	ns:close()
+end)
+
+check(cq:loop(30))
+check(cq:empty(), "coroutines left over")
+
+say"OK"
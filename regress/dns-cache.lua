@@ -0,0 +1,85 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- The shared answer cache must answer repeated lookups without touching
+-- the network, including search list expansions whose first candidates
+-- were negative, and must not leak answers between resolvers asking
+-- different nameservers.
+--
+require"regress".export".*"
+
+local resolver = require"cqueues.dns.resolver"
+local nameserver = require"nameserver"
+
+local function addrs(pkt)
+	local list = {}
+
+	for rr in pkt:grep{ section = "answer", type = "A" } do
+		list[#list + 1] = rr:addr()
+	end
+
+	return table.concat(list, " ")
+end
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local ns1 = nameserver(cq, { ["www.test."] = "10.0.0.1", ["host.b.test."] = "10.0.0.2" })
+	local ns2 = nameserver(cq, { ["www.test."] = "10.9.9.9" })
+
+	local function stub(ns)
+		return check(resolver.new{
+			nameserver = { ns.nameserver },
+			search = { "a.test", "b.test" },
+			lookup = { "bind" },
+			options = { ndots = 1 },
+		})
+	end
+
+	dns.setcache(true)
+	dns.flushcache()
+
+	local r1 = stub(ns1)
+	local stats = dns.cachestats()
+
+	-- a miss goes to the network and is stored
+	check(addrs(check(r1:query("www.test.", "A", "IN", 5))) == "10.0.0.1", "wrong answer")
+	check(ns1.queries == 1, "expected one query, got %d", ns1.queries)
+
+	-- the same resolver and a new one hit the cache
+	check(addrs(check(r1:query("www.test.", "A", "IN", 5))) == "10.0.0.1", "wrong cached answer")
+	check(addrs(check(stub(ns1):query("www.test.", "A", "IN", 5))) == "10.0.0.1", "wrong cached answer for a new resolver")
+	check(ns1.queries == 1, "cache hit went to the network")
+	check(dns.cachestats().hits >= stats.hits + 2, "hits not counted")
+
+	-- search list expansion: host.a.test is NXDOMAIN, host.b.test answers
+	check(addrs(check(r1:query("host", "A", "IN", 5))) == "10.0.0.2", "wrong search answer")
+	check(ns1.asked["host.a.test."] == 1 and ns1.asked["host.b.test."] == 1, "search list not walked")
+
+	local queries = ns1.queries
+
+	check(addrs(check(r1:query("host", "A", "IN", 5))) == "10.0.0.2", "wrong cached search answer")
+	check(ns1.queries == queries, "cached search went to the network")
+	check(dns.cachestats().negative > stats.negative, "negative hit not counted")
+
+	-- another nameserver must not see ns1's answers
+	check(addrs(check(stub(ns2):query("www.test.", "A", "IN", 5))) == "10.9.9.9", "answer leaked between nameservers")
+	check(ns2.queries == 1, "expected one query to the second nameserver")
+
+	-- flushing drops everything
+	dns.flushcache()
+	check(dns.cachestats().count == 0, "entries survived flush")
+	check(r1:query("www.test.", "A", "IN", 5))
+	check(ns1.queries == queries + 1, "flushed entry still answered")
+
+	ns1:close()
+	ns2:close()
+end)
+
+check(cq:loop(30))
+check(cq:empty(), "coroutines left over")
+
+say"OK"
@@ -0,0 +1,83 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- With the .edge option sockets which last returned EAGAIN are polled
+-- edge-triggered. Readiness which arrives while nobody waits, or which
+-- isn't fully drained, must still wake the next waiter.
+--
+require"regress".export".*"
+
+local cq = cqueues.new{ edge = true }
+local a, b = check(socket.pair())
+local chunk = string.rep("x", 4093)
+local total = chunk:len() * 256
+
+a:setmode("bn", "bn")
+b:setmode("bn", "bn")
+
+-- bulk transfer in odd sized pieces, so reads rarely drain the socket
+cq:wrap(function ()
+	for _ = 1, 256 do
+		check(a:write(chunk))
+	end
+
+	check(a:flush())
+end)
+
+cq:wrap(function ()
+	local n = 0
+
+	while n < total do
+		local data = check(b:read(math.min(1000, total - n)))
+
+		n = n + #data
+	end
+end)
+
+check(cq:loop(10))
+check(cq:empty(), "bulk transfer stalled")
+
+-- the last waiter gives up, then data arrives while nobody waits
+cq:wrap(function ()
+	check(cqueues.poll(b, 0.1) == nil, "woke up without data")
+end)
+
+check(cq:loop(5))
+
+check(a:write"ping")
+check(a:flush())
+cqueues.sleep(0.1)
+
+local got
+
+cq:wrap(function ()
+	got = b:read(4)
+end)
+
+check(cq:loop(5))
+check(got == "ping", "readiness lost while nobody waited")
+
+-- trickled writes, each fully drained before the next arrives
+local lines = {}
+
+cq:wrap(function ()
+	for _ = 1, 10 do
+		lines[#lines + 1] = check(b:read(1))
+	end
+end)
+
+cq:wrap(function ()
+	for i = 1, 10 do
+		check(a:write(tostring(i % 10)))
+		check(a:flush())
+		cqueues.sleep(0.01)
+	end
+end)
+
+check(cq:loop(5))
+check(table.concat(lines) == "1234567890", "edge-triggered reads out of order or lost")
+
+say"OK"
@@ -0,0 +1,76 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Run sockets, timeouts and alerts through a controller asking for the
+-- io_uring backend. Builds or kernels without io_uring silently fall back
+-- to the native backend, so either answer from :stats is acceptable, but
+-- the controller must behave the same.
+--
+require"regress".export".*"
+
+local cq = cqueues.new{ backend = "io_uring" }
+local backend = cq:stats().backend
+
+check(backend == "io_uring" or backend == cqueues.new():stats().backend, "unexpected backend (%s)", tostring(backend))
+info("backend is %s", backend)
+
+local a, b = check(socket.pair())
+local rounds = 100
+
+cq:wrap(function ()
+	for i = 1, rounds do
+		check(a:write(string.format("%d\n", i)))
+		check(a:flush())
+		check(a:read"*l" == tostring(i), "echo %d lost", i)
+	end
+
+	a:close()
+end)
+
+cq:wrap(function ()
+	for ln in b:lines() do
+		check(b:write(ln, "\n"))
+		check(b:flush())
+	end
+
+	b:close()
+end)
+
+local slept = false
+
+cq:wrap(function ()
+	local began = cqueues.monotime()
+
+	cqueues.sleep(0.1)
+
+	check(cqueues.monotime() - began >= 0.1, "sleep woke early")
+	slept = true
+end)
+
+check(cq:loop(5))
+check(cq:empty(), "coroutines left over")
+check(slept, "sleep never woke")
+
+-- an idle controller must still notice new coroutines when nested
+local main = cqueues.new()
+local alerted = false
+
+main:wrap(function ()
+	check(cq:loop())
+end)
+
+check(main:step(0))
+
+main:wrap(function ()
+	cq:wrap(function () alerted = true end)
+end)
+
+check(main:loop(3))
+check(alerted, "nested io_uring loop never woke up")
+
+check(not pcall(cqueues.new, { backend = "bogus" }), "bogus backend accepted")
+
+say"OK"
@@ -0,0 +1,142 @@
+--
+-- A toy authoritative nameserver on 127.0.0.1 for the DNS tests, so they
+-- needn't depend on the network. zone maps names (lowercase, with the
+-- trailing dot) to IPv4 address strings. A queries for those names are
+-- answered with ttl; anything else gets NODATA or NXDOMAIN with an SOA
+-- so negative answers can be cached. .queries counts the queries
+-- received and .asked[name] the queries per name. Runs on controller cq
+-- until :close is called.
+--
+-- There's no sendto, so each client is answered through a datagram
+-- socket connected to it and bound to our port, which from then on also
+-- receives that client's queries.
+--
+--   local nameserver = require"nameserver"
+--   local ns = nameserver(cq, { ["www.test."] = "10.0.0.1" })
+--
+local regress = require"regress"
+
+local function dns_u16(n)
+	return string.char(math.floor(n / 256) % 256, n % 256)
+end -- dns_u16
+
+local function dns_u32(n)
+	return dns_u16(math.floor(n / 65536) % 65536) .. dns_u16(n % 65536)
+end -- dns_u32
+
+local function dns_name(name)
+	local wire = {}
+
+	for label in name:gmatch"[^.]+" do
+		wire[#wire + 1] = string.char(#label) .. label
+	end
+
+	wire[#wire + 1] = "\0"
+
+	return table.concat(wire)
+end -- dns_name
+
+local function dns_reply(ns, query)
+	local p, labels = 13, {}
+
+	while true do
+		local n = query:byte(p)
+
+		if not n then
+			return -- truncated
+		elseif n == 0 then
+			break
+		end
+
+		labels[#labels + 1] = query:sub(p + 1, p + n):lower()
+		p = p + n + 1
+	end
+
+	if #query < p + 4 then
+		return
+	end
+
+	local name = table.concat(labels, ".") .. "."
+	local qtype = query:byte(p + 1) * 256 + query:byte(p + 2)
+	local addr = ns.zone[name]
+	local rcode, an, auth = 0, {}, {}
+
+	ns.queries = ns.queries + 1
+	ns.asked[name] = (ns.asked[name] or 0) + 1
+
+	if addr and qtype == 1 then
+		local a, b, c, d = addr:match"^(%d+)%.(%d+)%.(%d+)%.(%d+)$"
+
+		an[1] = "\192\012" .. dns_u16(1) .. dns_u16(1) .. dns_u32(ns.ttl) .. dns_u16(4)
+		     .. string.char(tonumber(a), tonumber(b), tonumber(c), tonumber(d))
+	else
+		local rdata = dns_name"ns.test." .. dns_name"root.test."
+		           .. dns_u32(1) .. dns_u32(3600) .. dns_u32(600) .. dns_u32(86400) .. dns_u32(ns.ttl)
+
+		rcode = (addr and 0) or 3
+		auth[1] = dns_name"test." .. dns_u16(6) .. dns_u16(1) .. dns_u32(ns.ttl) .. dns_u16(#rdata) .. rdata
+	end
+
+	-- QR, AA and the query's RD; RA and the rcode
+	return query:sub(1, 2) .. string.char(0x84 + query:byte(3) % 2, 0x80 + rcode)
+	    .. dns_u16(1) .. dns_u16(#an) .. dns_u16(#auth) .. dns_u16(0)
+	    .. query:sub(13, p + 4) .. table.concat(an) .. table.concat(auth)
+end -- dns_reply
+
+return function (cq, zone, ttl)
+	local socket = regress.socket
+	local ns = { zone = zone or {}, ttl = ttl or 60, queries = 0, asked = {}, host = "127.0.0.1" }
+	local peers = {}
+	local con = regress.check(socket.listen{ host = ns.host, port = 0, type = socket.SOCK_DGRAM, reuseport = true })
+
+	regress.check(con:listen())
+
+	ns.port = select(3, regress.check(regress.fileresult(con:localname())))
+	ns.nameserver = string.format("[%s]:%d", ns.host, ns.port)
+
+	local serve
+
+	local function peer(batch, i)
+		local _, addr, port = batch:peer(i)
+		local key = string.format("%s:%d", addr, port)
+
+		if not peers[key] then
+			local so = regress.check(socket.connect{
+				host = addr, port = port, type = socket.SOCK_DGRAM,
+				bind = { addr = ns.host, port = ns.port }, reuseport = true,
+			})
+
+			regress.check(so:connect())
+			peers[key] = so
+			cq:wrap(serve, so)
+		end
+
+		return peers[key]
+	end -- peer
+
+	function serve(so)
+		while not ns.closed do
+			local batch = so:recvmany(16, 0.05)
+
+			if batch then
+				for i = 1, #batch do
+					local reply = dns_reply(ns, (batch:get(i)))
+
+					if reply then
+						regress.check((so == con and peer(batch, i) or so):sendmany{ reply })
+					end
+				end
+			end
+		end
+
+		so:close()
+	end -- serve
+
+	cq:wrap(serve, con)
+
+	function ns:close()
+		self.closed = true
+	end
+
+	return ns
+end -- nameserver
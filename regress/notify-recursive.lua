@@ -0,0 +1,129 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A recursive notify object must report changes anywhere in the tree by
+-- relative path, including entries of directories created after it was
+-- opened, and coalesce a burst of changes to one name into one entry.
+--
+require"regress".export".*"
+
+local notify = require"cqueues.notify"
+
+local root = os.tmpname()
+os.remove(root)
+check(os.execute(string.format("mkdir '%s'", root)), "unable to create %s", root)
+
+local function path(name)
+	return root .. "/" .. name
+end
+
+local function touch(name, data)
+	local fh = check(io.open(path(name), "a"))
+	fh:write(data or "")
+	fh:close()
+end
+
+local function has(changes, flag)
+	return changes and math.floor(changes / flag) % 2 == 1
+end
+
+local function merge(changes, flags)
+	changes = changes or 0
+
+	for _, flag in ipairs{ notify.CREATE, notify.DELETE, notify.ATTRIB, notify.MODIFY, notify.REVOKE } do
+		if has(flags, flag) and not has(changes, flag) then
+			changes = changes + flag
+		end
+	end
+
+	return changes
+end
+
+local nfy, why = notify.opendir(root, notify.ALL, { recursive = true, window = 0.05 })
+
+if not nfy and why == errno.EOPNOTSUPP then
+	os.execute(string.format("rm -rf '%s'", root))
+	say"OK (recursive watching unsupported)"
+	return
+end
+
+check(nfy, "unable to watch %s (%s)", root, tostring(why))
+
+local seen = {}
+
+-- merge batches until every name in want has been seen
+local function collect(want)
+	local deadline = cqueues.monotime() + 5
+
+	while true do
+		local missing = false
+
+		for _, name in ipairs(want) do
+			missing = missing or not seen[name]
+		end
+
+		if not missing then
+			return
+		end
+
+		local timeout = deadline - cqueues.monotime()
+		check(timeout > 0, "timed out waiting for changes")
+
+		local changes = nfy:batch(timeout)
+
+		if changes then
+			for name, flags in pairs(changes) do
+				info("%s: %d", name, flags)
+				check(flags ~= notify.ALL or name ~= ".", "kernel dropped events")
+				seen[name] = merge(seen[name], flags)
+			end
+		end
+	end
+end
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	-- a new subdirectory and a file inside it
+	check(os.execute(string.format("mkdir '%s'", path"sub")))
+	touch("sub/file", "x")
+	collect{ "sub", "sub/file" }
+	check(has(seen["sub"], notify.CREATE), "subdirectory creation not reported")
+	check(has(seen["sub/file"], notify.CREATE), "file creation not reported")
+
+	-- a whole tree appearing at once, before it can be watched
+	check(os.execute(string.format("mkdir -p '%s'", path"sub/deep/er")))
+	touch("sub/deep/er/leaf")
+	collect{ "sub/deep", "sub/deep/er", "sub/deep/er/leaf" }
+	check(has(seen["sub/deep/er/leaf"], notify.CREATE), "entry of a new tree not reported as created")
+
+	-- a burst of writes, delivered as one entry
+	seen = {}
+	touch("burst")
+
+	for i = 1, 20 do
+		touch("burst", tostring(i))
+	end
+
+	collect{ "burst" }
+	check(has(seen["burst"], notify.CREATE) and has(seen["burst"], notify.MODIFY), "burst changes not merged")
+
+	local extra = nfy:batch(0.2)
+	check(not (extra and extra["burst"]), "burst split across batches")
+
+	-- deletion deep in the tree
+	seen = {}
+	os.remove(path"sub/deep/er/leaf")
+	collect{ "sub/deep/er/leaf" }
+	check(has(seen["sub/deep/er/leaf"], notify.DELETE), "deletion not reported")
+end)
+
+check(cq:loop(30))
+check(cq:empty(), "coroutines left over")
+
+os.execute(string.format("rm -rf '%s'", root))
+
+say"OK"
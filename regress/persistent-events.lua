@@ -0,0 +1,62 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A coroutine which polls the same object across yields should have its
+-- event carried over rather than rebuilt, and an object it stops polling
+-- must not keep waking it.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+local a, b = check(socket.pair())
+local rounds = 50
+
+cq:wrap(function ()
+	for i = 1, rounds do
+		check(a:write(string.format("%d\n", i)))
+		check(a:flush())
+		cqueues.sleep(0)
+	end
+end)
+
+cq:wrap(function ()
+	for i = 1, rounds do
+		check(b:read"*l" == tostring(i), "line %d lost", i)
+	end
+end)
+
+check(cq:loop(5))
+
+local stats = cq:stats()
+
+info("reused=%d kept=%d", stats.reused, stats.kept)
+check(stats.reused > 0, "no events carried across yields")
+check(stats.kept > 0, "no registrations left untouched")
+
+-- stop polling b after one wakeup; later readiness mustn't resume us
+local cv, idle = condition.new(), condition.new()
+local stale
+
+cq:wrap(function ()
+	local ready = cqueues.poll(b, cv)
+
+	check(ready == cv, "woke up for the wrong object")
+
+	stale = cqueues.poll(idle, 0.5)
+end)
+
+cq:wrap(function ()
+	cv:signal()
+	cqueues.sleep(0.1)
+	check(a:write"late\n")
+	check(a:flush())
+end)
+
+check(cq:loop(5))
+check(stale == nil, "woke up for an object no longer polled")
+check(b:read"*l" == "late", "late line lost")
+
+say"OK"
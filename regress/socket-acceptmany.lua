@@ -0,0 +1,98 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- socket:acceptmany must drain up to count queued connections per call,
+-- each a working socket, and time out on an empty backlog; clients with
+-- .batch must hand every connection out exactly once.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local lsn = check(socket.listen{ host = "127.0.0.1", port = 0 })
+	lsn:onerror(function (_, _, why) return why end)
+	check(lsn:listen())
+
+	local _, _, port = check(fileresult(lsn:localname()))
+
+	-- queue n connections, each announcing its index
+	local function connect(n)
+		local list = {}
+
+		for i = 1, n do
+			local con = check(socket.connect{ host = "127.0.0.1", port = port })
+
+			check(con:connect(5))
+			check(con:write(i, "\n"))
+			check(con:flush())
+			list[i] = con
+		end
+
+		return list
+	end -- connect
+
+	local function collect(seen, con)
+		local i = tonumber(con:read"*l")
+
+		check(i and not seen[i], "connection %s handed out twice or garbled", tostring(i))
+		seen[i] = true
+		con:close()
+	end -- collect
+
+	-- batches of at most 4
+	local clients = connect(10)
+	local seen, count, calls = {}, 0, 0
+
+	while count < 10 do
+		local cons = check(lsn:acceptmany(4, nil, 5))
+
+		calls = calls + 1
+		check(#cons >= 1 and #cons <= 4, "batch of %d connections", #cons)
+
+		for _, con in ipairs(cons) do
+			collect(seen, con)
+			count = count + 1
+		end
+	end
+
+	info("10 connections in %d calls", calls)
+	check(calls < 10, "connections not batched")
+
+	for _, con in ipairs(clients) do
+		con:close()
+	end
+
+	-- nothing queued
+	local cons, why = lsn:acceptmany(4, nil, 0.1)
+	check(cons == nil and why == errno.ETIMEDOUT, "empty backlog didn't time out (%s)", tostring(why))
+
+	-- the batching iterator
+	clients = connect(7)
+	seen, count = {}, 0
+
+	for con in lsn:clients({ batch = 3 }, 5) do
+		collect(seen, con)
+		count = count + 1
+
+		if count == 7 then
+			break
+		end
+	end
+
+	check(count == 7, "iterator handed out %d of 7 connections", count)
+
+	for _, con in ipairs(clients) do
+		con:close()
+	end
+
+	lsn:close()
+end)
+
+check(cq:loop(20))
+check(cq:empty(), "coroutines left over")
+
+say"OK"
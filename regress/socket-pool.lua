@@ -0,0 +1,129 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A socket.pool must lend a returned connection out again, make callers
+-- over the cap wait for one or time out, and refuse to reuse connections
+-- with unread input, closed by the peer, or idle too long.
+--
+require"regress".export".*"
+
+local sockpool = require"cqueues.socket.pool"
+
+local cq = cqueues.new()
+
+-- line echo server; "close" hangs up, "junk" also sends unsolicited data
+local lsn = check(socket.listen{ host = "127.0.0.1", port = 0 })
+lsn:onerror(function (_, _, why) return why end)
+check(lsn:listen())
+local _, _, port = check(fileresult(lsn:localname()))
+
+cq:wrap(function ()
+	for con in lsn:clients() do
+		cq:wrap(function ()
+			con:onerror(function (_, _, why) return why end)
+
+			for line in con:lines() do
+				if line == "close" then
+					break
+				end
+
+				con:write(line, "\n")
+
+				if line == "junk" then
+					con:write"unsolicited\n"
+				end
+
+				con:flush()
+			end
+
+			con:close()
+		end)
+	end
+end)
+
+local function echo(con, line)
+	check(con:write(line, "\n"))
+	check(con:flush())
+	check(con:read"*l" == line, "no echo for %s", line)
+end -- echo
+
+cq:wrap(function ()
+	local opts = { host = "127.0.0.1", port = port }
+	local pool = sockpool.new{ max = 1, idle = 0.5 }
+
+	-- reuse
+	local con = check(pool:get(opts))
+	echo(con, "one")
+	pool:put(con)
+
+	local again = check(pool:get(opts))
+	check(again == con, "idle connection not reused")
+	echo(again, "two")
+
+	local stats = pool:stats()
+	check(stats.created == 1 and stats.reused == 1, "created=%d reused=%d", stats.created, stats.reused)
+	check(stats.busy == 1 and stats.idle == 0, "busy=%d idle=%d", stats.busy, stats.idle)
+
+	-- at capacity: time out, or wait for a connection to be returned
+	local none, why = pool:get(opts, 0.1)
+	check(none == nil and why == errno.ETIMEDOUT, "get over capacity didn't time out")
+
+	local waited
+
+	cq:wrap(function ()
+		waited = check(pool:get(opts, 5))
+	end)
+
+	cqueues.sleep(0.1)
+	check(waited == nil, "get over capacity didn't wait")
+	pool:put(again)
+	cqueues.sleep(0.1)
+	check(waited == con, "waiting get not handed the returned connection")
+
+	stats = pool:stats()
+	check(stats.waited == 2 and stats.timeouts == 1, "waited=%d timeouts=%d", stats.waited, stats.timeouts)
+
+	-- unread input: closed rather than kept
+	check(waited:write"junk\n")
+	check(waited:flush())
+	check(waited:read"*l" == "junk", "no echo for junk")
+	cqueues.sleep(0.1)
+	pool:put(waited)
+	check(pool:stats().idle == 0, "connection with unread input kept")
+
+	-- closed by the peer while idle
+	con = check(pool:get(opts))
+	check(con:write"close\n")
+	check(con:flush())
+	cqueues.sleep(0.1)
+	pool:put(con)
+	check(pool:stats().idle == 0, "connection closed by the peer kept")
+
+	con = check(pool:get(opts))
+	echo(con, "three")
+	pool:put(con)
+	check(pool:stats().idle == 1, "healthy connection not kept")
+
+	-- expired
+	cqueues.sleep(0.6)
+	con = check(pool:get(opts))
+	check(pool:stats().expired == 1, "idle connection not expired")
+	echo(con, "four")
+	pool:discard(con)
+	check(pool:stats().busy == 0, "discarded connection still counted")
+
+	-- closed pool
+	pool:close()
+	none, why = pool:get(opts)
+	check(none == nil and why == errno.EPIPE, "closed pool lent a connection")
+
+	cq:cancel(lsn)
+	lsn:close()
+end)
+
+check(cq:loop(20))
+
+say"OK"
@@ -0,0 +1,101 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- socket:recvmany must return datagrams in the order they were sent,
+-- starting with whatever is left of one already taken into the input
+-- buffer by socket:read, flag datagrams which didn't fit their slot, and
+-- refuse sockets without message boundaries.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local a, b = check(socket.pair(socket.SOCK_DGRAM))
+	local msgs = {}
+
+	for i = 1, 10 do
+		msgs[i] = string.format("message %d", i)
+	end
+
+	-- one batch, several calls, in order
+	check(a:sendmany(msgs) == #msgs, "short sendmany")
+
+	local batch = socket.batch(4)
+	local got = {}
+
+	while #got < #msgs do
+		check(b:recvmany(batch, 5))
+		check(#batch > 0 and #batch <= 4, "wrong batch length (%d)", #batch)
+
+		for i = 1, #batch do
+			local msg, trunc = batch:get(i)
+
+			check(not trunc, "datagram %d truncated", #got + 1)
+			check(batch:size(i) == #msg, "wrong datagram size")
+			got[#got + 1] = msg
+		end
+	end
+
+	for i = 1, #msgs do
+		check(got[i] == msgs[i], "datagram %d out of order (%s)", i, tostring(got[i]))
+	end
+
+	-- what :read left in the input buffer comes first
+	check(a:sendmany{ "buffered", "next" })
+	check(b:read(3) == "buf", "short read lost")
+
+	check(b:recvmany(batch, 5))
+	check(batch:get(1) == "fered", "buffered datagram lost (%s)", tostring(batch:get(1)))
+	check(batch:peer(1) == nil, "buffered datagram has a sender")
+
+	if #batch < 2 then
+		check(b:recvmany(batch, 5))
+		check(batch:get(1) == "next", "datagram after the buffered one lost")
+	else
+		check(batch:get(2) == "next", "datagram after the buffered one out of order")
+	end
+
+	-- datagrams longer than a slot are truncated
+	local small = socket.batch(2, 4)
+
+	check(a:sendmany{ "abcdefgh", "ijk" })
+	check(b:recvmany(small, 5))
+
+	local msg, trunc = small:get(1)
+	check(msg == "abcd" and trunc, "long datagram not truncated (%s)", msg)
+
+	if #small < 2 then
+		check(b:recvmany(small, 5))
+		msg, trunc = small:get(1)
+	else
+		msg, trunc = small:get(2)
+	end
+
+	check(msg == "ijk" and not trunc, "short datagram truncated (%s)", msg)
+
+	a:close()
+	b:close()
+
+	-- byte streams have no datagrams to return
+	local c, d = check(socket.pair(socket.SOCK_STREAM))
+
+	d:onerror(function (_, _, why) return why end)
+	check(c:write"xyz")
+	check(c:flush())
+
+	local res, why = d:recvmany(4, 1)
+	check(res == nil and why == errno.EOPNOTSUPP, "recvmany on a stream socket (%s)", tostring(why))
+	check(d:read(3) == "xyz", "recvmany on a stream socket consumed input")
+
+	c:close()
+	d:close()
+end)
+
+check(cq:loop(10))
+check(cq:empty(), "coroutines left over")
+
+say"OK"
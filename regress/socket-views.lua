@@ -0,0 +1,84 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Buffer views expose input without copying it into a Lua string, and
+-- must become unusable once the bytes beneath them are consumed.
+-- socket:relay forwards input straight from the buffer.
+--
+require"regress".export".*"
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local a, b = check(socket.pair())
+
+	check(a:write"hello\nworld\nrest")
+	check(a:flush())
+
+	local v = check(b:view())
+
+	check(#v == 6, "wrong view length (%d)", #v)
+	check(tostring(v) == "hello\n", "wrong view contents")
+	check(v:tostring() == "hello\n", "wrong view contents")
+	check(v:byte(1) == string.byte"h", "wrong first byte")
+
+	local i, j = v:find"ll"
+	check(i == 3 and j == 4, "wrong find result")
+	check(v:find"world" == nil, "find ran past the view")
+
+	-- a view leaves its data in the buffer
+	check(b:read"*L" == "hello\n", "view consumed its data")
+	check(not v:valid(), "view valid after its data was consumed")
+	check(not pcall(tostring, v), "stale view readable")
+
+	v = check(b:view(-3))
+	check(tostring(v) == "wor", "wrong counted view")
+	v:discard()
+	check(not v:valid(), "view valid after discard")
+	check(b:read"*l" == "ld", "discard consumed the wrong bytes")
+
+	for _, n in ipairs{ 0/0, 1/0, -1/0 } do
+		check(not pcall(b.view, b, n), "view size %s accepted", tostring(n))
+	end
+
+	-- move a view to another socket
+	local c, d = check(socket.pair())
+
+	v = check(b:view(4))
+	check(v:move(c))
+	check(c:flush())
+	check(d:read(4) == "rest", "moved data lost")
+
+	a:close()
+	check(b:view() == nil, "view at EOF")
+
+	-- relay a stream across two pairs
+	local e, f = check(socket.pair())
+	local data = string.rep("0123456789abcdef", 4096)
+
+	cq:wrap(function ()
+		check(e:write(data))
+		check(e:flush())
+		e:close()
+	end)
+
+	cq:wrap(function ()
+		check(d:read(#data) == data, "relayed data corrupted")
+	end)
+
+	local n = check(f:relay(c))
+	check(n == #data, "relayed %d of %d bytes", n, #data)
+	check(c:flush())
+
+	c:close()
+	b:close()
+	f:close()
+end)
+
+check(cq:loop(10))
+check(cq:empty(), "coroutines left over")
+
+say"OK"
@@ -0,0 +1,107 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- A channel must deliver every message exactly once and in order, also
+-- between threads with senders blocking on a full ring, honor send and
+-- receive timeouts, and report EPIPE once closed and drained.
+--
+require"regress".export".*"
+
+local channel = require"cqueues.thread.channel"
+
+-- single thread: capacity, ordering, multiple values, timeouts
+local ch = check(channel.new(3))
+
+check(ch:stats().size == 4, "size not rounded up to a power of 2")
+
+for i = 1, 4 do
+	check(ch:trysend(i, "n" .. i, i % 2 == 0))
+end
+
+local ok, why = ch:trysend(5)
+check(not ok and why == errno.EAGAIN, "send to a full channel succeeded")
+check(ch:stats().full > 0, "full channel not counted")
+
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	local began = cqueues.monotime()
+	local ok, why = ch:xsend(0.1, 5)
+
+	check(not ok and why == errno.ETIMEDOUT, "send to a full channel didn't time out")
+	check(cqueues.monotime() - began >= 0.1, "send timed out early")
+
+	for i = 1, 4 do
+		local n, s, b = ch:recv()
+
+		check(n == i and s == "n" .. i and b == (i % 2 == 0), "message %d garbled", i)
+	end
+
+	began = cqueues.monotime()
+
+	local v, why = ch:recv(0.1)
+
+	check(v == nil and why == errno.ETIMEDOUT, "receive from an empty channel didn't time out")
+	check(cqueues.monotime() - began >= 0.1, "receive timed out early")
+end)
+
+check(cq:loop(5))
+check(cq:empty(), "coroutines left over")
+
+-- across threads, with a ring small enough that the sender blocks
+local count = 10000
+local ch = check(channel.new(8))
+
+local thr = check(thread.start(function (pipe, handle, count)
+	local channel = require"cqueues.thread.channel"
+	local ch = assert(channel.new(handle))
+
+	for i = 1, count do
+		assert(ch:send(i, tostring(i)))
+	end
+
+	assert(ch:xsend(nil, "done"))
+	ch:close()
+end, ch:handle(), count))
+
+local got = 0
+
+cq:wrap(function ()
+	while true do
+		local v, s = ch:recv(10)
+
+		if v == nil then
+			check(s == errno.EPIPE, "receive failed (%s)", tostring(s))
+			break
+		elseif v == "done" then
+			check(got == count, "received %d of %d messages", got, count)
+		else
+			got = got + 1
+			check(v == got and s == tostring(got), "message %d out of order", got)
+		end
+	end
+end)
+
+check(cq:loop(30))
+check(cq:empty(), "coroutines left over")
+check(thr:join(5))
+
+local stats = ch:stats()
+
+info("sent=%d received=%d full=%d wakeups=%d", stats.sent, stats.received, stats.full, stats.wakeups)
+check(stats.sent == count + 1 and stats.received == count + 1, "messages lost")
+check(stats.queued == 0, "messages left queued")
+
+local ok, why = ch:send"late"
+check(not ok and why == errno.EPIPE, "send to a closed channel succeeded")
+
+-- a handle is adopted exactly once
+local handle = ch:handle()
+
+check(channel.new(handle), "channel handle not adopted")
+check(not pcall(channel.new, handle), "channel handle adopted twice")
+
+say"OK"
@@ -0,0 +1,83 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Calls submitted to a work-stealing thread.pool must each complete
+-- exactly once with their own results, whether collected by the
+-- submitting coroutine or by another one waiting on the same pool, and
+-- errors must come back pcall-style.
+--
+require"regress".export".*"
+
+local pool = check(thread.pool{ count = 3 })
+
+local function sum(n)
+	local s = 0
+
+	for i = 1, n do
+		s = s + i
+	end
+
+	return n, s
+end
+
+local cq = cqueues.new()
+local items = 40
+local done = 0
+
+-- several coroutines waiting on the pool at once
+for c = 1, 4 do
+	cq:wrap(function ()
+		for i = c, items, 4 do
+			local n = i * 10000
+			local ok, m, s = pool:run(sum, n)
+
+			check(ok, "%s", tostring(m))
+			check(m == n and s == n * (n + 1) / 2, "wrong result for item %d", i)
+			done = done + 1
+		end
+	end)
+end
+
+-- a backlog queued without waiting, collected out of order
+cq:wrap(function ()
+	local ids = {}
+
+	for i = 1, items do
+		ids[i] = check(pool:submit(sum, i))
+	end
+
+	for i = items, 1, -1 do
+		local ok, m, s = pool:wait(ids[i])
+
+		check(ok and m == i and s == i * (i + 1) / 2, "wrong result for submitted item %d", i)
+	end
+end)
+
+check(cq:loop(30))
+check(done == items, "only %d of %d calls completed", done, items)
+
+-- outside of a controller, and with errors
+local ok, why = pool:run(function () error("oops", 0) end)
+check(not ok and why == "oops", "error not returned (%s)", tostring(why))
+
+check(not pcall(pool.submit, pool, function (x) return x end, {}), "unserializable argument accepted")
+
+-- a handle is adopted exactly once
+local handle = pool.sched:handle()
+
+check(thread.scheduler(handle), "scheduler handle not adopted")
+check(not pcall(thread.scheduler, handle), "scheduler handle adopted twice")
+
+local stats = pool:stats()
+
+info("submitted=%d completed=%d stolen=%d", stats.submitted, stats.completed, stats.stolen)
+check(stats.submitted == stats.completed, "%d calls still outstanding", stats.submitted - stats.completed)
+check(stats.queued == 0, "%d calls still queued", stats.queued)
+
+check(pool:close(5))
+check(not pool:submit(sum, 1), "submit after close accepted")
+
+say"OK"
@@ -0,0 +1,66 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- With thread.prewarm, thread.start hands functions to idle threads and
+-- they become idle again afterwards. Each start must still get its own
+-- pipe and arguments, join must report how its function ended, and an
+-- error in one function mustn't break the threads which follow.
+--
+require"regress".export".*"
+
+local monotime = cqueues.monotime
+
+local function waitfor(what, f)
+	local deadline = monotime() + 5
+
+	while not f() do
+		check(monotime() < deadline, "timed out waiting for %s", what)
+		cqueues.sleep(0.01)
+	end
+end
+
+check(thread.prewarm(2))
+waitfor("idle threads", function () return thread.warmstats().idle == 2 end)
+
+local reused = thread.warmstats().reused
+
+for i = 1, 6 do
+	local thr, pipe = check(thread.start(function (pipe, n)
+		pipe:write(tostring(n * 2), "\n")
+	end, i))
+
+	check(pipe:read"*l" == tostring(i * 2), "thread %d got the wrong argument", i)
+
+	local ok, why = thr:join(5)
+	check(ok and why == nil, "thread %d failed (%s)", i, tostring(why))
+	pipe:close()
+end
+
+-- errors from a reused thread are reported, and the thread recovers
+local thr = check(thread.start(function ()
+	error("oops", 0)
+end))
+
+local ok, why = thr:join(5)
+check(ok and why == "oops", "error not reported (%s)", tostring(why))
+
+local thr, pipe = check(thread.start(function (pipe)
+	pipe:write"alive\n"
+end))
+
+check(pipe:read"*l" == "alive", "thread after an error didn't run")
+check(thr:join(5))
+
+local stats = thread.warmstats()
+
+info("created=%d reused=%d retired=%d", stats.created, stats.reused, stats.retired)
+check(stats.reused > reused, "idle threads weren't reused")
+
+check(thread.prewarm(0))
+waitfor("retirement", function () return thread.warmstats().idle == 0 end)
+check(thread.warmstats().retired >= 2, "idle threads not retired")
+
+say"OK"
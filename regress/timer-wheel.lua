@@ -0,0 +1,67 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Timeouts on a controller using the timing wheel must never fire early,
+-- must fire in deadline order, and timeouts long enough to be cascaded
+-- down from a higher wheel level must still fire. Timers disarmed because
+-- their object became ready first mustn't fire at all.
+--
+require"regress".export".*"
+
+local tick = 0.01
+local cq = cqueues.new{ timers = "wheel", resolution = tick }
+local monotime = cqueues.monotime
+local durations = { 1.3, 0.05, 0.7, 0.2, 0.95, 0.45 }
+local woken = {}
+
+for _, timeout in ipairs(durations) do
+	cq:wrap(function ()
+		local began = monotime()
+
+		cqueues.sleep(timeout)
+
+		local elapsed = monotime() - began
+
+		check(elapsed >= timeout, "%g second timeout fired early (%g)", timeout, elapsed)
+		check(elapsed < timeout + 0.5, "%g second timeout fired late (%g)", timeout, elapsed)
+		info("%g second timeout fired after %g", timeout, elapsed)
+
+		woken[#woken + 1] = timeout
+	end)
+end
+
+-- a condition signaled well before its timeout
+local cv = condition.new()
+local signaled = false
+
+cq:wrap(function ()
+	local began = monotime()
+
+	check(cv:wait(2), "condition timed out")
+	check(monotime() - began < 1, "condition woke late")
+	signaled = true
+end)
+
+cq:wrap(function ()
+	cqueues.sleep(0.1)
+	cv:signal()
+end)
+
+check(cq:loop(5))
+check(cq:empty(), "coroutines left over")
+check(signaled, "condition never signaled")
+check(#woken == #durations, "only %d of %d timeouts fired", #woken, #durations)
+
+table.sort(durations)
+
+for i, timeout in ipairs(durations) do
+	check(woken[i] == timeout, "timeouts fired out of order")
+end
+
+check(not pcall(cqueues.new, { timers = "wheel", resolution = 0 }), "zero resolution accepted")
+check(not pcall(cqueues.new, { timers = "bogus" }), "bogus timers accepted")
+
+say"OK"
@@ -0,0 +1,105 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Requesting kernel TLS offload must never break a session: where the
+-- kernel can't take over, as on a Unix domain socket pair, the session
+-- must carry on in userspace, and either way reads, writes and sendfile
+-- must move the same bytes.
+--
+require"regress".export".*"
+
+local srv_ctx = getsslctx("TLS", true)
+local cli_ctx = getsslctx("TLS", false, false)
+
+local payload = string.rep("0123456789abcdef", 4096)
+local file = check(io.tmpfile())
+check(file:write(payload))
+check(file:flush())
+
+-- returns whether either end claimed offload
+local function exchange(cli, srv, name)
+	local cq = cqueues.new()
+	local offload = false
+
+	cq:wrap(function ()
+		check(srv:starttls{ context = srv_ctx, ktls = true, timeout = 5 })
+		check(srv:write"hello\n")
+		check(srv:flush())
+		check(srv:sendfile(file, 0, #payload, 5) == #payload, "%s: short sendfile", name)
+		check(srv:flush())
+		check(srv:read"*l" == "bye", "%s: client went away", name)
+
+		local send, recv = srv:ktls()
+
+		info("%s: ktls send=%s recv=%s", name, tostring(send), tostring(recv))
+		offload = offload or send or recv
+		srv:close()
+	end)
+
+	cq:wrap(function ()
+		check(cli:starttls{ context = cli_ctx, ktls = true, timeout = 5 })
+		check(cli:read"*l" == "hello", "%s: server went away", name)
+		check(cli:read(#payload) == payload, "%s: sendfile data garbled", name)
+		check(cli:write"bye\n")
+		check(cli:flush())
+
+		local send, recv = cli:ktls()
+
+		offload = offload or send or recv
+		cli:close()
+	end)
+
+	check(cq:loop(10))
+	check(cq:empty(), "%s: coroutines left over", name)
+
+	return offload
+end -- exchange
+
+-- no kTLS on Unix domain sockets; this must fall back
+local cli, srv = check(socket.pair())
+check(not exchange(cli, srv, "socketpair"), "offload claimed on a socket pair")
+
+-- over TCP offload depends on the kernel and OpenSSL; both ways must work
+local cq = cqueues.new()
+local tcpcli, tcpsrv
+
+cq:wrap(function ()
+	local lsn = check(socket.listen{ host = "127.0.0.1", port = 0 })
+	local _, _, port = check(fileresult(lsn:localname()))
+
+	check(lsn:listen())
+
+	tcpcli = check(socket.connect{ host = "127.0.0.1", port = port })
+	check(tcpcli:connect(5))
+
+	tcpsrv = check(lsn:accept(5))
+	lsn:close()
+end)
+
+check(cq:loop(10))
+exchange(tcpcli, tcpsrv, "tcp")
+
+-- plain starttls takes no offload path
+local cli, srv = check(socket.pair())
+local cq = cqueues.new()
+
+cq:wrap(function ()
+	check(srv:starttls(srv_ctx))
+	check(srv:write"plain\n")
+	check(srv:flush())
+	srv:close()
+end)
+
+cq:wrap(function ()
+	check(cli:starttls(cli_ctx))
+	check(cli:read"*l" == "plain", "plain session broken")
+	check(not (cli:ktls()), "offload without request")
+	cli:close()
+end)
+
+check(cq:loop(10))
+
+say"OK"
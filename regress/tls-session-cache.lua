@@ -0,0 +1,98 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Contexts attached with socket.sessioncache must issue tickets from the
+-- shared keys, draw a new key every rotate seconds, resume a stored
+-- session on a later connection, and pick up a new ttl.
+--
+require"regress".export".*"
+
+local context = require"openssl.ssl.context"
+local openssl_ssl = require"openssl.ssl"
+
+local srv_ctx = newsslctx("TLS", true)
+check(socket.sessioncache(srv_ctx) == srv_ctx, "context not returned")
+
+local cli_ctx = newsslctx("TLS", false, false)
+
+local osize, ottl, orotate = socket.setsessioncache(nil, 60, 1)
+
+-- handshake over a fresh pair; returns the client's SSL object
+local function handshake(cq, ssl)
+	local cli, srv = check(socket.pair())
+	local cli_ssl
+
+	cq:wrap(function ()
+		check(srv:starttls(srv_ctx))
+		check(srv:write"hello\n")
+		check(srv:flush())
+		check(srv:read"*l" == "bye", "client went away")
+		srv:close()
+	end)
+
+	cq:wrap(function ()
+		check(cli:starttls(ssl or cli_ctx))
+		check(cli:read"*l" == "hello", "server went away")
+		check(cli:write"bye\n")
+		check(cli:flush())
+
+		cli_ssl = check(cli:checktls(), "no SSL object")
+		cli:close()
+	end)
+
+	check(cq:loop(10))
+	check(cq:empty(), "coroutines left over")
+
+	return cli_ssl
+end -- handshake
+
+local cq = cqueues.new()
+
+-- tickets and key rotation
+local stats = socket.sessionstats()
+
+handshake(cq)
+check(socket.sessionstats().issued > stats.issued, "no ticket issued")
+
+local rotated = socket.sessionstats().rotated
+cq:wrap(function () cqueues.sleep(1.2) end)
+check(cq:loop())
+handshake(cq)
+check(socket.sessionstats().rotated > rotated, "ticket key not rotated")
+
+-- a stored session resumes, which needs stateful sessions
+if context.OP_NO_TICKET and srv_ctx.setOptions then
+	srv_ctx:setOptions(context.OP_NO_TICKET)
+
+	local prev = handshake(cq)
+	local sess = prev.getSession and prev:getSession()
+
+	if sess and prev.setSession then
+		local ssl = openssl_ssl.new(cli_ctx)
+		local hits = socket.sessionstats().hits
+
+		ssl:setSession(sess)
+		handshake(cq, ssl)
+		check(socket.sessionstats().hits > hits, "stored session not resumed")
+	else
+		info("no client session support; resumption not checked")
+	end
+else
+	info("no SSL_OP_NO_TICKET; resumption not checked")
+end
+
+-- a new ttl reaches attached contexts
+socket.setsessioncache(nil, 42)
+
+if srv_ctx.getTimeout then
+	check(srv_ctx:getTimeout() == 42, "ttl not pushed to the attached context (%s)", tostring(srv_ctx:getTimeout()))
+else
+	info("no context:getTimeout; ttl propagation not checked")
+end
+
+socket.setsessioncache(osize, ottl, orotate)
+
+say"OK"
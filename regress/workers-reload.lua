@@ -0,0 +1,69 @@
+#!/bin/sh
+_=[[
+	. "${0%%/*}/regress.sh"
+	exec runlua "$0" "$@"
+]]
+--
+-- Connections made while workers:reload replaces one generation of
+-- workers with another must all be served, and the new generation must
+-- keep serving once the old one has exited.
+--
+require"regress".export".*"
+
+local workers = require"cqueues.workers"
+
+local function main(srv, greeting)
+	local cqueues = require"cqueues"
+
+	for con in srv:clients() do
+		cqueues.running():wrap(function ()
+			con:write(greeting, "\n")
+			con:flush()
+			con:close()
+		end)
+	end
+end
+
+-- workers bind their own listeners, so find a free port up front
+local tmp = check(socket.listen{ host = "127.0.0.1", port = 0 })
+local _, _, port = check(fileresult(tmp:localname()))
+tmp:close()
+
+local pool = check(workers.start({ count = 2, host = "127.0.0.1", port = port, timeout = 10 }, main, "hello"))
+
+local cq = cqueues.new()
+local reloading = true
+local served = 0
+
+cq:wrap(function ()
+	for i = 1, 3 do
+		check(pool:reload(10))
+		info("reload %d done after %d connections", i, served)
+	end
+
+	reloading = false
+end)
+
+cq:wrap(function ()
+	repeat
+		local con = check(socket.connect{ host = "127.0.0.1", port = port })
+
+		con:onerror(function (_, _, why) return why end)
+
+		local line, why = con:xread("*l", 5)
+		check(line == "hello", "connection %d not served (%s)", served + 1, tostring(line or why))
+		con:close()
+
+		served = served + 1
+	until not reloading and served >= 10
+end)
+
+check(cq:loop(60))
+check(cq:empty(), "coroutines left over")
+
+local stats = check(pool:stats(5))
+check(#stats == 2, "expected 2 workers, got %d", #stats)
+
+check(pool:stop(10))
+
+say"OK"
@@ -25,15 +25,17 @@
  */
 #include "config.h"
 
-#include <limits.h>	/* INT_MAX LONG_MAX */
+#include <limits.h>	/* INT_MAX LONG_MAX UINT_MAX */
 #include <float.h>	/* FLT_RADIX */
 #include <stdarg.h>	/* va_list va_start va_end */
 #include <stddef.h>	/* NULL offsetof() size_t */
-#include <stdlib.h>	/* malloc(3) free(3) */
+#include <stdint.h>	/* UINT64_C uint64_t uintptr_t */
+#include <stdio.h>	/* snprintf(3) */
+#include <stdlib.h>	/* malloc(3) calloc(3) free(3) posix_memalign(3) */
 #include <string.h>	/* memset(3) */
 #include <signal.h>	/* sigprocmask(2) pthread_sigmask(3) */
 #include <time.h>	/* struct timespec clock_gettime(3) */
-#include <math.h>	/* FP_* NAN fmax(3) fpclassify(3) isfinite(3) signbit(3) islessequal(3) isgreater(3) ceil(3) modf(3) */
+#include <math.h>	/* FP_* NAN fmax(3) fpclassify(3) isfinite(3) signbit(3) islessequal(3) isgreater(3) isgreaterequal(3) ceil(3) modf(3) */
 #include <errno.h>	/* errno */
 #include <assert.h>	/* assert */
 
@@ -336,76 +338,146 @@ static inline double mintimeout(double a, double b) {
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
-static void *make(size_t size, int *error) {
-	void *p;
-
-	if (!(p = malloc(size)))
-		*error = errno;
+/*
+ * Objects are carved from page-sized, page-aligned slabs so they're packed
+ * together in memory and the owning slab is found by masking an object's
+ * address. Slabs with free objects sit on .partial, completely allocated
+ * slabs on .full. Completely free slabs are only released by pool_trim(),
+ * so a steady state doesn't thrash malloc.
+ */
+#define POOL_SLABSIZE 4096
+#define POOL_ALIGN 16
 
-	return p;
-} /* make() */
+struct slab {
+	LIST_ENTRY(slab) le;
+	void *head;
+	size_t nfree, nobj;
+}; /* struct slab */
 
+#define SLAB_HDRSIZE ((sizeof (struct slab) + (POOL_ALIGN - 1)) & ~(size_t)(POOL_ALIGN - 1))
+#define SLAB_OF(p) ((struct slab *)((uintptr_t)(p) & ~(uintptr_t)(POOL_SLABSIZE - 1)))
 
 struct pool {
-	size_t size, count;
-	void *head;
+	size_t size, count; /* object size, objects allocated */
+	size_t nslab;
+	LIST_HEAD(, slab) partial, full;
 }; /* pool */
 
 static void pool_init(struct pool *P, size_t size) {
-	P->size  = MAX(size, sizeof (void **));
+	P->size  = (MAX(size, sizeof (void **)) + (POOL_ALIGN - 1)) & ~(size_t)(POOL_ALIGN - 1);
 	P->count = 0;
-	P->head  = NULL;
+	P->nslab = 0;
+	LIST_INIT(&P->partial);
+	LIST_INIT(&P->full);
+
+	assert(SLAB_HDRSIZE + P->size <= POOL_SLABSIZE);
 } /* pool_init() */
 
+static void slab_free(struct pool *P, struct slab *S) {
+	LIST_REMOVE(S, le);
+	P->count -= S->nobj;
+	P->nslab--;
+	free(S);
+} /* slab_free() */
+
 static void pool_destroy(struct pool *P) {
-	void *p;
+	struct slab *S;
 
-	while ((p = P->head)) {
-		P->head = *(void **)p;
-		free(p);
-		P->count--;
-	}
+	while ((S = LIST_FIRST(&P->partial)))
+		slab_free(P, S);
+
+	while ((S = LIST_FIRST(&P->full)))
+		slab_free(P, S);
 } /* pool_destroy() */
 
 static void pool_put(struct pool *P, void *p) {
-	*(void **)p = P->head;
-	P->head = p;
+	struct slab *S = SLAB_OF(p);
+
+	*(void **)p = S->head;
+	S->head = p;
+
+	if (S->nfree++ == 0) {
+		LIST_REMOVE(S, le);
+		LIST_INSERT_HEAD(&P->partial, S, le);
+	}
 } /* pool_put() */
 
 static int pool_grow(struct pool *P, size_t n) {
+	struct slab *S;
 	void *p;
+	size_t i;
 	int error;
 
-	while (n--) {
-		if (P->count + 1 == 0)
-			return ENOMEM;
-
-		if (!(p = make(P->size, &error)))
+	while (n > 0) {
+		if ((error = posix_memalign(&p, POOL_SLABSIZE, POOL_SLABSIZE)))
 			return error;
 
-		P->count++;
+		S = p;
+		S->head = NULL;
+		S->nfree = 0;
+		S->nobj = (POOL_SLABSIZE - SLAB_HDRSIZE) / P->size;
 
-		pool_put(P, p);
+		for (i = S->nobj; i > 0; i--) {
+			p = (char *)S + SLAB_HDRSIZE + ((i - 1) * P->size);
+			*(void **)p = S->head;
+			S->head = p;
+		}
+
+		S->nfree = S->nobj;
+		LIST_INSERT_HEAD(&P->partial, S, le);
+		P->count += S->nobj;
+		P->nslab++;
+
+		n -= MIN(n, S->nobj);
 	}
 
 	return 0;
 } /* pool_grow() */
 
+/* release completely free slabs, returning the number of bytes freed */
+static size_t pool_trim(struct pool *P) {
+	struct slab *S, *next;
+	size_t n = 0;
+
+	for (S = LIST_FIRST(&P->partial); S; S = next) {
+		next = LIST_NEXT(S, le);
+
+		if (S->nfree == S->nobj) {
+			slab_free(P, S);
+			n += POOL_SLABSIZE;
+		}
+	}
+
+	return n;
+} /* pool_trim() */
+
+/* make sure at least n objects have been allocated */
+static int pool_reserve(struct pool *P, size_t n) {
+	return (n > P->count)? pool_grow(P, n - P->count) : 0;
+} /* pool_reserve() */
+
 static void *pool_get(struct pool *P, int *_error) {
+	struct slab *S;
 	void *p;
 	int error;
 
-	if (!(p = P->head)) {
-		error = pool_grow(P, MAX(1, P->count));
-
-		if (!(p = P->head)) {
+	if (!(S = LIST_FIRST(&P->partial))) {
+		if ((error = pool_grow(P, 1))) {
 			*_error = error;
 
 			return NULL;
 		}
+
+		S = LIST_FIRST(&P->partial);
 	}
 
-	P->head = *(void **)p;
+	p = S->head;
+	S->head = *(void **)p;
+
+	if (--S->nfree == 0) {
+		LIST_REMOVE(S, le);
+		LIST_INSERT_HEAD(&P->full, S, le);
+	}
 
 	return p;
 } /* pool_get() */
@@ -430,16 +502,44 @@ static void *pool_get(struct pool *P, int *_error) {
 #include <sys/eventfd.h> /* eventfd(2) */
 #endif
 
+#if ENABLE_IOURING
+#if !ENABLE_EPOLL
+#error "io_uring backend requires epoll"
+#endif
+#include <stdint.h>		/* uintptr_t */
+#include <sys/mman.h>		/* MAP_* PROT_* mmap(2) munmap(2) */
+#include <sys/syscall.h>	/* SYS_io_uring_setup SYS_io_uring_enter syscall(2) */
+#include <linux/io_uring.h>	/* IORING_* struct io_uring_params struct io_uring_sqe struct io_uring_cqe */
+
+#if !defined IORING_ENTER_EXT_ARG || !defined SYS_io_uring_setup
+#error "io_uring headers too old (Linux 5.11 or later required)"
+#endif
+#endif
+
 
 #define KPOLL_FOREACH(ke, kp) for (ke = (kp)->pending.event; ke < &(kp)->pending.event[(kp)->pending.count]; ke++)
 
-#define KPOLL_MAXWAIT 32
+#define KPOLL_MAXWAIT 32 /* default (or initial, if adaptive) batch size */
+#define KPOLL_MAXADAPT 1024 /* default ceiling for adaptive batch size */
+
+/* private state bit requesting edge-triggered notification */
+#define KPOLL_EDGE 0x4000
+
+#if ENABLE_IOURING
+#define KPOLL_URING_ENTRIES 256
+#define KPOLL_URING_CQENTRIES 4096
+#define KPOLL_URING_NOOP 0 /* user_data of ignorable completions */
+#define KPOLL_URING_REMOVE 1 /* tag bit in user_data of removal requests */
+#endif
 
 #if ENABLE_EPOLL
+#define KPOLL_NATIVE "epoll"
 typedef struct epoll_event kpoll_event_t;
 #elif ENABLE_PORTS
+#define KPOLL_NATIVE "ports"
 typedef port_event_t kpoll_event_t;
 #elif ENABLE_KQUEUE
+#define KPOLL_NATIVE "kqueue"
 /* NetBSD uses intptr_t, others use void *, for .udata */
 #define KP_P2UDATA(p) ((__typeof__(((struct kevent *)0)->udata))(p))
 #define KP_UDATA2P(udata) ((void *)(udata))
@@ -452,8 +552,12 @@ struct kpoll {
 	int fd;
 
 	struct {
-		kpoll_event_t event[KPOLL_MAXWAIT];
-		size_t count;
+		kpoll_event_t *event;
+		size_t count, size;
+
+		/* user settings; survive kpoll_destroy */
+		size_t maxevents;
+		_Bool adaptive;
 	} pending;
 
 	struct {
@@ -461,19 +565,488 @@ struct kpoll {
 		short state;
 		int pending;
 	} alert;
+
+#if ENABLE_IOURING
+	/*
+	 * When active, .fd is the ring descriptor and completions are
+	 * translated into epoll events in .pending, so only kpoll_ctl and
+	 * kpoll_wait need to know which backend is in use.
+	 */
+	struct {
+		_Bool enable; /* requested by user; survives kpoll_destroy */
+		_Bool active;
+
+		struct {
+			void *map;
+			size_t mapsize;
+			unsigned *head, *tail, *mask, *entries, *array;
+			struct io_uring_sqe *sqe;
+			size_t sqesize;
+		} sq;
+
+		struct {
+			void *map;
+			size_t mapsize;
+			unsigned *head, *tail, *mask;
+			struct io_uring_cqe *cqe;
+		} cq;
+
+		/* udata of polls with a removal still in flight */
+		struct {
+			uintptr_t *udata;
+			size_t count, size;
+		} removing;
+	} uring;
+#endif
 }; /* struct kpoll */
 
 
+#if ENABLE_IOURING
+static void uring_preinit(struct kpoll *kp) {
+	kp->uring.active = 0;
+	memset(&kp->uring.sq, 0, sizeof kp->uring.sq);
+	memset(&kp->uring.cq, 0, sizeof kp->uring.cq);
+	memset(&kp->uring.removing, 0, sizeof kp->uring.removing);
+} /* uring_preinit() */
+#endif
+
+
 static void kpoll_preinit(struct kpoll *kp) {
 	kp->fd = -1;
+	kp->pending.event = NULL;
 	kp->pending.count = 0;
+	kp->pending.size = 0;
 	for (size_t i = 0; i < countof(kp->alert.fd); i++)
 		kp->alert.fd[i] = -1;
 	kp->alert.state = 0;
 	kp->alert.pending = 0;
+#if ENABLE_IOURING
+	uring_preinit(kp);
+#endif
 } /* kpoll_preinit() */
 
 
+static const char *kpoll_name(const struct kpoll *kp NOTUSED) {
+#if ENABLE_IOURING
+	if (kp->uring.active)
+		return "io_uring";
+#endif
+	return KPOLL_NATIVE;
+} /* kpoll_name() */
+
+
+/*
+ * Select the backend to use on the next kpoll_init. If io_uring was
+ * requested but isn't compiled in, or if kpoll_init finds the kernel
+ * doesn't support it, we silently fall back to the native backend.
+ */
+static cqs_error_t kpoll_setbackend(struct kpoll *kp NOTUSED, const char *name) {
+	if (!strcmp(name, "io_uring")) {
+#if ENABLE_IOURING
+		kp->uring.enable = 1;
+#endif
+		return 0;
+	}
+
+	if (!strcmp(name, "native") || !strcmp(name, KPOLL_NATIVE)) {
+#if ENABLE_IOURING
+		kp->uring.enable = 0;
+#endif
+		return 0;
+	}
+
+	return EINVAL;
+} /* kpoll_setbackend() */
+
+
+/*
+ * Set the number of events read per kpoll_wait. In adaptive mode the
+ * batch starts small and doubles, up to maxevents, whenever a wait
+ * returns a full batch.
+ */
+static void kpoll_setmaxevents(struct kpoll *kp, size_t maxevents, _Bool adaptive) {
+	kp->pending.maxevents = maxevents;
+	kp->pending.adaptive = adaptive;
+} /* kpoll_setmaxevents() */
+
+
+static size_t kpoll_maxevents(const struct kpoll *kp) {
+	if (kp->pending.maxevents)
+		return kp->pending.maxevents;
+
+	return (kp->pending.adaptive)? KPOLL_MAXADAPT : KPOLL_MAXWAIT;
+} /* kpoll_maxevents() */
+
+
+static cqs_error_t kpoll_resize(struct kpoll *kp, size_t size) {
+	kpoll_event_t *event;
+
+	if (size > INT_MAX || size > (size_t)-1 / sizeof *event)
+		return EOVERFLOW;
+
+	if (!(event = realloc(kp->pending.event, size * sizeof *event)))
+		return errno;
+
+	kp->pending.event = event;
+	kp->pending.size = size;
+
+	return 0;
+} /* kpoll_resize() */
+
+
+static void kpoll_adapt(struct kpoll *kp) {
+	size_t maxevents = kpoll_maxevents(kp);
+
+	/* a full batch suggests more events were ready than we could read */
+	if (!kp->pending.adaptive || kp->pending.count < kp->pending.size || kp->pending.size >= maxevents)
+		return;
+
+	/* on failure just keep using the current array */
+	(void)kpoll_resize(kp, MIN(kp->pending.size * 2, maxevents));
+} /* kpoll_adapt() */
+
+
+#if ENABLE_IOURING
+/*
+ * I O _ U R I N G  B A C K E N D
+ *
+ * Poll requests are one-shot, like Solaris Ports, so kpoll_diff clears
+ * the descriptor state on delivery and cqueue_update re-arms. Both
+ * additions and removals are only queued to the submission ring and
+ * submitted in bulk by kpoll_wait, which replaces a syscall per readiness
+ * change with one per step.
+ *
+ * The caller may recycle udata as soon as a removal is queued, so
+ * completions the poll posts until the kernel has processed the removal
+ * must be dropped. Completions already in the ring are scrubbed at once.
+ * Later ones are matched against .removing, which remembers the udata
+ * until the removal's own completion, tagged with KPOLL_URING_REMOVE,
+ * arrives. Submission is in order, so completions of a poll re-added
+ * with the same udata only come after that.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void uring_destroy(struct kpoll *kp) {
+	free(kp->uring.removing.udata);
+
+	if (kp->uring.sq.sqe)
+		munmap(kp->uring.sq.sqe, kp->uring.sq.sqesize);
+	if (kp->uring.cq.map && kp->uring.cq.mapsize)
+		munmap(kp->uring.cq.map, kp->uring.cq.mapsize);
+	if (kp->uring.sq.map)
+		munmap(kp->uring.sq.map, kp->uring.sq.mapsize);
+
+	uring_preinit(kp);
+} /* uring_destroy() */
+
+
+static void *uring_mmap(int fd, size_t size, off_t offset, int *error) {
+	void *map;
+
+	if (MAP_FAILED == (map = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, offset))) {
+		*error = errno;
+
+		return NULL;
+	}
+
+	return map;
+} /* uring_mmap() */
+
+
+static cqs_error_t uring_init(struct kpoll *kp) {
+	struct io_uring_params p;
+	char *sq, *cq;
+	int error;
+
+	memset(&p, 0, sizeof p);
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = KPOLL_URING_CQENTRIES;
+
+	/* ring descriptors are always created close-on-exec */
+	if (-1 == (kp->fd = syscall(SYS_io_uring_setup, KPOLL_URING_ENTRIES, &p)))
+		return errno;
+
+	/*
+	 * NODROP guarantees completions for armed polls are never lost,
+	 * and EXT_ARG lets us wait with a timeout without queueing a
+	 * timeout request.
+	 */
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+		error = ENOTSUP;
+		goto error;
+	}
+
+	kp->uring.sq.mapsize = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	kp->uring.cq.mapsize = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		kp->uring.sq.mapsize = MAX(kp->uring.sq.mapsize, kp->uring.cq.mapsize);
+		kp->uring.cq.mapsize = 0; /* shared with .sq.map */
+	}
+
+	if (!(kp->uring.sq.map = uring_mmap(kp->fd, kp->uring.sq.mapsize, IORING_OFF_SQ_RING, &error)))
+		goto error;
+
+	if (kp->uring.cq.mapsize) {
+		if (!(kp->uring.cq.map = uring_mmap(kp->fd, kp->uring.cq.mapsize, IORING_OFF_CQ_RING, &error)))
+			goto error;
+	} else {
+		kp->uring.cq.map = kp->uring.sq.map;
+	}
+
+	kp->uring.sq.sqesize = p.sq_entries * sizeof (struct io_uring_sqe);
+
+	if (!(kp->uring.sq.sqe = uring_mmap(kp->fd, kp->uring.sq.sqesize, IORING_OFF_SQES, &error)))
+		goto error;
+
+	sq = kp->uring.sq.map;
+	kp->uring.sq.head = (unsigned *)(sq + p.sq_off.head);
+	kp->uring.sq.tail = (unsigned *)(sq + p.sq_off.tail);
+	kp->uring.sq.mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	kp->uring.sq.entries = (unsigned *)(sq + p.sq_off.ring_entries);
+	kp->uring.sq.array = (unsigned *)(sq + p.sq_off.array);
+
+	cq = kp->uring.cq.map;
+	kp->uring.cq.head = (unsigned *)(cq + p.cq_off.head);
+	kp->uring.cq.tail = (unsigned *)(cq + p.cq_off.tail);
+	kp->uring.cq.mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	kp->uring.cq.cqe = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	kp->uring.active = 1;
+
+	return 0;
+error:
+	uring_destroy(kp);
+	cqs_closefd(&kp->fd);
+
+	return error;
+} /* uring_init() */
+
+
+static cqs_error_t uring_enter(struct kpoll *kp, unsigned flags, unsigned mincount, const struct timespec *ts) {
+	struct __kernel_timespec kts;
+	struct io_uring_getevents_arg arg;
+	unsigned count;
+
+	count = *kp->uring.sq.tail - __atomic_load_n(kp->uring.sq.head, __ATOMIC_ACQUIRE);
+
+	if (flags & IORING_ENTER_GETEVENTS) {
+		memset(&arg, 0, sizeof arg);
+		arg.sigmask_sz = _NSIG / 8;
+
+		if (ts) {
+			kts.tv_sec = ts->tv_sec;
+			kts.tv_nsec = ts->tv_nsec;
+			arg.ts = (uintptr_t)&kts;
+		}
+
+		if (-1 == syscall(SYS_io_uring_enter, kp->fd, count, mincount, flags|IORING_ENTER_EXT_ARG, &arg, sizeof arg))
+			goto syerr;
+	} else if (count) {
+		if (-1 == syscall(SYS_io_uring_enter, kp->fd, count, 0, flags, NULL, 0))
+			goto syerr;
+	}
+
+	return 0;
+syerr:
+	/* EBUSY means completions are backlogged; we'll reap them */
+	return (errno == ETIME || errno == EINTR || errno == EBUSY)? 0 : errno;
+} /* uring_enter() */
+
+
+static struct io_uring_sqe *uring_getsqe(struct kpoll *kp, int *error) {
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+
+	tail = *kp->uring.sq.tail;
+
+	if (tail - __atomic_load_n(kp->uring.sq.head, __ATOMIC_ACQUIRE) >= *kp->uring.sq.entries) {
+		if ((*error = uring_enter(kp, 0, 0, NULL)))
+			return NULL;
+
+		if (tail - __atomic_load_n(kp->uring.sq.head, __ATOMIC_ACQUIRE) >= *kp->uring.sq.entries) {
+			*error = EBUSY;
+			return NULL;
+		}
+	}
+
+	/*
+	 * NB: Without SQPOLL the kernel only reads the submission ring
+	 * from within io_uring_enter, so it's safe to publish the entry
+	 * before the caller fills it in.
+	 */
+	index = tail & *kp->uring.sq.mask;
+	sqe = &kp->uring.sq.sqe[index];
+	memset(sqe, 0, sizeof *sqe);
+	kp->uring.sq.array[index] = index;
+	__atomic_store_n(kp->uring.sq.tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+} /* uring_getsqe() */
+
+
+static void uring_scrub(struct kpoll *kp, void *udata) {
+	unsigned head = *kp->uring.cq.head;
+	unsigned tail = __atomic_load_n(kp->uring.cq.tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+
+	/* entries between head and tail belong to us until head advances */
+	for (; head != tail; head++) {
+		cqe = &kp->uring.cq.cqe[head & *kp->uring.cq.mask];
+
+		if (cqe->user_data == (uintptr_t)udata)
+			cqe->user_data = KPOLL_URING_NOOP;
+	}
+} /* uring_scrub() */
+
+
+static inline __u32 uring_pollmask(short events) {
+	__u32 mask = (unsigned short)events;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	mask = (mask << 16) | (mask >> 16); /* poll32_events is word-reversed */
+#endif
+	return mask;
+} /* uring_pollmask() */
+
+
+static cqs_error_t uring_remove(struct kpoll *kp, void *udata) {
+	struct io_uring_sqe *sqe;
+	int error;
+
+	if (kp->uring.removing.count >= kp->uring.removing.size) {
+		size_t size = MAX(16, kp->uring.removing.size * 2);
+		uintptr_t *tmp;
+
+		if (!(tmp = realloc(kp->uring.removing.udata, size * sizeof *tmp)))
+			return errno;
+
+		kp->uring.removing.udata = tmp;
+		kp->uring.removing.size = size;
+	}
+
+	if (!(sqe = uring_getsqe(kp, &error)))
+		return error;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)udata;
+	sqe->user_data = (uintptr_t)udata | KPOLL_URING_REMOVE;
+
+	kp->uring.removing.udata[kp->uring.removing.count++] = (uintptr_t)udata;
+
+	uring_scrub(kp, udata);
+
+	return 0;
+} /* uring_remove() */
+
+
+/* returns true if a completion for udata predates its removal */
+static _Bool uring_removed(struct kpoll *kp, uintptr_t udata) {
+	for (size_t i = 0; i < kp->uring.removing.count; i++) {
+		if (kp->uring.removing.udata[i] == udata)
+			return 1;
+	}
+
+	return 0;
+} /* uring_removed() */
+
+
+/* the removal of udata completed; forget one record of it */
+static void uring_unremove(struct kpoll *kp, uintptr_t udata) {
+	for (size_t i = 0; i < kp->uring.removing.count; i++) {
+		if (kp->uring.removing.udata[i] == udata) {
+			kp->uring.removing.udata[i] = kp->uring.removing.udata[--kp->uring.removing.count];
+
+			return;
+		}
+	}
+} /* uring_unremove() */
+
+
+static cqs_error_t uring_ctl(struct kpoll *kp, int fd, short *state, short events, void *udata) {
+	struct io_uring_sqe *sqe;
+	int error;
+
+	if (*state == events)
+		return 0;
+
+	if (*state) {
+		if ((error = uring_remove(kp, udata)))
+			return error;
+
+		*state = 0;
+	}
+
+	if (events) {
+		if (!(sqe = uring_getsqe(kp, &error)))
+			return error;
+
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = uring_pollmask(events);
+		sqe->user_data = (uintptr_t)udata;
+
+		*state = events;
+	}
+
+	return 0;
+} /* uring_ctl() */
+
+
+static void uring_reap(struct kpoll *kp) {
+	unsigned head = *kp->uring.cq.head;
+	unsigned tail = __atomic_load_n(kp->uring.cq.tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	kpoll_event_t *ke;
+
+	kp->pending.count = 0;
+
+	/* anything which doesn't fit is left for the next kpoll_wait */
+	for (; head != tail && kp->pending.count < kp->pending.size; head++) {
+		cqe = &kp->uring.cq.cqe[head & *kp->uring.cq.mask];
+
+		if (cqe->user_data & KPOLL_URING_REMOVE) {
+			uring_unremove(kp, cqe->user_data & ~(__u64)KPOLL_URING_REMOVE);
+			continue;
+		}
+
+		if (cqe->user_data == KPOLL_URING_NOOP || cqe->res == -ECANCELED)
+			continue;
+
+		if (kp->uring.removing.count && uring_removed(kp, cqe->user_data))
+			continue;
+
+		ke = &kp->pending.event[kp->pending.count++];
+		ke->data.ptr = (void *)(uintptr_t)cqe->user_data;
+
+		/*
+		 * A failed request, e.g. EBADF, is reported as readiness so
+		 * the owner discovers the error on its next I/O operation.
+		 */
+		ke->events = (cqe->res < 0)? POLLERR|POLLHUP|POLLIN|POLLOUT|POLLPRI : (unsigned)cqe->res;
+
+		/* alert descriptor isn't routed through kpoll_diff */
+		if (ke->data.ptr == &kp->alert)
+			kp->alert.state = 0;
+	}
+
+	__atomic_store_n(kp->uring.cq.head, head, __ATOMIC_RELEASE);
+} /* uring_reap() */
+
+
+static cqs_error_t uring_wait(struct kpoll *kp, double timeout) {
+	int error;
+
+	if ((error = uring_enter(kp, IORING_ENTER_GETEVENTS, 1, f2ts(timeout))))
+		return error;
+
+	uring_reap(kp);
+
+	return 0;
+} /* uring_wait() */
+#endif /* ENABLE_IOURING */
+
+
 static int kpoll_ctl(struct kpoll *, int, short *, short, void *);
 static int alert_rearm(struct kpoll *);
 
@@ -523,7 +1096,14 @@ static int alert_rearm(struct kpoll *kp) {
 static int kpoll_init(struct kpoll *kp) {
 	int error;
 
+	if ((error = kpoll_resize(kp, (kp->pending.adaptive)? MIN(KPOLL_MAXWAIT, kpoll_maxevents(kp)) : kpoll_maxevents(kp))))
+		return error;
+
 #if ENABLE_EPOLL
+#if ENABLE_IOURING
+	if (kp->uring.enable && !uring_init(kp))
+		return alert_init(kp);
+#endif
 #if defined EPOLL_CLOEXEC
 	(void)error;
 	if (-1 == (kp->fd = epoll_create1(EPOLL_CLOEXEC)))
@@ -555,7 +1135,11 @@ static int kpoll_init(struct kpoll *kp) {
 
 static void kpoll_destroy(struct kpoll *kp, int (*closefd)(int *, void *), void *cb_udata) {
 	alert_destroy(kp, closefd, cb_udata);
+#if ENABLE_IOURING
+	uring_destroy(kp);
+#endif
 	closefd(&kp->fd, cb_udata);
+	free(kp->pending.event);
 	kpoll_preinit(kp);
 } /* kpoll_destroy() */
 
@@ -582,11 +1166,16 @@ static inline short kpoll_pending(const kpoll_event_t *event) {
 } /* kpoll_pending() */
 
 
-static inline short kpoll_diff(const kpoll_event_t *event NOTUSED, short ostate NOTUSED) {
+static inline short kpoll_diff(const struct kpoll *kp NOTUSED, const kpoll_event_t *event NOTUSED, short ostate NOTUSED) {
 #if ENABLE_PORTS
 	/* Solaris Event Ports aren't persistent. */
 	return 0;
 #else
+#if ENABLE_IOURING
+	/* Neither are io_uring poll requests. */
+	if (kp->uring.active)
+		return 0;
+#endif
 	return ostate;
 #endif
 } /* kpoll_diff() */
@@ -597,6 +1186,11 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 	struct epoll_event event;
 	int op;
 
+#if ENABLE_IOURING
+	if (kp->uring.active)
+		return uring_ctl(kp, fd, state, events & ~KPOLL_EDGE, udata);
+#endif
+
 	if (*state == events)
 		return 0;
 
@@ -604,7 +1198,9 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 
 	memset(&event, 0, sizeof event);
 
-	event.events = events;
+	event.events = events & ~KPOLL_EDGE;
+	if (events & KPOLL_EDGE)
+		event.events |= EPOLLET;
 	event.data.ptr = udata;
 
 	if (0 != epoll_ctl(kp->fd, op, fd, &event))
@@ -614,6 +1210,8 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 
 	return 0;
 #elif ENABLE_PORTS
+	events &= ~KPOLL_EDGE;
+
 	if (*state == events)
 		return 0;
 
@@ -630,13 +1228,20 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 	return 0;
 #elif ENABLE_KQUEUE
 	struct kevent event;
+	int flags = EV_ADD;
+	_Bool reflag;
 
 	if (*state == events)
 		return 0;
 
+	/* EV_ADD on an existing filter updates its flags */
+	if (events & KPOLL_EDGE)
+		flags |= EV_CLEAR;
+	reflag = !!((*state ^ events) & KPOLL_EDGE);
+
 	if (events & POLLIN) {
-		if (!(*state & POLLIN)) {
-			KP_SET(&event, fd, EVFILT_READ, EV_ADD, 0, 0, udata);
+		if (!(*state & POLLIN) || reflag) {
+			KP_SET(&event, fd, EVFILT_READ, flags, 0, 0, udata);
 
 			if (0 != kevent(kp->fd, &event, 1, NULL, 0, &(struct timespec){ 0, 0 }))
 				return errno;
@@ -653,8 +1258,8 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 	}
 
 	if (events & POLLOUT) {
-		if (!(*state & POLLOUT)) {
-			KP_SET(&event, fd, EVFILT_WRITE, EV_ADD, 0, 0, udata);
+		if (!(*state & POLLOUT) || reflag) {
+			KP_SET(&event, fd, EVFILT_WRITE, flags, 0, 0, udata);
 
 			if (0 != kevent(kp->fd, &event, 1, NULL, 0, &(struct timespec){ 0, 0 }))
 				return errno;
@@ -670,11 +1275,30 @@ static int kpoll_ctl(struct kpoll *kp, int fd, short *state, short events, void
 		*state &= ~POLLOUT;
 	}
 
+	*state = (*state & ~KPOLL_EDGE) | ((*state)? (events & KPOLL_EDGE) : 0);
+
 	return 0;
 #endif
 } /* kpoll_ctl() */
 
 
+/*
+ * Edge-triggered registrations need persistent kernel readiness state,
+ * which neither Solaris Ports nor io_uring one-shot polls provide.
+ */
+static inline _Bool kpoll_canedge(const struct kpoll *kp NOTUSED) {
+#if ENABLE_PORTS
+	return 0;
+#else
+#if ENABLE_IOURING
+	if (kp->uring.active)
+		return 0;
+#endif
+	return 1;
+#endif
+} /* kpoll_canedge() */
+
+
 static int kpoll_alert(struct kpoll *kp) {
 	int error;
 
@@ -767,10 +1391,16 @@ static inline short kpoll_isalert(struct kpoll *kp, const kpoll_event_t *event)
 
 
 static int kpoll_wait(struct kpoll *kp, double timeout) {
+	kpoll_adapt(kp);
 #if ENABLE_EPOLL
 	int n;
 
-	if (-1 == (n = epoll_wait(kp->fd, kp->pending.event, (int)countof(kp->pending.event), f2ms(timeout))))
+#if ENABLE_IOURING
+	if (kp->uring.active)
+		return uring_wait(kp, timeout);
+#endif
+
+	if (-1 == (n = epoll_wait(kp->fd, kp->pending.event, (int)kp->pending.size, f2ms(timeout))))
 		return (errno == EINTR)? 0 : errno;
 
 	kp->pending.count = n;
@@ -782,7 +1412,7 @@ static int kpoll_wait(struct kpoll *kp, double timeout) {
 
 	kp->pending.count = 0;
 
-	if (0 != port_getn(kp->fd, kp->pending.event, countof(kp->pending.event), &n, f2ts(timeout)))
+	if (0 != port_getn(kp->fd, kp->pending.event, kp->pending.size, &n, f2ts(timeout)))
 		return (errno == ETIME || errno == EINTR)? 0 : errno;
 
 	kp->pending.count = n;
@@ -791,7 +1421,7 @@ static int kpoll_wait(struct kpoll *kp, double timeout) {
 #elif ENABLE_KQUEUE
 	int n;
 
-	if (-1 == (n = kevent(kp->fd, NULL, 0, kp->pending.event, (int)countof(kp->pending.event), f2ts(timeout))))
+	if (-1 == (n = kevent(kp->fd, NULL, 0, kp->pending.event, (int)kp->pending.size, f2ts(timeout))))
 		return (errno == EINTR)? 0 : errno;
 
 	kp->pending.count = n;
@@ -1110,6 +1740,8 @@ struct event {
 	double timeout;
 
 	_Bool pending;
+	_Bool stale; /* parked while thread runs; see event_park() */
+	_Bool edge; /* may be polled edge-triggered; see fileno_update() */
 
 	int index; /* on .thread->L stack */
 
@@ -1126,21 +1758,43 @@ struct event {
 struct fileno {
 	int fd;
 	short state;
+	short ready; /* latched while edge-triggered; see fileno_signal() */
 
 	LIST_HEAD(, event) events;
 
 	LLRB_ENTRY(fileno) rbe;
 
 	LIST_ENTRY(fileno) le;
+
+	struct cqueue *cqueue;
+	LIST_ENTRY(fileno) cse; /* see cstack_addfd() */
 }; /* struct fileno */
 
+LIST_HEAD(filenos, fileno);
+
 
 struct timer {
 	double timeout;
 
 	LLRB_ENTRY(timer) rbe;
+
+	/* only used by the timing wheel; see wheel_add() */
+	uint64_t expires;
+	struct timerlist *pending;
+	TAILQ_ENTRY(timer) tqe;
 }; /* struct timer */
 
+TAILQ_HEAD(timerlist, timer);
+
+
+/*
+ * Priority classes. Each has its own pending queue, and each pass of
+ * cqueue_process() drains them in this order.
+ */
+#define THREAD_HIGH   0
+#define THREAD_NORMAL 1
+#define THREAD_LOW    2
+#define THREAD_NPRIO  3
 
 struct thread {
 	lua_State *L; /* only for coroutines */
@@ -1149,7 +1803,10 @@ struct thread {
 	unsigned count;
 
 	struct threads *threads;
-	LIST_ENTRY(thread) le;
+	TAILQ_ENTRY(thread) le;
+
+	unsigned priority;
+	unsigned long pass; /* pass when last queued; see thread_next() */
 
 	double mintimeout;
 
@@ -1163,40 +1820,479 @@ struct cqueue {
 	struct kpoll kp;
 
 	struct {
-		LLRB_HEAD(table, fileno) table;
-		LIST_HEAD(, fileno) polling, outstanding, inactive;
+		struct fileno **index; /* indexed by descriptor number */
+		size_t size;
+		LLRB_HEAD(table, fileno) table; /* descriptors beyond .index */
+		struct filenos polling, outstanding, inactive;
 	} fileno;
 
-	struct {
-		struct pool wakecb, fileno, event;
-	} pool;
+	struct {
+		struct pool wakecb, fileno, event;
+	} pool;
+
+	struct {
+		TAILQ_HEAD(threads, thread) polling, pending[THREAD_NPRIO];
+		struct thread *current;
+		unsigned count;
+
+		unsigned long pass; /* incremented by each cqueue_process() */
+		unsigned budget, left; /* resumes per pass; 0 is unlimited */
+		double slice, deadline; /* seconds per pass; 0 is unlimited */
+	} thread;
+
+	LLRB_HEAD(timers, timer) timers;
+	struct wheel *wheel; /* replaces timers tree if non-NULL */
+
+	_Bool edge; /* use edge-triggered polling where safe */
+
+	double busypoll; /* seconds to spin on the kernel queue before blocking */
+
+	struct {
+		unsigned long reused; /* events carried over a resume */
+		unsigned long kept; /* descriptor registrations left untouched */
+		unsigned long steps; /* kernel polls */
+		unsigned long events; /* kernel events read */
+		unsigned long alerts; /* wakeups by cqueue_alert() */
+		unsigned long expired; /* threads woken by timeout */
+		unsigned long resumes;
+		unsigned long ctl; /* kernel registration changes */
+		unsigned long preempted; /* passes cut short by the budget */
+		unsigned long fastwakes; /* wakecb wakeups run in the same pass */
+		unsigned long spins; /* zero-timeout polls while busy polling */
+		unsigned long spinhits; /* steps whose events arrived while spinning */
+		unsigned long blocks; /* steps which blocked in the kernel */
+	} stats;
+
+	struct profile *profile; /* see cqueue:stats() */
+
+	struct cstack *cstack;
+
+	LIST_ENTRY(cqueue) le;
+}; /* struct cqueue */
+
+
+static inline int fileno_cmp(const struct fileno *const a, const struct fileno *const b) {
+	return a->fd - b->fd;
+} /* fileno_cmp() */
+
+LLRB_GENERATE_STATIC(table, fileno, rbe, fileno_cmp)
+
+
+static inline int timer_cmp(const struct timer *const a, const struct timer *const b) {
+	return (a->timeout < b->timeout)? -1 : (a->timeout > b->timeout)? 1 : (a < b)? -1 : (a > b)? 1 : 0;
+} /* timer_cmp() */
+
+LLRB_GENERATE_STATIC(timers, timer, rbe, timer_cmp)
+
+
+/*
+ * Hierarchical timing wheel, an optional alternative to the timers tree
+ * for controllers juggling very many timeouts (e.g. one per connection)
+ * which can tolerate a coarser resolution. Deadlines are converted to
+ * ticks, rounding up so nothing fires early. Each level holds WHEEL_LEN
+ * slots of WHEEL_LEN^level ticks plus a bitmap of non-empty slots, so
+ * arming, disarming and finding the next deadline don't depend on the
+ * number of timers. Timers in a higher level are cascaded down as their
+ * slot comes due.
+ */
+#define WHEEL_BIT 6
+#define WHEEL_NUM 6
+#define WHEEL_LEN (1U << WHEEL_BIT)
+#define WHEEL_MASK (WHEEL_LEN - 1)
+#define WHEEL_TICKMAX ((UINT64_C(1) << (WHEEL_BIT * WHEEL_NUM)) - 1)
+
+#define WHEEL_RESOLUTION 0.001
+
+struct wheel {
+	double tick; /* resolution in seconds */
+	uint64_t curtime; /* in ticks */
+	uint64_t pending[WHEEL_NUM]; /* bitmap of non-empty slots */
+	struct timerlist slot[WHEEL_NUM][WHEEL_LEN];
+	struct timerlist expired;
+}; /* struct wheel */
+
+
+static inline int wheel_ctz(uint64_t n) {
+#if __GNUC__
+	return __builtin_ctzll(n);
+#else
+	int i;
+
+	for (i = 0; !(n & 1); i++)
+		n >>= 1;
+
+	return i;
+#endif
+} /* wheel_ctz() */
+
+
+static inline int wheel_fls(uint64_t n) {
+#if __GNUC__
+	return 64 - __builtin_clzll(n);
+#else
+	int i;
+
+	for (i = 0; n; i++)
+		n >>= 1;
+
+	return i;
+#endif
+} /* wheel_fls() */
+
+
+static inline uint64_t wheel_rotl(uint64_t v, int c) {
+	if (!(c &= 63))
+		return v;
+
+	return (v << c) | (v >> (64 - c));
+} /* wheel_rotl() */
+
+
+static inline uint64_t wheel_rotr(uint64_t v, int c) {
+	if (!(c &= 63))
+		return v;
+
+	return (v >> c) | (v << (64 - c));
+} /* wheel_rotr() */
+
+
+static uint64_t wheel_ticks(const struct wheel *W, double t, _Bool roundup) {
+	t /= W->tick;
+	t = (roundup)? ceil(t) : floor(t);
+
+	/* leave headroom so tick arithmetic can't wrap */
+	return (t > 0)? ((t < 0x1p62)? (uint64_t)t : UINT64_C(1) << 62) : 0;
+} /* wheel_ticks() */
+
+
+static struct wheel *wheel_new(double tick, double curtime, int *error) {
+	struct wheel *W;
+	int i, j;
+
+	if (!(W = malloc(sizeof *W))) {
+		*error = errno;
+
+		return NULL;
+	}
+
+	W->tick = tick;
+	W->curtime = wheel_ticks(W, curtime, 0);
+
+	for (i = 0; i < WHEEL_NUM; i++) {
+		W->pending[i] = 0;
+
+		for (j = 0; j < (int)WHEEL_LEN; j++)
+			TAILQ_INIT(&W->slot[i][j]);
+	}
+
+	TAILQ_INIT(&W->expired);
+
+	return W;
+} /* wheel_new() */
+
+
+static void wheel_del(struct wheel *W, struct timer *timer) {
+	if (timer->pending) {
+		TAILQ_REMOVE(timer->pending, timer, tqe);
+
+		if (timer->pending != &W->expired && TAILQ_EMPTY(timer->pending)) {
+			ptrdiff_t index = timer->pending - &W->slot[0][0];
+
+			W->pending[index / WHEEL_LEN] &= ~(UINT64_C(1) << (index % WHEEL_LEN));
+		}
+
+		timer->pending = NULL;
+	}
+} /* wheel_del() */
+
+
+static void wheel_sched(struct wheel *W, struct timer *timer) {
+	if (timer->expires > W->curtime) {
+		uint64_t rem = timer->expires - W->curtime;
+		int wheel, slot;
+
+		/*
+		 * rem is nonzero so wheel_fls() is at least 1. Timers beyond
+		 * the range of the top level are parked there and simply
+		 * rescheduled each time their slot comes around.
+		 */
+		wheel = (wheel_fls(MIN(rem, WHEEL_TICKMAX)) - 1) / WHEEL_BIT;
+		slot = WHEEL_MASK & ((timer->expires >> (wheel * WHEEL_BIT)) - !!wheel);
+
+		timer->pending = &W->slot[wheel][slot];
+		W->pending[wheel] |= UINT64_C(1) << slot;
+	} else {
+		timer->pending = &W->expired;
+	}
+
+	TAILQ_INSERT_TAIL(timer->pending, timer, tqe);
+} /* wheel_sched() */
+
+
+static void wheel_add(struct wheel *W, struct timer *timer) {
+	wheel_del(W, timer);
+
+	timer->expires = wheel_ticks(W, timer->timeout, 1);
+
+	wheel_sched(W, timer);
+} /* wheel_add() */
+
+
+/*
+ * Advance the wheel to curtime, moving every timer in a slot passed over
+ * to the expired list or, for cascaded timers not yet due, to a lower
+ * level.
+ */
+static void wheel_update(struct wheel *W, double curtime) {
+	uint64_t now = wheel_ticks(W, curtime, 0);
+	uint64_t elapsed;
+	struct timerlist todo;
+	struct timer *timer;
+	int wheel;
+
+	if (now <= W->curtime)
+		return;
+
+	elapsed = now - W->curtime;
+
+	TAILQ_INIT(&todo);
+
+	for (wheel = 0; wheel < WHEEL_NUM; wheel++) {
+		uint64_t pending;
+
+		if ((elapsed >> (wheel * WHEEL_BIT)) > WHEEL_MASK) {
+			pending = ~UINT64_C(0);
+		} else {
+			uint64_t _elapsed = WHEEL_MASK & (elapsed >> (wheel * WHEEL_BIT));
+			int oslot, nslot;
+
+			oslot = WHEEL_MASK & (W->curtime >> (wheel * WHEEL_BIT));
+			pending = wheel_rotl((UINT64_C(1) << _elapsed) - 1, oslot);
+
+			nslot = WHEEL_MASK & (now >> (wheel * WHEEL_BIT));
+			pending |= wheel_rotr(wheel_rotl((UINT64_C(1) << _elapsed) - 1, nslot), (int)_elapsed);
+			pending |= UINT64_C(1) << nslot;
+		}
+
+		while (pending & W->pending[wheel]) {
+			int slot = wheel_ctz(pending & W->pending[wheel]);
+
+			while ((timer = TAILQ_FIRST(&W->slot[wheel][slot]))) {
+				TAILQ_REMOVE(&W->slot[wheel][slot], timer, tqe);
+				TAILQ_INSERT_TAIL(&todo, timer, tqe);
+			}
+
+			W->pending[wheel] &= ~(UINT64_C(1) << slot);
+		}
+
+		/* stop unless we wrapped around the end of this level */
+		if (!(0x1 & pending))
+			break;
+
+		/* if we're continuing, the next level must tick at least once */
+		elapsed = MAX(elapsed, (uint64_t)WHEEL_LEN << (wheel * WHEEL_BIT));
+	}
+
+	W->curtime = now;
+
+	while ((timer = TAILQ_FIRST(&todo))) {
+		TAILQ_REMOVE(&todo, timer, tqe);
+		wheel_sched(W, timer);
+	}
+} /* wheel_update() */
+
+
+/*
+ * Seconds until the next slot must be processed, or NAN if the wheel is
+ * empty. For higher levels this is when the slot cascades, which may
+ * precede the earliest deadline within it.
+ */
+static double wheel_timeout(const struct wheel *W, double curtime) {
+	uint64_t timeout = ~UINT64_C(0), relmask = 0;
+	int wheel, slot;
+
+	if (!TAILQ_EMPTY(&W->expired))
+		return 0.0;
+
+	for (wheel = 0; wheel < WHEEL_NUM; wheel++) {
+		if (W->pending[wheel]) {
+			uint64_t _timeout;
+
+			slot = WHEEL_MASK & (W->curtime >> (wheel * WHEEL_BIT));
+
+			/* higher levels are at least one rotation out */
+			_timeout = (uint64_t)(wheel_ctz(wheel_rotr(W->pending[wheel], slot)) + !!wheel) << (wheel * WHEEL_BIT);
+
+			/* less however far the lower levels have progressed */
+			_timeout -= relmask & W->curtime;
+
+			timeout = MIN(_timeout, timeout);
+		}
+
+		relmask <<= WHEEL_BIT;
+		relmask |= WHEEL_MASK;
+	}
+
+	if (timeout == ~UINT64_C(0))
+		return NAN;
+
+	return fmax(0.0, (double)(W->curtime + timeout) * W->tick - curtime);
+} /* wheel_timeout() */
+
+
+/*
+ * Log-bucketed histograms for cqueue:stats(), in the manner of HDR
+ * histograms: each power of two is split into HIST_SUB linear buckets,
+ * so a recorded value is off by at most 1/HIST_SUB wherever it falls.
+ * Durations are recorded in microseconds. Values beyond HIST_OCTAVES
+ * octaves land in the last bucket, but .max stays exact.
+ */
+#define HIST_SUBBITS 2
+#define HIST_SUB (1U << HIST_SUBBITS)
+#define HIST_OCTAVES 40
+#define HIST_LEN (HIST_SUB * (HIST_OCTAVES - HIST_SUBBITS + 1))
+
+#define STATS_SLOW 0.01 /* default slow resume threshold, in seconds */
+
+struct hist {
+	uint64_t count, sum, max;
+	uint64_t bucket[HIST_LEN];
+}; /* struct hist */
+
+/* allocated only when the controller was created with .stats */
+struct profile {
+	struct hist wait;    /* time blocked in kpoll_wait() */
+	struct hist batch;   /* kernel events read per step */
+	struct hist resumes; /* coroutines resumed per step */
+	struct hist process; /* time spent resuming them */
+	struct hist resume;  /* time of each coroutine resume */
+
+	struct {
+		double threshold;
+		unsigned long count;
+		double max;
+		char where[256]; /* traceback of the slowest one */
+	} slow;
+}; /* struct profile */
+
+
+static unsigned hist_index(uint64_t v) {
+	int e;
+
+	if (v < HIST_SUB)
+		return (unsigned)v;
+
+	if ((e = wheel_fls(v) - 1) >= HIST_OCTAVES)
+		return HIST_LEN - 1;
+
+	return HIST_SUB * (e - HIST_SUBBITS + 1) + ((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1));
+} /* hist_index() */
+
+
+/* largest value recorded in bucket i */
+static uint64_t hist_upper(unsigned i) {
+	int e;
+
+	if (i < HIST_SUB)
+		return i;
+
+	e = i / HIST_SUB - 1 + HIST_SUBBITS;
+
+	return ((uint64_t)(HIST_SUB + i % HIST_SUB + 1) << (e - HIST_SUBBITS)) - 1;
+} /* hist_upper() */
+
+
+static void hist_add(struct hist *H, uint64_t v) {
+	H->count++;
+	H->sum += v;
+	H->max = MAX(H->max, v);
+	H->bucket[hist_index(v)]++;
+} /* hist_add() */
+
+
+static inline uint64_t hist_us(double t) {
+	return (t > 0)? (uint64_t)(t * 1000000.0) : 0;
+} /* hist_us() */
+
+
+/* smallest bucket bound covering fraction q of the samples */
+static uint64_t hist_quantile(const struct hist *H, double q) {
+	uint64_t want = (uint64_t)ceil(q * (double)H->count), n = 0;
+	unsigned i;
+
+	for (i = 0; i < HIST_LEN; i++) {
+		if ((n += H->bucket[i]) >= want && n > 0)
+			return MIN(hist_upper(i), H->max);
+	}
+
+	return H->max;
+} /* hist_quantile() */
+
+
+static void profile_resume(lua_State *L, struct profile *P, lua_State *co, int status, double elapsed) {
+	hist_add(&P->resume, hist_us(elapsed));
+
+	if (!isgreaterequal(elapsed, P->slow.threshold))
+		return;
+
+	P->slow.count++;
+
+	if (!isgreater(elapsed, P->slow.max))
+		return;
+
+	P->slow.max = elapsed;
+
+	/* a finished coroutine has no stack left to describe */
+	if (status == LUA_OK) {
+		snprintf(P->slow.where, sizeof P->slow.where, "(finished)");
+	} else {
+		luaL_traceback(L, co, NULL, 0);
+		snprintf(P->slow.where, sizeof P->slow.where, "%s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+} /* profile_resume() */
+
 
-	struct {
-		LIST_HEAD(threads, thread) polling, pending;
-		struct thread *current;
-		unsigned count;
-	} thread;
+static void hist_push(lua_State *L, const struct hist *H, double unit) {
+	static const struct { const char *name; double q; } quantile[] = {
+		{ "p50", 0.50 }, { "p90", 0.90 }, { "p99", 0.99 }, { "p999", 0.999 },
+	};
+	unsigned i, n;
 
-	LLRB_HEAD(timers, timer) timers;
+	lua_createtable(L, 0, 8);
 
-	struct cstack *cstack;
+	lua_pushinteger(L, (lua_Integer)H->count);
+	lua_setfield(L, -2, "count");
 
-	LIST_ENTRY(cqueue) le;
-}; /* struct cqueue */
+	lua_pushnumber(L, (double)H->sum * unit);
+	lua_setfield(L, -2, "sum");
 
+	lua_pushnumber(L, (double)H->max * unit);
+	lua_setfield(L, -2, "max");
 
-static inline int fileno_cmp(const struct fileno *const a, const struct fileno *const b) {
-	return a->fd - b->fd;
-} /* fileno_cmp() */
+	for (i = 0; i < countof(quantile); i++) {
+		lua_pushnumber(L, (double)hist_quantile(H, quantile[i].q) * unit);
+		lua_setfield(L, -2, quantile[i].name);
+	}
 
-LLRB_GENERATE_STATIC(table, fileno, rbe, fileno_cmp)
+	/* { upper bound, count } of each non-empty bucket, ascending */
+	lua_newtable(L);
 
+	for (i = 0, n = 0; i < HIST_LEN; i++) {
+		if (!H->bucket[i])
+			continue;
 
-static inline int timer_cmp(const struct timer *const a, const struct timer *const b) {
-	return (a->timeout < b->timeout)? -1 : (a->timeout > b->timeout)? 1 : (a < b)? -1 : (a > b)? 1 : 0;
-} /* timer_cmp() */
+		lua_createtable(L, 2, 0);
+		lua_pushnumber(L, (double)hist_upper(i) * unit);
+		lua_rawseti(L, -2, 1);
+		lua_pushinteger(L, (lua_Integer)H->bucket[i]);
+		lua_rawseti(L, -2, 2);
 
-LLRB_GENERATE_STATIC(timers, timer, rbe, timer_cmp)
+		lua_rawseti(L, -2, ++n);
+	}
+
+	lua_setfield(L, -2, "buckets");
+} /* hist_push() */
 
 
 struct stackinfo {
@@ -1255,8 +2351,18 @@ static struct cqueue *cqueue_enter(lua_State *L, struct callinfo *I, int index)
 } /* cqueue_enter() */
 
 
+static _Bool thread_pending(struct cqueue *Q) {
+	for (unsigned i = 0; i < countof(Q->thread.pending); i++) {
+		if (!TAILQ_EMPTY(&Q->thread.pending[i]))
+			return 1;
+	}
+
+	return 0;
+} /* thread_pending() */
+
+
 static cqs_error_t cqueue_tryalert(struct cqueue *Q) {
-	if (!cstack_isrunning(Q->cstack, Q) || LIST_EMPTY(&Q->thread.pending)) {
+	if (!cstack_isrunning(Q->cstack, Q) || !thread_pending(Q)) {
 		return kpoll_alert(&Q->kp);
 	} else {
 		return 0;
@@ -1395,6 +2501,11 @@ static void cqueue_preinit(struct cqueue *Q) {
 
 	Q->thread.current = NULL;
 
+	TAILQ_INIT(&Q->thread.polling);
+
+	for (unsigned i = 0; i < countof(Q->thread.pending); i++)
+		TAILQ_INIT(&Q->thread.pending[i]);
+
 	pool_init(&Q->pool.wakecb, sizeof (struct wakecb));
 	pool_init(&Q->pool.fileno, sizeof (struct fileno));
 	pool_init(&Q->pool.event, sizeof (struct event));
@@ -1443,14 +2554,25 @@ static void cqueue_destroy(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 
 	Q->thread.current = NULL;
 
-	while ((thread = LIST_FIRST(&Q->thread.pending))) {
-		thread_del(L, Q, I, thread);
+	for (unsigned i = 0; i < countof(Q->thread.pending); i++) {
+		while ((thread = TAILQ_FIRST(&Q->thread.pending[i]))) {
+			thread_del(L, Q, I, thread);
+		}
 	}
 
-	while ((thread = LIST_FIRST(&Q->thread.polling))) {
+	while ((thread = TAILQ_FIRST(&Q->thread.polling))) {
 		thread_del(L, Q, I, thread);
 	}
 
+	for (size_t i = 0; i < Q->fileno.size; i++) {
+		if ((fileno = Q->fileno.index[i]))
+			fileno_del(Q, fileno, 0);
+	}
+
+	free(Q->fileno.index);
+	Q->fileno.index = NULL;
+	Q->fileno.size = 0;
+
 	for (fileno = LLRB_MIN(table, &Q->fileno.table); fileno; fileno = next) {
 		next = LLRB_NEXT(table, &Q->fileno.table, fileno);
 		fileno_del(Q, fileno, 0);
@@ -1458,15 +2580,163 @@ static void cqueue_destroy(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 
 	kpoll_destroy(&Q->kp, &cstack_onclosefd, cstack);
 
+	free(Q->wheel);
+	Q->wheel = NULL;
+
+	free(Q->profile);
+	Q->profile = NULL;
+
 	pool_destroy(&Q->pool.event);
 	pool_destroy(&Q->pool.fileno);
 	pool_destroy(&Q->pool.wakecb);
 } /* cqueue_destroy() */
 
 
+static _Bool cqueue_getfield(lua_State *L, int index, const char *k) {
+	lua_getfield(L, index, k);
+
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+
+		return 0;
+	} else {
+		return 1;
+	}
+} /* cqueue_getfield() */
+
+
+static void cqueue_checkopts(lua_State *L, struct cqueue *Q, int index) {
+	if (lua_isnoneornil(L, index))
+		return;
+
+	luaL_checktype(L, index, LUA_TTABLE);
+
+	if (cqueue_getfield(L, index, "backend")) {
+		const char *name = luaL_checkstring(L, -1);
+
+		if (kpoll_setbackend(&Q->kp, name))
+			luaL_argerror(L, index, lua_pushfstring(L, "%s: unsupported backend", name));
+
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, index, "maxevents");
+	lua_getfield(L, index, "adaptive");
+
+	if (!lua_isnil(L, -2) || !lua_isnil(L, -1)) {
+		lua_Integer maxevents = luaL_optinteger(L, -2, 0);
+
+		luaL_argcheck(L, maxevents >= 0 && maxevents <= INT_MAX, index, "maxevents out of range");
+
+		kpoll_setmaxevents(&Q->kp, maxevents, lua_toboolean(L, -1));
+	}
+
+	lua_pop(L, 2);
+
+	if (cqueue_getfield(L, index, "prealloc")) {
+		static const struct {
+			const char *name;
+			size_t offset;
+		} field[] = {
+			{ "events",  offsetof(struct cqueue, pool.event) },
+			{ "filenos", offsetof(struct cqueue, pool.fileno) },
+			{ "wakecbs", offsetof(struct cqueue, pool.wakecb) },
+		};
+		unsigned i;
+		int error;
+
+		luaL_checktype(L, -1, LUA_TTABLE);
+
+		for (i = 0; i < countof(field); i++) {
+			lua_Integer n;
+
+			lua_getfield(L, -1, field[i].name);
+			n = luaL_optinteger(L, -1, 0);
+			luaL_argcheck(L, n >= 0, index, "prealloc count out of range");
+			lua_pop(L, 1);
+
+			if ((error = pool_reserve((struct pool *)((char *)Q + field[i].offset), n)))
+				luaL_error(L, "unable to preallocate %s: %s", field[i].name, cqs_strerror(error));
+		}
+
+		lua_pop(L, 1);
+	}
+
+	if (cqueue_getfield(L, index, "edge")) {
+		Q->edge = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, index, "timers");
+	lua_getfield(L, index, "resolution");
+
+	if (!lua_isnil(L, -2) || !lua_isnil(L, -1)) {
+		const char *timers = luaL_optstring(L, -2, "wheel");
+		double tick = luaL_optnumber(L, -1, WHEEL_RESOLUTION);
+		int error;
+
+		if (!strcmp(timers, "wheel")) {
+			luaL_argcheck(L, isfinite(tick) && tick > 0, index, "timer resolution out of range");
+
+			if (!(Q->wheel = wheel_new(tick, monotime(), &error)))
+				luaL_error(L, "unable to initialize timing wheel: %s", cqs_strerror(error));
+		} else if (strcmp(timers, "tree")) {
+			luaL_argerror(L, index, lua_pushfstring(L, "%s: unsupported timers", timers));
+		}
+	}
+
+	lua_pop(L, 2);
+
+	if (cqueue_getfield(L, index, "budget")) {
+		lua_Integer budget = luaL_checkinteger(L, -1);
+
+		luaL_argcheck(L, budget >= 0 && budget <= UINT_MAX, index, "resume budget out of range");
+		Q->thread.budget = budget;
+
+		lua_pop(L, 1);
+	}
+
+	if (cqueue_getfield(L, index, "slice")) {
+		double slice = luaL_checknumber(L, -1);
+
+		luaL_argcheck(L, isfinite(slice) && slice >= 0, index, "time slice out of range");
+		Q->thread.slice = slice;
+
+		lua_pop(L, 1);
+	}
+
+	if (cqueue_getfield(L, index, "busypoll")) {
+		double busypoll = luaL_checknumber(L, -1);
+
+		luaL_argcheck(L, isfinite(busypoll) && busypoll >= 0, index, "busy poll window out of range");
+		Q->busypoll = busypoll;
+
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, index, "stats");
+	lua_getfield(L, index, "slow");
+
+	if (lua_toboolean(L, -2) || !lua_isnil(L, -1)) {
+		double slow = luaL_optnumber(L, -1, STATS_SLOW);
+
+		luaL_argcheck(L, slow >= 0, index, "slow resume threshold out of range");
+
+		if (!(Q->profile = calloc(1, sizeof *Q->profile)))
+			luaL_error(L, "unable to allocate statistics: %s", cqs_strerror(errno));
+
+		Q->profile->slow.threshold = slow;
+	}
+
+	lua_pop(L, 2);
+} /* cqueue_checkopts() */
+
+
 static int cqueue_new(lua_State *L) {
 	struct cqueue *Q;
 
+	lua_settop(L, 1);
+
 	Q = lua_newuserdata(L, sizeof *Q);
 
 	cqueue_preinit(Q);
@@ -1474,6 +2744,8 @@ static int cqueue_new(lua_State *L) {
 	luaL_getmetatable(L, CQUEUE_CLASS);
 	lua_setmetatable(L, -2);
 
+	cqueue_checkopts(L, Q, 1);
+
 	cqueue_init(L, Q, -1);
 
 	return 1;
@@ -1505,24 +2777,125 @@ static int cqueue__gc(lua_State *L) {
 } /* cqueue__gc() */
 
 
-static void thread_move(struct thread *T, struct threads *list) {
+/*
+ * A pass of cqueue_process() resumes the threads queued before it
+ * began, class by class. Threads queued during the pass go to the tail
+ * stamped with the pass number, behind every thread still to run, and
+ * wait for the next pass; so a thread that's always ready can't keep a
+ * pass from returning to the kernel.
+ */
+static void thread_move(struct cqueue *Q, struct thread *T, struct threads *list) {
 	if (T->threads != list) {
-		LIST_REMOVE(T, le);
-		LIST_INSERT_HEAD(list, T, le);
+		TAILQ_REMOVE(T->threads, T, le);
+		TAILQ_INSERT_TAIL(list, T, le);
 		T->threads = list;
+		T->pass = Q->thread.pass;
 	}
 } /* thread_move() */
 
 
+static void thread_pend(struct cqueue *Q, struct thread *T) {
+	thread_move(Q, T, &Q->thread.pending[T->priority]);
+} /* thread_pend() */
+
+
+/* send T to the back of its queue, e.g. after resuming it */
+static void thread_requeue(struct cqueue *Q, struct thread *T) {
+	TAILQ_REMOVE(T->threads, T, le);
+	T->threads = &Q->thread.polling;
+
+	thread_pend(Q, T);
+} /* thread_requeue() */
+
+
+/*
+ * Fast lane for threads woken by another thread, e.g. through a
+ * condition variable: they run in the current pass right after the
+ * waker, unless they already ran in it, which bounds the pass.
+ */
+static void thread_wake(struct cqueue *Q, struct thread *T) {
+	struct threads *list = &Q->thread.pending[T->priority];
+
+	if (T->threads == list || T->pass == Q->thread.pass)
+		return thread_pend(Q, T);
+
+	TAILQ_REMOVE(T->threads, T, le);
+	TAILQ_INSERT_HEAD(list, T, le);
+	T->threads = list;
+
+	Q->stats.fastwakes++;
+} /* thread_wake() */
+
+
+static struct thread *thread_next(struct cqueue *Q) {
+	struct thread *T;
+
+	for (unsigned i = 0; i < countof(Q->thread.pending); i++) {
+		if ((T = TAILQ_FIRST(&Q->thread.pending[i])) && T->pass != Q->thread.pass)
+			return T;
+	}
+
+	return NULL;
+} /* thread_next() */
+
+
+/*
+ * Descriptors are small, dense integers, so filenos are normally found by
+ * indexing an array. Descriptors at or beyond FILENO_MAXINDEX, or which
+ * arrive when the array can't be grown, are kept in the table tree.
+ */
+#define FILENO_MININDEX 64
+#define FILENO_MAXINDEX (1 << 20)
+
 static struct fileno *fileno_find(struct cqueue *Q, int fd) {
 	struct fileno key;
 
+	if (fd >= 0 && (size_t)fd < Q->fileno.size)
+		return Q->fileno.index[fd];
+
+	if (LLRB_EMPTY(&Q->fileno.table))
+		return NULL;
+
 	key.fd = fd;
 
 	return LLRB_FIND(table, &Q->fileno.table, &key);
 } /* fileno_find() */
 
 
+static _Bool fileno_index(struct cqueue *Q, int fd) {
+	struct fileno **index, *fileno;
+	size_t size;
+
+	if (fd < 0 || fd >= FILENO_MAXINDEX)
+		return 0;
+
+	if ((size_t)fd >= Q->fileno.size) {
+		size = MAX(Q->fileno.size, FILENO_MININDEX);
+
+		while (size <= (size_t)fd)
+			size *= 2;
+
+		if (!(index = realloc(Q->fileno.index, size * sizeof *index)))
+			return 0;
+
+		memset(&index[Q->fileno.size], 0, (size - Q->fileno.size) * sizeof *index);
+
+		Q->fileno.index = index;
+		Q->fileno.size = size;
+
+		/* migrate any tree entries the index now covers */
+		while ((fileno = LLRB_MIN(table, &Q->fileno.table)) && (size_t)fileno->fd < size) {
+			LLRB_REMOVE(table, &Q->fileno.table, fileno);
+			index[fileno->fd] = fileno;
+		}
+	}
+
+	return 1;
+} /* fileno_index() */
+
+
+static void cstack_addfd(struct cstack *, struct fileno *);
+
 static struct fileno *fileno_get(struct cqueue *Q, int fd, int *error) {
 	struct fileno *fileno;
 
@@ -1532,10 +2905,18 @@ static struct fileno *fileno_get(struct cqueue *Q, int fd, int *error) {
 
 		fileno->fd = fd;
 		fileno->state = 0;
+		fileno->ready = 0;
 		LIST_INIT(&fileno->events);
 
 		LIST_INSERT_HEAD(&Q->fileno.inactive, fileno, le);
-		LLRB_INSERT(table, &Q->fileno.table, fileno);
+
+		if (fileno_index(Q, fd))
+			Q->fileno.index[fd] = fileno;
+		else
+			LLRB_INSERT(table, &Q->fileno.table, fileno);
+
+		fileno->cqueue = Q;
+		cstack_addfd(Q->cstack, fileno);
 	}
 
 	return fileno;
@@ -1544,26 +2925,55 @@ static struct fileno *fileno_get(struct cqueue *Q, int fd, int *error) {
 
 static cqs_error_t fileno_signal(struct cqueue *Q, struct fileno *fileno, short events) {
 	struct event *event;
+	short delivered = 0;
 	int error = 0, _error;
 
 	LIST_FOREACH(event, &fileno->events, fle) {
 		/* XXX: If POLLPRI should we always mark as pending? */
 		if (event->events & events)
 			event->pending = 1;
+		else if ((fileno->state & KPOLL_EDGE) && !(events & (POLLERR|POLLHUP)))
+			continue; /* only interested in the widened registration */
+
+		if (!event->stale)
+			delivered |= event->events;
 
-		thread_move(event->thread, &Q->thread.pending);
+		thread_pend(Q, event->thread);
 
 		if ((_error = cqueue_tryalert(Q)))
 			error = _error;
 	}
 
+	/*
+	 * An edge won't be reported again, so hold onto any that arrived
+	 * while nobody was waiting on it. See fileno_latch().
+	 */
+	if (fileno->state & KPOLL_EDGE)
+		fileno->ready |= events & ~delivered;
+
 	return error;
 } /* fileno_signal() */
 
 
+/*
+ * Deliver readiness latched by fileno_signal() to an event newly
+ * registered on an edge-triggered descriptor. At worst this causes one
+ * spurious wakeup.
+ */
+static void fileno_latch(struct cqueue *Q, struct fileno *fileno, struct event *event) {
+	if ((fileno->state & KPOLL_EDGE) && (fileno->ready & event->events)) {
+		fileno->ready &= ~event->events;
+		event->pending = 1;
+		thread_pend(Q, event->thread);
+	}
+} /* fileno_latch() */
+
+
 static int fileno_ctl(struct cqueue *Q, struct fileno *fileno, short events) {
 	int error;
 
+	Q->stats.ctl += (fileno->state != events);
+
 	if ((error = kpoll_ctl(&Q->kp, fileno->fd, &fileno->state, events, fileno)))
 		return error; /* XXX: Should we call fileno_signal? */
 
@@ -1581,11 +2991,32 @@ static int fileno_ctl(struct cqueue *Q, struct fileno *fileno, short events) {
 static int fileno_update(struct cqueue *Q, struct fileno *fileno) {
 	struct event *event;
 	short events = 0;
+	_Bool edge = 1;
 
 	LIST_FOREACH(event, &fileno->events, fle) {
 		events |= event->events;
+		edge &= event->edge;
+	}
+
+	/*
+	 * While edge-triggered, a descriptor's interest only widens, so
+	 * it's normally registered just once for as long as anyone waits on
+	 * it; parked events keep a coroutine polling in a loop counted as
+	 * waiting. It reverts to level-triggered if anyone polls it who
+	 * can't promise to drain it first. With no waiters left it's
+	 * deregistered, because the descriptor may be closed behind our
+	 * back and its number reused by one the kernel has never seen.
+	 */
+	if (fileno->state & KPOLL_EDGE) {
+		if (edge && events)
+			events |= fileno->state;
+	} else if (edge && events) {
+		events |= KPOLL_EDGE;
 	}
 
+	if (events != fileno->state)
+		fileno->ready = 0; /* kernel re-reports current readiness */
+
 	return fileno_ctl(Q, fileno, events);
 } /* fileno_update() */
 
@@ -1602,10 +3033,17 @@ static int fileno_del(struct cqueue *Q, struct fileno *fileno, _Bool update) {
 	if (update)
 		error = fileno_update(Q, fileno);
 
-	LLRB_REMOVE(table, &Q->fileno.table, fileno);
+	if (fileno->fd >= 0 && (size_t)fileno->fd < Q->fileno.size)
+		Q->fileno.index[fileno->fd] = NULL;
+	else
+		LLRB_REMOVE(table, &Q->fileno.table, fileno);
 
 	LIST_REMOVE(fileno, le);
 
+	/* NB: cstack_del() already unlinked us if Q->cstack is NULL */
+	if (Q->cstack)
+		LIST_REMOVE(fileno, cse);
+
 	pool_put(&Q->pool.fileno, fileno);
 
 	return error;
@@ -1617,7 +3055,7 @@ static cqs_error_t wakecb_wakeup(struct wakecb *cb) {
 	struct event *event = cb->arg[1];
 
 	event->pending = 1;
-	thread_move(event->thread, &Q->thread.pending);
+	thread_wake(Q, event->thread);
 
 	return cqueue_tryalert(Q);
 } /* wakecb_wakeup() */
@@ -1660,6 +3098,13 @@ static int object_getcv(lua_State *L, struct cqueue *Q, struct callinfo *I, stru
 	struct condition *cv = lua_touserdata(L, index);
 	int error;
 
+	/* parked by event_park() */
+	if (event->wakecb) {
+		wakecb_add(event->wakecb, cv);
+
+		return LUA_OK;
+	}
+
 	if (!(event->wakecb = pool_get(&Q->pool.wakecb, &error))) {
 		err_setinfo(L, I, error, T, index, "unable to wait on conditional variable: %s", cqs_strerror(error));
 
@@ -1695,6 +3140,10 @@ static cqs_status_t object_getinfo(lua_State *L, struct cqueue *Q, struct callin
 		event->fd = cqs_socket_pollfd(L, -1);
 		event->events = cqs_socket_events(L, -1);
 		event->timeout = abstimeout(cqs_socket_timeout(L, -1));
+
+		/* only safe if every event is owed to a prior EAGAIN */
+		if (Q->edge && kpoll_canedge(&Q->kp))
+			event->edge = event->events && !(event->events & ~cqs_socket_drained(L, -1));
 	} else if (cqs_testudata(L, -1, 3)) {
 		if ((LUA_OK != (status = object_getcv(L, Q, I, T, -1, event))))
 			goto oops;
@@ -1733,42 +3182,155 @@ static cqs_status_t object_getinfo(lua_State *L, struct cqueue *Q, struct callin
 			}
 		}
 
-		lua_pop(L, 1); /* pop event mode */
-
-		if (LUA_OK != (status = object_pcall(L, I, T, -1, "timeout", LUA_TNUMBER, LUA_TNIL)))
-			goto oops;
-
-		event->timeout = abstimeout(luaL_optnumber(L, -1, event->timeout));
+		lua_pop(L, 1); /* pop event mode */
+
+		if (LUA_OK != (status = object_pcall(L, I, T, -1, "timeout", LUA_TNUMBER, LUA_TNIL)))
+			goto oops;
+
+		event->timeout = abstimeout(luaL_optnumber(L, -1, event->timeout));
+
+		lua_pop(L, 1); /* pop timeout */
+	}
+
+	lua_pop(L, 1); /* pop object */
+
+	return LUA_OK;
+oops:
+	return status;
+} /* object_getinfo() */
+
+
+static void event_init(struct event *event, struct thread *T, int index) {
+	memset(event, 0, sizeof *event);
+
+	event->fd = -1;
+	event->timeout = NAN;
+	event->index = index;
+	event->thread = T;
+
+	TAILQ_INSERT_TAIL(&T->events, event, tqe);
+	T->count++;
+} /* event_init() */
+
+
+/*
+ * Detach an event from its condition variable while its thread runs, but
+ * otherwise leave it and its descriptor registration intact so the next
+ * yield can pick it back up with event_reuse() instead of rebuilding it.
+ * A parked wakecb can't be left waiting, as it would swallow signals
+ * meant for other waiters.
+ */
+static void event_park(struct event *event) {
+	if (event->wakecb)
+		wakecb_del(event->wakecb);
+
+	event->stale = 1;
+} /* event_park() */
+
+
+static struct event *event_find(lua_State *L, struct thread *T, int index, int base) {
+	struct event *event;
+
+	lua_pushvalue(T->L, index);
+	lua_xmove(T->L, L, 1);
+
+	TAILQ_FOREACH(event, &T->events, tqe) {
+		/* previously yielded objects preserved at base by cqueue_resume */
+		if (event->stale && lua_rawequal(L, -1, base + event->index))
+			break;
+	}
+
+	lua_pop(L, 1);
+
+	return event;
+} /* event_find() */
+
+
+static cqs_status_t event_reuse(lua_State *L, struct cqueue *Q, struct callinfo *I, struct thread *T, int index, struct event *event) {
+	struct fileno *fileno = event->fileno;
+	short events = event->events;
+	int error, status;
+
+	/* keep T->events in the order objects were yielded */
+	TAILQ_REMOVE(&T->events, event, tqe);
+	TAILQ_INSERT_TAIL(&T->events, event, tqe);
+
+	event->stale = 0;
+	event->pending = 0;
+	event->index = index;
+	event->fd = -1;
+	event->events = 0;
+	event->timeout = NAN;
+	event->edge = 0;
+
+	Q->stats.reused++;
+
+	if (LUA_OK != (status = object_getinfo(L, Q, I, T, index, event)))
+		return status;
+
+	/* no longer a condition variable */
+	if (event->wakecb && !event->wakecb->cv) {
+		pool_put(&Q->pool.wakecb, event->wakecb);
+		event->wakecb = NULL;
+	}
+
+	if (fileno && (fileno->fd != event->fd || !event->events)) {
+		LIST_REMOVE(event, fle);
+		event->fileno = NULL;
+
+		LIST_REMOVE(fileno, le);
+		LIST_INSERT_HEAD(&Q->fileno.outstanding, fileno, le);
+	} else if (fileno) {
+		/*
+		 * Same descriptor. Unless interest changed or the kernel
+		 * registration lapsed (one-shot backends, cancellation) there's
+		 * nothing for cqueue_update() to do.
+		 */
+		if (event->events == events && (fileno->state & events) == events && event->edge == !!(fileno->state & KPOLL_EDGE)) {
+			Q->stats.kept++;
+		} else {
+			LIST_REMOVE(fileno, le);
+			LIST_INSERT_HEAD(&Q->fileno.outstanding, fileno, le);
+		}
+
+		fileno_latch(Q, fileno, event);
 
-		lua_pop(L, 1); /* pop timeout */
+		return LUA_OK;
 	}
 
-	lua_pop(L, 1); /* pop object */
+	if (event->fd >= 0 && event->events) {
+		if (!(fileno = fileno_get(Q, event->fd, &error)))
+			goto error;
 
-	return LUA_OK;
-oops:
-	return status;
-} /* object_getinfo() */
+		LIST_INSERT_HEAD(&fileno->events, event, fle);
+		event->fileno = fileno;
 
+		LIST_REMOVE(fileno, le);
+		LIST_INSERT_HEAD(&Q->fileno.outstanding, fileno, le);
 
-static void event_init(struct event *event, struct thread *T, int index) {
-	memset(event, 0, sizeof *event);
+		fileno_latch(Q, fileno, event);
+	}
 
-	event->fd = -1;
-	event->timeout = NAN;
-	event->index = index;
-	event->thread = T;
+	return LUA_OK;
+error:
+	err_setinfo(L, I, error, T, index, "unable to add event: %s", cqs_strerror(error));
 
-	TAILQ_INSERT_TAIL(&T->events, event, tqe);
-	T->count++;
-} /* event_init() */
+	return LUA_ERRRUN;
+} /* event_reuse() */
 
 
-static cqs_status_t event_add(lua_State *L, struct cqueue *Q, struct callinfo *I, struct thread *T, int index) {
+/*
+ * base, if non-zero, is where the objects T previously yielded were
+ * preserved on L, permitting parked events to be reused.
+ */
+static cqs_status_t event_add(lua_State *L, struct cqueue *Q, struct callinfo *I, struct thread *T, int index, int base) {
 	struct event *event;
 	struct fileno *fileno;
 	int error, status;
 
+	if (base && (event = event_find(L, T, index, base)))
+		return event_reuse(L, Q, I, T, index, event);
+
 	if (!(event = pool_get(&Q->pool.event, &error)))
 		goto error;
 
@@ -1786,6 +3348,8 @@ static cqs_status_t event_add(lua_State *L, struct cqueue *Q, struct callinfo *I
 
 		LIST_REMOVE(fileno, le);
 		LIST_INSERT_HEAD(&Q->fileno.outstanding, fileno, le);
+
+		fileno_latch(Q, fileno, event);
 	}
 
 	return LUA_OK;
@@ -1819,12 +3383,17 @@ static void event_del(struct cqueue *Q, struct event *event) {
 
 static void timer_init(struct timer *timer) {
 	timer->timeout = NAN;
+	timer->pending = NULL;
 } /* timer_init() */
 
 
 static void timer_del(struct cqueue *Q, struct timer *timer) {
 	if (isfinite(timer->timeout)) {
-		LLRB_REMOVE(timers, &Q->timers, timer);
+		if (Q->wheel)
+			wheel_del(Q->wheel, timer);
+		else
+			LLRB_REMOVE(timers, &Q->timers, timer);
+
 		timer->timeout = NAN;
 	}
 } /* timer_del() */
@@ -1835,7 +3404,11 @@ static void timer_add(struct cqueue *Q, struct timer *timer, double timeout) {
 
 	if (isfinite(timeout)) {
 		timer->timeout = timeout;
-		LLRB_INSERT(timers, &Q->timers, timer);
+
+		if (Q->wheel)
+			wheel_add(Q->wheel, timer);
+		else
+			LLRB_INSERT(timers, &Q->timers, timer);
 	}
 } /* timer_add() */
 
@@ -1845,6 +3418,30 @@ static void timer_destroy(struct cqueue *Q, struct timer *timer) {
 } /* timer_destroy() */
 
 
+static void thread_purge(struct cqueue *Q, struct thread *T) {
+	struct event *event, *next;
+
+	for (event = TAILQ_FIRST(&T->events); event; event = next) {
+		next = TAILQ_NEXT(event, tqe);
+
+		if (event->stale)
+			event_del(Q, event);
+	}
+} /* thread_purge() */
+
+
+static _Bool thread_ready(struct thread *T) {
+	struct event *event;
+
+	TAILQ_FOREACH(event, &T->events, tqe) {
+		if (event->pending)
+			return 1;
+	}
+
+	return 0;
+} /* thread_ready() */
+
+
 static double thread_timeout(struct thread *T) {
 	double timeout = NAN;
 	struct event *event;
@@ -1857,7 +3454,7 @@ static double thread_timeout(struct thread *T) {
 } /* thread_timeout() */
 
 
-static void thread_add(lua_State *L, struct cqueue *Q, struct callinfo *I, int index) {
+static void thread_add(lua_State *L, struct cqueue *Q, struct callinfo *I, int index, unsigned priority) {
 	struct thread *T;
 
 	index = lua_absindex(L, index);
@@ -1878,8 +3475,10 @@ static void thread_add(lua_State *L, struct cqueue *Q, struct callinfo *I, int i
 	lua_rawsetp(L, -2, T);
 	lua_pop(L, 2);
 
-	LIST_INSERT_HEAD(&Q->thread.pending, T, le);
-	T->threads = &Q->thread.pending;
+	T->priority = priority;
+	T->pass = Q->thread.pass;
+	TAILQ_INSERT_TAIL(&Q->thread.pending[priority], T, le);
+	T->threads = &Q->thread.pending[priority];
 	Q->thread.count++;
 } /* thread_add() */
 
@@ -1891,7 +3490,7 @@ static void thread_del(lua_State *L, struct cqueue *Q, struct callinfo *I, struc
 		event_del(Q, event);
 	}
 	timer_destroy(Q, &T->timer);
-	LIST_REMOVE(T, le);
+	TAILQ_REMOVE(T->threads, T, le);
 	Q->thread.count--;
 
 	/*
@@ -1965,8 +3564,8 @@ static cqs_error_t cqueue_reboot(struct cqueue *Q, _Bool stop, _Bool restart) {
 			fileno->state = 0;
 		}
 
-		while ((thread = LIST_FIRST(&Q->thread.polling))) {
-			thread_move(thread, &Q->thread.pending);
+		while ((thread = TAILQ_FIRST(&Q->thread.polling))) {
+			thread_pend(Q, thread);
 		}
 
 		kpoll_destroy(&Q->kp, &cstack_onclosefd, Q->cstack);
@@ -2002,6 +3601,7 @@ static _Bool auxL_xcopy(lua_State *from, lua_State *to, int count) {
 static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinfo *I, struct thread *T) {
 	int otop = lua_gettop(L), nargs, status, tmp_status, index;
 	struct event *event;
+	double began = 0;
 
 	status = lua_status(T->L);
 	if (status == LUA_YIELD && lua_islightuserdata(T->L, 1) && lua_topointer(T->L, 1) == CQUEUE__POLL) {
@@ -2020,13 +3620,13 @@ static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinf
 		if (!lua_checkstack(T->L, T->count + LUA_MINSTACK))
 			goto nospace;
 
-		while ((event = TAILQ_FIRST(&T->events))) {
+		TAILQ_FOREACH(event, &T->events, tqe) {
 			if (event->pending) {
 				lua_pushvalue(T->L, event->index);
 				nargs++;
 			}
 
-			event_del(Q, event);
+			event_park(event);
 		}
 	} else {
 		nargs = lua_gettop(T->L);
@@ -2040,8 +3640,16 @@ static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinf
 
 	cstack_push(Q->cstack, &(struct stackinfo){ Q, L, I->self, T->L });
 
+	Q->stats.resumes++;
+
+	if (Q->profile)
+		began = monotime();
+
 	status = lua_resume(T->L, L, nargs);
 
+	if (Q->profile)
+		profile_resume(L, Q->profile, T->L, status, monotime() - began);
+
 	cstack_pop(Q->cstack);
 
 	switch (status) {
@@ -2052,28 +3660,39 @@ static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinf
 				case LUA_TNIL:
 					continue;
 				default:
-					if (LUA_OK != (status = event_add(L, Q, I, T, index)))
+					if (LUA_OK != (status = event_add(L, Q, I, T, index, otop)))
 						goto defunct;
 				}
 			}
 
+			thread_purge(Q, T);
+
 			if (LUA_OK != (status = cqueue_update(L, Q, I, T)))
 				goto defunct;
 
 			timer_add(Q, &T->timer, thread_timeout(T));
 
-			if (!TAILQ_EMPTY(&T->events) || isfinite(T->timer.timeout))
-				thread_move(T, &Q->thread.polling);
+			if (!TAILQ_EMPTY(&T->events) || isfinite(T->timer.timeout)) {
+				if (!thread_ready(T))
+					thread_move(Q, T, &Q->thread.polling);
+			}
 		} else {
+			thread_purge(Q, T);
+
 			if (LUA_OK != (tmp_status = cqueue_update(L, Q, I, T))) {
 				status = tmp_status;
 				goto defunct;
 			}
-
-			break;
 		}
+
+		/* still runnable; make way for the rest of the pass */
+		if (T->threads != &Q->thread.polling)
+			thread_requeue(Q, T);
+
 		break;
 	case LUA_OK:
+		thread_purge(Q, T);
+
 		if (LUA_OK != (status = cqueue_update(L, Q, I, T)))
 			goto defunct;
 
@@ -2081,6 +3700,8 @@ static cqs_status_t cqueue_resume(lua_State *L, struct cqueue *Q, struct callinf
 
 		break;
 	default:
+		thread_purge(Q, T);
+
 		if (LUA_OK != cqueue_update(L, Q, I, T))
 			goto defunct;
 
@@ -2106,36 +3727,67 @@ nospace:
 } /* cqueue_resume() */
 
 
+/* has the pass used up its resume or time budget? */
+static _Bool thread_spent(struct cqueue *Q) {
+	if (Q->thread.budget && !--Q->thread.left)
+		return 1;
+
+	return Q->thread.slice > 0 && monotime() >= Q->thread.deadline;
+} /* thread_spent() */
+
+
 static cqs_status_t cqueue_process_threads(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 	cqs_status_t status;
-	struct thread *nxt;
-
-	for (; Q->thread.current; Q->thread.current = nxt) {
-		nxt = LIST_NEXT(Q->thread.current, le);
 
+	while (Q->thread.current || (Q->thread.current = thread_next(Q))) {
 		if (LUA_OK != (status = cqueue_resume(L, Q, I, Q->thread.current))) {
 			return status;
 		}
+
+		Q->thread.current = NULL;
+
+		/* leave the rest queued, and let the caller poll the kernel */
+		if (thread_spent(Q)) {
+			Q->stats.preempted += (NULL != thread_next(Q));
+
+			break;
+		}
 	}
 
 	return LUA_OK;
 } /* cqueue_process_threads() */
 
 
+static void thread_expire(struct cqueue *Q, struct thread *T, double curtime) {
+	struct event *event;
+
+	Q->stats.expired++;
+
+	TAILQ_FOREACH(event, &T->events, tqe) {
+		if (islessequal(event->timeout, curtime))
+			event->pending = 1;
+	}
+
+	thread_pend(Q, T);
+} /* thread_expire() */
+
+
 static cqs_status_t cqueue_process(lua_State *L, struct cqueue *Q, struct callinfo *I) {
 	int onalert = 0;
 	kpoll_event_t *ke;
 	struct fileno *fileno;
-	struct event *event;
-	struct thread *T;
 	struct timer *timer;
-	double curtime;
+	double curtime, began = 0.0;
+	unsigned long resumes;
 	short events;
 	int status;
 
+	Q->stats.events += Q->kp.pending.count;
+
 	KPOLL_FOREACH(ke, &Q->kp) {
 		if (kpoll_isalert(&Q->kp, ke)) {
 			onalert = 1;
+			Q->stats.alerts++;
 
 			continue;
 		}
@@ -2144,28 +3796,44 @@ static cqs_status_t cqueue_process(lua_State *L, struct cqueue *Q, struct callin
 		events = kpoll_pending(ke);
 
 		fileno_signal(Q, fileno, events);
-		fileno->state = kpoll_diff(ke, fileno->state);
+		fileno->state = kpoll_diff(&Q->kp, ke, fileno->state);
 	}
 
 	curtime = monotime();
 
-	LLRB_FOREACH(timer, timers, &Q->timers) {
-		if (isgreater(timer->timeout, curtime))
-			break;
-
-		T = timer2thread(timer);
+	if (Q->wheel) {
+		wheel_update(Q->wheel, curtime);
 
-		TAILQ_FOREACH(event, &T->events, tqe) {
-			if (islessequal(event->timeout, curtime))
-				event->pending = 1;
+		TAILQ_FOREACH(timer, &Q->wheel->expired, tqe) {
+			thread_expire(Q, timer2thread(timer), curtime);
 		}
+	} else {
+		LLRB_FOREACH(timer, timers, &Q->timers) {
+			if (isgreater(timer->timeout, curtime))
+				break;
 
-		thread_move(T, &Q->thread.pending);
+			thread_expire(Q, timer2thread(timer), curtime);
+		}
 	}
 
 	assert(NULL == Q->thread.current);
-	Q->thread.current = LIST_FIRST(&Q->thread.pending);
-	if (LUA_OK != (status = cqueue_process_threads(L, Q, I))) {
+	Q->thread.pass++;
+	Q->thread.left = Q->thread.budget;
+	Q->thread.deadline = curtime + Q->thread.slice;
+	resumes = Q->stats.resumes;
+
+	/* timer expiry above isn't counted as processing */
+	if (Q->profile)
+		began = monotime();
+
+	status = cqueue_process_threads(L, Q, I);
+
+	if (Q->profile) {
+		hist_add(&Q->profile->resumes, Q->stats.resumes - resumes);
+		hist_add(&Q->profile->process, hist_us(monotime() - began));
+	}
+
+	if (LUA_OK != status) {
 		return status;
 	}
 
@@ -2181,6 +3849,9 @@ static double cqueue_timeout_(struct cqueue *Q) {
 	struct timer *timer;
 	double curtime;
 
+	if (Q->wheel)
+		return wheel_timeout(Q->wheel, monotime());
+
 	if (!(timer = LLRB_MIN(timers, &Q->timers)))
 		return NAN;
 
@@ -2244,10 +3915,53 @@ oops:
 } /* yield_cont() */
 
 
+/*
+ * Poll the kernel queue. When the step would block and .busypoll is set,
+ * first spin on zero-timeout polls for up to that long, trading CPU for
+ * the wakeup latency of sleeping in the kernel.
+ */
+static int cqueue_wait(struct cqueue *Q, double timeout) {
+	double began, spun, window;
+	int error;
+
+	if (Q->busypoll > 0 && !islessequal(timeout, 0)) {
+		window = mintimeout(Q->busypoll, timeout);
+		began = monotime();
+
+		do {
+			Q->stats.spins++;
+
+			/* an EINTR'd poll doesn't clear the previous batch */
+			Q->kp.pending.count = 0;
+
+			if ((error = kpoll_wait(&Q->kp, 0.0)))
+				return error;
+
+			if (Q->kp.pending.count) {
+				Q->stats.spinhits++;
+
+				return 0;
+			}
+		} while ((spun = monotime() - began) < window);
+
+		if (isfinite(timeout))
+			timeout = MAX(0.0, timeout - spun);
+
+		if (timeout == 0)
+			return 0;
+	}
+
+	if (!islessequal(timeout, 0))
+		Q->stats.blocks++;
+
+	return kpoll_wait(&Q->kp, timeout);
+} /* cqueue_wait() */
+
+
 static int cqueue_step(lua_State *L) {
 	struct callinfo I;
 	struct cqueue *Q;
-	double timeout;
+	double timeout, began = 0;
 	int error;
 	int nargs;
 
@@ -2259,18 +3973,28 @@ static int cqueue_step(lua_State *L) {
 		return luaL_error(L, "cannot step live cqueue");
 	}
 
-	if (Q->thread.count && LIST_EMPTY(&Q->thread.pending)) {
+	if (Q->thread.count && !thread_pending(Q)) {
 		timeout = mintimeout(luaL_optnumber(L, 2, NAN), cqueue_timeout_(Q));
 	} else {
 		timeout = 0.0;
 	}
 
-	if ((error = kpoll_wait(&Q->kp, timeout))) {
+	Q->stats.steps++;
+
+	if (Q->profile)
+		began = monotime();
+
+	if ((error = cqueue_wait(Q, timeout))) {
 		err_setfstring(L, &I, "error polling: %s", cqs_strerror(error));
 		err_setcode(L, &I, error);
 		goto oops;
 	}
 
+	if (Q->profile) {
+		hist_add(&Q->profile->wait, hist_us(monotime() - began));
+		hist_add(&Q->profile->batch, Q->kp.pending.count);
+	}
+
 	switch(cqueue_process(L, Q, &I)) {
 	case LUA_OK:
 		break;
@@ -2303,17 +4027,33 @@ oops:
 } /* cqueue_step() */
 
 
+/* .priority of an options table at index, if any */
+static unsigned thread_checkpriority(lua_State *L, int index) {
+	static const char *const opts[] = { "high", "normal", "low", NULL };
+	unsigned priority;
+
+	if (!lua_istable(L, index))
+		return THREAD_NORMAL;
+
+	lua_getfield(L, index, "priority");
+	priority = luaL_checkoption(L, lua_gettop(L), "normal", opts);
+	lua_pop(L, 1);
+
+	return priority;
+} /* thread_checkpriority() */
+
+
 static int cqueue_attach(lua_State *L) {
 	struct callinfo I;
 	struct cqueue *Q;
 	int error;
 
-	lua_settop(L, 2);
+	lua_settop(L, 3);
 
 	Q = cqueue_enter(L, &I, 1);
 	luaL_checktype(L, 2, LUA_TTHREAD);
 
-	thread_add(L, Q, &I, 2);
+	thread_add(L, Q, &I, 2, thread_checkpriority(L, 3));
 
 	if ((error = cqueue_tryalert(Q)))
 		goto error;
@@ -2334,11 +4074,21 @@ static int cqueue_wrap(lua_State *L) {
 	struct callinfo I;
 	struct cqueue *Q;
 	struct lua_State *newL;
+	unsigned priority;
 	int top, i, error;
 
 	top = lua_gettop(L);
 
 	Q = cqueue_enter(L, &I, 1);
+
+	/* cqueue:wrap([options,] function, ...) */
+	priority = thread_checkpriority(L, 2);
+
+	if (lua_istable(L, 2)) {
+		lua_remove(L, 2);
+		top--;
+	}
+
 	luaL_checktype(L, 2, LUA_TFUNCTION);
 
 	newL = lua_newthread(L);
@@ -2346,7 +4096,7 @@ static int cqueue_wrap(lua_State *L) {
 	luaL_checkstack(newL, top - 1, "too many arguments");
 	lua_xmove(L, newL, top - 1);
 
-	thread_add(L, Q, &I, -1);
+	thread_add(L, Q, &I, -1, priority);
 
 	if ((error = cqueue_tryalert(Q)))
 		goto error;
@@ -2400,12 +4150,138 @@ static int cqueue_count(lua_State *L) {
 } /* cqueue_count() */
 
 
-static cqs_error_t cqueue_cancelfd(struct cqueue *Q, int fd) {
-	struct fileno *fileno;
-	int error = 0, _error;
+static int cqueue_trim(lua_State *L) {
+	struct cqueue *Q = cqueue_checkself(L, 1);
+	size_t n = 0;
 
-	if (!(fileno = fileno_find(Q, fd)))
-		return 0;
+	n += pool_trim(&Q->pool.event);
+	n += pool_trim(&Q->pool.fileno);
+	n += pool_trim(&Q->pool.wakecb);
+
+	lua_pushinteger(L, (lua_Integer)n);
+
+	return 1;
+} /* cqueue_trim() */
+
+
+static void cqueue_pushpool(lua_State *L, const struct pool *P, const char *name) {
+	const struct slab *S;
+	size_t nfree = 0;
+
+	LIST_FOREACH(S, &P->partial, le) {
+		nfree += S->nfree;
+	}
+
+	lua_createtable(L, 0, 3);
+
+	lua_pushinteger(L, (lua_Integer)(P->count - nfree));
+	lua_setfield(L, -2, "inuse");
+
+	lua_pushinteger(L, (lua_Integer)P->count);
+	lua_setfield(L, -2, "count");
+
+	lua_pushinteger(L, (lua_Integer)P->nslab * POOL_SLABSIZE);
+	lua_setfield(L, -2, "bytes");
+
+	lua_setfield(L, -2, name);
+} /* cqueue_pushpool() */
+
+
+static int cqueue_stats(lua_State *L) {
+	static const struct {
+		const char *name;
+		size_t offset;
+	} counter[] = {
+		{ "reused",  offsetof(struct cqueue, stats.reused) },
+		{ "kept",    offsetof(struct cqueue, stats.kept) },
+		{ "steps",   offsetof(struct cqueue, stats.steps) },
+		{ "events",  offsetof(struct cqueue, stats.events) },
+		{ "alerts",  offsetof(struct cqueue, stats.alerts) },
+		{ "expired", offsetof(struct cqueue, stats.expired) },
+		{ "resumes", offsetof(struct cqueue, stats.resumes) },
+		{ "ctl",     offsetof(struct cqueue, stats.ctl) },
+		{ "preempted", offsetof(struct cqueue, stats.preempted) },
+		{ "fastwakes", offsetof(struct cqueue, stats.fastwakes) },
+		{ "spins", offsetof(struct cqueue, stats.spins) },
+		{ "spinhits", offsetof(struct cqueue, stats.spinhits) },
+		{ "blocks", offsetof(struct cqueue, stats.blocks) },
+	};
+	struct cqueue *Q = cqueue_checkself(L, 1);
+	struct profile *P = Q->profile;
+	unsigned i;
+
+	lua_createtable(L, 0, countof(counter) + 5);
+
+	for (i = 0; i < countof(counter); i++) {
+		lua_pushinteger(L, (lua_Integer)*(unsigned long *)((char *)Q + counter[i].offset));
+		lua_setfield(L, -2, counter[i].name);
+	}
+
+	lua_pushinteger(L, (lua_Integer)Q->thread.count);
+	lua_setfield(L, -2, "threads");
+
+	lua_pushinteger(L, (lua_Integer)Q->kp.pending.size);
+	lua_setfield(L, -2, "maxevents");
+
+	lua_pushstring(L, kpoll_name(&Q->kp));
+	lua_setfield(L, -2, "backend");
+
+	lua_createtable(L, 0, 3);
+	cqueue_pushpool(L, &Q->pool.event, "events");
+	cqueue_pushpool(L, &Q->pool.fileno, "filenos");
+	cqueue_pushpool(L, &Q->pool.wakecb, "wakecbs");
+	lua_setfield(L, -2, "pools");
+
+	if (!P)
+		return 1;
+
+	hist_push(L, &P->wait, 1e-6);
+	lua_setfield(L, -2, "wait");
+
+	hist_push(L, &P->batch, 1);
+	lua_setfield(L, -2, "batch");
+
+	hist_push(L, &P->resumes, 1);
+	lua_setfield(L, -2, "perstep");
+
+	hist_push(L, &P->process, 1e-6);
+	lua_setfield(L, -2, "process");
+
+	hist_push(L, &P->resume, 1e-6);
+	lua_setfield(L, -2, "resume");
+
+	lua_createtable(L, 0, 4);
+
+	lua_pushnumber(L, P->slow.threshold);
+	lua_setfield(L, -2, "threshold");
+
+	lua_pushinteger(L, (lua_Integer)P->slow.count);
+	lua_setfield(L, -2, "count");
+
+	lua_pushnumber(L, P->slow.max);
+	lua_setfield(L, -2, "max");
+
+	if (*P->slow.where) {
+		lua_pushstring(L, P->slow.where);
+		lua_setfield(L, -2, "where");
+	}
+
+	lua_setfield(L, -2, "slow");
+
+	/* an exporter sampling periodically wants per-interval histograms */
+	if (lua_toboolean(L, 2)) {
+		double threshold = P->slow.threshold;
+
+		memset(P, 0, sizeof *P);
+		P->slow.threshold = threshold;
+	}
+
+	return 1;
+} /* cqueue_stats() */
+
+
+static cqs_error_t fileno_cancel(struct cqueue *Q, struct fileno *fileno) {
+	int error = 0, _error;
 
 	if ((_error = fileno_signal(Q, fileno, POLLIN|POLLOUT|POLLPRI)))
 		error = _error;
@@ -2413,6 +4289,16 @@ static cqs_error_t cqueue_cancelfd(struct cqueue *Q, int fd) {
 		error = _error;
 
 	return error;
+} /* fileno_cancel() */
+
+
+static cqs_error_t cqueue_cancelfd(struct cqueue *Q, int fd) {
+	struct fileno *fileno;
+
+	if (!(fileno = fileno_find(Q, fd)))
+		return 0;
+
+	return fileno_cancel(Q, fileno);
 } /* cqueue_cancelfd() */
 
 
@@ -2433,14 +4319,28 @@ static int cqueue_checkfd(lua_State *L, struct callinfo *I, int index) {
 } /* cqueue_checkfd() */
 
 
+/*
+ * Resolve every argument to a descriptor before cancelling any, so a
+ * :pollfd method which throws leaves none of them cancelled.
+ */
+static void cqueue_checkfds(lua_State *L, struct callinfo *I, int index, int top) {
+	for (; index <= top; index++) {
+		lua_pushinteger(L, cqueue_checkfd(L, I, index));
+		lua_replace(L, index);
+	}
+} /* cqueue_checkfds() */
+
+
 static int cqueue_cancel(lua_State *L) {
 	struct callinfo I;
 	int top = lua_gettop(L);
 	struct cqueue *Q = cqueue_enter(L, &I, 1);
 	int index;
 
+	cqueue_checkfds(L, &I, 2, top);
+
 	for (index = 2; index <= top; index++)
-		cqueue_cancelfd(Q, cqueue_checkfd(L, &I, index));
+		cqueue_cancelfd(Q, lua_tointeger(L, index));
 
 	return 0;
 } /* cqueue_cancel() */
@@ -2655,7 +4555,7 @@ static int cqueue_events(lua_State *L) {
 static int cqueue_timeout(lua_State *L) {
 	struct cqueue *Q = cqueue_checkself(L, 1);
 
-	if (!LIST_EMPTY(&Q->thread.pending)) {
+	if (thread_pending(Q)) {
 		lua_pushnumber(L, 0.0);
 	} else {
 		double timeout = cqueue_timeout_(Q);
@@ -2706,13 +4606,47 @@ static int cqueue_monotime(lua_State *L) {
 
 #undef CS /* defined by Solaris in /usr/include/sys/crtctl.h */
 
+/*
+ * Every fileno of every controller is also listed here by descriptor, so
+ * cancelling or closing a descriptor only visits the controllers which
+ * have polled it. Like the per-controller index, descriptors outside
+ * [0, FILENO_MAXINDEX), or which arrive when the array can't be grown,
+ * share the overflow list.
+ */
 struct cstack {
 	LIST_HEAD(, cqueue) cqueues;
 
+	struct {
+		struct filenos *index; /* indexed by descriptor number */
+		size_t size;
+		struct filenos overflow;
+	} fileno;
+
 	struct stackinfo *running;
 }; /* struct cstack */
 
 
+static void cstack_del(struct cqueue *);
+
+static int cstack__gc(lua_State *L) {
+	struct cstack *CS = lua_touserdata(L, 1);
+	struct cqueue *Q;
+
+	/*
+	 * Only reached from lua_close, possibly before the controllers'
+	 * own finalizers. Detach them so they don't touch the index.
+	 */
+	while ((Q = LIST_FIRST(&CS->cqueues)))
+		cstack_del(Q);
+
+	free(CS->fileno.index);
+	CS->fileno.index = NULL;
+	CS->fileno.size = 0;
+
+	return 0;
+} /* cstack__gc() */
+
+
 static struct cstack *cstack_self(lua_State *L) {
 	static const int index = 47;
 	struct cstack *CS;
@@ -2730,6 +4664,12 @@ static struct cstack *cstack_self(lua_State *L) {
 	memset(CS, 0, sizeof *CS);
 
 	LIST_INIT(&CS->cqueues);
+	LIST_INIT(&CS->fileno.overflow);
+
+	lua_createtable(L, 0, 1);
+	lua_pushcfunction(L, &cstack__gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
 
 	lua_rawsetp(L, LUA_REGISTRYINDEX, &index);
 
@@ -2744,19 +4684,87 @@ static void cstack_add(lua_State *L, struct cqueue *Q) {
 
 
 static void cstack_del(struct cqueue *Q) {
+	struct filenos *list[] = { &Q->fileno.polling, &Q->fileno.outstanding, &Q->fileno.inactive };
+	struct fileno *fileno;
+
 	/* NB: Q->cstack can be NULL. See cqueue_destroy(). */
 	if (Q->cstack) {
+		for (size_t i = 0; i < countof(list); i++) {
+			LIST_FOREACH(fileno, list[i], le) {
+				LIST_REMOVE(fileno, cse);
+			}
+		}
+
 		LIST_REMOVE(Q, le);
 		Q->cstack = NULL;
 	}
 } /* cstack_del() */
 
 
+static _Bool cstack_index(struct cstack *CS, int fd) {
+	struct filenos *index;
+	struct fileno *fileno, *next;
+	size_t size, i;
+
+	if (fd < 0 || fd >= FILENO_MAXINDEX)
+		return 0;
+
+	if ((size_t)fd >= CS->fileno.size) {
+		size = MAX(CS->fileno.size, FILENO_MININDEX);
+
+		while (size <= (size_t)fd)
+			size *= 2;
+
+		if (!(index = realloc(CS->fileno.index, size * sizeof *index)))
+			return 0;
+
+		/* the first entry of each list points back into the array */
+		for (i = 0; i < CS->fileno.size; i++) {
+			if ((fileno = LIST_FIRST(&index[i])))
+				fileno->cse.le_prev = &LIST_FIRST(&index[i]);
+		}
+
+		for (i = CS->fileno.size; i < size; i++)
+			LIST_INIT(&index[i]);
+
+		CS->fileno.index = index;
+		CS->fileno.size = size;
+
+		/* migrate any overflow entries the index now covers */
+		for (fileno = LIST_FIRST(&CS->fileno.overflow); fileno; fileno = next) {
+			next = LIST_NEXT(fileno, cse);
+
+			if (fileno->fd >= 0 && (size_t)fileno->fd < size) {
+				LIST_REMOVE(fileno, cse);
+				LIST_INSERT_HEAD(&index[fileno->fd], fileno, cse);
+			}
+		}
+	}
+
+	return 1;
+} /* cstack_index() */
+
+
+static void cstack_addfd(struct cstack *CS, struct fileno *fileno) {
+	if (cstack_index(CS, fileno->fd))
+		LIST_INSERT_HEAD(&CS->fileno.index[fileno->fd], fileno, cse);
+	else
+		LIST_INSERT_HEAD(&CS->fileno.overflow, fileno, cse);
+} /* cstack_addfd() */
+
+
 static void cstack_cancelfd(struct cstack *CS, int fd) {
-	struct cqueue *Q;
+	struct filenos *list;
+	struct fileno *fileno;
 
-	LIST_FOREACH(Q, &CS->cqueues, le) {
-		cqueue_cancelfd(Q, fd);
+	if (fd >= 0 && (size_t)fd < CS->fileno.size)
+		list = &CS->fileno.index[fd];
+	else
+		list = &CS->fileno.overflow;
+
+	LIST_FOREACH(fileno, list, cse) {
+		if (fileno->fd == fd)
+			fileno_cancel(fileno->cqueue, fileno);
 	}
 } /* cstack_cancelfd() */
 
@@ -2781,13 +4789,13 @@ static int cstack_onclosefd(int *fd, void *CS) {
 static int cstack_cancel(lua_State *L) {
 	struct callinfo I = CALLINFO_INITIALIZER;
 	struct cstack *CS = cstack_self(L);
-	struct cqueue *Q;
-	int index, fd;
+	int top = lua_gettop(L);
+	int index;
 
-	for (index = 1; index <= lua_gettop(L); index++) {
-		fd = cqueue_checkfd(L, &I, index);
-		cstack_cancelfd(CS, fd);
-	}
+	cqueue_checkfds(L, &I, 1, top);
+
+	for (index = 1; index <= top; index++)
+		cstack_cancelfd(CS, lua_tointeger(L, index));
 
 	return 0;
 } /* cstack_cancel() */
@@ -2870,6 +4878,8 @@ static const luaL_Reg cqueue_methods[] = {
 	{ "alert",   &cqueue_alert },
 	{ "empty",   &cqueue_empty },
 	{ "count",   &cqueue_count },
+	{ "stats",   &cqueue_stats },
+	{ "trim",    &cqueue_trim },
 	{ "cancel",  &cqueue_cancel },
 	{ "reset",   &cqueue_reset },
 	{ "pause",   &cqueue_pause },
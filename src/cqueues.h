@@ -86,6 +86,15 @@
 #define ENABLE_KQUEUE HAVE_KQUEUE
 #endif
 
+/*
+ * io_uring is layered atop epoll and only used when requested at runtime,
+ * so it must be explicitly enabled at build time. Requires Linux 5.11 or
+ * later headers.
+ */
+#ifndef ENABLE_IOURING
+#define ENABLE_IOURING 0
+#endif
+
 #if __GNUC__
 #define NOTUSED __attribute__((unused))
 #define EXTENSION __extension__
@@ -115,6 +124,8 @@
 #define CQS_SOCKET "CQS Socket"
 #define CQS_SIGNAL "CQS Signal"
 #define CQS_THREAD "CQS Thread"
+#define CQS_SCHED "CQS Scheduler"
+#define CQS_CHANNEL "CQS Channel"
 #define CQS_NOTIFY "CQS Notify"
 #define CQS_CONDITION "CQS Condition"
 
@@ -131,6 +142,8 @@ cqs_nargs_t luaopen__cqueues_signal(lua_State *);
 
 cqs_nargs_t luaopen__cqueues_thread(lua_State *);
 
+cqs_nargs_t luaopen__cqueues_thread_channel(lua_State *);
+
 cqs_nargs_t luaopen__cqueues_notify(lua_State *);
 
 cqs_nargs_t luaopen__cqueues_condition(lua_State *);
@@ -147,6 +160,8 @@ cqs_nargs_t luaopen__cqueues_dns_hints(lua_State *);
 
 cqs_nargs_t luaopen__cqueues_dns_resolver(lua_State *);
 
+cqs_nargs_t luaopen__cqueues_dns_batch(lua_State *);
+
 cqs_nargs_t luaopen__cqueues_dns(lua_State *);
 
 
@@ -161,6 +176,8 @@ int cqs_socket_pollfd(lua_State *, int);
 
 int cqs_socket_events(lua_State *, int);
 
+int cqs_socket_drained(lua_State *, int);
+
 double cqs_socket_timeout(lua_State *, int);
 
 
@@ -184,6 +201,7 @@ static void cqs_openlibs(lua_State *L) {
 	cqs_requiref(L, "_cqueues.socket", &luaopen__cqueues_socket, 0);
 	cqs_requiref(L, "_cqueues.signal", &luaopen__cqueues_signal, 0);
 	cqs_requiref(L, "_cqueues.thread", &luaopen__cqueues_thread, 0);
+	cqs_requiref(L, "_cqueues.thread.channel", &luaopen__cqueues_thread_channel, 0);
 	cqs_requiref(L, "_cqueues.notify", &luaopen__cqueues_notify, 0);
 #if 0 /* Make optional? */
 	cqs_requiref(L, "_cqueues.condition", &luaopen__cqueues_condition, 0);
@@ -193,6 +211,7 @@ static void cqs_openlibs(lua_State *L) {
 	cqs_requiref(L, "_cqueues.dns.hosts", &luaopen__cqueues_dns_hosts, 0);
 	cqs_requiref(L, "_cqueues.dns.hints", &luaopen__cqueues_dns_hints, 0);
 	cqs_requiref(L, "_cqueues.dns.resolver", &luaopen__cqueues_dns_resolver, 0);
+	cqs_requiref(L, "_cqueues.dns.batch", &luaopen__cqueues_dns_batch, 0);
 	cqs_requiref(L, "_cqueues.dns", &luaopen__cqueues_dns, 0);
 #endif
 
@@ -0,0 +1,44 @@
+local loader = function(loader, ...)
+	local batch = require"_cqueues.dns.batch"
+	local config = require"cqueues.dns.config"
+	local record = require"cqueues.dns.record"
+
+	local _new = batch.new; batch.new = function (resconf, window)
+		if type(resconf) == "table" then
+			resconf = config.new(resconf)
+		end
+
+		return _new(resconf, window)
+	end
+
+	local function toconst(id, map, what, lvl)
+		local n
+
+		if id == nil then
+			return
+		elseif type(id) == "number" then
+			n = map[id] and id
+		elseif type(id) == "string" then
+			n = map[id] or map[string.upper(id)]
+		end
+
+		if not n then
+			error((tostring(id) .. ": unknown DNS " .. what), lvl + 1)
+		end
+
+		return n
+	end -- toconst
+
+	local _submit; _submit = batch.interpose("submit", function (self, name, type, class, tag)
+		type = toconst(type, record.type, "type", 2)
+		class = toconst(class, record.class, "class", 2)
+
+		return _submit(self, name, type, class, tag)
+	end)
+
+	batch.loader = loader
+
+	return batch
+end
+
+return loader(loader, ...)
@@ -41,6 +41,8 @@
 #include <lauxlib.h>
 
 #include "lib/dns.h"
+#include "lib/cache.h"
+#include "lib/mquery.h"
 #include "cqueues.h"
 
 #define RR_ANY_CLASS   "DNS RR Any"
@@ -62,6 +64,7 @@
 #define HOSTS_CLASS    "DNS Hosts"
 #define HINTS_CLASS    "DNS Hints"
 #define RESOLVER_CLASS "DNS Resolver"
+#define BATCH_CLASS    "DNS Batch"
 
 
 static int optfint(lua_State *L, int t, const char *k, int def) {
@@ -91,12 +94,22 @@ static int optfbool(lua_State *L, int t, const char *k, _Bool def) {
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/*
+ * Records carry a private copy of their packet up to the end of the
+ * record, which is all that compression pointers in it can reference, so
+ * they stay valid however the source packet is reused afterwards. The
+ * owner name is expanded on each call to :name, and the RDATA is parsed
+ * into .data on first access.
+ */
 struct rr {
 	struct dns_rr attr;
-	char *name;
+	_Bool decoded;
+	struct dns_packet *pkt; /* trails .data in the same userdata */
 	union dns_any data;
 }; /* struct rr */
 
+#define RR_ALIGN offsetof(struct { char c; struct dns_packet P; }, P)
+
 
 static const struct rr_info {
 	const char *tname;
@@ -140,30 +153,20 @@ static size_t rr_bufsiz(const struct dns_rr *rr) {
 } /* rr_bufsiz() */
 
 static void rr_push(lua_State *L, struct dns_rr *any, struct dns_packet *P) {
-	char name[DNS_D_MAXNAME + 1];
-	size_t namelen, datasiz;
+	size_t datasiz = rr_bufsiz(any);
+	size_t pktoff = (offsetof(struct rr, data) + datasiz + RR_ALIGN - 1) / RR_ALIGN * RR_ALIGN;
+	size_t end = (any->section == DNS_S_QD)? any->dn.p + any->dn.len + 4U : any->rd.p + any->rd.len;
 	struct rr *rr;
-	int error;
-
-	namelen = dns_d_expand(name, sizeof name, any->dn.p, P, &error);
-	datasiz = rr_bufsiz(any);
 
-	rr = lua_newuserdata(L, offsetof(struct rr, data) + datasiz + namelen + 1);
+	rr = lua_newuserdata(L, pktoff + dns_p_calcsize(end));
 
 	rr->attr = *any;
-
-	rr->name = (char *)rr + offsetof(struct rr, data) + datasiz;
-	memcpy(rr->name, name, namelen);
-	rr->name[namelen] = '\0';
-
+	rr->decoded = (any->section == DNS_S_QD);
 	memset(&rr->data, '\0', datasiz);
 
-	if (any->section != DNS_S_QD) {
-		dns_any_init(&rr->data, datasiz);
-
-		if ((error = dns_any_parse(&rr->data, any, P)))
-			luaL_error(L, "dns.rr.parse: %s", cqs_strerror(error));
-	}
+	rr->pkt = dns_p_init((struct dns_packet *)((char *)rr + pktoff), dns_p_calcsize(end));
+	memcpy(rr->pkt->data, P->data, end);
+	rr->pkt->end = end;
 
 	luaL_setmetatable(L, rr_tname(any));
 } /* rr_push() */
@@ -177,6 +180,29 @@ static struct rr *rr_toany(lua_State *L, int index) {
 } /* rr_toany() */
 
 
+/* parse the RDATA on first use */
+static struct rr *rr_decode(lua_State *L, struct rr *rr) {
+	int error;
+
+	if (rr->decoded)
+		return rr;
+
+	dns_any_init(&rr->data, (char *)rr->pkt - (char *)&rr->data);
+
+	if ((error = dns_any_parse(&rr->data, &rr->attr, rr->pkt)))
+		luaL_error(L, "dns.rr.parse: %s", cqs_strerror(error));
+
+	rr->decoded = 1;
+
+	return rr;
+} /* rr_decode() */
+
+
+static struct rr *rr_check(lua_State *L, int index, const char *tname) {
+	return rr_decode(L, luaL_checkudata(L, index, tname));
+} /* rr_check() */
+
+
 /*
  * ANY RR Bindings
  */
@@ -190,8 +216,12 @@ static int any_section(lua_State *L) {
 
 static int any_name(lua_State *L) {
 	struct rr *rr = rr_toany(L, 1);
+	char name[DNS_D_MAXNAME + 1];
+	size_t namelen;
+	int error;
 
-	lua_pushstring(L, rr->name);
+	namelen = dns_d_expand(name, sizeof name, rr->attr.dn.p, rr->pkt, &error);
+	lua_pushlstring(L, name, MIN(namelen, sizeof name - 1));
 
 	return 1;
 } /* any_name() */
@@ -221,7 +251,7 @@ static int any_ttl(lua_State *L) {
 } /* any_ttl() */
 
 static int any_rdata(lua_State *L) {
-	struct rr *rr = rr_toany(L, 1);
+	struct rr *rr = rr_decode(L, rr_toany(L, 1));
 
 	if (rr->attr.section == DNS_S_QD)
 		return lua_pushliteral(L, ""), 1;
@@ -232,7 +262,7 @@ static int any_rdata(lua_State *L) {
 } /* any_rdata() */
 
 static int any__tostring(lua_State *L) {
-	struct rr *rr = rr_toany(L, 1);
+	struct rr *rr = rr_decode(L, rr_toany(L, 1));
 
 	if (rr->attr.section == DNS_S_QD)
 		return lua_pushliteral(L, ""), 1;
@@ -272,7 +302,7 @@ static const luaL_Reg any_metatable[] = {
  * A RR Bindings
  */
 static int a_addr(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_A_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_A_CLASS);
 	char addr[INET_ADDRSTRLEN + 1] = "";
 
 	if (rr->attr.section != DNS_S_QD)
@@ -302,7 +332,7 @@ static const luaL_Reg a_metatable[] = {
  * NS, CNAME, PTR RR Bindings
  */
 static int ns_host(lua_State *L) {
-	struct rr *rr = rr_toany(L, 1);
+	struct rr *rr = rr_decode(L, rr_toany(L, 1));
 
 	if (rr->attr.section == DNS_S_QD)
 		return lua_pushliteral(L, ""), 1;
@@ -332,7 +362,7 @@ static const luaL_Reg ns_metatable[] = {
  * SOA RR Bindings
  */
 static int soa_mname(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SOA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SOA_CLASS);
 
 	lua_pushstring(L, rr->data.soa.mname);
 
@@ -340,7 +370,7 @@ static int soa_mname(lua_State *L) {
 } /* soa_mname() */
 
 static int soa_rname(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SOA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SOA_CLASS);
 
 	lua_pushstring(L, rr->data.soa.rname);
 
@@ -348,7 +378,7 @@ static int soa_rname(lua_State *L) {
 } /* soa_rname() */
 
 static int soa_serial(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SOA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SOA_CLASS);
 
 	lua_pushinteger(L, rr->data.soa.serial);
 
@@ -356,7 +386,7 @@ static int soa_serial(lua_State *L) {
 } /* soa_serial() */
 
 static int soa_refresh(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SOA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SOA_CLASS);
 
 	lua_pushinteger(L, rr->data.soa.refresh);
 
@@ -364,7 +394,7 @@ static int soa_refresh(lua_State *L) {
 } /* soa_refresh() */
 
 static int soa_retry(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SOA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SOA_CLASS);
 
 	lua_pushinteger(L, rr->data.soa.retry);
 
@@ -372,7 +402,7 @@ static int soa_retry(lua_State *L) {
 } /* soa_retry() */
 
 static int soa_expire(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SOA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SOA_CLASS);
 
 	lua_pushinteger(L, rr->data.soa.expire);
 
@@ -380,7 +410,7 @@ static int soa_expire(lua_State *L) {
 } /* soa_expire() */
 
 static int soa_minimum(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SOA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SOA_CLASS);
 
 	lua_pushinteger(L, rr->data.soa.minimum);
 
@@ -413,7 +443,7 @@ static const luaL_Reg soa_metatable[] = {
  * MX RR Bindings
  */
 static int mx_host(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_MX_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_MX_CLASS);
 
 	lua_pushstring(L, rr->data.mx.host);
 
@@ -421,7 +451,7 @@ static int mx_host(lua_State *L) {
 } /* mx_host() */
 
 static int mx_preference(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_MX_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_MX_CLASS);
 
 	lua_pushinteger(L, rr->data.mx.preference);
 
@@ -468,7 +498,7 @@ static const luaL_Reg txt_metatable[] = {
  * AAAA RR Bindings
  */
 static int aaaa_addr(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_AAAA_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_AAAA_CLASS);
 	char addr[INET6_ADDRSTRLEN + 1] = "";
 
 	if (rr->attr.section != DNS_S_QD)
@@ -498,7 +528,7 @@ static const luaL_Reg aaaa_metatable[] = {
  * SRV RR Bindings
  */
 static int srv_priority(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SRV_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SRV_CLASS);
 
 	lua_pushinteger(L, rr->data.srv.priority);
 
@@ -506,7 +536,7 @@ static int srv_priority(lua_State *L) {
 } /* srv_priority() */
 
 static int srv_weight(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SRV_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SRV_CLASS);
 
 	lua_pushinteger(L, rr->data.srv.weight);
 
@@ -514,7 +544,7 @@ static int srv_weight(lua_State *L) {
 } /* srv_weight() */
 
 static int srv_port(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SRV_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SRV_CLASS);
 
 	lua_pushinteger(L, rr->data.srv.port);
 
@@ -522,7 +552,7 @@ static int srv_port(lua_State *L) {
 } /* srv_port() */
 
 static int srv_target(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SRV_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SRV_CLASS);
 
 	lua_pushstring(L, rr->data.srv.target);
 
@@ -552,7 +582,7 @@ static const luaL_Reg srv_metatable[] = {
  * OPT RR Bindings
  */
 static int opt_rcode(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_OPT_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_OPT_CLASS);
 
 	lua_pushinteger(L, rr->data.opt.rcode);
 
@@ -560,7 +590,7 @@ static int opt_rcode(lua_State *L) {
 } /* opt_rcode() */
 
 static int opt_version(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_OPT_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_OPT_CLASS);
 
 	lua_pushinteger(L, rr->data.opt.version);
 
@@ -568,7 +598,7 @@ static int opt_version(lua_State *L) {
 } /* opt_version() */
 
 static int opt_maxsize(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_OPT_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_OPT_CLASS);
 
 	lua_pushinteger(L, rr->data.opt.maxsize);
 
@@ -597,7 +627,7 @@ static const luaL_Reg opt_metatable[] = {
  * SSHFP RR Bindings
  */
 static int sshfp_algo(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SSHFP_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SSHFP_CLASS);
 
 	lua_pushinteger(L, rr->data.sshfp.algo);
 
@@ -606,7 +636,7 @@ static int sshfp_algo(lua_State *L) {
 
 
 static int sshfp_digest(lua_State *L) {
-	struct rr *rr = luaL_checkudata(L, 1, RR_SSHFP_CLASS);
+	struct rr *rr = rr_check(L, 1, RR_SSHFP_CLASS);
 	int fmt = luaL_checkoption(L, 2, "x", (const char *[]){ "s", "x", 0 });
 	unsigned char *hash;
 	size_t hashlen;
@@ -2098,6 +2128,8 @@ static int res_new(lua_State *L) {
 	struct dns_resolv_conf *resconf = resconf_test(L, 1);
 	struct dns_hosts *hosts = hosts_test(L, 2);
 	struct dns_hints *hints = hints_test(L, 3);
+	struct dns_cache *resi = NULL;
+	struct cache *cache;
 	int error;
 
 	if (resconf)
@@ -2120,6 +2152,10 @@ static int res_new(lua_State *L) {
 			goto error;
 	}
 
+	/*
+	 * The answer cache is scoped by the nameservers in resconf, which
+	 * explicit hints needn't match, so only derived hints use it.
+	 */
 	if (!hints) {
 		if (resconf->options.recurse)
 			hints = dns_hints_root(resconf, &error);
@@ -2128,20 +2164,25 @@ static int res_new(lua_State *L) {
 
 		if (!hints)
 			goto error;
+
+		if ((cache = cache_shared(&(int){ 0 })))
+			resi = cache_resi(cache, resconf, &(int){ 0 });
 	}
 
-	if (!(R->res = dns_res_open(resconf, hosts, hints, NULL, dns_opts(.closefd = { R, &res_closefd }), &error)))
+	if (!(R->res = dns_res_open(resconf, hosts, hints, resi, dns_opts(.closefd = { R, &res_closefd }), &error)))
 		goto error;
 
 	dns_resconf_close(resconf);
 	dns_hosts_close(hosts);
 	dns_hints_close(hints);
+	dns_cache_close(resi);
 
 	return 1;
 error:
 	dns_resconf_close(resconf);
 	dns_hosts_close(hosts);
 	dns_hints_close(hints);
+	dns_cache_close(resi);
 
 	lua_pushnil(L);
 	lua_pushinteger(L, error);
@@ -2364,6 +2405,293 @@ int luaopen__cqueues_dns_resolver(lua_State *L) {
 } /* luaopen__cqueues_dns_resolver() */
 
 
+/*
+ * B A T C H  B I N D I N G S
+ *
+ * Many stub queries pipelined over one socket. There's no search list,
+ * hosts file, or TCP fallback; names are queried as given and truncated
+ * answers are returned as-is for the caller to retry with a resolver.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+struct batch {
+	struct mquery *mq;
+	lua_State *mainthread;
+}; /* struct batch */
+
+
+static int bat_closefd(int *fd, void *arg) {
+	struct batch *B = arg;
+
+	if (B->mainthread) {
+		cqs_cancelfd(B->mainthread, *fd);
+		cqs_closefd(fd);
+	}
+
+	return 0;
+} /* bat_closefd() */
+
+
+static int bat_new(lua_State *L) {
+	struct dns_resolv_conf *resconf = resconf_test(L, 1);
+	unsigned window = luaL_optunsigned(L, 2, mq_opts()->window);
+	struct batch *B;
+	struct dns_cache *resi = NULL;
+	struct cache *cache;
+	int error;
+
+	B = lua_newuserdata(L, sizeof *B);
+	B->mq = 0;
+
+#if defined LUA_RIDX_MAINTHREAD
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	B->mainthread = lua_tothread(L, -1);
+	lua_pop(L, 1);
+#else
+	B->mainthread = 0;
+#endif
+
+	luaL_setmetatable(L, BATCH_CLASS);
+
+	if (resconf)
+		dns_resconf_acquire(resconf);
+	else if (!(resconf = dns_resconf_local(&error)))
+		goto error;
+
+	if ((cache = cache_shared(&(int){ 0 })))
+		resi = cache_resi(cache, resconf, &(int){ 0 });
+
+	if (!(B->mq = mq_open(resconf, resi, mq_opts(.window = window), dns_opts(.closefd = { B, &bat_closefd }), &error)))
+		goto error;
+
+	dns_resconf_close(resconf);
+	dns_cache_close(resi);
+
+	return 1;
+error:
+	dns_resconf_close(resconf);
+	dns_cache_close(resi);
+
+	lua_pushnil(L);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* bat_new() */
+
+
+static int bat_interpose(lua_State *L) {
+	return cqs_interpose(L, BATCH_CLASS);
+} /* bat_interpose() */
+
+
+static int bat_type(lua_State *L) {
+	struct batch *B;
+
+	if ((B = luaL_testudata(L, 1, BATCH_CLASS))) {
+		lua_pushstring(L, (B->mq)? "dns batch" : "closed dns batch");
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+} /* bat_type() */
+
+
+static inline struct mquery *bat_check(lua_State *L, int index) {
+	struct batch *B = luaL_checkudata(L, index, BATCH_CLASS);
+
+	if (!B->mq)
+		luaL_argerror(L, index, "batch defunct");
+
+	return B->mq;
+} /* bat_check() */
+
+
+static int bat_submit(lua_State *L) {
+	struct mquery *mq = bat_check(L, 1);
+	const char *name = luaL_checkstring(L, 2);
+	int type = luaL_optint(L, 3, DNS_T_A);
+	int class = luaL_optint(L, 4, DNS_C_IN);
+	unsigned long tag = luaL_optinteger(L, 5, 0);
+	int error;
+
+	if (!(error = mq_submit(mq, name, type, class, tag))) {
+		lua_pushboolean(L, 1);
+
+		return 1;
+	} else {
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+} /* bat_submit() */
+
+
+/*
+ * Returns the next finished query as packet and tag; false, error and tag
+ * if it failed; or false and EAGAIN if none are finished yet.
+ */
+static int bat_fetch(lua_State *L) {
+	struct mquery *mq = bat_check(L, 1);
+	struct dns_packet *P = NULL, *pkt = NULL;
+	unsigned long tag = 0;
+	size_t size;
+	int error;
+
+	if ((error = mq_step(mq)))
+		goto error;
+
+	/* allocate before taking the answer, as lua_newuserdata may throw */
+	if ((size = mq_peek(mq)))
+		P = dns_p_init(lua_newuserdata(L, size), size);
+
+	if ((error = mq_fetch(mq, &pkt, &tag))) {
+		if (error == EAGAIN)
+			goto error;
+
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, error);
+		lua_pushinteger(L, tag);
+
+		return 3;
+	}
+
+	error = dns_p_study(dns_p_copy(P, pkt));
+	free(pkt);
+
+	if (error) {
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, error);
+		lua_pushinteger(L, tag);
+
+		return 3;
+	}
+
+	luaL_setmetatable(L, PACKET_CLASS);
+	lua_pushinteger(L, tag);
+
+	return 2;
+error:
+	lua_pushboolean(L, 0);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* bat_fetch() */
+
+
+static int bat_count(lua_State *L) {
+	lua_pushinteger(L, mq_count(bat_check(L, 1)));
+
+	return 1;
+} /* bat_count() */
+
+
+static int bat_pollfd(lua_State *L) {
+	lua_pushinteger(L, mq_pollfd(bat_check(L, 1)));
+
+	return 1;
+} /* bat_pollfd() */
+
+
+static int bat_events(lua_State *L) {
+	struct mquery *mq = bat_check(L, 1);
+
+	switch (mq_events(mq)) {
+	case POLLIN|POLLOUT:
+		lua_pushliteral(L, "rw");
+		break;
+	case POLLIN:
+		lua_pushliteral(L, "r");
+		break;
+	case POLLOUT:
+		lua_pushliteral(L, "w");
+		break;
+	default:
+		lua_pushnil(L);
+		break;
+	}
+
+	return 1;
+} /* bat_events() */
+
+
+static int bat_timeout(lua_State *L) {
+	double timeout = mq_timeout(bat_check(L, 1));
+
+	if (timeout < 0)
+		lua_pushnil(L);
+	else
+		lua_pushnumber(L, timeout);
+
+	return 1;
+} /* bat_timeout() */
+
+
+static int bat_close(lua_State *L) {
+	struct batch *B = luaL_checkudata(L, 1, BATCH_CLASS);
+
+	if (!B->mainthread) {
+		B->mainthread = L;
+		mq_close(B->mq);
+		B->mq = 0;
+		B->mainthread = 0;
+	} else {
+		mq_close(B->mq);
+		B->mq = 0;
+	}
+
+	return 0;
+} /* bat_close() */
+
+
+static int bat__gc(lua_State *L) {
+	struct batch *B = luaL_checkudata(L, 1, BATCH_CLASS);
+
+	B->mainthread = 0;
+
+	mq_close(B->mq);
+	B->mq = 0;
+
+	return 0;
+} /* bat__gc() */
+
+
+static const luaL_Reg bat_methods[] = {
+	{ "submit",  &bat_submit },
+	{ "fetch",   &bat_fetch },
+	{ "count",   &bat_count },
+	{ "pollfd",  &bat_pollfd },
+	{ "events",  &bat_events },
+	{ "timeout", &bat_timeout },
+	{ "close",   &bat_close },
+	{ NULL,      NULL },
+}; /* bat_methods[] */
+
+static const luaL_Reg bat_metatable[] = {
+	{ "__gc", &bat__gc },
+	{ NULL,   NULL }
+}; /* bat_metatable[] */
+
+static const luaL_Reg bat_globals[] = {
+	{ "new",       &bat_new },
+	{ "interpose", &bat_interpose },
+	{ "type",      &bat_type },
+	{ NULL,        NULL }
+};
+
+int luaopen__cqueues_dns_batch(lua_State *L) {
+	cqs_newmetatable(L, BATCH_CLASS, bat_methods, bat_metatable, 0);
+
+	cqs_requiref(L, "_cqueues.dns.config", &luaopen__cqueues_dns_config, 0);
+	cqs_requiref(L, "_cqueues.dns.packet", &luaopen__cqueues_dns_packet, 0);
+
+	luaL_newlib(L, bat_globals);
+
+	return 1;
+} /* luaopen__cqueues_dns_batch() */
+
+
 /*
  * G L O B A L  B I N D I N G S
  *
@@ -2405,10 +2733,126 @@ static int dnsL_random(lua_State *L) {
 } /* dnsL_random() */
 
 
+static void dnsL_pushcacheopts(lua_State *L, const struct cache_options *opts) {
+	lua_newtable(L);
+	lua_pushinteger(L, opts->size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, opts->maxttl);
+	lua_setfield(L, -2, "maxttl");
+	lua_pushinteger(L, opts->negttl);
+	lua_setfield(L, -2, "negttl");
+	lua_pushinteger(L, opts->prefetch);
+	lua_setfield(L, -2, "prefetch");
+} /* dnsL_pushcacheopts() */
+
+
+/*
+ * Answer cache shared by resolvers from dns.resolver.new, and so
+ * dns.resolvers pools, and by cqueues.socket connections to host names.
+ */
+static int dnsL_setcache(lua_State *L) {
+	struct cache_options old, opts;
+	struct cache *C;
+	int error;
+
+	if (!(C = cache_shared(&error))) {
+		lua_pushnil(L);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+
+	cache_getopts(C, &old);
+	opts = old;
+
+	if (lua_isboolean(L, 1)) {
+		if (!lua_toboolean(L, 1))
+			opts.size = 0;
+		else if (!opts.size)
+			opts.size = cache_opts()->size;
+	} else if (!lua_isnoneornil(L, 1)) {
+		int size, maxttl, negttl, prefetch;
+
+		luaL_checktype(L, 1, LUA_TTABLE);
+
+		size = optfint(L, 1, "size", (int)opts.size);
+		maxttl = optfint(L, 1, "maxttl", (int)opts.maxttl);
+		negttl = optfint(L, 1, "negttl", (int)opts.negttl);
+		prefetch = optfint(L, 1, "prefetch", (int)opts.prefetch);
+
+		luaL_argcheck(L, size >= 0, 1, "cache size must not be negative");
+		luaL_argcheck(L, maxttl >= 0 && negttl >= 0, 1, "TTL limits must not be negative");
+		luaL_argcheck(L, prefetch >= 0 && prefetch <= 100, 1, "prefetch must be a percentage");
+
+		opts.size = size;
+		opts.maxttl = maxttl;
+		opts.negttl = negttl;
+		opts.prefetch = prefetch;
+	}
+
+	cache_setopts(C, &opts);
+
+	dnsL_pushcacheopts(L, &old);
+
+	return 1;
+} /* dnsL_setcache() */
+
+
+static int dnsL_cachestats(lua_State *L) {
+	struct cache_options opts;
+	struct cache_stat st;
+	struct cache *C;
+	int error;
+
+	if (!(C = cache_shared(&error))) {
+		lua_pushnil(L);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+
+	cache_getopts(C, &opts);
+	cache_stat(C, &st);
+
+	dnsL_pushcacheopts(L, &opts);
+	lua_pushinteger(L, st.count);
+	lua_setfield(L, -2, "count");
+	lua_pushinteger(L, st.hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, st.negative);
+	lua_setfield(L, -2, "negative");
+	lua_pushinteger(L, st.misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, st.prefetches);
+	lua_setfield(L, -2, "prefetches");
+	lua_pushinteger(L, st.stored);
+	lua_setfield(L, -2, "stored");
+	lua_pushinteger(L, st.evicted);
+	lua_setfield(L, -2, "evicted");
+	lua_pushinteger(L, st.expired);
+	lua_setfield(L, -2, "expired");
+
+	return 1;
+} /* dnsL_cachestats() */
+
+
+static int dnsL_flushcache(lua_State *L) {
+	struct cache *C;
+
+	if ((C = cache_shared(&(int){ 0 })))
+		cache_purge(C);
+
+	return 0;
+} /* dnsL_flushcache() */
+
+
 static const luaL_Reg dnsL_globals[] = {
-	{ "version", &dnsL_version },
-	{ "random",  &dnsL_random },
-	{ NULL,      NULL }
+	{ "version",    &dnsL_version },
+	{ "random",     &dnsL_random },
+	{ "setcache",   &dnsL_setcache },
+	{ "cachestats", &dnsL_cachestats },
+	{ "flushcache", &dnsL_flushcache },
+	{ NULL,         NULL }
 };
 
 int luaopen__cqueues_dns(lua_State *L) {
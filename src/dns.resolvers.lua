@@ -1,10 +1,13 @@
 local loader = function(loader, ...)
 	local resolver = require"cqueues.dns.resolver"
+	local batch = require"cqueues.dns.batch"
 	local config = require"cqueues.dns.config"
 	local condition = require"cqueues.condition"
-	local monotime = require"cqueues".monotime
+	local cqueues = require"cqueues"
+	local monotime = cqueues.monotime
 	local random = require"cqueues.dns".random
 	local errno = require"cqueues.errno"
+	local EAGAIN = errno.EAGAIN
 	local ETIMEDOUT = errno.ETIMEDOUT
 
 
@@ -187,6 +190,82 @@ local loader = function(loader, ...)
 	end -- pool:query
 
 
+	--
+	-- NOTE: Stub queries for every { name, type, class } in list are
+	-- pipelined over a single socket, ignoring the search list and hosts
+	-- file. Truncated answers are retried with a pooled resolver once the
+	-- batch drains. Returns a table of answers and a table of errors, each
+	-- indexed like list.
+	--
+	local BATCH_MAXQUEUED = 0x8000
+
+	function pool:queryall(list, timeout)
+		local deadline = todeadline(timeout or self.timeout)
+		local answers, errors, retry = {}, {}, {}
+		local b, why = batch.new(self.resconf)
+
+		if not b then
+			return nil, why
+		end
+
+		local n = 0
+
+		local function fill()
+			while n < #list and b:count() < BATCH_MAXQUEUED do
+				local q = list[n + 1]
+				local ok, why = b:submit(q[1] or q.name, q[2] or q.type, q[3] or q.class, n + 1)
+
+				if not ok then
+					errors[n + 1] = why
+				end
+
+				n = n + 1
+			end
+		end
+
+		fill()
+
+		while b:count() > 0 do
+			local answer, why, i = b:fetch()
+
+			if answer then
+				if answer:flags().tc then
+					retry[#retry + 1] = i
+				else
+					answers[i] = answer
+				end
+
+				fill()
+			elseif why == EAGAIN then
+				if deadline and deadline <= monotime() then
+					break
+				end
+
+				cqueues.poll(b, totimeout(deadline))
+			else
+				errors[i] = why
+				fill()
+			end
+		end
+
+		b:close()
+
+		for i = 1, #list do
+			if not answers[i] and not errors[i] then
+				errors[i] = ETIMEDOUT
+			end
+		end
+
+		for _, i in ipairs(retry) do
+			local q = list[i]
+
+			answers[i], errors[i] = self:query(q[1] or q.name, q[2] or q.type, q[3] or q.class, totimeout(deadline))
+		end
+
+		return answers, errors
+	end -- pool:queryall
+
+
 	function pool:check()
 		return self.alive:check()
 	end -- pool:check
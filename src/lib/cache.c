@@ -0,0 +1,610 @@
+/* ==========================================================================
+ * cache.c - In-memory DNS answer cache.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#include "config.h"
+
+#include <stddef.h>	/* size_t */
+#include <stdlib.h>	/* calloc(3) free(3) */
+#include <string.h>	/* memcmp(3) memcpy(3) memset(3) strcmp(3) */
+#include <ctype.h>	/* tolower(3) */
+#include <errno.h>	/* ENOMEM */
+
+#include <sys/socket.h>	/* AF_INET AF_INET6 */
+#include <netinet/in.h>	/* struct sockaddr_in struct sockaddr_in6 */
+#include <time.h>	/* CLOCK_MONOTONIC clock_gettime(2) time(2) */
+
+#include <sys/queue.h>	/* TAILQ_* */
+#include <pthread.h>	/* pthread_mutex_* pthread_once(3) */
+
+#include "cache.h"
+#include "llrb.h"
+
+
+/*
+ * An entry in the prefetch window is handed to one lookup to refresh.
+ * If that lookup never stores an answer, let another try after this
+ * many seconds.
+ */
+#define CACHE_REFRESH 5
+
+
+/*
+ * Which upstream an answer came from. Resolvers asking different
+ * nameservers, or iterating instead of asking a recursive server, can
+ * legitimately get different answers for the same question, so they
+ * neither see nor replace each others' entries. All bytes are
+ * significant, padding included, so the key is compared with memcmp.
+ */
+struct cache_scope {
+	unsigned char ns[3][1 + 2 + 16]; /* family, port, address */
+	unsigned char recurse;
+}; /* struct cache_scope */
+
+struct cache_entry {
+	LLRB_ENTRY(cache_entry) rbe;
+	TAILQ_ENTRY(cache_entry) tqe;
+
+	enum dns_type type;
+	enum dns_class class;
+	struct cache_scope scope;
+
+	time_t stored, expires, refresh;
+	_Bool negative;
+
+	struct dns_packet *answer;
+
+	char name[DNS_D_MAXNAME + 1];
+}; /* struct cache_entry */
+
+struct cache {
+	pthread_mutex_t mutex;
+	unsigned refcount;
+
+	struct cache_options opts;
+	struct cache_stat st;
+
+	LLRB_HEAD(cache_entries, cache_entry) tree;
+	TAILQ_HEAD(cache_lru, cache_entry) lru; /* most recently used first */
+}; /* struct cache */
+
+/* a scoped struct dns_cache interface onto a cache */
+struct cache_view {
+	struct dns_cache resi;
+
+	struct cache *cache;
+	unsigned refcount; /* protected by cache->mutex */
+
+	struct cache_scope scope;
+}; /* struct cache_view */
+
+
+static time_t cache_now(void) {
+#if defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+		return ts.tv_sec;
+#endif
+	return time(NULL);
+} /* cache_now() */
+
+
+static int cache_cmp(const struct cache_entry *a, const struct cache_entry *b) {
+	int cmp;
+
+	if (a->type != b->type)
+		return (a->type < b->type)? -1 : 1;
+
+	if (a->class != b->class)
+		return (a->class < b->class)? -1 : 1;
+
+	if ((cmp = memcmp(&a->scope, &b->scope, sizeof a->scope)))
+		return cmp;
+
+	return strcmp(a->name, b->name);
+} /* cache_cmp() */
+
+LLRB_GENERATE_STATIC(cache_entries, cache_entry, rbe, cache_cmp)
+
+
+/* fill the key fields of ent from the question of Q */
+static int cache_key(struct cache_entry *ent, const struct cache_scope *scope, struct dns_packet *Q) {
+	struct dns_rr rr;
+	size_t len, i;
+	int error;
+
+	ent->scope = *scope;
+
+	if (!dns_p_count(Q, DNS_S_QD))
+		return DNS_ENOQUERY;
+
+	if (!(len = dns_d_expand(ent->name, sizeof ent->name, 12, Q, &error)))
+		return error;
+	else if (len >= sizeof ent->name)
+		return DNS_EILLEGAL;
+
+	for (i = 0; i < len; i++)
+		ent->name[i] = tolower((unsigned char)ent->name[i]);
+
+	if ((error = dns_rr_parse(&rr, 12, Q)))
+		return error;
+
+	ent->type = rr.type;
+	ent->class = rr.class;
+
+	return 0;
+} /* cache_key() */
+
+
+/* unlink and free ent; call with mutex held */
+static void cache_free(struct cache *C, struct cache_entry *ent) {
+	LLRB_REMOVE(cache_entries, &C->tree, ent);
+	TAILQ_REMOVE(&C->lru, ent, tqe);
+	C->st.count--;
+
+	free(ent->answer);
+	free(ent);
+} /* cache_free() */
+
+
+/* evict from the cold end until within size; call with mutex held */
+static void cache_trim(struct cache *C, size_t size) {
+	struct cache_entry *ent;
+
+	while (C->st.count > size && (ent = TAILQ_LAST(&C->lru, cache_lru))) {
+		cache_free(C, ent);
+		C->st.evicted++;
+	}
+} /* cache_trim() */
+
+
+/*
+ * Lifetime of answer A, or 0 if it shouldn't be cached. Sets *negative
+ * for NXDOMAIN and NODATA answers.
+ */
+static unsigned cache_ttl(struct dns_packet *A, _Bool *negative) {
+	struct dns_rr rr;
+	struct dns_soa soa;
+	unsigned ttl = ~0U;
+
+	if (dns_header(A)->tc)
+		return 0;
+
+	switch (dns_p_rcode(A)) {
+	case DNS_RC_NOERROR:
+		if (dns_p_count(A, DNS_S_AN) > 0) {
+			*negative = 0;
+
+			dns_rr_foreach(&rr, A, .section = DNS_S_AN) {
+				if (rr.ttl < ttl)
+					ttl = rr.ttl;
+			}
+
+			return (ttl == ~0U)? 0 : ttl;
+		}
+
+		/* FALL THROUGH */
+	case DNS_RC_NXDOMAIN:
+		*negative = 1;
+
+		dns_rr_foreach(&rr, A, .section = DNS_S_NS, .type = DNS_T_SOA) {
+			if (dns_soa_parse(&soa, &rr, A))
+				continue;
+
+			ttl = (rr.ttl < soa.minimum)? rr.ttl : soa.minimum;
+
+			break;
+		}
+
+		return (ttl == ~0U)? 0 : ttl;
+	default:
+		return 0;
+	}
+} /* cache_ttl() */
+
+
+/* count age seconds off every TTL in P */
+static void cache_age(struct dns_packet *P, unsigned age) {
+	struct dns_rr rr;
+	unsigned char *p;
+	unsigned ttl;
+
+	if (!age)
+		return;
+
+	dns_rr_foreach(&rr, P, .section = (DNS_S_ALL & ~DNS_S_QD)) {
+		if (rr.type == DNS_T_OPT)
+			continue;
+
+		ttl = (rr.ttl > age)? rr.ttl - age : 0;
+		p = &P->data[rr.dn.p + rr.dn.len + 4];
+
+		p[0] = 0xff & (ttl >> 24);
+		p[1] = 0xff & (ttl >> 16);
+		p[2] = 0xff & (ttl >> 8);
+		p[3] = 0xff & (ttl >> 0);
+	}
+} /* cache_age() */
+
+
+static struct dns_packet *cache_dup(struct dns_packet *P0, int *error) {
+	struct dns_packet *P;
+
+	if (!(P = dns_p_copy(dns_p_make(P0->end, error), P0)))
+		return NULL;
+
+	if ((*error = dns_p_study(P))) {
+		free(P);
+
+		return NULL;
+	}
+
+	return P;
+} /* cache_dup() */
+
+
+/*
+ * Returns a copy of the answer to question Q with TTLs reduced by the
+ * time it has been held, or NULL without setting *error if there is none
+ * or the caller should refresh it.
+ */
+static struct dns_packet *cache_query(struct cache *C, const struct cache_scope *scope, struct dns_packet *Q, int *error) {
+	struct cache_entry key, *ent;
+	struct dns_packet *P = NULL;
+	time_t now;
+	unsigned age = 0;
+
+	if (cache_key(&key, scope, Q))
+		return NULL;
+
+	now = cache_now();
+
+	pthread_mutex_lock(&C->mutex);
+
+	if (!(ent = LLRB_FIND(cache_entries, &C->tree, &key))) {
+		C->st.misses++;
+
+		goto unlock;
+	}
+
+	if (now >= ent->expires) {
+		cache_free(C, ent);
+		C->st.expired++;
+		C->st.misses++;
+
+		goto unlock;
+	}
+
+	if (!ent->negative && C->opts.prefetch && now >= ent->refresh
+	&&  (ent->expires - now) * 100 <= (ent->expires - ent->stored) * (time_t)C->opts.prefetch) {
+		ent->refresh = now + CACHE_REFRESH;
+		C->st.prefetches++;
+
+		goto unlock;
+	}
+
+	if (!(P = dns_p_copy(dns_p_make(ent->answer->end, error), ent->answer)))
+		goto unlock;
+
+	age = now - ent->stored;
+
+	TAILQ_REMOVE(&C->lru, ent, tqe);
+	TAILQ_INSERT_HEAD(&C->lru, ent, tqe);
+
+	C->st.hits++;
+
+	if (ent->negative)
+		C->st.negative++;
+unlock:
+	pthread_mutex_unlock(&C->mutex);
+
+	if (P) {
+		if ((*error = dns_p_study(P))) {
+			free(P);
+
+			return NULL;
+		}
+
+		cache_age(P, age);
+		dns_header(P)->qid = dns_header(Q)->qid;
+	}
+
+	return P;
+} /* cache_query() */
+
+
+/*
+ * Store answer A to question Q, replacing any earlier answer. Answers
+ * which mustn't be cached are ignored.
+ */
+static int cache_insert(struct cache *C, const struct cache_scope *scope, struct dns_packet *Q, struct dns_packet *A) {
+	struct cache_entry *ent, *old;
+	_Bool negative = 0;
+	unsigned ttl;
+	time_t now;
+	int error;
+
+	if (!(ent = calloc(1, sizeof *ent)))
+		return errno;
+
+	if ((error = cache_key(ent, scope, Q)))
+		goto error;
+
+	if (!(ent->answer = cache_dup(A, &error)))
+		goto error;
+
+	if (!(ttl = cache_ttl(ent->answer, &negative)))
+		goto ignore;
+
+	now = cache_now();
+
+	pthread_mutex_lock(&C->mutex);
+
+	if (!C->opts.size) {
+		pthread_mutex_unlock(&C->mutex);
+
+		goto ignore;
+	}
+
+	if (negative && ttl > C->opts.negttl)
+		ttl = C->opts.negttl;
+	else if (!negative && ttl > C->opts.maxttl)
+		ttl = C->opts.maxttl;
+
+	ent->stored = now;
+	ent->expires = now + ttl;
+	ent->negative = negative;
+
+	if ((old = LLRB_FIND(cache_entries, &C->tree, ent)))
+		cache_free(C, old);
+
+	LLRB_INSERT(cache_entries, &C->tree, ent);
+	TAILQ_INSERT_HEAD(&C->lru, ent, tqe);
+	C->st.count++;
+	C->st.stored++;
+
+	cache_trim(C, C->opts.size);
+
+	pthread_mutex_unlock(&C->mutex);
+
+	return 0;
+ignore:
+	error = 0;
+error:
+	free(ent->answer);
+	free(ent);
+
+	return error;
+} /* cache_insert() */
+
+
+void cache_setopts(struct cache *C, const struct cache_options *opts) {
+	pthread_mutex_lock(&C->mutex);
+	C->opts = *opts;
+	cache_trim(C, C->opts.size);
+	pthread_mutex_unlock(&C->mutex);
+} /* cache_setopts() */
+
+
+void cache_getopts(struct cache *C, struct cache_options *opts) {
+	pthread_mutex_lock(&C->mutex);
+	*opts = C->opts;
+	pthread_mutex_unlock(&C->mutex);
+} /* cache_getopts() */
+
+
+void cache_stat(struct cache *C, struct cache_stat *st) {
+	pthread_mutex_lock(&C->mutex);
+	*st = C->st;
+	pthread_mutex_unlock(&C->mutex);
+} /* cache_stat() */
+
+
+void cache_purge(struct cache *C) {
+	struct cache_entry *ent;
+
+	pthread_mutex_lock(&C->mutex);
+
+	while ((ent = TAILQ_FIRST(&C->lru)))
+		cache_free(C, ent);
+
+	pthread_mutex_unlock(&C->mutex);
+} /* cache_purge() */
+
+
+/*
+ * R E S O L V E R  I N T E R F A C E
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static void cache_scope(struct cache_scope *scope, const struct dns_resolv_conf *resconf) {
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+	unsigned char *p;
+	unsigned i;
+
+	memset(scope, 0, sizeof *scope);
+
+	for (i = 0; i < sizeof resconf->nameserver / sizeof resconf->nameserver[0]; i++) {
+		p = scope->ns[i];
+
+		switch (resconf->nameserver[i].ss_family) {
+		case AF_INET:
+			sin = (const struct sockaddr_in *)&resconf->nameserver[i];
+			p[0] = 4;
+			memcpy(&p[1], &sin->sin_port, 2);
+			memcpy(&p[3], &sin->sin_addr, 4);
+
+			break;
+		case AF_INET6:
+			sin6 = (const struct sockaddr_in6 *)&resconf->nameserver[i];
+			p[0] = 6;
+			memcpy(&p[1], &sin6->sin6_port, 2);
+			memcpy(&p[3], &sin6->sin6_addr, 16);
+
+			break;
+		}
+	}
+
+	scope->recurse = !!resconf->options.recurse;
+} /* cache_scope() */
+
+
+static dns_refcount_t cache_resi_acquire(struct dns_cache *resi) {
+	struct cache_view *V = resi->state;
+	unsigned count;
+
+	pthread_mutex_lock(&V->cache->mutex);
+	count = V->refcount++;
+	pthread_mutex_unlock(&V->cache->mutex);
+
+	return count;
+} /* cache_resi_acquire() */
+
+
+static dns_refcount_t cache_resi_release(struct dns_cache *resi) {
+	struct cache_view *V = resi->state;
+	unsigned count;
+
+	pthread_mutex_lock(&V->cache->mutex);
+	count = V->refcount--;
+	pthread_mutex_unlock(&V->cache->mutex);
+
+	if (count == 1) {
+		cache_close(V->cache);
+		free(V);
+	}
+
+	return count;
+} /* cache_resi_release() */
+
+
+static struct dns_packet *cache_resi_query(struct dns_packet *Q, struct dns_cache *resi, int *error) {
+	struct cache_view *V = resi->state;
+
+	return cache_query(V->cache, &V->scope, Q, error);
+} /* cache_resi_query() */
+
+
+static int cache_resi_insert(struct dns_packet *Q, struct dns_packet *A, struct dns_cache *resi) {
+	struct cache_view *V = resi->state;
+
+	return cache_insert(V->cache, &V->scope, Q, A);
+} /* cache_resi_insert() */
+
+
+/*
+ * Returns a new struct dns_cache interface onto C for resolvers
+ * configured by resconf. The caller owns the only reference.
+ */
+struct dns_cache *cache_resi(struct cache *C, const struct dns_resolv_conf *resconf, int *error) {
+	struct cache_view *V;
+
+	if (!(V = calloc(1, sizeof *V))) {
+		*error = errno;
+
+		return NULL;
+	}
+
+	dns_cache_init(&V->resi);
+	V->resi.state = V;
+	V->resi.acquire = &cache_resi_acquire;
+	V->resi.release = &cache_resi_release;
+	V->resi.query = &cache_resi_query;
+	V->resi.insert = &cache_resi_insert;
+
+	cache_scope(&V->scope, resconf);
+
+	pthread_mutex_lock(&C->mutex);
+	C->refcount++;
+	pthread_mutex_unlock(&C->mutex);
+
+	V->cache = C;
+	V->refcount = 1;
+
+	return &V->resi;
+} /* cache_resi() */
+
+
+struct cache *cache_open(const struct cache_options *opts, int *error) {
+	struct cache *C;
+
+	if (!(C = calloc(1, sizeof *C)))
+		goto syerr;
+
+	if ((*error = pthread_mutex_init(&C->mutex, NULL))) {
+		free(C);
+
+		return NULL;
+	}
+
+	C->refcount = 1;
+	C->opts = *opts;
+
+	LLRB_INIT(&C->tree);
+	TAILQ_INIT(&C->lru);
+
+	return C;
+syerr:
+	*error = errno;
+
+	return NULL;
+} /* cache_open() */
+
+
+void cache_close(struct cache *C) {
+	unsigned count;
+
+	if (!C)
+		return;
+
+	pthread_mutex_lock(&C->mutex);
+	count = C->refcount--;
+	pthread_mutex_unlock(&C->mutex);
+
+	if (count == 1) {
+		cache_purge(C);
+		pthread_mutex_destroy(&C->mutex);
+		free(C);
+	}
+} /* cache_close() */
+
+
+static struct {
+	pthread_once_t once;
+	struct cache *cache;
+	int error;
+} cache_global = { PTHREAD_ONCE_INIT, NULL, 0 };
+
+static void cache_global_init(void) {
+	cache_global.cache = cache_open(cache_opts(), &cache_global.error);
+} /* cache_global_init() */
+
+struct cache *cache_shared(int *error) {
+	pthread_once(&cache_global.once, &cache_global_init);
+
+	if (!cache_global.cache)
+		*error = (cache_global.error)? cache_global.error : ENOMEM;
+
+	return cache_global.cache;
+} /* cache_shared() */
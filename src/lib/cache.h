@@ -0,0 +1,87 @@
+/* ==========================================================================
+ * cache.h - In-memory DNS answer cache.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>	/* size_t */
+
+#include "dns.h"
+
+
+/*
+ * A thread-safe, size-bounded LRU cache of resolver answers keyed by the
+ * fully qualified question actually answered. Positive answers live for
+ * the smallest TTL in the answer section; NXDOMAIN and NODATA answers
+ * for the SOA minimum (RFC 2308). Other responses, and negative
+ * responses without an SOA, aren't cached.
+ *
+ * cache_resi() returns a struct dns_cache interface for dns_res_open(),
+ * scoped to the nameservers and recursion mode of a resolver
+ * configuration; resolvers with another upstream don't share entries.
+ * Resolvers consult it before their lookup order unless the order names
+ * the cache explicitly, walking their own search list, and store what
+ * they learn from the network. Once an entry enters the last .prefetch
+ * percent of its lifetime, the next lookup is told to miss so that it
+ * refreshes the entry while concurrent lookups are still answered from
+ * the cache.
+ */
+
+struct cache_options {
+	size_t size;       /* maximum entries; 0 disables caching */
+	unsigned maxttl;   /* upper bound on positive lifetimes, in seconds */
+	unsigned negttl;   /* upper bound on negative lifetimes, in seconds */
+	unsigned prefetch; /* percent of a lifetime to refresh early; 0 disables */
+}; /* struct cache_options */
+
+#define cache_opts(...) (&(struct cache_options){ .size = 1024, .maxttl = 86400, .negttl = 900, .prefetch = 10, __VA_ARGS__ })
+
+struct cache_stat {
+	unsigned long hits;       /* answered from the cache */
+	unsigned long negative;   /* ... of which were NXDOMAIN or NODATA */
+	unsigned long misses;     /* not found or expired */
+	unsigned long prefetches; /* hits turned into early refreshes */
+	unsigned long stored;     /* answers stored or refreshed */
+	unsigned long evicted;    /* entries dropped to stay within .size */
+	unsigned long expired;    /* entries dropped at end of lifetime */
+	size_t count;             /* entries held */
+}; /* struct cache_stat */
+
+struct cache *cache_open(const struct cache_options *, int *);
+
+void cache_close(struct cache *);
+
+/* process-wide instance shared by cqueues resolvers and sockets */
+struct cache *cache_shared(int *);
+
+struct dns_cache *cache_resi(struct cache *, const struct dns_resolv_conf *, int *);
+
+void cache_setopts(struct cache *, const struct cache_options *);
+
+void cache_getopts(struct cache *, struct cache_options *);
+
+void cache_stat(struct cache *, struct cache_stat *);
+
+void cache_purge(struct cache *);
+
+#endif /* CACHE_H */
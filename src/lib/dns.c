@@ -6064,6 +6064,15 @@ static void dns_cache_clear(struct dns_cache *cache) {
 } /* dns_cache_clear() */
 
 
+static int dns_cache_insert(struct dns_packet *query, struct dns_packet *answer, struct dns_cache *cache) {
+	(void)query;
+	(void)answer;
+	(void)cache;
+
+	return 0;
+} /* dns_cache_insert() */
+
+
 struct dns_cache *dns_cache_init(struct dns_cache *cache) {
 	static const struct dns_cache c_init = {
 		.acquire = &dns_cache_acquire,
@@ -6075,6 +6084,7 @@ struct dns_cache *dns_cache_init(struct dns_cache *cache) {
 		.pollfd  = &dns_cache_pollfd,
 		.events  = &dns_cache_events,
 		.clear   = &dns_cache_clear,
+		.insert  = &dns_cache_insert,
 		._ = { .refcount = 1, },
 	};
 
@@ -6889,6 +6899,8 @@ struct dns_resolver {
 
 	struct dns_packet *nodata; /* answer if nothing better */
 
+	_Bool local; /* answered from hosts or cache; don't offer to cache */
+
 	unsigned sp;
 
 	struct dns_res_frame {
@@ -6937,7 +6949,7 @@ struct dns_resolver *dns_res_open(struct dns_resolv_conf *resconf, struct dns_ho
 	if (hints)
 		dns_hints_acquire(hints);
 	if (cache)
-		dns_cache_acquire(cache);
+		cache->acquire(cache);
 
 	/*
 	 * Don't try to load it ourselves because a NULL object might be an
@@ -7246,6 +7258,35 @@ static int dns_res_nameserv_cmp(struct dns_rr *a, struct dns_rr *b, struct dns_r
 } /* dns_res_nameserv_cmp() */
 
 
+/*
+ * Whether a cache answer is final: records, or a negative answer with
+ * the authority section that justified caching it.
+ */
+static _Bool dns_res_cached(struct dns_packet *P) {
+	if (dns_p_count(P, DNS_S_AN) > 0)
+		return 1;
+
+	switch (dns_p_rcode(P)) {
+	case DNS_RC_NXDOMAIN:
+		return 1;
+	case DNS_RC_NOERROR:
+		return dns_p_count(P, DNS_S_NS) > 0;
+	default:
+		return 0;
+	}
+} /* dns_res_cached() */
+
+
+/*
+ * Offer an answer to the cache, keyed by its own question: the fully
+ * qualified name actually asked, after search list expansion. See the
+ * walk in DNS_R_CACHE. Failure only costs a later cache miss.
+ */
+static void dns_res_offer(struct dns_resolver *R, struct dns_packet *answer) {
+	(void)R->cache->insert(answer, answer, R->cache);
+} /* dns_res_offer() */
+
+
 #define dgoto(sp, i)	\
 	do { R->stack[(sp)].state = (i); goto exec; } while (0)
 
@@ -7270,6 +7311,13 @@ exec:
 	case DNS_R_INIT:
 		F->state++;
 	case DNS_R_GLUE:
+		/*
+		 * A cache the lookup order doesn't place is consulted
+		 * first. On a miss DNS_R_FETCH continues to DNS_R_SWITCH.
+		 */
+		if (R->sp == 0 && R->cache && !memchr(R->resconf->lookup, 'c', sizeof R->resconf->lookup))
+			dgoto(R->sp, DNS_R_CACHE);
+
 		if (R->sp == 0)
 			dgoto(R->sp, DNS_R_SWITCH);
 
@@ -7358,8 +7406,11 @@ exec:
 				if (!dns_p_setptr(&F->answer, dns_hosts_query(R->hosts, F->query, &error)))
 					goto error;
 
-				if (dns_p_count(F->answer, DNS_S_AN) > 0)
+				if (dns_p_count(F->answer, DNS_S_AN) > 0) {
+					R->local = 1;
+
 					dgoto(R->sp, DNS_R_FINISH);
+				}
 
 				dns_p_setptr(&F->answer, NULL);
 			}
@@ -7369,19 +7420,71 @@ exec:
 	case DNS_R_CACHE:
 		error = 0;
 
-		if (!F->query && (error = dns_q_make(&F->query, R->qname, R->qtype, R->qclass, F->qflags)))
-			goto error;
+		if (R->sp > 0) {
+			if (!F->query && (error = dns_q_make(&F->query, R->qname, R->qtype, R->qclass, F->qflags)))
+				goto error;
+
+			if (dns_p_setptr(&F->answer, R->cache->query(F->query, R->cache, &error))) {
+				if (dns_res_cached(F->answer))
+					dgoto(R->sp, DNS_R_FINISH);
+
+				dns_p_setptr(&F->answer, NULL);
+
+				dgoto(R->sp, DNS_R_SWITCH);
+			} else if (error)
+				goto error;
+
+			F->state++;
+
+			goto submit;
+		}
+
+		/*
+		 * Entries are keyed by the expanded name, so walk the
+		 * search list as DNS_R_SEARCH would. A negative answer
+		 * moves a stub resolver on to the next candidate, keeping
+		 * the first as in DNS_R_QUERY_A; a miss anywhere is a miss.
+		 */
+		R->search = 0;
+
+		while ((len = dns_resconf_search(u.name, sizeof u.name, R->qname, R->qlen, R->resconf, &R->search))) {
+			if ((error = dns_q_make2(&F->query, u.name, len, R->qtype, R->qclass, F->qflags)))
+				goto error;
+
+			if (!dns_p_setptr(&F->answer, R->cache->query(F->query, R->cache, &error))) {
+				if (error)
+					goto error;
+
+				break;
+			}
+
+			if (!dns_res_cached(F->answer)) {
+				dns_p_setptr(&F->answer, NULL);
+
+				dgoto(R->sp, DNS_R_SWITCH);
+			}
+
+			if (dns_p_count(F->answer, DNS_S_AN) > 0 || R->resconf->options.recurse) {
+				R->local = 1;
 
-		if (dns_p_setptr(&F->answer, R->cache->query(F->query, R->cache, &error))) {
-			if (dns_p_count(F->answer, DNS_S_AN) > 0)
 				dgoto(R->sp, DNS_R_FINISH);
+			}
 
-			dns_p_setptr(&F->answer, NULL);
+			if (!R->nodata)
+				dns_p_movptr(&R->nodata, &F->answer);
+			else
+				dns_p_setptr(&F->answer, NULL);
+		}
 
-			dgoto(R->sp, DNS_R_SWITCH);
-		} else if (error)
-			goto error;
+		if (!len && R->nodata) {
+			dns_p_movptr(&F->answer, &R->nodata);
+			R->local = 1;
+
+			dgoto(R->sp, DNS_R_FINISH);
+		}
 
+		F->state++;
+submit:
 		F->state++;
 	case DNS_R_SUBMIT:
 		if ((error = R->cache->submit(F->query, R->cache)))
@@ -7397,8 +7500,11 @@ exec:
 		error = 0;
 
 		if (dns_p_setptr(&F->answer, R->cache->fetch(R->cache, &error))) {
-			if (dns_p_count(F->answer, DNS_S_AN) > 0)
+			if (dns_res_cached(F->answer)) {
+				R->local |= (R->sp == 0);
+
 				dgoto(R->sp, DNS_R_FINISH);
+			}
 
 			dns_p_setptr(&F->answer, NULL);
 
@@ -7584,6 +7690,10 @@ exec:
 		 * options.recurse. See DNS_R_BIND.
 		 */
 		if (!R->resconf->options.recurse) {
+			/* remember why this candidate failed; see DNS_R_CACHE */
+			if (R->sp == 0 && R->cache && dns_res_cached(F->answer))
+				dns_res_offer(R, F->answer);
+
 			/* Make first answer our tentative answer */
 			if (!R->nodata)
 				dns_p_movptr(&R->nodata, &F->answer);
@@ -7738,6 +7848,9 @@ exec:
 		if (R->sp > 0)
 			dgoto(--R->sp, F[-1].state);
 
+		if (R->cache && !R->local)
+			dns_res_offer(R, F->answer);
+
 		break;
 	case DNS_R_SERVFAIL:
 		if (!dns_p_setptr(&F->answer, dns_p_make(DNS_P_QBUFSIZ, &error)))
@@ -1028,6 +1028,9 @@ struct dns_cache {
 	short (*events)(struct dns_cache *);
 	void (*clear)(struct dns_cache *);
 
+	/* offered answers the resolver obtained elsewhere; query, answer */
+	int (*insert)(struct dns_packet *, struct dns_packet *, struct dns_cache *);
+
 	union {
 		long i;
 		void *p;
@@ -343,13 +343,40 @@ FIFO_NOTUSED static size_t fifo_slice(struct fifo *fifo, struct iovec *iov, size
 	if (fifo->head + p < fifo->size && fifo->head + pe > fifo->size)
 		fifo_realign(fifo);
 
-	iov->iov_base = &fifo->base[((fifo->head + p) % fifo->size)];
+	iov->iov_base = (fifo->size)? &fifo->base[((fifo->head + p) % fifo->size)] : fifo->base;
 	iov->iov_len  = count;
 
 	return count;
 } /* fifo_slice() */
 
 
+/*
+ * Like fifo_slice(fifo, iov, 0, count) but never realigns. Wrapped data
+ * is described by two vectors. Returns the number of vectors used.
+ */
+FIFO_NOTUSED static int fifo_rvecs(struct fifo *fifo, struct iovec iov[2], size_t count) {
+	size_t n;
+
+	count = FIFO_MIN(count, fifo->count);
+
+	if (!count)
+		return 0;
+
+	n = FIFO_MIN(count, fifo->size - fifo->head);
+
+	iov[0].iov_base = &fifo->base[fifo->head];
+	iov[0].iov_len  = n;
+
+	if (n == count)
+		return 1;
+
+	iov[1].iov_base = fifo->base;
+	iov[1].iov_len  = count - n;
+
+	return 2;
+} /* fifo_rvecs() */
+
+
 static size_t fifo_tvec(struct fifo *fifo, struct iovec *iov, int ch) {
 	unsigned char *p;
 
@@ -407,7 +434,7 @@ static int fifo_wbuf(struct fifo *fifo, struct iovec *iov, size_t size) {
 
 static inline size_t fifo_discard(struct fifo *fifo, size_t count) {
 	count       = FIFO_MIN(count, fifo->count);
-	fifo->head  = (fifo->head + count) % fifo->size;
+	fifo->head  = (fifo->size)? (fifo->head + count) % fifo->size : 0;
 	fifo->count -= count;
 #if FIFO_AUTOALIGN
 	if (!fifo->count)
@@ -426,7 +453,7 @@ static inline size_t fifo_update(struct fifo *fifo, size_t count) {
 
 static inline size_t fifo_rewind(struct fifo *fifo, size_t count) {
 	count       = FIFO_MIN(count, fifo->size - fifo->count);
-	fifo->head  = (fifo->head + (fifo->size - count)) % fifo->size;
+	fifo->head  = (fifo->size)? (fifo->head + (fifo->size - count)) % fifo->size : 0;
 	fifo->count += count;
 	return count;
 } /* fifo_rewind() */
@@ -0,0 +1,350 @@
+/* ==========================================================================
+ * memscan.h - Vectorized byte scanning kernels.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#ifndef MEMSCAN_H
+#define MEMSCAN_H
+
+#include <stddef.h>	/* NULL size_t */
+#include <string.h>	/* memchr(3) memcmp(3) */
+
+
+/*
+ * Each kernel set provides
+ *
+ *   rchr - like memrchr(3), which isn't portable
+ *   mem  - like memmem(3), using a first/last byte filter so that
+ *          candidate positions are found a vector at a time
+ *
+ * memscan_best() returns the fastest set supported by the running CPU.
+ * memscan_list() returns every set compiled in and supported, scalar
+ * first, so they can be checked against each other.
+ *
+ * Vector kernels handle whole vectors with compares and a bit mask of
+ * matches, and hand whatever is left over to the scalar kernel.
+ *
+ * SSE2 and NEON are architecture baselines on x86-64 and AArch64 and are
+ * used unconditionally there. AVX2 is compiled with a target attribute
+ * and only selected after CPU detection. Define MEMSCAN_NOSIMD to build
+ * the scalar kernels only.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#if !defined MEMSCAN_NOSIMD && defined __SSE2__
+#define MEMSCAN_HAVE_SSE2 1
+#else
+#define MEMSCAN_HAVE_SSE2 0
+#endif
+
+#if MEMSCAN_HAVE_SSE2 && (defined __x86_64__ || defined __i386__) && (defined __clang__ || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define MEMSCAN_HAVE_AVX2 1
+#else
+#define MEMSCAN_HAVE_AVX2 0
+#endif
+
+#if !defined MEMSCAN_NOSIMD && defined __aarch64__ && defined __ARM_NEON
+#define MEMSCAN_HAVE_NEON 1
+#else
+#define MEMSCAN_HAVE_NEON 0
+#endif
+
+#if MEMSCAN_HAVE_AVX2
+#include <immintrin.h>
+#elif MEMSCAN_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if MEMSCAN_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+struct memscan {
+	const char *name;
+	const void *(*rchr)(const void *, int, size_t);
+	const void *(*mem)(const void *, size_t, const void *, size_t);
+}; /* struct memscan */
+
+
+/*
+ * S C A L A R  K E R N E L S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static const void *memscan_rchr_scalar(const void *src, int ch, size_t len) {
+	const unsigned char *p = (const unsigned char *)src + len;
+
+	while (p > (const unsigned char *)src) {
+		if (*--p == (unsigned char)ch)
+			return p;
+	}
+
+	return NULL;
+} /* memscan_rchr_scalar() */
+
+static const void *memscan_mem_scalar(const void *src, size_t len, const void *sub, size_t sublen) {
+	const unsigned char *p = src, *pe;
+
+	if (!sublen)
+		return src;
+
+	if (len < sublen)
+		return NULL;
+
+	pe = p + (len - sublen);
+
+	for (; p <= pe && (p = memchr(p, *(const unsigned char *)sub, pe - p + 1)); p++) {
+		if (!memcmp(p + 1, (const unsigned char *)sub + 1, sublen - 1))
+			return p;
+	}
+
+	return NULL;
+} /* memscan_mem_scalar() */
+
+static const struct memscan memscan_scalar = {
+	"scalar", &memscan_rchr_scalar, &memscan_mem_scalar,
+};
+
+
+/*
+ * S S E 2  K E R N E L S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#if MEMSCAN_HAVE_SSE2
+
+static const void *memscan_rchr_sse2(const void *src, int ch, size_t len) {
+	const unsigned char *p = src;
+	const __m128i c = _mm_set1_epi8((char)ch);
+	size_t n = len;
+	unsigned mask;
+
+	while (n >= 16) {
+		n -= 16;
+
+		if ((mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + n)), c))))
+			return p + n + (31 - __builtin_clz(mask));
+	}
+
+	return memscan_rchr_scalar(p, ch, n);
+} /* memscan_rchr_sse2() */
+
+static const void *memscan_mem_sse2(const void *src, size_t len, const void *sub, size_t sublen) {
+	const unsigned char *p = src, *s = sub;
+	__m128i first, last;
+	size_t i = 0;
+	unsigned mask;
+
+	if (sublen < 2 || len < sublen)
+		return memscan_mem_scalar(src, len, sub, sublen);
+
+	first = _mm_set1_epi8((char)s[0]);
+	last = _mm_set1_epi8((char)s[sublen - 1]);
+
+	for (; i + sublen - 1 + 16 <= len; i += 16) {
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), first);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + sublen - 1)), last);
+
+		for (mask = _mm_movemask_epi8(_mm_and_si128(a, b)); mask; mask &= mask - 1) {
+			size_t j = i + __builtin_ctz(mask);
+
+			if (!memcmp(p + j + 1, s + 1, sublen - 2))
+				return p + j;
+		}
+	}
+
+	return memscan_mem_scalar(p + i, len - i, sub, sublen);
+} /* memscan_mem_sse2() */
+
+static const struct memscan memscan_sse2 = {
+	"sse2", &memscan_rchr_sse2, &memscan_mem_sse2,
+};
+
+#endif /* MEMSCAN_HAVE_SSE2 */
+
+
+/*
+ * A V X 2  K E R N E L S
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#if MEMSCAN_HAVE_AVX2
+
+__attribute__((target("avx2")))
+static const void *memscan_rchr_avx2(const void *src, int ch, size_t len) {
+	const unsigned char *p = src;
+	const __m256i c = _mm256_set1_epi8((char)ch);
+	size_t n = len;
+	unsigned mask;
+
+	while (n >= 32) {
+		n -= 32;
+
+		if ((mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + n)), c))))
+			return p + n + (31 - __builtin_clz(mask));
+	}
+
+	return memscan_rchr_sse2(p, ch, n);
+} /* memscan_rchr_avx2() */
+
+__attribute__((target("avx2")))
+static const void *memscan_mem_avx2(const void *src, size_t len, const void *sub, size_t sublen) {
+	const unsigned char *p = src, *s = sub;
+	__m256i first, last;
+	size_t i = 0;
+	unsigned mask;
+
+	if (sublen < 2 || len < sublen)
+		return memscan_mem_scalar(src, len, sub, sublen);
+
+	first = _mm256_set1_epi8((char)s[0]);
+	last = _mm256_set1_epi8((char)s[sublen - 1]);
+
+	for (; i + sublen - 1 + 32 <= len; i += 32) {
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), first);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + sublen - 1)), last);
+
+		for (mask = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(a, b)); mask; mask &= mask - 1) {
+			size_t j = i + __builtin_ctz(mask);
+
+			if (!memcmp(p + j + 1, s + 1, sublen - 2))
+				return p + j;
+		}
+	}
+
+	return memscan_mem_scalar(p + i, len - i, sub, sublen);
+} /* memscan_mem_avx2() */
+
+static const struct memscan memscan_avx2 = {
+	"avx2", &memscan_rchr_avx2, &memscan_mem_avx2,
+};
+
+#endif /* MEMSCAN_HAVE_AVX2 */
+
+
+/*
+ * N E O N  K E R N E L S
+ *
+ * NEON has no movemask, so a block is tested with a horizontal max and
+ * only blocks with a hit are searched byte by byte.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#if MEMSCAN_HAVE_NEON
+
+static const void *memscan_rchr_neon(const void *src, int ch, size_t len) {
+	const unsigned char *p = src;
+	const uint8x16_t c = vdupq_n_u8((uint8_t)ch);
+	size_t n = len;
+
+	while (n >= 16) {
+		n -= 16;
+
+		if (vmaxvq_u8(vceqq_u8(vld1q_u8(p + n), c)))
+			return memscan_rchr_scalar(p + n, ch, 16);
+	}
+
+	return memscan_rchr_scalar(p, ch, n);
+} /* memscan_rchr_neon() */
+
+static const void *memscan_mem_neon(const void *src, size_t len, const void *sub, size_t sublen) {
+	const unsigned char *p = src, *s = sub;
+	uint8x16_t first, last;
+	size_t i = 0, j;
+
+	if (sublen < 2 || len < sublen)
+		return memscan_mem_scalar(src, len, sub, sublen);
+
+	first = vdupq_n_u8(s[0]);
+	last = vdupq_n_u8(s[sublen - 1]);
+
+	for (; i + sublen - 1 + 16 <= len; i += 16) {
+		uint8x16_t a = vceqq_u8(vld1q_u8(p + i), first);
+		uint8x16_t b = vceqq_u8(vld1q_u8(p + i + sublen - 1), last);
+
+		if (!vmaxvq_u8(vandq_u8(a, b)))
+			continue;
+
+		for (j = i; j < i + 16; j++) {
+			if (p[j] == s[0] && p[j + sublen - 1] == s[sublen - 1] && !memcmp(p + j + 1, s + 1, sublen - 2))
+				return p + j;
+		}
+	}
+
+	return memscan_mem_scalar(p + i, len - i, sub, sublen);
+} /* memscan_mem_neon() */
+
+static const struct memscan memscan_neon = {
+	"neon", &memscan_rchr_neon, &memscan_mem_neon,
+};
+
+#endif /* MEMSCAN_HAVE_NEON */
+
+
+/*
+ * K E R N E L  S E L E C T I O N
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+static inline _Bool memscan_hasavx2(void) {
+#if MEMSCAN_HAVE_AVX2
+	__builtin_cpu_init();
+
+	return !!__builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+} /* memscan_hasavx2() */
+
+static inline const struct memscan *memscan_best(void) {
+#if MEMSCAN_HAVE_AVX2
+	if (memscan_hasavx2())
+		return &memscan_avx2;
+#endif
+#if MEMSCAN_HAVE_SSE2
+	return &memscan_sse2;
+#elif MEMSCAN_HAVE_NEON
+	return &memscan_neon;
+#else
+	return &memscan_scalar;
+#endif
+} /* memscan_best() */
+
+/* fills list with up to 4 kernel sets; returns the count */
+static inline int memscan_list(const struct memscan *list[4]) {
+	int n = 0;
+
+	list[n++] = &memscan_scalar;
+#if MEMSCAN_HAVE_SSE2
+	list[n++] = &memscan_sse2;
+#endif
+#if MEMSCAN_HAVE_AVX2
+	if (memscan_hasavx2())
+		list[n++] = &memscan_avx2;
+#endif
+#if MEMSCAN_HAVE_NEON
+	list[n++] = &memscan_neon;
+#endif
+
+	return n;
+} /* memscan_list() */
+
+#endif /* MEMSCAN_H */
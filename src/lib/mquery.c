@@ -0,0 +1,568 @@
+/* ==========================================================================
+ * mquery.c - Many DNS stub queries over one UDP socket.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#include "config.h"
+
+#include <stddef.h>	/* offsetof size_t */
+#include <stdlib.h>	/* calloc(3) free(3) */
+#include <string.h>	/* memcmp(3) memset(3) strlen(3) */
+#include <strings.h>	/* strcasecmp(3) */
+#include <errno.h>	/* EAGAIN EINTR EINVAL ENOBUFS ENOMEM ETIMEDOUT EWOULDBLOCK */
+#include <time.h>	/* CLOCK_MONOTONIC clock_gettime(2) */
+
+#include <sys/queue.h>	/* TAILQ_* */
+#include <sys/types.h>	/* ssize_t */
+#include <sys/socket.h>	/* AF_INET AF_INET6 SOCK_DGRAM socket(2) sendto(2) recvfrom(2) */
+#include <netinet/in.h>	/* struct sockaddr_in struct sockaddr_in6 */
+#include <unistd.h>	/* close(2) */
+#include <fcntl.h>	/* F_GETFD F_SETFD F_GETFL F_SETFL FD_CLOEXEC O_NONBLOCK fcntl(2) */
+#include <poll.h>	/* POLLIN POLLOUT */
+
+#include "mquery.h"
+#include "llrb.h"
+
+
+#define MQ_MAXUDP 4096 /* EDNS0 payload size we advertise and accept */
+
+#define MQ_MIN(a, b) (((a) < (b))? (a) : (b))
+#define MQ_MAX(a, b) (((a) > (b))? (a) : (b))
+
+#define countof(a) (sizeof (a) / sizeof *(a))
+
+
+struct mq_query {
+	unsigned long tag;
+	unsigned short qid;
+	unsigned tries;
+	double deadline;
+	int error;
+
+	struct dns_packet *query, *answer;
+
+	enum dns_type qtype;
+	enum dns_class qclass;
+	size_t qlen;
+	char qname[DNS_D_MAXNAME + 1];
+
+	LLRB_ENTRY(mq_query) rbe; /* outstanding, by qid */
+	TAILQ_ENTRY(mq_query) tqe;
+	struct mq_list *list;
+}; /* struct mq_query */
+
+TAILQ_HEAD(mq_list, mq_query);
+
+static inline int mq_qidcmp(const struct mq_query *a, const struct mq_query *b)
+	{ return (int)a->qid - (int)b->qid; }
+
+
+struct mquery {
+	int fd;
+	struct dns_options opts;
+	unsigned window;
+
+	struct sockaddr_storage ns[countof(((struct dns_resolv_conf *)0)->nameserver)];
+	unsigned nscount;
+	double timeout;
+	unsigned attempts;
+	int qflags;
+
+	struct dns_cache *cache;
+
+	LLRB_HEAD(mq_qids, mq_query) qids;
+
+	struct mq_list queued;   /* not yet (re)sent */
+	struct mq_list inflight; /* by deadline */
+	struct mq_list done;     /* answered or failed */
+	unsigned ninflight, count;
+
+	_Bool blocked; /* last send would block */
+
+	struct dns_packet *scratch; /* receive buffer */
+}; /* struct mquery */
+
+
+LLRB_GENERATE_STATIC(mq_qids, mq_query, rbe, mq_qidcmp)
+
+
+#define MQ_Q_RD    0x1
+#define MQ_Q_EDNS0 0x2
+
+static double mq_now(void) {
+	struct timespec ts;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return ts.tv_sec + (ts.tv_nsec / 1000000000.0);
+} /* mq_now() */
+
+
+static socklen_t mq_salen(const struct sockaddr_storage *ss) {
+	return (ss->ss_family == AF_INET6)? sizeof (struct sockaddr_in6) : sizeof (struct sockaddr_in);
+} /* mq_salen() */
+
+
+static _Bool mq_isns(struct mquery *mq, const struct sockaddr_storage *from) {
+	unsigned i;
+
+	for (i = 0; i < mq->nscount; i++) {
+		const struct sockaddr_storage *ns = &mq->ns[i];
+
+		if (ns->ss_family != from->ss_family)
+			continue;
+
+		if (ns->ss_family == AF_INET) {
+			const struct sockaddr_in *a = (const void *)ns, *b = (const void *)from;
+
+			if (a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr)
+				return 1;
+		} else {
+			const struct sockaddr_in6 *a = (const void *)ns, *b = (const void *)from;
+
+			if (a->sin6_port == b->sin6_port && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof a->sin6_addr))
+				return 1;
+		}
+	}
+
+	return 0;
+} /* mq_isns() */
+
+
+static void mq_free(struct mq_query *q) {
+	free(q->query);
+	free(q->answer);
+	free(q);
+} /* mq_free() */
+
+
+static void mq_move(struct mquery *mq, struct mq_query *q, struct mq_list *list, _Bool head) {
+	if (q->list) {
+		TAILQ_REMOVE(q->list, q, tqe);
+		mq->ninflight -= (q->list == &mq->inflight);
+	}
+
+	if (head)
+		TAILQ_INSERT_HEAD(list, q, tqe);
+	else
+		TAILQ_INSERT_TAIL(list, q, tqe);
+
+	mq->ninflight += (list == &mq->inflight);
+	q->list = list;
+} /* mq_move() */
+
+
+static void mq_finish(struct mquery *mq, struct mq_query *q, struct dns_packet *answer, int error) {
+	LLRB_REMOVE(mq_qids, &mq->qids, q);
+
+	q->answer = answer;
+	q->error = error;
+	mq_move(mq, q, &mq->done, 0);
+} /* mq_finish() */
+
+
+struct mquery *mq_open(struct dns_resolv_conf *resconf, struct dns_cache *cache, const struct mq_options *opts, const struct dns_options *dopts, int *_error) {
+	struct mquery *mq;
+	unsigned i;
+	int flags, error;
+
+	if (!(mq = calloc(1, sizeof *mq)))
+		goto syerr;
+
+	mq->fd = -1;
+	mq->opts = *dopts;
+	mq->window = (opts->window)? opts->window : 1;
+
+	LLRB_INIT(&mq->qids);
+	TAILQ_INIT(&mq->queued);
+	TAILQ_INIT(&mq->inflight);
+	TAILQ_INIT(&mq->done);
+
+	/* one socket, so only nameservers of the first one's family */
+	for (i = 0; i < countof(resconf->nameserver); i++) {
+		int af = resconf->nameserver[i].ss_family;
+
+		if (af != AF_INET && af != AF_INET6)
+			continue;
+		if (mq->nscount && af != mq->ns[0].ss_family)
+			continue;
+
+		mq->ns[mq->nscount++] = resconf->nameserver[i];
+	}
+
+	if (!mq->nscount) {
+		error = EINVAL;
+		goto error;
+	}
+
+	mq->timeout = (resconf->options.timeout)? resconf->options.timeout : 1;
+	mq->attempts = ((resconf->options.attempts)? resconf->options.attempts : 1) * mq->nscount;
+
+	if (!resconf->options.recurse)
+		mq->qflags |= MQ_Q_RD;
+	if (resconf->options.edns0)
+		mq->qflags |= MQ_Q_EDNS0;
+
+	if (!(mq->scratch = dns_p_make(MQ_MAXUDP, &error)))
+		goto error;
+
+	if (-1 == (mq->fd = socket(mq->ns[0].ss_family, SOCK_DGRAM, 0)))
+		goto syerr;
+
+	if (-1 == (flags = fcntl(mq->fd, F_GETFD)) || -1 == fcntl(mq->fd, F_SETFD, flags|FD_CLOEXEC))
+		goto syerr;
+
+	if (-1 == (flags = fcntl(mq->fd, F_GETFL)) || -1 == fcntl(mq->fd, F_SETFL, flags|O_NONBLOCK))
+		goto syerr;
+
+	if (cache) {
+		cache->acquire(cache);
+		mq->cache = cache;
+	}
+
+	return mq;
+syerr:
+	error = errno;
+error:
+	*_error = error;
+
+	mq_close(mq);
+
+	return NULL;
+} /* mq_open() */
+
+
+void mq_close(struct mquery *mq) {
+	struct mq_list *list[3];
+	struct mq_query *q;
+	unsigned i;
+
+	if (!mq)
+		return;
+
+	list[0] = &mq->queued;
+	list[1] = &mq->inflight;
+	list[2] = &mq->done;
+
+	for (i = 0; i < countof(list); i++) {
+		while ((q = TAILQ_FIRST(list[i]))) {
+			TAILQ_REMOVE(list[i], q, tqe);
+			mq_free(q);
+		}
+	}
+
+	if (mq->fd != -1) {
+		if (mq->opts.closefd.cb)
+			mq->opts.closefd.cb(&mq->fd, mq->opts.closefd.arg);
+
+		if (mq->fd != -1)
+			close(mq->fd);
+	}
+
+	dns_cache_close(mq->cache);
+	free(mq->scratch);
+	free(mq);
+} /* mq_close() */
+
+
+static int mq_query(struct mquery *mq, struct mq_query *q) {
+	int error;
+
+	if (!(q->query = dns_p_make(DNS_P_QBUFSIZ, &error)))
+		return error;
+
+	if ((error = dns_p_push(q->query, DNS_S_QD, q->qname, q->qlen, q->qtype, q->qclass, 0, 0)))
+		return error;
+
+	dns_header(q->query)->rd = !!(mq->qflags & MQ_Q_RD);
+
+	if (mq->qflags & MQ_Q_EDNS0) {
+		struct dns_opt opt = DNS_OPT_INIT(&opt);
+
+		opt.version = 0; /* RFC 6891 version */
+		opt.maxudp = MQ_MAXUDP;
+
+		if ((error = dns_p_push(q->query, DNS_S_AR, ".", 1, DNS_T_OPT, dns_opt_class(&opt), dns_opt_ttl(&opt), &opt)))
+			return error;
+	}
+
+	return 0;
+} /* mq_query() */
+
+
+int mq_submit(struct mquery *mq, const char *name, enum dns_type type, enum dns_class class, unsigned long tag) {
+	struct mq_query *q;
+	struct dns_packet *answer;
+	int error;
+
+	/* every outstanding query needs its own ID */
+	if (mq->count > 0xffff)
+		return ENOBUFS;
+
+	if (!(q = calloc(1, sizeof *q)))
+		return errno;
+
+	q->tag = tag;
+	q->qtype = type;
+	q->qclass = class;
+
+	if (!(q->qlen = dns_d_anchor(q->qname, sizeof q->qname, name, strlen(name))) || q->qlen >= sizeof q->qname) {
+		error = DNS_EILLEGAL;
+		goto error;
+	}
+
+	if ((error = mq_query(mq, q)))
+		goto error;
+
+	/* a random ID no other outstanding query is using */
+	do {
+		q->qid = dns_header(q->query)->qid = 0xffff & dns_random();
+	} while (LLRB_INSERT(mq_qids, &mq->qids, q));
+
+	mq_move(mq, q, &mq->queued, 0);
+	mq->count++;
+
+	if (mq->cache && (answer = mq->cache->query(q->query, mq->cache, &error)))
+		mq_finish(mq, q, answer, 0);
+
+	return 0;
+error:
+	mq_free(q);
+
+	return error;
+} /* mq_submit() */
+
+
+/* same checks as dns_so_verify */
+static _Bool mq_verify(struct mq_query *q, struct dns_packet *P) {
+	char qname[DNS_D_MAXNAME + 1];
+	struct dns_rr rr;
+	size_t qlen;
+	int error;
+
+	if (!dns_header(P)->qr || !dns_p_count(P, DNS_S_QD))
+		return 0;
+
+	if (0 != dns_rr_parse(&rr, 12, P))
+		return 0;
+
+	if (rr.type != q->qtype || rr.class != q->qclass)
+		return 0;
+
+	if (!(qlen = dns_d_expand(qname, sizeof qname, rr.dn.p, P, &error)) || qlen != q->qlen)
+		return 0;
+
+	return 0 == strcasecmp(qname, q->qname);
+} /* mq_verify() */
+
+
+static int mq_recv(struct mquery *mq) {
+	struct sockaddr_storage from;
+	socklen_t fromlen;
+	struct dns_packet *P = mq->scratch, *answer;
+	struct mq_query key, *q;
+	ssize_t n;
+	int error;
+
+	for (;;) {
+		fromlen = sizeof from;
+		memset(&from, 0, sizeof from);
+
+		if (-1 == (n = recvfrom(mq->fd, P->data, P->size, 0, (struct sockaddr *)&from, &fromlen))) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
+				return 0;
+			case ECONNREFUSED:
+				/* FALL THROUGH */
+			case EHOSTUNREACH:
+				/* FALL THROUGH */
+			case ENETUNREACH:
+				continue; /* ICMP for an earlier send; let it time out */
+			default:
+				return errno;
+			}
+		}
+
+		if (n < 12 || !mq_isns(mq, &from))
+			continue;
+
+		P->end = n;
+		key.qid = dns_header(P)->qid;
+
+		if (!(q = LLRB_FIND(mq_qids, &mq->qids, &key)) || !mq_verify(q, P))
+			continue;
+
+		if (!(answer = dns_p_make(P->end, &error)))
+			return error;
+
+		dns_p_copy(answer, P);
+
+		if ((error = dns_p_study(answer))) {
+			free(answer);
+
+			continue;
+		}
+
+		if (mq->cache && !dns_header(answer)->tc)
+			(void)mq->cache->insert(q->query, answer, mq->cache);
+
+		mq_finish(mq, q, answer, 0);
+	}
+} /* mq_recv() */
+
+
+static void mq_expire(struct mquery *mq, double now) {
+	struct mq_query *q;
+
+	while ((q = TAILQ_FIRST(&mq->inflight)) && q->deadline <= now) {
+		if (q->tries < mq->attempts) {
+			/* retransmit, keeping the ID so a late reply still counts */
+			mq_move(mq, q, &mq->queued, 1);
+		} else {
+			mq_finish(mq, q, NULL, ETIMEDOUT);
+		}
+	}
+} /* mq_expire() */
+
+
+static int mq_send(struct mquery *mq, double now) {
+	struct mq_query *q;
+	const struct sockaddr_storage *ns;
+
+	mq->blocked = 0;
+
+	while (mq->ninflight < mq->window && (q = TAILQ_FIRST(&mq->queued))) {
+		ns = &mq->ns[q->tries % mq->nscount];
+
+		if (-1 == sendto(mq->fd, q->query->data, q->query->end, 0, (const struct sockaddr *)ns, mq_salen(ns))) {
+			switch (errno) {
+			case EINTR:
+				continue;
+			case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+			case EWOULDBLOCK:
+#endif
+				/* FALL THROUGH */
+			case ENOBUFS:
+				mq->blocked = 1;
+
+				return 0;
+			default:
+				mq_finish(mq, q, NULL, errno);
+
+				continue;
+			}
+		}
+
+		q->tries++;
+		q->deadline = now + mq->timeout;
+		mq_move(mq, q, &mq->inflight, 0);
+	}
+
+	return 0;
+} /* mq_send() */
+
+
+int mq_step(struct mquery *mq) {
+	double now;
+	int error;
+
+	if ((error = mq_recv(mq)))
+		return error;
+
+	now = mq_now();
+	mq_expire(mq, now);
+
+	return mq_send(mq, now);
+} /* mq_step() */
+
+
+size_t mq_peek(struct mquery *mq) {
+	struct mq_query *q;
+
+	if (!(q = TAILQ_FIRST(&mq->done)) || !q->answer)
+		return 0;
+
+	return dns_p_sizeof(q->answer);
+} /* mq_peek() */
+
+
+int mq_fetch(struct mquery *mq, struct dns_packet **answer, unsigned long *tag) {
+	struct mq_query *q;
+	int error;
+
+	if (!(q = TAILQ_FIRST(&mq->done)))
+		return EAGAIN;
+
+	TAILQ_REMOVE(&mq->done, q, tqe);
+	mq->count--;
+
+	*tag = q->tag;
+	*answer = q->answer;
+	q->answer = NULL;
+	error = q->error;
+
+	mq_free(q);
+
+	return error;
+} /* mq_fetch() */
+
+
+unsigned mq_count(struct mquery *mq) {
+	return mq->count;
+} /* mq_count() */
+
+
+int mq_pollfd(struct mquery *mq) {
+	return mq->fd;
+} /* mq_pollfd() */
+
+
+short mq_events(struct mquery *mq) {
+	short events = 0;
+
+	if (mq->ninflight)
+		events |= POLLIN;
+	if (mq->blocked)
+		events |= POLLOUT;
+
+	return events;
+} /* mq_events() */
+
+
+double mq_timeout(struct mquery *mq) {
+	struct mq_query *q;
+
+	if (!TAILQ_EMPTY(&mq->done))
+		return 0;
+	if (!TAILQ_EMPTY(&mq->queued) && !mq->blocked && mq->ninflight < mq->window)
+		return 0;
+	if ((q = TAILQ_FIRST(&mq->inflight)))
+		return MQ_MIN(mq->timeout, MQ_MAX(0, q->deadline - mq_now()));
+
+	return -1;
+} /* mq_timeout() */
@@ -0,0 +1,75 @@
+/* ==========================================================================
+ * mquery.h - Many DNS stub queries over one UDP socket.
+ * --------------------------------------------------------------------------
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to permit
+ * persons to whom the Software is furnished to do so, subject to the
+ * following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN
+ * NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR
+ * OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE
+ * USE OR OTHER DEALINGS IN THE SOFTWARE.
+ * ==========================================================================
+ */
+#ifndef MQUERY_H
+#define MQUERY_H
+
+#include "dns.h"
+
+
+/*
+ * Stub queries sent to the resolv.conf nameservers over a single UDP
+ * socket, up to .window at a time. Each query gets a random ID unique
+ * among those outstanding, and replies are matched by ID, source
+ * address and question, in whatever order they arrive. Unanswered
+ * queries are retransmitted every resolv.conf timeout, rotating through
+ * the nameservers, until attempts run out.
+ *
+ * Names are queried as given, anchored to the root; there's no search
+ * list, hosts file or TCP. Truncated replies are handed back as-is for
+ * the caller to retry some other way. The answer cache, if any, is
+ * consulted on submit and offered every complete answer.
+ */
+
+struct mq_options {
+	unsigned window; /* maximum queries awaiting a reply */
+}; /* struct mq_options */
+
+#define mq_opts(...) (&(struct mq_options){ .window = 256, __VA_ARGS__ })
+
+struct mquery *mq_open(struct dns_resolv_conf *, struct dns_cache *, const struct mq_options *, const struct dns_options *, int *);
+
+void mq_close(struct mquery *);
+
+int mq_submit(struct mquery *, const char *, enum dns_type, enum dns_class, unsigned long);
+
+/* send, receive and retransmit whatever we can without blocking */
+int mq_step(struct mquery *);
+
+/* buffer size for the answer mq_fetch would return next, or 0 if none */
+size_t mq_peek(struct mquery *);
+
+/* 0 and an answer to free(3), EAGAIN if none is ready, or why a query failed */
+int mq_fetch(struct mquery *, struct dns_packet **, unsigned long *);
+
+/* queries submitted and not yet fetched */
+unsigned mq_count(struct mquery *);
+
+int mq_pollfd(struct mquery *);
+
+short mq_events(struct mquery *);
+
+/* seconds until mq_step has work to do, or negative if never */
+double mq_timeout(struct mquery *);
+
+#endif /* MQUERY_H */
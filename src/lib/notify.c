@@ -32,8 +32,10 @@
 #include <string.h>	/* memcpy(3) memchr(3) strcmp(3) */
 #include <strings.h>	/* ffs(3) */
 #include <errno.h>	/* ENAMETOOLONG EINTR EAGAIN EMFILE EISDIR ENOTDIR */
+#include <time.h>	/* CLOCK_MONOTONIC clock_gettime(2) */
 
 #include <sys/queue.h>	/* LIST_* */
+#include <sys/stat.h>	/* struct stat S_ISDIR fstatat(2) */
 #include <unistd.h>	/* close(2) */
 #include <fcntl.h>	/* O_CLOEXEC O_DIRECTORY ... open(2) openat(2) fcntl(2) */
 #include <dirent.h>	/* DIR fdopendir(3) opendir(3) readdir_r(3) closedir(3) */
@@ -182,6 +184,19 @@ const char *notify_strflag(int flag) {
 	LIST_INSERT_HEAD((head), (elm), le); \
 } while (0)
 
+#define NFY_MAX(a, b) (((a) > (b))? (a) : (b))
+
+
+/* monotonic clock in milliseconds */
+static long long nfy_now(void) {
+	struct timespec ts;
+
+	if (0 != clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+} /* nfy_now() */
+
 
 /*
  * F I L E  R O U T I N E S
@@ -403,6 +418,37 @@ static inline int filecmp(const struct file *a, const struct file *b)
 	{ return strcmp(a->name, b->name); }
 
 
+#if ENABLE_INOTIFY
+/* a watched directory of a recursive notifier */
+struct dir {
+	int wd;
+
+	LLRB_ENTRY(dir) rbe;
+	LIST_ENTRY(dir) le; /* awaiting a scan of its entries */
+
+	size_t pathlen;
+	char path[]; /* relative to the notification directory; "" for itself */
+}; /* struct dir */
+
+static inline int dircmp(const struct dir *a, const struct dir *b)
+	{ return (a->wd < b->wd)? -1 : (a->wd > b->wd); }
+
+
+/* changes to one path, coalesced until delivered */
+struct change {
+	int changes;
+
+	LLRB_ENTRY(change) rbe;
+
+	size_t pathlen;
+	char path[];
+}; /* struct change */
+
+static inline int changecmp(const struct change *a, const struct change *b)
+	{ return strcmp(a->path, b->path); }
+#endif
+
+
 struct notify {
 	int fd;
 
@@ -421,8 +467,18 @@ struct notify {
 
 	_Bool dirty;
 
+	int window; /* ms to coalesce changes before delivering them */
+	long long deadline; /* when the current batch may be delivered, or 0 */
+
 #if ENABLE_INOTIFY
 	_Bool critical;
+	_Bool recursive;
+
+	LLRB_HEAD(dirs, dir) dirs;
+	LIST_HEAD(, dir) unscanned;
+
+	LLRB_HEAD(batch, change) batch;
+	struct change *delivered; /* name returned by the last notify_get */
 #endif
 
 #if ENABLE_FEN
@@ -436,6 +492,10 @@ struct notify {
 
 
 LLRB_GENERATE_STATIC(files, file, rbe, filecmp)
+#if ENABLE_INOTIFY
+LLRB_GENERATE_STATIC(dirs, dir, rbe, dircmp)
+LLRB_GENERATE_STATIC(batch, change, rbe, changecmp)
+#endif
 
 
 static struct file *lookup(struct notify *nfy, const char *name, size_t namelen) {
@@ -512,6 +572,287 @@ static void discard(struct notify *nfy, struct file *file) {
 } /* discard() */
 
 
+#if ENABLE_INOTIFY
+#define IN_DIRMASK (IN_ATTRIB|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MODIFY|IN_MOVE|IN_MOVE_SELF|IN_ONLYDIR)
+
+static int decode(int);
+
+/* join a and b with a slash, or return a copy of b if a is empty */
+static char *in_join(const char *a, size_t alen, const char *b, size_t blen, size_t *len) {
+	char *path;
+
+	*len = (alen)? alen + 1 + blen : blen;
+
+	if (!(path = malloc(*len + 1)))
+		return NULL;
+
+	if (alen) {
+		memcpy(path, a, alen);
+		path[alen] = '/';
+	}
+
+	memcpy(&path[*len - blen], b, blen);
+	path[*len] = '\0';
+
+	return path;
+} /* in_join() */
+
+
+static int in_record(struct notify *nfy, const char *path, size_t pathlen, int changes) {
+	struct change *change, *key;
+
+	if (!(changes &= nfy->flags))
+		return 0;
+
+	key = &((union { char pad[offsetof(struct change, path) + NAME_MAX + 1]; struct change change; }){ { 0 } }).change;
+
+	if (pathlen <= NAME_MAX) {
+		memcpy(key->path, path, pathlen);
+		change = LLRB_FIND(batch, &nfy->batch, key);
+	} else {
+		if (!(key = malloc(offsetof(struct change, path) + pathlen + 1)))
+			return errno;
+
+		memcpy(key->path, path, pathlen);
+		key->path[pathlen] = '\0';
+		change = LLRB_FIND(batch, &nfy->batch, key);
+		free(key);
+	}
+
+	if (!change) {
+		if (!(change = calloc(1, offsetof(struct change, path) + pathlen + 1)))
+			return errno;
+
+		memcpy(change->path, path, pathlen);
+		change->pathlen = pathlen;
+		LLRB_INSERT(batch, &nfy->batch, change);
+	}
+
+	change->changes |= changes;
+
+	return 0;
+} /* in_record() */
+
+
+static struct dir *in_lookup(struct notify *nfy, int wd) {
+	struct dir key = { .wd = wd };
+
+	return LLRB_FIND(dirs, &nfy->dirs, &key);
+} /* in_lookup() */
+
+
+static void in_freedir(struct notify *nfy, struct dir *dir) {
+	LLRB_REMOVE(dirs, &nfy->dirs, dir);
+
+	if (dir->le.le_prev)
+		LIST_REMOVE(dir, le);
+
+	free(dir);
+} /* in_freedir() */
+
+
+/* start watching path, relative to the notification directory */
+static int in_adddir(struct notify *nfy, int wd, const char *path, size_t pathlen) {
+	struct dir *dir;
+	char *abspath;
+	size_t abslen;
+	int error;
+
+	if (wd < 0) {
+		if (!(abspath = in_join(nfy->dirpath, nfy->dirlen, path, pathlen, &abslen)))
+			return errno;
+
+		wd = inotify_add_watch(nfy->fd, abspath, IN_DIRMASK|IN_DONT_FOLLOW);
+		error = errno;
+		free(abspath);
+
+		if (wd == -1) {
+			switch (error) {
+			case ENOENT:
+				/* FALL THROUGH */
+			case ENOTDIR:
+				/* FALL THROUGH */
+			case EACCES:
+				/* FALL THROUGH */
+			case ELOOP:
+				return 0; /* gone, or never one of ours */
+			default:
+				return error;
+			}
+		}
+	}
+
+	/* the same directory reached again, e.g. through a rename */
+	if ((dir = in_lookup(nfy, wd)))
+		in_freedir(nfy, dir);
+
+	if (!(dir = calloc(1, offsetof(struct dir, path) + pathlen + 1)))
+		return errno;
+
+	dir->wd = wd;
+	memcpy(dir->path, path, pathlen);
+	dir->pathlen = pathlen;
+
+	LLRB_INSERT(dirs, &nfy->dirs, dir);
+	LIST_INSERT_HEAD(&nfy->unscanned, dir, le);
+
+	return 0;
+} /* in_adddir() */
+
+
+/* stop watching path and everything beneath it */
+static void in_deldir(struct notify *nfy, const char *path, size_t pathlen) {
+	struct dir *dir, *next;
+
+	for (dir = LLRB_MIN(dirs, &nfy->dirs); dir; dir = next) {
+		next = LLRB_NEXT(dirs, &nfy->dirs, dir);
+
+		if (dir->pathlen < pathlen || memcmp(dir->path, path, pathlen))
+			continue;
+		if (dir->pathlen > pathlen && dir->path[pathlen] != '/')
+			continue;
+
+		(void)inotify_rm_watch(nfy->fd, dir->wd);
+		in_freedir(nfy, dir);
+	}
+} /* in_deldir() */
+
+
+/*
+ * Watch the subdirectories of newly added directories. Entries of a
+ * directory which appeared after we opened the notifier are reported
+ * as created, as they may have been created before we watched it.
+ */
+static int in_scan(struct notify *nfy, _Bool report) {
+	struct dir *dir;
+	struct dirent *ent;
+	struct stat st;
+	DIR *dp;
+	char *path;
+	size_t pathlen, namelen;
+	_Bool isdir;
+	int error;
+
+	while ((dir = LIST_FIRST(&nfy->unscanned))) {
+		LIST_REMOVE(dir, le);
+		dir->le.le_prev = NULL;
+
+		if (!(path = in_join(nfy->dirpath, nfy->dirlen, dir->path, dir->pathlen, &pathlen)))
+			return errno;
+
+		dp = opendir(path);
+		free(path);
+
+		if (!dp)
+			continue; /* gone already; IN_IGNORED will clean up */
+
+		while ((ent = readdir(dp))) {
+			if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+				continue;
+
+			namelen = strlen(ent->d_name);
+#if defined DT_DIR
+			if (ent->d_type != DT_UNKNOWN)
+				isdir = (ent->d_type == DT_DIR);
+			else
+#endif
+				isdir = (0 == fstatat(dirfd(dp), ent->d_name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode));
+
+			if (!(path = in_join(dir->path, dir->pathlen, ent->d_name, namelen, &pathlen)))
+				goto syerr;
+
+			error = (report)? in_record(nfy, path, pathlen, NOTIFY_CREATE) : 0;
+
+			if (!error && isdir)
+				error = in_adddir(nfy, -1, path, pathlen);
+
+			free(path);
+
+			if (error)
+				goto error;
+		}
+
+		closedir(dp);
+	}
+
+	return 0;
+syerr:
+	error = errno;
+error:
+	closedir(dp);
+
+	return error;
+} /* in_scan() */
+
+
+static int in_event(struct notify *nfy, const struct inotify_event *msg) {
+	size_t namelen = (msg->len)? strlen(msg->name) : 0;
+	struct dir *dir;
+	char *path;
+	size_t pathlen;
+	int error;
+
+	if (msg->mask & IN_Q_OVERFLOW) {
+		/* events were lost; ask for a rescan */
+		nfy->critical = 1;
+
+		return in_record(nfy, ".", 1, NOTIFY_ALL);
+	}
+
+	if (!(dir = in_lookup(nfy, msg->wd)))
+		return 0; /* watch already dropped by in_deldir */
+
+	if (!namelen) {
+		/* subdirectories are also reported by name from their parent */
+		if (dir->pathlen)
+			goto ignored;
+
+		if (msg->mask & (IN_IGNORED|IN_UNMOUNT))
+			nfy->critical = 1;
+
+		if ((error = in_record(nfy, ".", 1, decode(msg->mask))))
+			return error;
+
+		goto ignored;
+	}
+
+	if (!(path = in_join(dir->path, dir->pathlen, msg->name, namelen, &pathlen)))
+		return errno;
+
+	error = in_record(nfy, path, pathlen, decode(msg->mask));
+
+	if (!error && (msg->mask & IN_ISDIR)) {
+		if (msg->mask & (IN_DELETE|IN_MOVED_FROM))
+			in_deldir(nfy, path, pathlen);
+
+		if ((msg->mask & (IN_CREATE|IN_MOVED_TO)) && !(error = in_adddir(nfy, -1, path, pathlen)))
+			error = in_scan(nfy, 1);
+	}
+
+	free(path);
+
+	return error;
+ignored:
+	if (msg->mask & IN_IGNORED)
+		in_freedir(nfy, dir);
+
+	return 0;
+} /* in_event() */
+
+
+static int in_recurse(struct notify *nfy) {
+	int error;
+
+	nfy->recursive = 1;
+
+	if ((error = in_adddir(nfy, nfy->dirwd, "", 0)))
+		return error;
+
+	return in_scan(nfy, 0);
+} /* in_recurse() */
+#endif
+
+
 struct notify *notify_opendir(const char *dirpath, int flags, int *_error) {
 	struct notify *nfy = NULL;
 	size_t dirlen = strlen(dirpath);
@@ -526,11 +867,18 @@ struct notify *notify_opendir(const char *dirpath, int flags, int *_error) {
 		goto error;
 	}
 
+#if !ENABLE_INOTIFY
+	if (flags & NOTIFY_RECURSE) {
+		error = EOPNOTSUPP;
+		goto error;
+	}
+#endif
+
 	if (!(nfy = calloc(1, offsetof(struct notify, dirpath) + dirlen + padlen)))
 		goto syerr;
 
 	nfy->fd = -1;
-	nfy->flags = flags;
+	nfy->flags = flags & ~NOTIFY_RECURSE;
 
 	nfy->dirfd = -1;
 	nfy->dirwd = -1;
@@ -552,8 +900,11 @@ struct notify *notify_opendir(const char *dirpath, int flags, int *_error) {
 		goto error;
 #endif
 
-	if (-1 == (nfy->dirwd = inotify_add_watch(nfy->fd, nfy->dirpath, IN_ATTRIB|IN_CREATE|IN_DELETE|IN_DELETE_SELF|IN_MODIFY|IN_MOVE|IN_MOVE_SELF|IN_ONLYDIR)))
+	if (-1 == (nfy->dirwd = inotify_add_watch(nfy->fd, nfy->dirpath, IN_DIRMASK)))
 		goto syerr;
+
+	if ((flags & NOTIFY_RECURSE) && (error = in_recurse(nfy)))
+		goto error;
 #elif ENABLE_FEN
 	if (-1 == (nfy->fd = port_create())) {
 		if (errno == EAGAIN)
@@ -608,6 +959,10 @@ error:
 
 void notify_close(struct notify *nfy) {
 	struct file *file, *next;
+#if ENABLE_INOTIFY
+	struct dir *dir;
+	struct change *change;
+#endif
 
 	if (!nfy)
 		return;
@@ -618,6 +973,18 @@ void notify_close(struct notify *nfy) {
 		discard(nfy, file);
 	}
 
+#if ENABLE_INOTIFY
+	while ((dir = LLRB_MIN(dirs, &nfy->dirs)))
+		in_freedir(nfy, dir);
+
+	while ((change = LLRB_MIN(batch, &nfy->batch))) {
+		LLRB_REMOVE(batch, &nfy->batch, change);
+		free(change);
+	}
+
+	free(nfy->delivered);
+#endif
+
 	closefd(&nfy->fd);
 	closefd(&nfy->dirfd);
 
@@ -634,14 +1001,38 @@ int notify_pollfd(struct notify *nfy) {
 } /* notify_pollfd() */
 
 
+/* are there changes waiting for notify_get? */
+static _Bool ready(struct notify *nfy) {
+#if ENABLE_INOTIFY
+	if (!LLRB_EMPTY(&nfy->batch))
+		return 1;
+#endif
+	return nfy->changes || !LIST_EMPTY(&nfy->changed);
+} /* ready() */
+
+
 int notify_timeout(struct notify *nfy) {
-	if (nfy->dirty || !LIST_EMPTY(&nfy->pending) || !LIST_EMPTY(&nfy->changed))
+	if (nfy->dirty || !LIST_EMPTY(&nfy->pending))
+		return 0;
+	else if (nfy->deadline)
+		return (int)NFY_MAX(0, nfy->deadline - nfy_now());
+	else if (!LIST_EMPTY(&nfy->changed))
 		return 0;
 	else
 		return -1;
 } /* notify_timeout() */
 
 
+/*
+ * Hold changes back for up to ms milliseconds after the first one, so
+ * that bursts are delivered together. The kernel queue is still read in
+ * the meantime, and repeated changes to a name are merged.
+ */
+void notify_setwindow(struct notify *nfy, int ms) {
+	nfy->window = NFY_MAX(0, ms);
+} /* notify_setwindow() */
+
+
 static int decode(int flags) {
 #if ENABLE_INOTIFY
 	static const int table[][2] = {
@@ -710,6 +1101,17 @@ static int in_step1(struct notify *nfy) {
 		for (msg = buf, end = in_msgend(buf, len); msg < end; msg = in_msgnxt(msg)) {
 			size_t namelen = strlen(msg->name);
 
+			if (nfy->recursive) {
+				int error;
+
+				if ((error = in_event(nfy, msg)))
+					return error;
+
+				++count;
+
+				continue;
+			}
+
 			if (namelen) {
 				struct file *file;
 
@@ -1052,7 +1454,8 @@ int notify_step(struct notify *nfy, int timeout) {
 	if (nfy->dirty || !LIST_EMPTY(&nfy->pending))
 		goto post;
 
-	if (nfy->changes || !LIST_EMPTY(&nfy->changed))
+	/* while coalescing keep draining the kernel queue */
+	if (!nfy->deadline && ready(nfy))
 		return 0;
 
 	if ((error = NFY_STEP(nfy, timeout)))
@@ -1062,6 +1465,9 @@ post:
 	if ((error = NFY_POST(nfy)))
 		return error;
 
+	if (nfy->window && !nfy->deadline && ready(nfy))
+		nfy->deadline = nfy_now() + nfy->window;
+
 	return 0;
 } /* notify_step() */
 
@@ -1145,8 +1551,29 @@ static int notify_del(struct notify *dir, const char *name) {
 
 int notify_get(struct notify *nfy, const char **name) {
 	struct file *file;
+#if ENABLE_INOTIFY
+	struct change *change;
+#endif
 	int changes;
 
+	if (nfy->deadline && nfy_now() < nfy->deadline)
+		return 0;
+
+#if ENABLE_INOTIFY
+	free(nfy->delivered);
+	nfy->delivered = NULL;
+
+	if ((change = LLRB_MIN(batch, &nfy->batch))) {
+		LLRB_REMOVE(batch, &nfy->batch, change);
+		nfy->delivered = change;
+
+		if (name)
+			*name = change->path;
+
+		return change->changes;
+	}
+#endif
+
 	if ((file = LIST_FIRST(&nfy->changed))) {
 		NFY_LIST_MOVE(&nfy->dormant, file, le);
 
@@ -1169,6 +1596,8 @@ int notify_get(struct notify *nfy, const char **name) {
 		return changes;
 	}
 
+	nfy->deadline = 0;
+
 	return 0;
 } /* notify_get() */
 
@@ -39,6 +39,7 @@
 
 #define NOTIFY_GLOB 0x20
 #define NOTIFY_GREP 0x40
+#define NOTIFY_RECURSE 0x80 /* also watch subdirectories (inotify only) */
 
 
 #define nfy_error_t int
@@ -60,6 +61,8 @@ nfy_error_t notify_add(struct notify *, const char *, nfy_flags_t);
 
 nfy_flags_t notify_get(struct notify *, const char **);
 
+void notify_setwindow(struct notify *, nfy_timeout_t);
+
 
 #define NOTIFY_INOTIFY    0x010000
 #define NOTIFY_FEN        0x020000
@@ -59,6 +59,7 @@
 #include <openssl/err.h>
 #include <openssl/bio.h>
 #include "dns.h"
+#include "cache.h"
 #include "socket.h"
 
 
@@ -136,6 +137,50 @@ int socket_v_api(void) {
 #define HAVE_SSL_UP_REF HAVE_OPENSSL11_API
 #endif
 
+#ifndef HAVE_SENDFILE
+#define HAVE_SENDFILE __linux__
+#endif
+
+#ifndef HAVE_SPLICE
+#if __linux__ && defined SPLICE_F_NONBLOCK
+#define HAVE_SPLICE 1
+#else
+#define HAVE_SPLICE 0
+#endif
+#endif
+
+#if HAVE_SENDFILE
+#include <sys/sendfile.h> /* sendfile(2) */
+#endif
+
+#ifndef HAVE_SENDMMSG
+#if __linux__ && defined MSG_WAITFORONE
+#define HAVE_SENDMMSG 1
+#else
+#define HAVE_SENDMMSG 0
+#endif
+#endif
+
+#ifndef HAVE_RECVMMSG
+#define HAVE_RECVMMSG HAVE_SENDMMSG
+#endif
+
+#ifndef HAVE_KTLS
+#if defined SSL_OP_ENABLE_KTLS && !defined OPENSSL_NO_KTLS && !defined LIBRESSL_VERSION_NUMBER
+#define HAVE_KTLS 1
+#else
+#define HAVE_KTLS 0
+#endif
+#endif
+
+#ifndef SO_IOV_MAX
+#if defined IOV_MAX
+#define SO_IOV_MAX IOV_MAX
+#else
+#define SO_IOV_MAX 16
+#endif
+#endif
+
 
 /*
  * C O M P A T  R O U T I N E S
@@ -794,6 +839,11 @@ int so_socket(int domain, int type, const struct so_options *opts, int *_error)
 	if ((error = so_setfl(fd, flags, mask, need)))
 		goto error;
 
+	if ((domain == AF_INET || domain == AF_INET6) && (opts->sin_busypoll > 0 || opts->sin_preferbusypoll)) {
+		if ((error = so_busypoll(fd, opts->sin_busypoll, opts->sin_preferbusypoll)))
+			goto error;
+	}
+
 	return fd;
 syerr:
 	error = so_syerr();
@@ -1004,6 +1054,83 @@ int so_oobinline(int fd, _Bool oobinline) {
 } /* so_oobinline() */
 
 
+static int so_setintopt(int fd, int lvl, int opt, int val) {
+	if (0 != setsockopt(fd, lvl, opt, &val, sizeof val)) {
+		switch (errno) {
+		case ENOTSOCK:
+			/* FALL THROUGH */
+		case ENOPROTOOPT:
+			return EOPNOTSUPP;
+		default:
+			return errno;
+		}
+	}
+
+	return 0;
+} /* so_setintopt() */
+
+
+/* don't wake a listener until data arrives, for up to secs seconds */
+int so_deferaccept(int fd, int secs) {
+#if defined TCP_DEFER_ACCEPT
+	return so_setintopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, secs);
+#else
+	(void)fd;
+
+	return (secs > 0)? EOPNOTSUPP : 0;
+#endif
+} /* so_deferaccept() */
+
+
+/* accept data in the SYN from up to qlen clients awaiting accept */
+int so_fastopen(int fd, int qlen) {
+#if defined TCP_FASTOPEN
+	return so_setintopt(fd, IPPROTO_TCP, TCP_FASTOPEN, qlen);
+#else
+	(void)fd;
+
+	return (qlen > 0)? EOPNOTSUPP : 0;
+#endif
+} /* so_fastopen() */
+
+
+/* steer new connections to the SO_REUSEPORT listener on this CPU */
+int so_incomingcpu(int fd, int cpu) {
+#if defined SO_INCOMING_CPU
+	return so_setintopt(fd, SOL_SOCKET, SO_INCOMING_CPU, cpu);
+#else
+	(void)fd;
+	(void)cpu;
+
+	return EOPNOTSUPP;
+#endif
+} /* so_incomingcpu() */
+
+
+/* have blocking reads and epoll spin on the device queue for usecs */
+int so_busypoll(int fd, int usecs, _Bool prefer) {
+	int error;
+
+#if defined SO_BUSY_POLL
+	if (usecs > 0 && (error = so_setintopt(fd, SOL_SOCKET, SO_BUSY_POLL, usecs)))
+		return error;
+#else
+	if (usecs > 0)
+		return EOPNOTSUPP;
+#endif
+
+#if defined SO_PREFER_BUSY_POLL
+	if (prefer && (error = so_setintopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, 1)))
+		return error;
+#else
+	if (prefer)
+		return EOPNOTSUPP;
+#endif
+
+	return 0;
+} /* so_busypoll() */
+
+
 #define NO_OFFSET ((size_t)-1)
 #define optoffset(m) offsetof(struct so_options, m)
 
@@ -1285,11 +1412,42 @@ struct socket {
 	struct addrinfo *host;
 
 	short events;
+	short drained; /* descriptor returned EAGAIN for these; see so_drained() */
+
+	struct {
+		int fd[2];    /* staging pipe for splice(2) */
+		size_t count; /* bytes staged but not yet written */
+		dev_t dev;    /* source the staged bytes were read from */
+		ino_t ino;
+	} splice;
 
 	int done, todo;
 
 	int lerror;
 
+	/*
+	 * RFC 8305 connection race. The attempt in progress is .fd and
+	 * .host; earlier attempts still in flight are parked in .pending.
+	 * Resolved addresses read ahead while looking for the other family
+	 * wait in .queue.
+	 */
+	struct {
+		struct so_attempt {
+			int fd;
+			struct addrinfo *host;
+			unsigned seq;
+		} pending[3];
+		unsigned count;
+
+		struct addrinfo *queue[8];
+		unsigned nqueued;
+
+		unsigned seq;       /* attempt number of .fd */
+		int family;         /* family of the newest attempt */
+		long long next;     /* monotonic ms after which to start the next attempt */
+		_Bool exhausted;    /* resolver has no more addresses */
+	} race;
+
 	int olowat;
 
 	struct {
@@ -1298,6 +1456,7 @@ struct socket {
 		int state;
 		_Bool accept;
 		_Bool vrfd;
+		_Bool ktls; /* kernel TLS requested; uses a socket BIO */
 	} ssl;
 
 	struct {
@@ -1393,6 +1552,67 @@ static int so_pipeok(struct socket *so, _Bool rdonly) {
 } /* so_pipeok() */
 
 
+/* milliseconds on a clock unaffected by wall clock adjustments */
+static long long so_mono(void) {
+#if defined CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (0 == clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+	return (long long)time(NULL) * 1000;
+} /* so_mono() */
+
+
+/*
+ * Only connects through the resolver race; so_dial and friends have a
+ * single address and nothing to race it against.
+ */
+static _Bool so_racing(struct socket *so) {
+	return so->opts.sin_race > 0 && (so->todo & SO_S_GETADDR) && (so->todo & SO_S_CONNECT) && !(so->todo & SO_S_LISTEN);
+} /* so_racing() */
+
+
+/*
+ * Pick the next address to race, alternating address families as RFC
+ * 8305 suggests. Resolvers yield all of one family's addresses before the
+ * other's, so read ahead into .queue looking for the other family, and
+ * settle for the oldest queued address if it doesn't turn up.
+ */
+static int so_racenext(struct socket *so) {
+	struct addrinfo *ent;
+	unsigned i;
+	int error = 0;
+
+	for (i = 0; i < so->race.nqueued; i++) {
+		if (so->race.queue[i]->ai_family != so->race.family)
+			goto take;
+	}
+
+	while (so->race.nqueued < countof(so->race.queue)) {
+		if ((error = dns_ai_nextent(&ent, so->res)))
+			break;
+
+		so->race.queue[i = so->race.nqueued++] = ent;
+
+		if (ent->ai_family != so->race.family)
+			goto take;
+	}
+
+	if (!so->race.nqueued)
+		return error;
+
+	i = 0;
+take:
+	so->host = so->race.queue[i];
+	so->race.family = so->host->ai_family;
+	memmove(&so->race.queue[i], &so->race.queue[i + 1], (so->race.nqueued - i - 1) * sizeof *so->race.queue);
+	so->race.nqueued--;
+
+	return 0;
+} /* so_racenext() */
+
+
 static int so_getaddr_(struct socket *so) {
 	int error;
 
@@ -1400,11 +1620,12 @@ static int so_getaddr_(struct socket *so) {
 		return SO_ENOHOST;
 
 	so->events = 0;
+	so->drained = 0;
 
 	free(so->host);
 	so->host = 0;
 
-	if ((error = dns_ai_nextent(&so->host, so->res)))
+	if ((error = (so_racing(so))? so_racenext(so) : dns_ai_nextent(&so->host, so->res)))
 		goto error;
 
 	return 0;
@@ -1431,6 +1652,7 @@ static int so_socket_(struct socket *so) {
 		return SO_ENOHOST;
 
 	so_closesocket(&so->fd, &so->opts);
+	so->race.seq = 0;
 
 	if (-1 == (so->fd = so_socket(so->host->ai_family, so->host->ai_socktype, &so->opts, &error)))
 		return error;
@@ -1463,9 +1685,23 @@ static int so_bind_(struct socket *so) {
 
 
 static int so_listen_(struct socket *so) {
+	int error;
+
 	if (!S_ISSOCK(so->mode) || (so->type != SOCK_STREAM && so->type != SOCK_SEQPACKET))
 		return 0;
 
+	if (so->domain == AF_INET || so->domain == AF_INET6) {
+		/* Linux requires TCP_FASTOPEN before listen(2) */
+		if (so->opts.sin_fastopen > 0 && (error = so_fastopen(so->fd, so->opts.sin_fastopen)))
+			return error;
+
+		if (so->opts.sin_deferaccept > 0 && (error = so_deferaccept(so->fd, so->opts.sin_deferaccept)))
+			return error;
+	}
+
+	if (so->opts.sin_incomingcpu >= 0 && (error = so_incomingcpu(so->fd, so->opts.sin_incomingcpu)))
+		return error;
+
 	return (0 == listen(so->fd, SOMAXCONN))? 0 : so_soerr();
 } /* so_listen_() */
 
@@ -1481,11 +1717,16 @@ retry:
 		goto error;
 	}
 
+	/* count attempts, not the polling of one in progress */
+	if (!so->race.seq) {
+		so->race.seq = ++so->st.connect.attempts;
+		so->race.next = so_mono() + so->opts.sin_race;
+	}
+
 	if (0 != connect(so->fd, so->host->ai_addr, so->host->ai_addrlen)) {
 		error = so_soerr();
 		goto error;
 	}
-
 ready:
 	so_trace(SO_T_CONNECT, so->fd, so->host, "ready");
 
@@ -1515,6 +1756,161 @@ error:
 } /* so_connect_() */
 
 
+/* check an attempt in flight without blocking */
+static int so_racepoll(int fd) {
+	struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+	int error = 0;
+
+	if (poll(&pfd, 1, 0) == -1)
+		return (so_syerr() == EINTR)? SO_EAGAIN : so_syerr();
+
+	if (!pfd.revents)
+		return SO_EAGAIN;
+
+	if (0 != getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &(socklen_t){ sizeof error }))
+		return so_soerr();
+
+	return error;
+} /* so_racepoll() */
+
+
+/* make attempt i of .pending the current one, dropping the current one */
+static int so_raceswap(struct socket *so, unsigned i) {
+	struct so_attempt att = so->race.pending[i];
+
+	memmove(&so->race.pending[i], &so->race.pending[i + 1], (so->race.count - i - 1) * sizeof *so->race.pending);
+	so->race.count--;
+
+	so_closesocket(&so->fd, &so->opts);
+	free(so->host);
+
+	so->fd = att.fd;
+	so->host = att.host;
+	so->race.seq = att.seq;
+	so->events = 0;
+	so->drained = 0;
+
+	if (!so->host)
+		return SO_ENOHOST;
+
+	so->flags = so_getfl(so->fd, ~0);
+
+	return so_ftype(so->fd, &so->mode, &so->domain, &so->type, &so->protocol);
+} /* so_raceswap() */
+
+
+static void so_racedrop(struct socket *so, unsigned i) {
+	so_closesocket(&so->race.pending[i].fd, &so->opts);
+	free(so->race.pending[i].host);
+
+	memmove(&so->race.pending[i], &so->race.pending[i + 1], (so->race.count - i - 1) * sizeof *so->race.pending);
+	so->race.count--;
+} /* so_racedrop() */
+
+
+/*
+ * Called while the current attempt is in progress. Returns 0 if an
+ * earlier attempt connected and was swapped in. Otherwise returns
+ * SO_EAGAIN, setting *next if the delay has passed and the current
+ * attempt was parked so that the next address can be tried.
+ */
+static int so_race_(struct socket *so, _Bool *next) {
+	unsigned i;
+	int error;
+
+	*next = 0;
+
+	for (i = 0; i < so->race.count;) {
+		switch ((error = so_racepoll(so->race.pending[i].fd))) {
+		case 0:
+			return so_raceswap(so, i);
+		case SO_EAGAIN:
+			i++;
+
+			break;
+		default:
+			so->lerror = error;
+			so_racedrop(so, i);
+
+			break;
+		}
+	}
+
+	if (so->race.exhausted || so_mono() < so->race.next)
+		return SO_EAGAIN;
+
+	/* bound the descriptors held; the oldest attempt is least likely to win */
+	if (so->race.count == countof(so->race.pending))
+		so_racedrop(so, 0);
+
+	so->race.pending[so->race.count].fd = so->fd;
+	so->race.pending[so->race.count].host = so->host;
+	so->race.pending[so->race.count].seq = so->race.seq;
+	so->race.count++;
+
+	so->fd = -1;
+	so->host = NULL;
+	*next = 1;
+
+	return SO_EAGAIN;
+} /* so_race_() */
+
+
+/*
+ * The resolver has nothing to try right now. Resume the newest attempt
+ * still in flight, if any. When the resolver is only waiting on the
+ * network, hold off a full delay before asking it again.
+ */
+static _Bool so_raceresume(struct socket *so, _Bool exhausted) {
+	int error;
+
+	while (so->race.count) {
+		struct so_attempt *att = &so->race.pending[so->race.count - 1];
+
+		if ((error = so_racepoll(att->fd)) && error != SO_EAGAIN) {
+			so->lerror = error;
+			so_racedrop(so, so->race.count - 1);
+
+			continue;
+		}
+
+		/* so_raceswap closes the current descriptor, if any */
+		if (so_raceswap(so, so->race.count - 1))
+			continue;
+
+		if (exhausted)
+			so->race.exhausted = 1;
+		else
+			so->race.next = so_mono() + so->opts.sin_race;
+
+		return 1;
+	}
+
+	return 0;
+} /* so_raceresume() */
+
+
+/* connected; close the losers and note the winner */
+static void so_racewon(struct socket *so) {
+	while (so->race.count)
+		so_racedrop(so, so->race.count - 1);
+
+	so->st.connect.winner = so->race.seq;
+
+	if (so->host)
+		memcpy(&so->st.connect.addr, so->host->ai_addr, SO_MIN(so->host->ai_addrlen, sizeof so->st.connect.addr));
+} /* so_racewon() */
+
+
+static void so_racereset(struct socket *so) {
+	while (so->race.count)
+		so_racedrop(so, so->race.count - 1);
+
+	while (so->race.nqueued)
+		free(so->race.queue[--so->race.nqueued]);
+} /* so_racereset() */
+
+
 static BIO *so_newbio(struct socket *, int *);
 
 static int so_starttls_(struct socket *so) {
@@ -1555,6 +1951,27 @@ static int so_starttls_(struct socket *so) {
 
 			SSL_set_bio(so->ssl.ctx, bio, bio);
 			SSL_set_read_ahead(so->ssl.ctx, 1);
+#if HAVE_KTLS
+		} else if (so->ssl.ktls) {
+			/*
+			 * OpenSSL only hands the record layer to the kernel
+			 * when it owns the descriptor, so use a plain socket
+			 * BIO. Offload starts once the handshake installs
+			 * the traffic keys; if the kernel or cipher doesn't
+			 * support it OpenSSL carries on in userspace.
+			 * KeyUpdate is handled by OpenSSL, but it can't
+			 * renegotiate an offloaded TLS 1.2 session.
+			 */
+			BIO *bio;
+
+			if (!(bio = BIO_new_socket(so->fd, BIO_NOCLOSE))) {
+				error = SO_EOPENSSL;
+				goto error;
+			}
+
+			SSL_set_bio(so->ssl.ctx, bio, bio);
+			SSL_set_options(so->ssl.ctx, SSL_OP_ENABLE_KTLS|SSL_OP_NO_RENEGOTIATION);
+#endif
 		} else {
 			BIO *bio;
 
@@ -1701,7 +2118,15 @@ exec:
 	case SO_S_INIT:
 		break;
 	case SO_S_GETADDR:
-		switch ((error_ = so_getaddr_(so))) {
+		error_ = so_getaddr_(so);
+
+		if ((error_ == ENOENT || error_ == SO_EAGAIN) && so_raceresume(so, error_ == ENOENT)) {
+			so->done |= SO_S_GETADDR|SO_S_SOCKET|SO_S_BIND;
+
+			goto exec;
+		}
+
+		switch (error_) {
 		case 0:
 			break;
 		case ENOENT:
@@ -1746,12 +2171,27 @@ exec:
 		if ((error = so_connect_(so))) {
 			switch (error) {
 			case SO_EAGAIN:
+				if (so_racing(so)) {
+					_Bool next;
+
+					if (!(error = so_race_(so, &next)))
+						goto connected;
+
+					/* park the current attempt and start another */
+					if (next) {
+						so->done = 0;
+
+						goto exec;
+					}
+				}
+
 				goto error;
 			default:
 				goto retry;
 			} /* switch() */
 		}
-
+connected:
+		so_racewon(so);
 		so->done |= state;
 
 		goto exec;
@@ -1818,6 +2258,7 @@ static struct socket *so_make(const struct so_options *opts, int *error) {
 	static const struct socket so_initializer = {
 		.fd = -1,
 		.domain = PF_UNSPEC,
+		.splice = { { -1, -1 }, 0 },
 		.cred = { (pid_t)-1, (uid_t)-1, (gid_t)-1, }
 	};
 	struct socket *so;
@@ -1869,6 +2310,8 @@ static void so_resetssl(struct socket *);
 static int so_destroy(struct socket *so) {
 	so_resetssl(so);
 
+	so_racereset(so);
+
 	dns_ai_close(so->res);
 	so->res = NULL;
 
@@ -1878,6 +2321,11 @@ static int so_destroy(struct socket *so) {
 	so_closesocket(&so->fd, &so->opts);
 
 	so->events = 0;
+	so->drained = 0;
+
+	so_closesocket(&so->splice.fd[0], NULL);
+	so_closesocket(&so->splice.fd[1], NULL);
+	so->splice.count = 0;
 
 	if (so->opts.tls_sendname && so->opts.tls_sendname != SO_OPTS_TLS_HOSTNAME) {
 		free((void *)so->opts.tls_sendname);
@@ -1935,11 +2383,32 @@ struct socket *(so_open)(const char *host, const char *port, int qtype, int doma
 		hints.ai_flags |= AI_NUMERICHOST;
 	} else {
 		struct dns_options *opts = dns_opts();
+		struct dns_resolv_conf *resconf = NULL;
+		struct dns_hosts *hosts = NULL;
+		struct dns_hints *nshints = NULL;
+		struct dns_cache *resi = NULL;
+		struct cache *cache;
 
 		opts->closefd.arg = so->opts.fd_close.arg;
 		opts->closefd.cb = so->opts.fd_close.cb;
 
-		if (!(res = dns_res_stub(opts, &error)))
+		/* as dns_res_stub(), but with an answer cache scoped to resconf */
+		if ((resconf = dns_resconf_local(&error))
+		&&  (hosts = dns_hosts_local(&error))
+		&&  (nshints = dns_hints_local(resconf, &error))) {
+			/* without the answer cache we only lose its speedup */
+			if ((cache = cache_shared(&(int){ 0 })))
+				resi = cache_resi(cache, resconf, &(int){ 0 });
+
+			res = dns_res_open(resconf, hosts, nshints, resi, opts, &error);
+		}
+
+		dns_resconf_close(resconf);
+		dns_hosts_close(hosts);
+		dns_hints_close(nshints);
+		dns_cache_close(resi);
+
+		if (!res)
 			goto error;
 	}
 
@@ -2124,6 +2593,8 @@ retry:
 		goto error;
 #endif
 
+	so->drained &= ~POLLIN;
+
 	return fd;
 soerr:
 	switch ((error = so_soerr())) {
@@ -2133,8 +2604,12 @@ soerr:
 	case SO_EWOULDBLOCK:
 		error = SO_EAGAIN;
 
-		break;
+		/* FALL THROUGH */
 #endif
+	case SO_EAGAIN:
+		so->drained |= POLLIN;
+
+		break;
 	case SO_ECONNABORTED:
 		error = SO_EAGAIN;
 
@@ -2155,6 +2630,7 @@ static void so_resetssl(struct socket *so) {
 	so->ssl.error  = 0;
 	so->ssl.accept = 0;
 	so->ssl.vrfd   = 0;
+	so->ssl.ktls   = 0;
 
 	if (so->bio.ctx) {
 		BIO_free(so->bio.ctx);
@@ -2239,6 +2715,9 @@ int so_starttls(struct socket *so, const struct so_starttls *cfg) {
 	SSL_set_mode(ssl, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 	SSL_set_mode(ssl, SSL_MODE_ENABLE_PARTIAL_WRITE);
 
+	/* a socket BIO can't replay pushback, so fall back to ours */
+	so->ssl.ktls = HAVE_KTLS && cfg->ktls && !cfg->pushback.iov_len && S_ISSOCK(so->mode);
+
 	so->ssl.ctx = ssl;
 	ssl = NULL;
 
@@ -2272,6 +2751,26 @@ SSL *so_checktls(struct socket *so) {
 } /* so_checktls() */
 
 
+int so_ktls(struct socket *so) {
+	int flags = 0;
+#if HAVE_KTLS
+	BIO *bio;
+
+	if (!so->ssl.ctx || !so->ssl.ktls)
+		return 0;
+
+	if ((bio = SSL_get_wbio(so->ssl.ctx)) && BIO_get_ktls_send(bio))
+		flags |= SO_KTLS_SEND;
+
+	if ((bio = SSL_get_rbio(so->ssl.ctx)) && BIO_get_ktls_recv(bio))
+		flags |= SO_KTLS_RECV;
+#else
+	(void)so;
+#endif
+	return flags;
+} /* so_ktls() */
+
+
 int so_shutdown(struct socket *so, int how) {
 	switch (how) {
 	case SHUT_RD:
@@ -2307,6 +2806,8 @@ retry:
 	if (len == 0)
 		goto epipe;
 
+	so->drained &= ~POLLIN;
+
 	return len;
 epipe:
 	*error = EPIPE;
@@ -2326,6 +2827,7 @@ error:
 #endif
 	case SO_EAGAIN:
 		so->events |= POLLIN;
+		so->drained |= POLLIN;
 		break;
 	} /* switch() */
 
@@ -2370,6 +2872,8 @@ retry:
 
 //	so_pipeok(so, 0);
 
+	so->drained &= ~POLLOUT;
+
 	return count;
 error:
 	*error = so_soerr();
@@ -2387,6 +2891,7 @@ error:
 #endif
 	case SO_EAGAIN:
 		so->events |= POLLOUT;
+		so->drained |= POLLOUT;
 		break;
 	} /* switch() */
 
@@ -2715,19 +3220,583 @@ error:
 } /* so_write() */
 
 
-size_t so_peek(struct socket *so, void *dst, size_t lim, int flags, int *_error) {
-	int rstlowat = so->todo & SO_S_RSTLOWAT;
-	long count;
-	int lowat, error;
+/*
+ * Map a failed kernel write to the so_syswrite conventions.
+ */
+static size_t so_syswerr(struct socket *so, int *error) {
+	switch ((*error = so_soerr())) {
+	case EPIPE:
+		so->st.sent.eof = 1;
+		break;
+#if SO_EWOULDBLOCK != SO_EAGAIN
+	case SO_EWOULDBLOCK:
+		*error = SO_EAGAIN;
+		/* FALL THROUGH */
+#endif
+	case SO_EAGAIN:
+		so->events |= POLLOUT;
+		so->drained |= POLLOUT;
+		break;
+	} /* switch() */
 
-	so->todo &= ~SO_S_RSTLOWAT;
+	return 0;
+} /* so_syswerr() */
 
-	error = so_exec(so);
 
-	so->todo |= rstlowat;
+static size_t so_syswritev(struct socket *so, const struct iovec *iov, int iovcnt, int *error) {
+	long count;
 
-	if (error)
-		goto error;
+	if (so->st.sent.eof) {
+		*error = EPIPE;
+		return 0;
+	}
+
+	iovcnt = SO_MIN(iovcnt, SO_IOV_MAX);
+retry:
+	if (S_ISSOCK(so->mode)) {
+		struct msghdr msg = { .msg_iov = (struct iovec *)iov, .msg_iovlen = iovcnt };
+		int flags = 0;
+
+		#if defined(MSG_NOSIGNAL)
+		if (so->opts.fd_nosigpipe)
+			flags |= MSG_NOSIGNAL;
+		#endif
+		if (so->type == SOCK_SEQPACKET)
+			flags |= MSG_EOR;
+
+		count = sendmsg(so->fd, &msg, flags);
+	} else {
+		count = writev(so->fd, iov, iovcnt);
+	}
+
+	if (count == -1) {
+		if (so_soerr() == SO_EINTR)
+			goto retry;
+
+		return so_syswerr(so, error);
+	}
+
+	so->drained &= ~POLLOUT;
+
+	return count;
+} /* so_syswritev() */
+
+
+/*
+ * Gather write. TLS has no vectored interface, so there each buffer is
+ * passed to SSL_write in turn, stopping at the first short write.
+ */
+size_t so_writev(struct socket *so, const struct iovec *iov, int iovcnt, int *error_) {
+	size_t count = 0, n;
+	int error, i;
+
+	so_pipeign(so, 0);
+
+	so->todo |= SO_S_SETWRITE;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	if (so->fd == -1) {
+		error = ENOTCONN;
+		goto error;
+	}
+
+	so->events &= ~POLLOUT;
+
+	if (so->ssl.ctx) {
+		for (i = 0; i < iovcnt; i++) {
+			if (!iov[i].iov_len)
+				continue;
+
+			if (!(n = so_write(so, iov[i].iov_base, iov[i].iov_len, &error))) {
+				if (count)
+					break;
+
+				goto error;
+			}
+
+			count += n;
+
+			if (n < iov[i].iov_len)
+				break;
+		}
+
+		so_pipeok(so, 0);
+
+		return count; /* so_write did the accounting */
+	}
+
+	if (!(count = so_syswritev(so, iov, iovcnt, &error)))
+		goto error;
+
+	so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "sent %zu bytes in %d buffers", count, iovcnt);
+	st_update(&so->st.sent, count, &so->opts);
+
+	so_pipeok(so, 0);
+
+	return count;
+error:
+	*error_ = error;
+
+	if (error != SO_EAGAIN)
+		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+
+	so_pipeok(so, 0);
+
+	return 0;
+} /* so_writev() */
+
+
+/*
+ * Send each buffer as its own datagram, batching with sendmmsg(2) where
+ * available. Returns the number of messages sent.
+ */
+size_t so_sendmmsg(struct socket *so, const struct iovec *msgv, size_t msgc, int *error_) {
+	size_t count = 0;
+	int error;
+
+	so_pipeign(so, 0);
+
+	so->todo |= SO_S_SETWRITE;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	if (so->fd == -1) {
+		error = ENOTCONN;
+		goto error;
+	}
+
+	so->events &= ~POLLOUT;
+
+	while (count < msgc) {
+#if HAVE_SENDMMSG
+		struct mmsghdr hdr[64];
+		unsigned i, n = SO_MIN(msgc - count, countof(hdr));
+		int flags = 0, sent;
+
+		memset(hdr, 0, n * sizeof *hdr);
+
+		for (i = 0; i < n; i++) {
+			hdr[i].msg_hdr.msg_iov = (struct iovec *)&msgv[count + i];
+			hdr[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		#if defined(MSG_NOSIGNAL)
+		if (so->opts.fd_nosigpipe)
+			flags |= MSG_NOSIGNAL;
+		#endif
+
+		if (-1 == (sent = sendmmsg(so->fd, hdr, n, flags))) {
+			if (so_soerr() == SO_EINTR)
+				continue;
+
+			so_syswerr(so, &error);
+
+			goto error;
+		}
+
+		for (i = 0; i < (unsigned)sent; i++)
+			st_update(&so->st.sent, hdr[i].msg_len, &so->opts);
+
+		count += sent;
+#else
+		size_t n;
+
+		if (!(n = so_syswrite(so, msgv[count].iov_base, msgv[count].iov_len, &error)) && msgv[count].iov_len)
+			goto error;
+
+		st_update(&so->st.sent, n, &so->opts);
+
+		count++;
+#endif
+		so->drained &= ~POLLOUT;
+	}
+
+	so_pipeok(so, 0);
+
+	return count;
+error:
+	*error_ = error;
+
+	if (error != SO_EAGAIN)
+		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+
+	so_pipeok(so, 0);
+
+	return count;
+} /* so_sendmmsg() */
+
+
+/*
+ * Receive up to count datagrams, one per msghdr, using a single
+ * recvmmsg(2) where available and otherwise looping over so_recvmsg until
+ * it would block. As with so_recvmsg, each message's iov_len is trimmed
+ * to the datagram size and MSG_TRUNC is reported in .msg_flags. Returns
+ * the number of datagrams received, or 0 and an error.
+ */
+size_t so_recvmany(struct socket *so, struct msghdr *msgv, size_t count, int *error_) {
+	int error;
+#if HAVE_RECVMMSG
+	struct mmsghdr hdr[64];
+	int i, rcvd;
+
+	so_pipeign(so, 1);
+
+	so->todo |= SO_S_SETREAD;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	so->events &= ~POLLIN;
+
+	count = SO_MIN(count, countof(hdr));
+
+	for (i = 0; i < (int)count; i++) {
+		hdr[i].msg_hdr = msgv[i];
+		hdr[i].msg_len = 0;
+	}
+retry:
+	if (-1 == (rcvd = recvmmsg(so->fd, hdr, count, 0, NULL))) {
+		if ((error = so_soerr()) == SO_EINTR)
+			goto retry;
+
+		if (error == SO_EWOULDBLOCK)
+			error = SO_EAGAIN;
+
+		if (error == SO_EAGAIN) {
+			so->events |= POLLIN;
+			so->drained |= POLLIN;
+		}
+
+		goto error;
+	}
+
+	so->drained &= ~POLLIN;
+
+	for (i = 0; i < rcvd; i++) {
+		msgv[i].msg_namelen = hdr[i].msg_hdr.msg_namelen;
+		msgv[i].msg_controllen = hdr[i].msg_hdr.msg_controllen;
+		msgv[i].msg_flags = hdr[i].msg_hdr.msg_flags;
+		msgv[i].msg_iov[0].iov_len = SO_MIN(msgv[i].msg_iov[0].iov_len, hdr[i].msg_len);
+
+		st_update(&so->st.rcvd, hdr[i].msg_len, &so->opts);
+	}
+
+	so_pipeok(so, 1);
+
+	return rcvd;
+error:
+	*error_ = error;
+
+	so_pipeok(so, 1);
+
+	return 0;
+#else
+	size_t n = 0;
+
+	while (n < count) {
+		if ((error = so_recvmsg(so, &msgv[n], 0))) {
+			if (n > 0 && error == SO_EAGAIN)
+				break;
+
+			*error_ = error;
+
+			return n;
+		}
+
+		n++;
+	}
+
+	return n;
+#endif
+} /* so_recvmany() */
+
+
+#if HAVE_SENDFILE
+static size_t so_syssendfile(struct socket *so, int fd, off_t *offset, size_t count, int *error) {
+	ssize_t n;
+
+	if (so->st.sent.eof) {
+		*error = EPIPE;
+		return 0;
+	}
+
+	while (-1 == (n = sendfile(so->fd, fd, offset, SO_MIN(count, 0x7ffff000)))) {
+		if (so_soerr() != SO_EINTR)
+			return so_syswerr(so, error);
+	}
+
+	so->drained &= ~POLLOUT;
+	*error = 0; /* zero return is EOF */
+
+	return n;
+} /* so_syssendfile() */
+#endif
+
+
+#if HAVE_KTLS
+/*
+ * Kernel TLS encrypts sendfile(2) output, so files can go out without
+ * a trip through userspace. SSL_sendfile always takes an explicit
+ * offset, so emulate use of the file position when none is given.
+ */
+static size_t so_sslsendfile(struct socket *so, int fd, off_t *offset, size_t count, int *error) {
+	ossl_ssize_t n;
+	off_t pos;
+
+	if (offset) {
+		pos = *offset;
+	} else if (-1 == (pos = lseek(fd, 0, SEEK_CUR))) {
+		*error = so_syerr();
+		return 0;
+	}
+
+	ERR_clear_error();
+
+	if ((n = SSL_sendfile(so->ssl.ctx, fd, pos, SO_MIN(count, 0x7ffff000), 0)) < 0) {
+		*error = ssl_error(so->ssl.ctx, (int)n, &so->events);
+		return 0;
+	}
+
+	if (offset) {
+		*offset += n;
+	} else if (-1 == lseek(fd, pos + n, SEEK_SET)) {
+		*error = so_syerr();
+		return 0;
+	}
+
+	*error = 0; /* zero return is EOF */
+
+	return n;
+} /* so_sslsendfile() */
+#endif
+
+
+#if HAVE_SPLICE
+/*
+ * splice(2) requires a pipe on one end, so socket-to-socket transfers
+ * stage through a private pipe. Bytes left in the pipe after a short
+ * write are flushed before anything new is read from the source. They
+ * were already consumed from the source that staged them, so a transfer
+ * from another source first writes them out without counting them as
+ * its own.
+ */
+static size_t so_syssplice(struct socket *so, int fd, const struct stat *st, size_t count, int *error) {
+	ssize_t n;
+
+	if (so->st.sent.eof) {
+		*error = EPIPE;
+		return 0;
+	}
+
+	if (so->splice.fd[0] == -1) {
+		if (0 != pipe2(so->splice.fd, O_NONBLOCK|O_CLOEXEC)) {
+			*error = so_syerr();
+			return 0;
+		}
+	}
+
+	while (so->splice.count && (so->splice.dev != st->st_dev || so->splice.ino != st->st_ino)) {
+		while (-1 == (n = splice(so->splice.fd[0], NULL, so->fd, NULL, so->splice.count, SPLICE_F_MOVE|SPLICE_F_NONBLOCK))) {
+			if (so_soerr() != SO_EINTR)
+				return so_syswerr(so, error);
+		}
+
+		st_update(&so->st.sent, n, &so->opts);
+		so->splice.count -= n;
+	}
+
+	if (!so->splice.count) {
+		while (-1 == (n = splice(fd, NULL, so->splice.fd[1], NULL, SO_MIN(count, 0x7ffff000), SPLICE_F_MOVE|SPLICE_F_NONBLOCK))) {
+			if ((*error = so_syerr()) != SO_EINTR)
+				return 0; /* EAGAIN here means the source is empty */
+		}
+
+		if (n == 0) {
+			*error = 0; /* EOF */
+			return 0;
+		}
+
+		so->splice.count = n;
+		so->splice.dev = st->st_dev;
+		so->splice.ino = st->st_ino;
+	}
+
+	while (-1 == (n = splice(so->splice.fd[0], NULL, so->fd, NULL, SO_MIN(count, so->splice.count), SPLICE_F_MOVE|SPLICE_F_NONBLOCK))) {
+		if (so_soerr() != SO_EINTR)
+			return so_syswerr(so, error);
+	}
+
+	so->splice.count -= n;
+	so->drained &= ~POLLOUT;
+
+	return n;
+} /* so_syssplice() */
+#endif
+
+
+/*
+ * Bounce through a buffer for TLS sessions and descriptors without a
+ * kernel path. Source bytes are consumed only once written, so nothing is
+ * lost on EAGAIN: seekable sources are reread with pread(2) and sockets
+ * are peeked. Other descriptor types aren't supported.
+ */
+static size_t so_copyfile(struct socket *so, int fd, mode_t mode, off_t *offset, size_t count, int *error) {
+	unsigned char buf[16384];
+	ssize_t n;
+	size_t sent;
+	off_t pos;
+
+	if (S_ISREG(mode) || S_ISBLK(mode)) {
+		if (offset) {
+			pos = *offset;
+		} else if (-1 == (pos = lseek(fd, 0, SEEK_CUR))) {
+			goto syerr;
+		}
+
+		while (-1 == (n = pread(fd, buf, SO_MIN(count, sizeof buf), pos))) {
+			if (so_syerr() != SO_EINTR)
+				goto syerr;
+		}
+	} else if (S_ISSOCK(mode)) {
+		while (-1 == (n = recv(fd, buf, SO_MIN(count, sizeof buf), MSG_PEEK))) {
+			if (so_soerr() != SO_EINTR)
+				goto soerr;
+		}
+	} else {
+		*error = EOPNOTSUPP;
+		return 0;
+	}
+
+	if (n == 0) {
+		*error = 0; /* EOF */
+		return 0;
+	}
+
+	if (!(sent = so_write(so, buf, n, error)))
+		return 0;
+
+	if (S_ISSOCK(mode)) {
+		while (-1 == recv(fd, buf, sent, 0)) {
+			if (so_soerr() != SO_EINTR)
+				goto soerr;
+		}
+	} else if (offset) {
+		*offset += sent;
+	} else if (-1 == lseek(fd, pos + sent, SEEK_SET)) {
+		goto syerr;
+	}
+
+	return sent;
+syerr:
+	*error = so_syerr();
+
+	return 0;
+soerr:
+	*error = so_soerr();
+
+	return 0;
+} /* so_copyfile() */
+
+
+static _Bool so_haskpath(struct socket *so, mode_t mode) {
+	if (so->splice.count)
+		return 1;
+#if HAVE_SENDFILE
+	if (S_ISREG(mode))
+		return 1;
+#endif
+#if HAVE_SPLICE
+	if (S_ISSOCK(mode) || S_ISFIFO(mode))
+		return 1;
+#endif
+	return 0;
+} /* so_haskpath() */
+
+
+size_t so_sendfile(struct socket *so, int fd, off_t *offset, size_t count, int *error_) {
+	struct stat st;
+	size_t n;
+	int error;
+
+	if (0 != fstat(fd, &st)) {
+		*error_ = so_syerr();
+		return 0;
+	}
+
+	if ((so->ssl.ctx)? !(S_ISREG(st.st_mode) && (so_ktls(so) & SO_KTLS_SEND)) : !so_haskpath(so, st.st_mode))
+		return so_copyfile(so, fd, st.st_mode, offset, count, error_);
+
+	so_pipeign(so, 0);
+
+	so->todo |= SO_S_SETWRITE;
+
+	if ((error = so_exec(so)))
+		goto error;
+
+	if (so->fd == -1) {
+		error = ENOTCONN;
+		goto error;
+	}
+
+	so->events &= ~POLLOUT;
+
+#if HAVE_KTLS
+	if (so->ssl.ctx) {
+		if (!(n = so_sslsendfile(so, fd, offset, count, &error)))
+			goto error;
+	} else
+#endif
+#if HAVE_SPLICE
+	if (so->splice.count || !S_ISREG(st.st_mode)) {
+		if (!(n = so_syssplice(so, fd, &st, count, &error)))
+			goto error;
+	} else
+#endif
+	{
+#if HAVE_SENDFILE
+		if (!(n = so_syssendfile(so, fd, offset, count, &error)))
+			goto error;
+#else
+		n = 0;
+		error = EOPNOTSUPP;
+		goto error;
+#endif
+	}
+
+	so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "sent %zu bytes from fd %d", n, fd);
+	st_update(&so->st.sent, n, &so->opts);
+
+	so_pipeok(so, 0);
+
+	return n;
+error:
+	*error_ = error;
+
+	if (error && error != SO_EAGAIN)
+		so_trace(SO_T_WRITE, so->fd, so->host, (void *)0, (size_t)0, "%s", so_strerror(error));
+
+	so_pipeok(so, 0);
+
+	return 0;
+} /* so_sendfile() */
+
+
+size_t so_peek(struct socket *so, void *dst, size_t lim, int flags, int *_error) {
+	int rstlowat = so->todo & SO_S_RSTLOWAT;
+	long count;
+	int lowat, error;
+
+	so->todo &= ~SO_S_RSTLOWAT;
+
+	error = so_exec(so);
+
+	so->todo |= rstlowat;
+
+	if (error)
+		goto error;
 
 	if (flags & SO_F_PEEKALL)
 		so->events &= ~POLLIN;
@@ -2759,6 +3828,7 @@ pollin:
 	}
 
 	so->events |= POLLIN;
+	so->drained &= ~POLLIN; /* waiting on SO_RCVLOWAT, not EAGAIN */
 
 	*_error = SO_EAGAIN;
 
@@ -2808,6 +3878,8 @@ retry:
 	if (-1 == (count = sendmsg(so->fd, msg, flags)))
 		goto syerr;
 
+	so->drained &= ~POLLOUT;
+
 	st_update(&so->st.sent, count, &so->opts);
 
 	so_pipeok(so, 0);
@@ -2815,6 +3887,9 @@ retry:
 	return 0;
 syerr:
 	error = errno;
+
+	if (error == SO_EAGAIN || error == SO_EWOULDBLOCK)
+		so->drained |= POLLOUT;
 error:
 	switch (error) {
 	case SO_EINTR:
@@ -2856,6 +3931,8 @@ retry:
 		goto error;
 	}
 
+	so->drained &= ~POLLIN;
+
 	st_update(&so->st.rcvd, count, &so->opts);
 
 	/* RE .msg_iovlen type
@@ -2883,6 +3960,9 @@ retry:
 	return 0;
 syerr:
 	error = errno;
+
+	if (error == SO_EAGAIN || error == SO_EWOULDBLOCK)
+		so->drained |= POLLIN;
 error:
 	switch (error) {
 	case SO_EINTR:
@@ -2911,6 +3991,7 @@ const struct so_stat *so_stat(struct socket *so) {
 void so_clear(struct socket *so) {
 	so->todo   &= ~(SO_S_SETREAD|SO_S_SETWRITE);
 	so->events = 0;
+	so->drained = 0;
 } /* so_clear() */
 
 
@@ -2934,6 +4015,34 @@ int so_events(struct socket *so) {
 } /* so_events() */
 
 
+/*
+ * Subset of so_events() owed to the descriptor itself returning EAGAIN,
+ * rather than, e.g., a DNS query or SO_RCVLOWAT. Used by event loops to
+ * decide whether edge-triggered polling is safe.
+ */
+int so_drained(struct socket *so) {
+	short events;
+
+	if (so_pollfd(so) != so->fd)
+		return 0;
+
+	switch (so->opts.fd_events) {
+	case SO_LIBEVENT:
+		events = SO_POLL2EV(so->events & so->drained);
+
+		break;
+	default:
+		/* FALL THROUGH */
+	case SO_SYSPOLL:
+		events = so->events & so->drained;
+
+		break;
+	} /* switch (.fd_events) */
+
+	return events;
+} /* so_drained() */
+
+
 int so_pollfd(struct socket *so) {
 	switch (so_state(so)) {
 	case SO_S_GETADDR:
@@ -2944,6 +4053,31 @@ int so_pollfd(struct socket *so) {
 } /* so_pollfd() */
 
 
+/*
+ * Milliseconds until a connection race wants to move on even though the
+ * descriptor it's polling hasn't become ready, or -1 if it doesn't.
+ * Attempts parked in .pending aren't polled, so they're also rechecked
+ * this often.
+ */
+int so_racetimeout(struct socket *so) {
+	long long now;
+
+	if (!so_racing(so) || (so->done & SO_S_CONNECT))
+		return -1;
+
+	if (so->race.exhausted)
+		return (so->race.count)? so->opts.sin_race : -1;
+
+	if (so->fd == -1)
+		return (so->race.count)? so->opts.sin_race : -1;
+
+	if ((now = so_mono()) >= so->race.next)
+		return 0;
+
+	return (int)SO_MIN(so->race.next - now, so->opts.sin_race);
+} /* so_racetimeout() */
+
+
 int so_poll(struct socket *so, int timeout) {
 	int nfds;
 
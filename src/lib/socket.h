@@ -180,11 +180,24 @@ struct so_options {
 	const char *tls_sendname;
 
 	_Bool st_time;
+
+	int sin_race; /* ms between staggered connect attempts; 0 (the default) tries one address at a time */
+
+	/* applied by listen; 0 (or -1 for .sin_incomingcpu) leaves unset */
+	int sin_deferaccept; /* TCP_DEFER_ACCEPT seconds */
+	int sin_fastopen;    /* TCP_FASTOPEN pending queue length */
+	int sin_incomingcpu; /* SO_INCOMING_CPU */
+
+	/* applied to new sockets, and inherited by accepted ones */
+	int sin_busypoll; /* SO_BUSY_POLL microseconds; 0 leaves unset */
+	_Bool sin_preferbusypoll; /* SO_PREFER_BUSY_POLL */
 }; /* struct so_options */
 
 #define SO_OPTS_TLS_HOSTNAME ((char *)1) /* place holder for peer host name */
 
-#define so_opts(...)	(&(struct so_options){ .sin_reuseaddr = 1, .sin_v6only = SO_V6ONLY_DEFAULT, .fd_nonblock = 1, .fd_cloexec = 1, .fd_nosigpipe = 1, .tls_sendname = SO_OPTS_TLS_HOSTNAME, .st_time = 1, __VA_ARGS__ })
+#define SO_RACE_DELAY 250 /* RFC 8305 recommended connection attempt delay, ms */
+
+#define so_opts(...)	(&(struct so_options){ .sin_reuseaddr = 1, .sin_v6only = SO_V6ONLY_DEFAULT, .fd_nonblock = 1, .fd_cloexec = 1, .fd_nosigpipe = 1, .tls_sendname = SO_OPTS_TLS_HOSTNAME, .st_time = 1, .sin_incomingcpu = -1, __VA_ARGS__ })
 
 static inline _Bool so_isbool(const so_optional v) {
 	return v.type == SO_OPT_BOOLEAN;
@@ -490,6 +503,14 @@ int so_v6only(int, _Bool);
 
 int so_oobinline(int, _Bool);
 
+int so_deferaccept(int, int);
+
+int so_fastopen(int, int);
+
+int so_incomingcpu(int, int);
+
+int so_busypoll(int, int, _Bool);
+
 #define SO_F_CLOEXEC   0x0001
 #define SO_F_NONBLOCK  0x0002
 #define SO_F_REUSEADDR 0x0004
@@ -559,18 +580,38 @@ struct so_starttls {
 	struct iovec pushback;
 
 	so_optional accept;
+
+	_Bool ktls; /* request kernel TLS offload where supported */
 }; /* struct so_starttls */
 
 int so_starttls(struct socket *, const struct so_starttls *);
 
 SSL *so_checktls(struct socket *);
 
+#define SO_KTLS_SEND 0x01
+#define SO_KTLS_RECV 0x02
+
+/* returns which directions are offloaded to kernel TLS */
+int so_ktls(struct socket *);
+
 int so_shutdown(struct socket *, int /* SHUT_RD, SHUT_WR, SHUT_RDWR */);
 
 size_t so_read(struct socket *, void *, size_t, int *);
 
 size_t so_write(struct socket *, const void *, size_t, int *);
 
+/*
+ * Write up to count bytes read from fd, using sendfile(2) or splice(2)
+ * where available. Returns 0 with error 0 at end of file.
+ */
+size_t so_sendfile(struct socket *, int, off_t *, size_t, int *);
+
+size_t so_writev(struct socket *, const struct iovec *, int, int *);
+
+size_t so_sendmmsg(struct socket *, const struct iovec *, size_t, int *);
+
+size_t so_recvmany(struct socket *, struct msghdr *, size_t, int *);
+
 #define SO_F_PEEKALL 0x01
 
 size_t so_peek(struct socket *, void *, size_t, int, int *);
@@ -618,6 +659,12 @@ struct so_stat {
 		_Bool eof;
 		time_t time;
 	} sent, rcvd;
+
+	struct st_connect {
+		unsigned attempts; /* connect(2) attempts started */
+		unsigned winner;   /* attempt that connected, from 1; 0 if none */
+		struct sockaddr_storage addr; /* address of the winner */
+	} connect;
 }; /* struct so_stat */
 
 const struct so_stat *so_stat(struct socket *);
@@ -627,10 +674,20 @@ const struct so_stat *so_stat(struct socket *);
 
 int so_events(struct socket *);
 
+int so_drained(struct socket *);
+
 void so_clear(struct socket *);
 
 int so_pollfd(struct socket *);
 
+/*
+ * While so_connect races addresses only the newest attempt is polled, so
+ * callers should retry so_connect within this many milliseconds to start
+ * the next attempt or notice an earlier one finishing. -1 when no race
+ * is in progress.
+ */
+int so_racetimeout(struct socket *);
+
 int so_poll(struct socket *, int);
 
 int so_peerfd(struct socket *);
@@ -66,6 +66,31 @@ static int ln_get(lua_State *L) {
 } /* ln_get() */
 
 
+/* step once and collect every ready change into a table keyed by name */
+static int ln_batch(lua_State *L) {
+	struct luanotify *N = luaL_checkudata(L, 1, CQS_NOTIFY);
+	const char *name = 0;
+	int changes, error, count = 0;
+
+	if ((error = notify_step(N->notify, 0))) {
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+
+	lua_newtable(L);
+
+	while ((changes = notify_get(N->notify, &name))) {
+		lua_pushinteger(L, changes);
+		lua_setfield(L, -2, name);
+		count++;
+	}
+
+	return (count)? 1 : 0;
+} /* ln_batch() */
+
+
 static int ln_add(lua_State *L) {
 	struct luanotify *N = luaL_checkudata(L, 1, CQS_NOTIFY);
 	const char *name = luaL_checkstring(L, 2);
@@ -120,6 +145,7 @@ static int ln_timeout(lua_State *L) {
 static const luaL_Reg ln_methods[] = {
 	{ "step",    &ln_step },
 	{ "get",     &ln_get },
+	{ "batch",   &ln_batch },
 	{ "add",     &ln_add },
 	{ "pollfd",  &ln_pollfd },
 	{ "events",  &ln_events },
@@ -146,16 +172,34 @@ static const luaL_Reg ln_metatable[] = {
 
 static int ln_opendir(lua_State *L) {
 	const char *path = luaL_checkstring(L, 1);
+	int flags = NOTIFY_ALL; /* NB: changes, argument 2, is ignored */
+	lua_Number window = 0;
 	struct luanotify *N = 0;
 	int error;
 
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+
+		lua_getfield(L, 3, "recursive");
+		if (lua_toboolean(L, -1))
+			flags |= NOTIFY_RECURSE;
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "window");
+		window = luaL_optnumber(L, -1, 0);
+		luaL_argcheck(L, window >= 0 && window <= INT_MAX / 1000, 3, "coalescing window out of range");
+		lua_pop(L, 1);
+	}
+
 	N = lua_newuserdata(L, sizeof *N);
 	N->notify = 0;
 	luaL_setmetatable(L, CQS_NOTIFY);
 
-	if (!(N->notify = notify_opendir(path, NOTIFY_ALL, &error)))
+	if (!(N->notify = notify_opendir(path, flags, &error)))
 		goto error;
 
+	notify_setwindow(N->notify, (int)(window * 1000));
+
 	return 1;
 error:
 	lua_pushnil(L);
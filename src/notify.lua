@@ -52,6 +52,32 @@ local loader = function(loader, ...)
 		end
 	end)
 
+	--
+	-- notify:batch
+	--
+	local batch; batch = notify.interpose("batch", function(self, timeout)
+		local deadline = timeout and (cqueues.monotime() + timeout)
+
+		while true do
+			local changes, why = batch(self)
+
+			if changes then
+				return changes
+			elseif changes == false then
+				oops(self, "batch", why)
+			elseif deadline then
+				local curtime = cqueues.monotime()
+				if curtime >= deadline then
+					return nil
+				else
+					cqueues.poll(self, deadline - curtime)
+				end
+			else
+				cqueues.poll(self)
+			end
+		end
+	end)
+
 	--
 	-- notify:add
 	--
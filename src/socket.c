@@ -28,11 +28,15 @@
 #include <stddef.h>	/* NULL offsetof size_t */
 #include <stdarg.h>	/* va_list va_start va_arg va_end */
 #include <stdlib.h>	/* strtol(3) */
+#include <limits.h>	/* INT_MAX */
 #include <string.h>	/* memset(3) memchr(3) memcpy(3) memmem(3) */
 #include <math.h>	/* NAN */
+#include <time.h>	/* clock(3) */
+#include <pthread.h>	/* PTHREAD_MUTEX_INITIALIZER pthread_mutex_lock(3) pthread_mutex_unlock(3) */
 #include <errno.h>	/* EBADF ENOTSOCK EOPNOTSUPP EOVERFLOW EPIPE */
 
 #include <sys/types.h>
+#include <sys/queue.h>	/* TAILQ_* */
 #include <sys/socket.h>	/* AF_UNIX MSG_CMSG_CLOEXEC SOCK_CLOEXEC SOCK_STREAM SOCK_SEQPACKET SOCK_DGRAM PF_UNSPEC socketpair(2) */
 #include <sys/un.h>	/* struct sockaddr_un */
 #include <unistd.h>	/* dup(2) */
@@ -40,14 +44,23 @@
 #include <arpa/inet.h>	/* ntohs(3) */
 
 #include <openssl/ssl.h> /* SSL_CTX, SSL_CTX_free(), SSL_CTX_up_ref(), SSL, SSL_up_ref() */
-#include <openssl/crypto.h> /* CRYPTO_LOCK_SSL CRYPTO_add() */
+#include <openssl/crypto.h> /* CRYPTO_LOCK_SSL CRYPTO_add() OPENSSL_cleanse() */
+#include <openssl/rand.h> /* RAND_bytes() */
+#include <openssl/evp.h> /* EVP_CIPHER_CTX EVP_aes_256_cbc() EVP_EncryptInit_ex() EVP_DecryptInit_ex() */
+#include <openssl/hmac.h> /* HMAC_CTX HMAC_Init_ex() */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined LIBRESSL_VERSION_NUMBER
+#include <openssl/core_names.h> /* OSSL_MAC_PARAM_KEY OSSL_MAC_PARAM_DIGEST */
+#include <openssl/params.h> /* OSSL_PARAM_construct_octet_string() OSSL_PARAM_construct_utf8_string() */
+#endif
 
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "lib/socket.h"
 #include "lib/fifo.h"
+#include "lib/memscan.h"
 #include "lib/dns.h"
+#include "lib/llrb.h"
 
 #include "cqueues.h"
 
@@ -67,6 +80,10 @@
 #define HAVE_SSL_UP_REF HAVE_OPENSSL11_API
 #endif
 
+#ifndef HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+#define HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB (OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined LIBRESSL_VERSION_NUMBER)
+#endif
+
 
 /*
  * C O M P A T  R O U T I N E S
@@ -87,6 +104,10 @@
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+/* replaced by the fastest supported kernels when the module is loaded */
+static const struct memscan *iov_kernel = &memscan_scalar;
+
+
 static inline _Bool mime_isblank(unsigned char ch) {
 	return ch == 32 || ch == 9;
 } /* mime_isblank() */
@@ -168,13 +189,13 @@ error:
  * Find end of MIME boundary marker. Returns length to end of marker, or 0
  * if not found.
  */
-static size_t iov_eob(const struct iovec *iov, const char *eob, size_t eoblen) {
+static size_t iov_eob(const struct iovec *iov, const char *eob, size_t eoblen, const struct memscan *K) {
 	const char *p;
 
 	if (iov->iov_len < eoblen)
 		return 0;
 
-	if ((p = memmem(iov->iov_base, iov->iov_len, eob, eoblen)))
+	if ((p = K->mem(iov->iov_base, iov->iov_len, eob, eoblen)))
 		return (p + eoblen) - (char *)iov->iov_base;
 
 	return 0;
@@ -194,12 +215,27 @@ static size_t iov_eot(const struct iovec *iov, size_t minbuf, size_t maxbuf, _Bo
 	p = iov->iov_base;
 	pe = p + iov->iov_len;
 
-	for (; p < pe && n < maxbuf; ++n) {
+	while (p < pe && n < maxbuf) {
+		size_t run = MIN((size_t)(pe - p), maxbuf - n);
+		const char *cr = memchr(p, '\r', run);
+
+		if (cr != p) {
+			/* text without \r translates one-for-one */
+			run = (cr)? (size_t)(cr - p) : run;
+			p += run;
+			n += run;
+			lc = p[-1];
+
+			continue;
+		}
+
 		lc = *p++;
 
-		if (lc == '\r' && p < pe && *p == '\n') {
+		if (p < pe && *p == '\n') {
 			lc = *p++; /* skip \n so we don't ++n */
 		}
+
+		++n;
 	}
 
 	if ((size_t)-1 == (eot = p - (char *)iov->iov_base)) {
@@ -242,18 +278,13 @@ error:
 } /* iov_eot() */
 
 
-static size_t iov_eol(const struct iovec *iov) {
-	const char *p, *pe;
-	size_t eol = 0;
-
-	p = iov->iov_base;
-	pe = p + iov->iov_len;
+static size_t iov_eol(const struct iovec *iov, const struct memscan *K) {
+	const char *p;
 
-	while (p < pe && (p = memchr(p, '\n', pe - p))) {
-		eol = ++p - (char *)iov->iov_base;
-	}
+	if ((p = K->rchr(iov->iov_base, '\n', iov->iov_len)))
+		return ++p - (char *)iov->iov_base;
 
-	return (eol)? eol : iov->iov_len;
+	return iov->iov_len;
 } /* iov_eol() */
 
 
@@ -268,14 +299,23 @@ static size_t iov_trimcr(struct iovec *iov, _Bool chomp) {
 		if (pe - p >= 2 && pe[-1] == '\n' && pe[-2] == '\r')
 			*(--pe - 1) = '\n';
 	} else {
-		while (p < pe && (p = memchr(p, '\r', pe - p))) {
-			if (++p >= pe) {
-				break;
-			} else if (*p == '\n') {
-				memmove(p - 1, p, pe - p);
-				--pe;
-			}
+		char *dp = p, *cr;
+		size_t n;
+
+		/* compact in one pass rather than shifting the tail per match */
+		while (p < pe && (cr = memchr(p, '\r', pe - p))) {
+			n = cr - p;
+
+			if (cr + 1 >= pe || cr[1] != '\n')
+				n++; /* keep lone \r */
+
+			memmove(dp, p, n);
+			dp += n;
+			p = cr + 1;
 		}
+
+		memmove(dp, p, pe - p);
+		pe = dp + (pe - p);
 	}
 
 	return iov->iov_len = pe - (char *)iov->iov_base;
@@ -284,9 +324,8 @@ static size_t iov_trimcr(struct iovec *iov, _Bool chomp) {
 
 /* strip \r?\n from \r?\n sequences */
 static size_t iov_trimcrlf(struct iovec *iov, _Bool chomp) {
-	char *sp, *p, *pe;
+	char *p, *pe;
 
-	sp = iov->iov_base;
 	p = iov->iov_base;
 	pe = p + iov->iov_len;
 
@@ -298,16 +337,22 @@ static size_t iov_trimcrlf(struct iovec *iov, _Bool chomp) {
 				--pe;
 		}
 	} else {
-		while (p < pe && (p = memchr(p, '\n', pe - p))) {
-			if (p > sp && p[-1] == '\r') {
-				++p;
-				memmove(p - 2, p, pe - p);
-				pe -= 2;
-			} else {
-				memmove(p, p + 1, pe - p - 1);
-				--pe;
-			}
+		char *dp = p, *lf;
+		size_t n;
+
+		while (p < pe && (lf = memchr(p, '\n', pe - p))) {
+			n = lf - p;
+
+			if (n > 0 && lf[-1] == '\r')
+				n--;
+
+			memmove(dp, p, n);
+			dp += n;
+			p = lf + 1;
 		}
+
+		memmove(dp, p, pe - p);
+		pe = dp + (pe - p);
 	}
 
 	return iov->iov_len = pe - (char *)iov->iov_base;
@@ -379,6 +424,11 @@ struct luasocket {
 		_Bool eof;
 		_Bool eom;
 
+		unsigned long long seq; /* bumped whenever input is consumed */
+
+		size_t charged; /* bytes counted against the buffer pool */
+		_Bool throttled; /* last fill refused by the pool budget */
+
 		int error;
 		size_t numerrs;
 		size_t maxerrs;
@@ -390,6 +440,7 @@ struct luasocket {
 		size_t bufsiz;
 
 		struct fifo fifo;
+		size_t charged;
 
 		_Bool eof;
 		size_t eol;
@@ -670,6 +721,66 @@ static struct so_options lso_checkopts(lua_State *L, int index) {
 	if (lso_altfield(L, index, "time", "st_time"))
 		opts.st_time = lso_popbool(L);
 
+	if (lso_altfield(L, index, "deferaccept", "sin_deferaccept")) {
+		if (lua_isboolean(L, -1)) {
+			opts.sin_deferaccept = lua_toboolean(L, -1);
+		} else {
+			int secs = luaL_checkint(L, -1);
+
+			luaL_argcheck(L, secs >= 0, index, "deferaccept timeout out of range");
+			opts.sin_deferaccept = secs;
+		}
+
+		lua_pop(L, 1);
+	}
+
+	if (lso_altfield(L, index, "fastopen", "sin_fastopen")) {
+		if (lua_isboolean(L, -1)) {
+			opts.sin_fastopen = (lua_toboolean(L, -1))? SOMAXCONN : 0;
+		} else {
+			int qlen = luaL_checkint(L, -1);
+
+			luaL_argcheck(L, qlen >= 0, index, "fastopen queue length out of range");
+			opts.sin_fastopen = qlen;
+		}
+
+		lua_pop(L, 1);
+	}
+
+	if (lso_altfield(L, index, "incomingcpu", "sin_incomingcpu")) {
+		int cpu = luaL_checkint(L, -1);
+
+		luaL_argcheck(L, cpu >= 0, index, "incomingcpu out of range");
+		opts.sin_incomingcpu = cpu;
+
+		lua_pop(L, 1);
+	}
+
+	if (lso_altfield(L, index, "busypoll", "sin_busypoll")) {
+		lua_Number usecs = luaL_checknumber(L, -1) * 1000000;
+
+		luaL_argcheck(L, usecs >= 0 && usecs <= INT_MAX, index, "busypoll interval out of range");
+		opts.sin_busypoll = (int)usecs;
+
+		lua_pop(L, 1);
+	}
+
+	if (lso_altfield(L, index, "preferbusypoll", "sin_preferbusypoll"))
+		opts.sin_preferbusypoll = lso_popbool(L);
+
+	if (lso_altfield(L, index, "race", "sin_race")) {
+		if (lua_isboolean(L, -1)) {
+			opts.sin_race = (lua_toboolean(L, -1))? SO_RACE_DELAY : 0;
+		} else {
+			lua_Number delay = luaL_checknumber(L, -1);
+
+			luaL_argcheck(L, delay >= 0 && delay <= INT_MAX / 1000, index, "race delay out of range");
+			opts.sin_race = (int)(delay * 1000);
+		}
+
+		lua_pop(L, 1);
+	}
+
 	return opts;
 } /* lso_checkopts() */
 
@@ -823,8 +934,374 @@ static struct luasocket *lso_newsocket(lua_State *L, int type) {
 } /* lso_newsocket() */
 
 
+/*
+ * Buffer pool. Socket buffers are borrowed when I/O needs them and handed
+ * back once drained, so idle sockets hold no buffer memory. Returned
+ * buffers are cached by power-of-2 size class for reuse by any socket in
+ * the process. With a budget set, input buffers aren't lent while the
+ * bytes lent out would exceed it, which stalls reads (see
+ * socket:throttled) until other sockets give memory back. Output is
+ * counted but never refused, so a stalled reader can always be answered.
+ *
+ * Each thread keeps up to LSO_TCACHE buffers of every class in front of
+ * the shared cache, so sockets draining and refilling don't contend on
+ * the pool mutex. It's taken only when a thread's cache of a class runs
+ * empty or overflows, moving half a cache's worth at a time, and when a
+ * thread exits. The counters are updated with the __atomic builtins where
+ * available, else under a mutex of their own.
+ *
+ * A refused fill registers a waiter, and the next buffer handed back
+ * makes the pool's wake pipe readable (see socket.bufwaitfd). The next
+ * budgeted fill drains it again.
+ */
+#define LSO_POOLMIN   8  /* smallest class, 256 bytes */
+#define LSO_POOLMAX   16 /* largest class, 64 KiB */
+#define LSO_POOLCACHE (8 * 1024 * 1024)
+#define LSO_NCLASS    (LSO_POOLMAX - LSO_POOLMIN + 1)
+#define LSO_TCACHE    8  /* buffers of each class cached per thread */
+
+#ifndef HAVE___ATOMIC_FETCH_ADD
+#define HAVE___ATOMIC_FETCH_ADD (defined __ATOMIC_RELAXED)
+#endif
+
+#if HAVE___ATOMIC_FETCH_ADD
+#define lso_add(p, n) __atomic_add_fetch((p), (n), __ATOMIC_SEQ_CST)
+#define lso_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define lso_load(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define lso_store(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#else
+static pthread_mutex_t lso_statmutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline size_t lso_add(size_t *p, size_t n) {
+	size_t v;
+
+	pthread_mutex_lock(&lso_statmutex);
+	v = (*p += n);
+	pthread_mutex_unlock(&lso_statmutex);
+
+	return v;
+} /* lso_add() */
+
+static inline size_t lso_xchg(size_t *p, size_t v) {
+	size_t o;
+
+	pthread_mutex_lock(&lso_statmutex);
+	o = *p;
+	*p = v;
+	pthread_mutex_unlock(&lso_statmutex);
+
+	return o;
+} /* lso_xchg() */
+
+#define lso_load(p) lso_add((p), 0)
+#define lso_store(p, v) ((void)lso_xchg((p), (v)))
+#endif
+
+static struct {
+	pthread_mutex_t mutex; /* free lists and wake pipe */
+	size_t budget, cachemax;
+	size_t inuse, cached;
+	size_t borrowed, reused, throttled;
+	size_t waiting, signaled;
+	int wake[2];
+	void *free[LSO_NCLASS];
+} lso_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cachemax = LSO_POOLCACHE,
+	.wake = { -1, -1 },
+};
+
+struct lso_tcache {
+	unsigned count[LSO_NCLASS];
+	void *free[LSO_NCLASS];
+}; /* struct lso_tcache */
+
+static pthread_once_t lso_tcacheonce = PTHREAD_ONCE_INIT;
+static pthread_key_t lso_tcachekey;
+static int lso_tcacheerror = -1;
+
+static int lso_poolclass(size_t size) {
+	int i;
+
+	for (i = LSO_POOLMIN; i <= LSO_POOLMAX; i++) {
+		if (size == (size_t)1 << i)
+			return i - LSO_POOLMIN;
+	}
+
+	return -1;
+} /* lso_poolclass() */
+
+static size_t lso_bufsize(size_t bufsiz) {
+	return (bufsiz == LSO_INFSIZ)? LSO_BUFSIZ : bufsiz;
+} /* lso_bufsize() */
+
+/* move thread cache buffers of class k to the shared cache until keep remain */
+static void lso_tcachespill(struct lso_tcache *tc, int k, unsigned keep) {
+	void *buf;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	while (tc->count[k] > keep && (buf = tc->free[k])) {
+		tc->free[k] = *(void **)buf;
+		tc->count[k]--;
+
+		*(void **)buf = lso_pool.free[k];
+		lso_pool.free[k] = buf;
+	}
+
+	pthread_mutex_unlock(&lso_pool.mutex);
+} /* lso_tcachespill() */
+
+/* move up to n buffers of class k from the shared cache */
+static void lso_tcachefill(struct lso_tcache *tc, int k, unsigned n) {
+	void *buf;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	while (tc->count[k] < n && (buf = lso_pool.free[k])) {
+		lso_pool.free[k] = *(void **)buf;
+
+		*(void **)buf = tc->free[k];
+		tc->free[k] = buf;
+		tc->count[k]++;
+	}
+
+	pthread_mutex_unlock(&lso_pool.mutex);
+} /* lso_tcachefill() */
+
+static void lso_pooltrim(void);
+
+/* thread exit: hand everything to the shared cache, then trim it */
+static void lso_tcachefree(void *arg) {
+	struct lso_tcache *tc = arg;
+	int k;
+
+	for (k = 0; k < LSO_NCLASS; k++)
+		lso_tcachespill(tc, k, 0);
+
+	free(tc);
+
+	pthread_mutex_lock(&lso_pool.mutex);
+	lso_pooltrim();
+	pthread_mutex_unlock(&lso_pool.mutex);
+} /* lso_tcachefree() */
+
+static void lso_tcacheinit(void) {
+	lso_tcacheerror = pthread_key_create(&lso_tcachekey, &lso_tcachefree);
+} /* lso_tcacheinit() */
+
+/* the calling thread's cache, or NULL to go straight to the shared one */
+static struct lso_tcache *lso_tcache(_Bool make) {
+	struct lso_tcache *tc;
+
+	if (pthread_once(&lso_tcacheonce, &lso_tcacheinit) || lso_tcacheerror)
+		return NULL;
+
+	if (!(tc = pthread_getspecific(lso_tcachekey)) && make) {
+		if (!(tc = calloc(1, sizeof *tc)))
+			return NULL;
+
+		if (pthread_setspecific(lso_tcachekey, tc)) {
+			free(tc);
+
+			return NULL;
+		}
+	}
+
+	return tc;
+} /* lso_tcache() */
+
+/* take a cached buffer of class k, if any */
+static void *lso_cacheget(int k) {
+	struct lso_tcache *tc = lso_tcache(1);
+	void *buf;
+
+	if (tc) {
+		if (!tc->free[k])
+			lso_tcachefill(tc, k, LSO_TCACHE / 2);
+
+		if ((buf = tc->free[k])) {
+			tc->free[k] = *(void **)buf;
+			tc->count[k]--;
+		}
+	} else {
+		pthread_mutex_lock(&lso_pool.mutex);
+
+		if ((buf = lso_pool.free[k]))
+			lso_pool.free[k] = *(void **)buf;
+
+		pthread_mutex_unlock(&lso_pool.mutex);
+	}
+
+	if (buf) {
+		lso_add(&lso_pool.cached, -((size_t)1 << (k + LSO_POOLMIN)));
+		lso_add(&lso_pool.reused, 1);
+	}
+
+	return buf;
+} /* lso_cacheget() */
+
+/* cache buf of class k; false if the cache is full */
+static _Bool lso_cacheput(int k, void *buf) {
+	size_t size = (size_t)1 << (k + LSO_POOLMIN);
+	struct lso_tcache *tc;
+
+	if (lso_add(&lso_pool.cached, size) > lso_load(&lso_pool.cachemax)) {
+		lso_add(&lso_pool.cached, -size);
+
+		return 0;
+	}
+
+	if ((tc = lso_tcache(1))) {
+		if (tc->count[k] >= LSO_TCACHE)
+			lso_tcachespill(tc, k, LSO_TCACHE / 2);
+
+		*(void **)buf = tc->free[k];
+		tc->free[k] = buf;
+		tc->count[k]++;
+	} else {
+		pthread_mutex_lock(&lso_pool.mutex);
+		*(void **)buf = lso_pool.free[k];
+		lso_pool.free[k] = buf;
+		pthread_mutex_unlock(&lso_pool.mutex);
+	}
+
+	return 1;
+} /* lso_cacheput() */
+
+/* make the wake pipe readable for throttled readers */
+static void lso_poolsignal(void) {
+	if (lso_xchg(&lso_pool.signaled, 1))
+		return;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	while (lso_pool.wake[1] != -1 && -1 == write(lso_pool.wake[1], "!", 1)) {
+		if (errno != EINTR)
+			break; /* EAGAIN: already readable */
+	}
+
+	pthread_mutex_unlock(&lso_pool.mutex);
+} /* lso_poolsignal() */
+
+static void lso_pooldrain(void) {
+	char buf[64];
+
+	if (!lso_load(&lso_pool.signaled) || !lso_xchg(&lso_pool.signaled, 0))
+		return;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	while (lso_pool.wake[0] != -1 && (0 < read(lso_pool.wake[0], buf, sizeof buf) || errno == EINTR))
+		;;
+
+	pthread_mutex_unlock(&lso_pool.mutex);
+} /* lso_pooldrain() */
+
+/*
+ * Lend fifo a buffer of at least size bytes if it has none. *charged
+ * tracks what the fifo is counted for, as it may have grown since.
+ */
+static lso_error_t lso_bufget(struct fifo *fifo, size_t *charged, size_t size, _Bool budgeted) {
+	size_t budget;
+	void *buf = NULL;
+	int k;
+
+	if (fifo->base) {
+		if (fifo->size != *charged) {
+			lso_add(&lso_pool.inuse, fifo->size - *charged);
+
+			*charged = fifo->size;
+		}
+
+		return 0;
+	}
+
+	size = fifo_roundup(MAX(size, (size_t)1 << LSO_POOLMIN));
+
+	if (budgeted)
+		lso_pooldrain();
+
+	if (budgeted && (budget = lso_load(&lso_pool.budget)) && lso_add(&lso_pool.inuse, size) > budget) {
+		lso_add(&lso_pool.inuse, -size);
+		lso_add(&lso_pool.throttled, 1);
+		lso_store(&lso_pool.waiting, 1);
+
+		/* memory handed back before we registered signaled nobody */
+		if (lso_load(&lso_pool.inuse) + size <= budget)
+			lso_poolsignal();
+
+		return EAGAIN;
+	} else if (!budgeted || !budget) {
+		lso_add(&lso_pool.inuse, size);
+	}
+
+	lso_add(&lso_pool.borrowed, 1);
+
+	if ((k = lso_poolclass(size)) >= 0)
+		buf = lso_cacheget(k);
+
+	if (!buf && !(buf = malloc(size))) {
+		int error = errno;
+
+		lso_add(&lso_pool.inuse, -size);
+
+		return error;
+	}
+
+	fifo->base = buf;
+	fifo->size = size;
+	fifo->head = 0;
+	*charged = size;
+
+	return 0;
+} /* lso_bufget() */
+
+/* return fifo's buffer to the pool, but only if nothing is pending */
+static void lso_bufput(struct fifo *fifo, size_t *charged) {
+	void *buf = fifo->base;
+	size_t size = fifo->size;
+	int k;
+
+	if (!buf || fifo_rlen(fifo) || fifo->rbits.count || fifo->wbits.count)
+		return;
+
+	fifo->base = NULL;
+	fifo->size = 0;
+	fifo->head = 0;
+
+	lso_add(&lso_pool.inuse, -*charged);
+	*charged = 0;
+
+	if ((k = lso_poolclass(size)) < 0 || !lso_cacheput(k, buf))
+		free(buf);
+
+	if (lso_load(&lso_pool.waiting) && lso_xchg(&lso_pool.waiting, 0))
+		lso_poolsignal();
+} /* lso_bufput() */
+
+/* release shared cached buffers until no more than cachemax bytes remain */
+static void lso_pooltrim(void) {
+	size_t cachemax = lso_load(&lso_pool.cachemax);
+	void *buf;
+	int k;
+
+	for (k = LSO_NCLASS - 1; k >= 0 && lso_load(&lso_pool.cached) > cachemax; k--) {
+		while (lso_load(&lso_pool.cached) > cachemax && (buf = lso_pool.free[k])) {
+			lso_pool.free[k] = *(void **)buf;
+			lso_add(&lso_pool.cached, -((size_t)1 << (k + LSO_POOLMIN)));
+			free(buf);
+		}
+	}
+} /* lso_pooltrim() */
+
+#define lso_ibufput(S) lso_bufput(&(S)->ibuf.fifo, &(S)->ibuf.charged)
+#define lso_obufput(S) lso_bufput(&(S)->obuf.fifo, &(S)->obuf.charged)
+
+
 static lso_error_t lso_adjbuf(struct fifo *buf, size_t size) {
-	if (size == LSO_INFSIZ)
+	/* buffers are borrowed lazily, so only resize one that's live */
+	if (size == LSO_INFSIZ || !buf->base)
 		return 0;
 
 	return fifo_realloc(buf, size);
@@ -874,6 +1351,8 @@ static lso_error_t lso_checktodo(struct luasocket *S) {
 
 				if (S->ibuf.mode & LSO_PUSHBACK) {
 					fifo_purge(&S->ibuf.fifo);
+					lso_ibufput(S);
+					S->ibuf.seq++;
 					S->ibuf.eom = 0;
 				}
 			} else {
@@ -1077,92 +1556,496 @@ static lso_nargs_t lso_listen1(lua_State *L) {
 } /* lso_listen1() */
 
 
-/* luasec compat */
-#define LSEC_MODE_INVALID 0
-#define LSEC_MODE_SERVER  1
-#define LSEC_MODE_CLIENT  2
+/*
+ * TLS session cache. Server contexts passed to socket.sessioncache share
+ * one process-wide store of serialized sessions and one set of session
+ * ticket keys, so a client reconnecting to any controller or cthread in
+ * the process can resume instead of redoing the full handshake. Sessions
+ * expire after ttl seconds, and beyond size entries the least recently
+ * used are evicted. A fresh ticket key is drawn every rotate seconds;
+ * retired keys still accept (and reissue) tickets until sessions sealed
+ * with them would have expired anyway.
+ *
+ * Cached sessions are aged against the current ttl, and attached contexts
+ * are kept on a list, unlinked through ex_data as they're freed, so that
+ * a new ttl also reaches the sessions and tickets they issue from then on.
+ */
+#define LSO_SESSMAX    20480
+#define LSO_SESSTTL    300
+#define LSO_SESSROTATE 3600
+#define LSO_TICKETKEYS 8
+
+struct lso_session {
+	LLRB_ENTRY(lso_session) rbe;
+	TAILQ_ENTRY(lso_session) tqe;
+	time_t created;
+	unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+	size_t idlen, derlen;
+	unsigned char der[];
+}; /* struct lso_session */
+
+struct lso_ticketkey {
+	unsigned char name[16], aes[32], hmac[32];
+	time_t created;
+}; /* struct lso_ticketkey */
+
+static struct {
+	pthread_mutex_t mutex;
+	size_t size, count;
+	time_t ttl, rotate;
+	LLRB_HEAD(lso_sessions, lso_session) tree;
+	TAILQ_HEAD(lso_sesslru, lso_session) lru; /* most recently used first */
+	struct lso_ticketkey key[LSO_TICKETKEYS]; /* newest first */
+	unsigned nkeys;
+	unsigned long long hits, misses, stored, evicted, expired;
+	unsigned long long issued, renewed, rejected, rotated;
+} lso_sess = {
+	PTHREAD_MUTEX_INITIALIZER, LSO_SESSMAX, 0, LSO_SESSTTL, LSO_SESSROTATE,
+	LLRB_INITIALIZER(&lso_sess.tree), TAILQ_HEAD_INITIALIZER(lso_sess.lru),
+};
 
-typedef struct {
-	SSL_CTX *context;
-	lua_State *L;
-	DH *dh_param;
-	int mode;
-} lsec_context;
+struct lso_sessctx {
+	SSL_CTX *ctx;
+	TAILQ_ENTRY(lso_sessctx) tqe;
+}; /* struct lso_sessctx */
 
+/* attached contexts and their ex_data index; mutex held */
+static TAILQ_HEAD(, lso_sessctx) lso_sessctxs = TAILQ_HEAD_INITIALIZER(lso_sessctxs);
+static int lso_sessctxindex = -1;
 
-static lso_nargs_t lso_starttls(lua_State *L) {
-	struct luasocket *S = lso_checkself(L, 1);
-	SSL_CTX **ctx = NULL;
-	SSL **ssl = NULL;
-	int error;
+static int lso_sesscmp(const struct lso_session *a, const struct lso_session *b) {
+	if (a->idlen != b->idlen)
+		return (a->idlen < b->idlen)? -1 : 1;
 
-	/*
-	 * NB: short-circuit if we've already started so we don't
-	 * unnecessarily check for or take a reference to the SSL_CTX
-	 * object.
-	 */
-	if ((S->todo & LSO_DO_STARTTLS))
-		goto check;
+	return memcmp(a->id, b->id, a->idlen);
+} /* lso_sesscmp() */
 
-	if ((ssl = luaL_testudata(L, 2, "SSL*"))) {
-		/* accept-mode check handled by so_starttls() */
-	} else if ((ctx = luaL_testudata(L, 2, "SSL_CTX*"))) {
-		/* accept-mode check handled by so_starttls() */
-	} else if ((ctx = luaL_testudata(L, 2, "SSL:Context"))) { /* luasec compatability */
-		luaL_argcheck(L, ((lsec_context*)ctx)->mode != LSEC_MODE_INVALID, 2, "invalid mode");
-		so_setbool(&S->tls.config.accept, ((((lsec_context*)ctx)->mode) == LSEC_MODE_SERVER));
-	}
+LLRB_GENERATE_STATIC(lso_sessions, lso_session, rbe, lso_sesscmp)
 
-	if (ssl && *ssl && *ssl != S->tls.config.instance) {
-		if (S->tls.config.instance)
-			SSL_free(S->tls.config.instance);
+/* unlink and free ent; call with mutex held */
+static void lso_sessfree(struct lso_session *ent) {
+	LLRB_REMOVE(lso_sessions, &lso_sess.tree, ent);
+	TAILQ_REMOVE(&lso_sess.lru, ent, tqe);
+	lso_sess.count--;
 
-		SSL_up_ref(*ssl);
-		S->tls.config.instance = *ssl;
-	}
+	OPENSSL_cleanse(ent->der, ent->derlen);
+	free(ent);
+} /* lso_sessfree() */
 
-	if (ctx && *ctx && *ctx != S->tls.config.context) {
-		if (S->tls.config.context)
-			SSL_CTX_free(S->tls.config.context);
+/* drop stale entries from the cold end and enforce size; mutex held */
+static void lso_sesstrim(time_t now) {
+	struct lso_session *ent;
 
-		SSL_CTX_up_ref(*ctx);
-		S->tls.config.context = *ctx;
+	while ((ent = TAILQ_LAST(&lso_sess.lru, lso_sesslru))) {
+		if (lso_sess.count > lso_sess.size) {
+			lso_sess.evicted++;
+		} else if (ent->created + lso_sess.ttl <= now) {
+			lso_sess.expired++;
+		} else {
+			break;
+		}
+
+		lso_sessfree(ent);
 	}
+} /* lso_sesstrim() */
+
+static int lso_sessnew(SSL *ssl, SSL_SESSION *sess) {
+	struct lso_session *ent, *old;
+	const unsigned char *id;
+	unsigned char *p;
+	unsigned idlen;
+	int len;
+	time_t now;
+
+#if defined TLS1_3_VERSION
+	/* TLS 1.3 tickets are self-contained unless stateful ones are asked for */
+	if (SSL_version(ssl) >= TLS1_3_VERSION && !(SSL_get_options(ssl) & SSL_OP_NO_TICKET))
+		return 0;
+#else
+	(void)ssl;
+#endif
 
-	S->todo |= LSO_DO_STARTTLS;
+	id = SSL_SESSION_get_id(sess, &idlen);
 
-	if (S->obuf.mode & LSO_AUTOFLUSH)
-		S->todo |= LSO_DO_FLUSH;
-check:
-	if ((error = lso_checktodo(S)))
-		goto error;
+	if (!idlen || idlen > sizeof ent->id || (len = i2d_SSL_SESSION(sess, NULL)) <= 0)
+		return 0;
 
-	lua_pushvalue(L, 1);
+	if (!(ent = malloc(offsetof(struct lso_session, der) + len)))
+		return 0;
 
-	return 1;
-error:
-	lua_pushnil(L);
-	lua_pushinteger(L, error);
+	p = ent->der;
+	ent->derlen = i2d_SSL_SESSION(sess, &p);
+	memcpy(ent->id, id, idlen);
+	ent->idlen = idlen;
 
-	return 2;
-} /* lso_starttls() */
+	now = time(NULL);
 
+	pthread_mutex_lock(&lso_sess.mutex);
 
-static lso_nargs_t lso_checktls(lua_State *L) {
-	struct luasocket *S = lso_checkself(L, 1);
-	SSL **ssl;
+	ent->created = now;
 
-	ssl = lua_newuserdata(L, sizeof *ssl);
+	if ((old = LLRB_FIND(lso_sessions, &lso_sess.tree, ent)))
+		lso_sessfree(old);
 
-	if (!(*ssl = so_checktls(S->socket)))
-		return 0;
+	LLRB_INSERT(lso_sessions, &lso_sess.tree, ent);
+	TAILQ_INSERT_HEAD(&lso_sess.lru, ent, tqe);
+	lso_sess.count++;
+	lso_sess.stored++;
 
-	luaL_getmetatable(L, "SSL*");
+	lso_sesstrim(now);
 
-	if (lua_isnil(L, -1))
-		return 0;
+	pthread_mutex_unlock(&lso_sess.mutex);
 
-	lua_setmetatable(L, -2);
+	return 0; /* we keep a copy, not the reference */
+} /* lso_sessnew() */
+
+#if HAVE_OPENSSL11_API
+#define LSO_SESSID const unsigned char
+#else
+#define LSO_SESSID unsigned char
+#endif
+
+static SSL_SESSION *lso_sessget(SSL *ssl, LSO_SESSID *id, int idlen, int *copy) {
+	struct lso_session key, *ent;
+	SSL_SESSION *sess = NULL;
+	const unsigned char *p;
+	time_t now;
+
+	(void)ssl;
+	*copy = 0;
+
+	if (idlen <= 0 || (size_t)idlen > sizeof key.id)
+		return NULL;
+
+	memcpy(key.id, id, idlen);
+	key.idlen = idlen;
+
+	now = time(NULL);
+
+	pthread_mutex_lock(&lso_sess.mutex);
+
+	if ((ent = LLRB_FIND(lso_sessions, &lso_sess.tree, &key))) {
+		if (ent->created + lso_sess.ttl <= now) {
+			lso_sess.expired++;
+			lso_sessfree(ent);
+		} else {
+			TAILQ_REMOVE(&lso_sess.lru, ent, tqe);
+			TAILQ_INSERT_HEAD(&lso_sess.lru, ent, tqe);
+
+			p = ent->der;
+
+			/* the session carries the ttl it was stored with */
+			if ((sess = d2i_SSL_SESSION(NULL, &p, ent->derlen)))
+				SSL_SESSION_set_timeout(sess, (long)lso_sess.ttl);
+		}
+	}
+
+	if (sess)
+		lso_sess.hits++;
+	else
+		lso_sess.misses++;
+
+	pthread_mutex_unlock(&lso_sess.mutex);
+
+	return sess;
+} /* lso_sessget() */
+
+static void lso_sessdel(SSL_CTX *ctx, SSL_SESSION *sess) {
+	struct lso_session key, *ent;
+	const unsigned char *id;
+	unsigned idlen;
+
+	(void)ctx;
+
+	id = SSL_SESSION_get_id(sess, &idlen);
+
+	if (!idlen || idlen > sizeof key.id)
+		return;
+
+	memcpy(key.id, id, idlen);
+	key.idlen = idlen;
+
+	pthread_mutex_lock(&lso_sess.mutex);
+
+	if ((ent = LLRB_FIND(lso_sessions, &lso_sess.tree, &key)))
+		lso_sessfree(ent);
+
+	pthread_mutex_unlock(&lso_sess.mutex);
+} /* lso_sessdel() */
+
+/* draw a new ticket key once the newest is rotate seconds old; mutex held */
+static int lso_ticketrotate(time_t now) {
+	struct lso_ticketkey key;
+
+	if (lso_sess.nkeys && now - lso_sess.key[0].created < lso_sess.rotate)
+		return 0;
+
+	if (RAND_bytes(key.name, sizeof key.name) <= 0
+	||  RAND_bytes(key.aes, sizeof key.aes) <= 0
+	||  RAND_bytes(key.hmac, sizeof key.hmac) <= 0)
+		return -1;
+
+	key.created = now;
+
+	OPENSSL_cleanse(&lso_sess.key[LSO_TICKETKEYS - 1], sizeof lso_sess.key[0]);
+	memmove(&lso_sess.key[1], &lso_sess.key[0], (LSO_TICKETKEYS - 1) * sizeof lso_sess.key[0]);
+	lso_sess.key[0] = key;
+	lso_sess.nkeys = MIN(lso_sess.nkeys + 1, LSO_TICKETKEYS);
+	lso_sess.rotated++;
+
+	OPENSSL_cleanse(&key, sizeof key);
+
+	return 0;
+} /* lso_ticketrotate() */
+
+#if HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+#define LSO_TICKETMAC EVP_MAC_CTX
+
+static int lso_ticketmac(EVP_MAC_CTX *hctx, unsigned char *key, size_t len) {
+	OSSL_PARAM params[3];
+
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, len);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+
+	return EVP_MAC_CTX_set_params(hctx, params);
+} /* lso_ticketmac() */
+#else
+#define LSO_TICKETMAC HMAC_CTX
+
+static int lso_ticketmac(HMAC_CTX *hctx, unsigned char *key, size_t len) {
+	return HMAC_Init_ex(hctx, key, (int)len, EVP_sha256(), NULL);
+} /* lso_ticketmac() */
+#endif
+
+/*
+ * Seal new tickets with the newest key. Tickets under a retired key are
+ * accepted while sessions from that key's era could still be live, and
+ * returning 2 asks OpenSSL to reissue them under the current key.
+ */
+static int lso_ticketkey(SSL *ssl, unsigned char name[16], unsigned char *iv, EVP_CIPHER_CTX *cctx, LSO_TICKETMAC *hctx, int enc) {
+	struct lso_ticketkey key;
+	time_t now = time(NULL);
+	unsigned i;
+	int rc;
+
+	(void)ssl;
+
+	pthread_mutex_lock(&lso_sess.mutex);
+
+	if (lso_ticketrotate(now)) {
+		pthread_mutex_unlock(&lso_sess.mutex);
+
+		return -1;
+	}
+
+	if (enc) {
+		i = 0;
+		lso_sess.issued++;
+	} else {
+		for (i = 0; i < lso_sess.nkeys; i++) {
+			if (!memcmp(name, lso_sess.key[i].name, sizeof key.name))
+				break;
+		}
+
+		/* key i was retired when key i - 1 was drawn */
+		if (i == lso_sess.nkeys || (i > 0 && now - lso_sess.key[i - 1].created >= lso_sess.ttl)) {
+			lso_sess.rejected++;
+			pthread_mutex_unlock(&lso_sess.mutex);
+
+			return 0;
+		} else if (i > 0) {
+			lso_sess.renewed++;
+		}
+	}
+
+	key = lso_sess.key[i];
+
+	pthread_mutex_unlock(&lso_sess.mutex);
+
+	if (enc) {
+		memcpy(name, key.name, sizeof key.name);
+
+		rc = RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) > 0
+		  && EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv)
+		  && lso_ticketmac(hctx, key.hmac, sizeof key.hmac);
+
+		rc = (rc)? 1 : -1;
+	} else {
+		rc = lso_ticketmac(hctx, key.hmac, sizeof key.hmac)
+		  && EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes, iv);
+
+		rc = (!rc)? -1 : (i > 0)? 2 : 1;
+	}
+
+	OPENSSL_cleanse(&key, sizeof key);
+
+	return rc;
+} /* lso_ticketkey() */
+
+/* ex_data free callback: unlink a context as it's freed */
+static void lso_sessdetach(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp) {
+	struct lso_sessctx *ent = ptr;
+
+	(void)parent;
+	(void)ad;
+	(void)idx;
+	(void)argl;
+	(void)argp;
+
+	if (!ent)
+		return;
+
+	pthread_mutex_lock(&lso_sess.mutex);
+	TAILQ_REMOVE(&lso_sessctxs, ent, tqe);
+	pthread_mutex_unlock(&lso_sess.mutex);
+
+	free(ent);
+} /* lso_sessdetach() */
+
+static int lso_sessattach(SSL_CTX *ctx) {
+	struct lso_sessctx *ent;
+	int error = 0;
+
+	pthread_mutex_lock(&lso_sess.mutex);
+
+	if (lso_sessctxindex == -1)
+		lso_sessctxindex = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, &lso_sessdetach);
+
+	if (lso_sessctxindex == -1) {
+		error = ENOMEM;
+	} else if (!SSL_CTX_get_ex_data(ctx, lso_sessctxindex)) {
+		if (!(ent = malloc(sizeof *ent))) {
+			error = errno;
+		} else if (!SSL_CTX_set_ex_data(ctx, lso_sessctxindex, ent)) {
+			free(ent);
+			error = ENOMEM;
+		} else {
+			ent->ctx = ctx;
+			TAILQ_INSERT_TAIL(&lso_sessctxs, ent, tqe);
+		}
+	}
+
+	if (!error)
+		SSL_CTX_set_timeout(ctx, (long)lso_sess.ttl);
+
+	pthread_mutex_unlock(&lso_sess.mutex);
+
+	if (error)
+		return error;
+
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER|SSL_SESS_CACHE_NO_INTERNAL);
+	SSL_CTX_sess_set_new_cb(ctx, &lso_sessnew);
+	SSL_CTX_sess_set_get_cb(ctx, &lso_sessget);
+	SSL_CTX_sess_set_remove_cb(ctx, &lso_sessdel);
+#if HAVE_SSL_CTX_SET_TLSEXT_TICKET_KEY_EVP_CB
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &lso_ticketkey);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(ctx, &lso_ticketkey);
+#endif
+
+	return 0;
+} /* lso_sessattach() */
+
+
+/* luasec compat */
+#define LSEC_MODE_INVALID 0
+#define LSEC_MODE_SERVER  1
+#define LSEC_MODE_CLIENT  2
+
+typedef struct {
+	SSL_CTX *context;
+	lua_State *L;
+	DH *dh_param;
+	int mode;
+} lsec_context;
+
+
+static lso_nargs_t lso_starttls(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	SSL_CTX **ctx = NULL;
+	SSL **ssl = NULL;
+	int index = 2, error;
+
+	/*
+	 * NB: short-circuit if we've already started so we don't
+	 * unnecessarily check for or take a reference to the SSL_CTX
+	 * object.
+	 */
+	if ((S->todo & LSO_DO_STARTTLS))
+		goto check;
+
+	/*
+	 * Either a context or SSL object, or an options table carrying one
+	 * in .context alongside flags like .ktls.
+	 */
+	if (lua_istable(L, 2)) {
+		if (lso_getfield(L, 2, "ktls"))
+			S->tls.config.ktls = lso_popbool(L);
+
+		lua_getfield(L, 2, "context");
+		index = lua_gettop(L);
+	}
+
+	if ((ssl = luaL_testudata(L, index, "SSL*"))) {
+		/* accept-mode check handled by so_starttls() */
+	} else if ((ctx = luaL_testudata(L, index, "SSL_CTX*"))) {
+		/* accept-mode check handled by so_starttls() */
+	} else if ((ctx = luaL_testudata(L, index, "SSL:Context"))) { /* luasec compatability */
+		luaL_argcheck(L, ((lsec_context*)ctx)->mode != LSEC_MODE_INVALID, index, "invalid mode");
+		so_setbool(&S->tls.config.accept, ((((lsec_context*)ctx)->mode) == LSEC_MODE_SERVER));
+	}
+
+	if (ssl && *ssl && *ssl != S->tls.config.instance) {
+		if (S->tls.config.instance)
+			SSL_free(S->tls.config.instance);
+
+		SSL_up_ref(*ssl);
+		S->tls.config.instance = *ssl;
+	}
+
+	if (ctx && *ctx && *ctx != S->tls.config.context) {
+		if (S->tls.config.context)
+			SSL_CTX_free(S->tls.config.context);
+
+		SSL_CTX_up_ref(*ctx);
+		S->tls.config.context = *ctx;
+	}
+
+	S->todo |= LSO_DO_STARTTLS;
+
+	if (S->obuf.mode & LSO_AUTOFLUSH)
+		S->todo |= LSO_DO_FLUSH;
+check:
+	if ((error = lso_checktodo(S)))
+		goto error;
+
+	lua_pushvalue(L, 1);
+
+	return 1;
+error:
+	lua_pushnil(L);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_starttls() */
+
+
+static lso_nargs_t lso_checktls(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	SSL **ssl;
+
+	ssl = lua_newuserdata(L, sizeof *ssl);
+
+	if (!(*ssl = so_checktls(S->socket)))
+		return 0;
+
+	luaL_getmetatable(L, "SSL*");
+
+	if (lua_isnil(L, -1))
+		return 0;
+
+	lua_setmetatable(L, -2);
 
 	SSL_up_ref(*ssl);
 
@@ -1170,6 +2053,17 @@ static lso_nargs_t lso_checktls(lua_State *L) {
 } /* lso_checktls() */
 
 
+static lso_nargs_t lso_ktls(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	int flags = so_ktls(S->socket);
+
+	lua_pushboolean(L, !!(flags & SO_KTLS_SEND));
+	lua_pushboolean(L, !!(flags & SO_KTLS_RECV));
+
+	return 2;
+} /* lso_ktls() */
+
+
 lso_error_t cqs_socket_fdopen(lua_State *L, int fd, const struct so_options *_opts) {
 	struct so_options opts = *((_opts)? _opts : so_opts());
 	struct luasocket *S;
@@ -1686,6 +2580,12 @@ static lso_error_t lso_fill(struct luasocket *S, size_t limit) {
 
 	prepbuf = (S->type == SOCK_DGRAM)? (SO_MIN(limit, 65536)) : 1;
 
+	error = lso_bufget(&S->ibuf.fifo, &S->ibuf.charged, MAX(lso_bufsize(S->ibuf.bufsiz), prepbuf), 1);
+	S->ibuf.throttled = (error == EAGAIN);
+
+	if (error)
+		return error;
+
 	while (fifo_rlen(&S->ibuf.fifo) < limit) {
 		if ((error = fifo_wbuf(&S->ibuf.fifo, &iov, prepbuf)))
 			return error;
@@ -1699,6 +2599,9 @@ static lso_error_t lso_fill(struct luasocket *S, size_t limit) {
 				return 0;
 			}
 		} else {
+			/* don't hold a buffer while waiting on an idle socket */
+			lso_ibufput(S);
+
 			switch (error) {
 			case EPIPE:
 				S->ibuf.eof = 1;
@@ -1802,7 +2705,7 @@ static lso_error_t lso_getbody(struct luasocket *S, struct iovec *iov, int *eom,
 
 	fifo_slice(&S->ibuf.fifo, iov, 0, maxbuf);
 
-	if ((n = iov_eob(iov, eob, eoblen))) {
+	if ((n = iov_eob(iov, eob, eoblen, iov_kernel))) {
 		iov->iov_len = n - eoblen; /* n >= eoblen */
 
 		*eom = 1;
@@ -1819,7 +2722,7 @@ static lso_error_t lso_getbody(struct luasocket *S, struct iovec *iov, int *eom,
 		iov->iov_len = bufsiz;
 
 		if (mode & LSO_TEXT) {
-			iov->iov_len = iov_eol(iov);
+			iov->iov_len = iov_eol(iov, iov_kernel);
 
 			/* trim if might be part of \r\n sequence */
 			if (iov_lc(iov) == '\r')
@@ -2181,8 +3084,12 @@ static lso_nargs_t lso_recv3(lua_State *L) {
 		goto error;
 	} /* switch(op) */
 
-	if (!fifo_rlen(&S->ibuf.fifo))
+	S->ibuf.seq++;
+
+	if (!fifo_rlen(&S->ibuf.fifo)) {
 		S->ibuf.eom = 0;
+		lso_ibufput(S);
+	}
 
 	return 1;
 error:
@@ -2207,6 +3114,7 @@ static lso_nargs_t lso_unget2(lua_State *L) {
 
 	fifo_rewind(&S->ibuf.fifo, len);
 	fifo_slice(&S->ibuf.fifo, &iov, 0, len);
+	S->ibuf.seq++;
 	memcpy(iov.iov_base, src, len);
 
 	S->ibuf.eof = 0;
@@ -2224,8 +3132,8 @@ error:
 
 static lso_error_t lso_doflush(struct luasocket *S, int mode) {
 	size_t amount = 0, n;
-	struct iovec iov;
-	int error;
+	struct iovec iov[2];
+	int iovcnt, error;
 
 	if (mode & LSO_LINEBUF) {
 		if (S->obuf.eol > 0) {
@@ -2241,10 +3149,11 @@ static lso_error_t lso_doflush(struct luasocket *S, int mode) {
 	}
 
 	while (amount) {
-		if (!fifo_slice(&S->obuf.fifo, &iov, 0, amount))
+		if (!(iovcnt = fifo_rvecs(&S->obuf.fifo, iov, amount)))
 			break; /* should never happen */
 
-		if (!(n = so_write(S->socket, iov.iov_base, iov.iov_len, &error)))
+		/* both halves of a wrapped buffer go out in one call */
+		if (!(n = so_writev(S->socket, iov, iovcnt, &error)))
 			goto error;
 
 		fifo_discard(&S->obuf.fifo, n);
@@ -2252,6 +3161,8 @@ static lso_error_t lso_doflush(struct luasocket *S, int mode) {
 		S->obuf.eol -= MIN(S->obuf.eol, n);
 	}
 
+	lso_obufput(S);
+
 	return 0;
 error:
 	switch (error) {
@@ -2293,6 +3204,36 @@ static lso_nargs_t lso_send5(lua_State *L) {
 
 	so_clear(S->socket);
 
+	if ((error = lso_bufget(&S->obuf.fifo, &S->obuf.charged, lso_bufsize(S->obuf.bufsiz), 0)))
+		goto error;
+
+	/*
+	 * Large binary writes bypass the buffer: whatever is queued and the
+	 * new data go out together in one gather write, and only what the
+	 * kernel doesn't take is copied below. Only byte streams, as a
+	 * gather write would merge datagrams and packets.
+	 */
+	if (S->type == SOCK_STREAM && !byline && (mode & (LSO_NOBUF|LSO_FULLBUF)) && pe - p >= S->obuf.bufsiz) {
+		struct iovec iov[3];
+		size_t queued = fifo_rlen(&S->obuf.fifo), direct = pe - p;
+		int iovcnt;
+
+		if (mode & LSO_FULLBUF)
+			direct -= (queued + direct) % S->obuf.bufsiz;
+
+		iovcnt = fifo_rvecs(&S->obuf.fifo, iov, queued);
+		iov[iovcnt].iov_base = (void *)&src[p];
+		iov[iovcnt].iov_len = direct;
+		iovcnt++;
+
+		if (!(n = so_writev(S->socket, iov, iovcnt, &error)))
+			goto error;
+
+		fifo_discard(&S->obuf.fifo, MIN(n, queued));
+		S->obuf.eol -= MIN(S->obuf.eol, MIN(n, queued));
+		p += n - MIN(n, queued);
+	}
+
 	while (p < pe) {
 		if (byline) {
 			n = MIN(pe - p, S->obuf.maxline);
@@ -2340,6 +3281,8 @@ static lso_nargs_t lso_send5(lua_State *L) {
 
 	return 1;
 error:
+	lso_obufput(S);
+
 	lua_pushinteger(L, p - tp);
 	lua_pushinteger(L, error);
 
@@ -2426,51 +3369,732 @@ error:
 } /* lso_sendfd3() */
 
 
-static lso_nargs_t lso_recvfd2(lua_State *L) {
-	struct luasocket *S = lso_checkself(L, 1);
-	size_t bufsiz = luaL_optunsigned(L, 2, S->ibuf.maxline);
-	struct msghdr *msg;
-	struct cmsghdr *cmsg;
-	struct iovec iov;
-	struct so_options opts;
-	int fd = -1, error;
+/*
+ * Non-blocking. Flushes buffered output, then transfers up to count bytes
+ * from a file, descriptor or socket without copying through Lua. Returns
+ * the number of bytes sent and, if stopped short for any reason other
+ * than end of file, an error code.
+ */
+static lso_nargs_t lso_sendfile4(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1), *src;
+	size_t count, sent = 0, n;
+	off_t offset, *offp = NULL;
+	int fd, error;
 
-	if ((error = lso_preprcv(L, S)))
+	if ((error = lso_prepsnd(L, S)))
 		goto error;
 
-	if ((error = fifo_grow(&S->ibuf.fifo, bufsiz)))
+	lua_settop(L, 4);
+
+	if ((fd = lso_tofileno(L, 2)) < 0) {
+		error = EBADF;
 		goto error;
+	}
 
-	fifo_wvec(&S->ibuf.fifo, &iov, 1);
+	if (!lua_isnil(L, 3)) {
+		offset = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, offset >= 0, 3, "negative offset");
+		offp = &offset;
+	}
 
-	msg = so_fdmsg(iov.iov_base, iov.iov_len, -1);
+	count = lua_isnil(L, 4)? LSO_INFSIZ : lso_checksize(L, 4);
 
-#if defined MSG_CMSG_CLOEXEC
-	if ((error = so_recvmsg(S->socket, msg, MSG_CMSG_CLOEXEC)))
-		goto error;
-#else
-	if ((error = so_recvmsg(S->socket, msg, 0)))
+	so_clear(S->socket);
+
+	if ((error = lso_doflush(S, LSO_NOBUF)))
 		goto error;
-#endif
 
-	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
-		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
-			continue;
+	/* a source socket may hold input we've already taken off its descriptor */
+	if ((src = luaL_testudata(L, 2, LSO_CLASS))) {
+		if (so_checktls(src->socket)) {
+			error = EOPNOTSUPP;
+			goto error;
+		}
 
-		cqs_closefd(&fd);
-		memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
-	}
+		while (sent < count && fifo_rlen(&src->ibuf.fifo)) {
+			struct iovec iov;
 
-	if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC))
-		goto trunc;
+			fifo_slice(&src->ibuf.fifo, &iov, 0, count - sent);
 
-	if (msg->msg_iovlen > 0 && msg->msg_iov[0].iov_len > 0)
-		lua_pushlstring(L, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
-	else
-		lua_pushliteral(L, "");
+			if (!(n = so_write(S->socket, iov.iov_base, iov.iov_len, &error)))
+				goto error;
 
-	if (fd == -1)
-		lua_pushnil(L);
+			fifo_discard(&src->ibuf.fifo, n);
+			src->ibuf.seq++;
+			sent += n;
+		}
+
+		lso_ibufput(src);
+	}
+
+	while (sent < count) {
+		if (!(n = so_sendfile(S->socket, fd, offp, count - sent, &error))) {
+			if (error)
+				goto error;
+
+			break; /* EOF */
+		}
+
+		sent += n;
+	}
+
+	lua_pushinteger(L, sent);
+
+	return 1;
+error:
+	lua_pushinteger(L, sent);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_sendfile4() */
+
+
+/*
+ * Non-blocking. Sends msgs[i..j] (default the whole array) as separate
+ * datagrams, batching system calls where possible. Returns the number of
+ * messages sent and, if short, an error code.
+ */
+static lso_nargs_t lso_sendmany4(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	struct iovec msgv[64];
+	lua_Integer i, j, sent = 0;
+	size_t n, k;
+	int error;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	i = luaL_optinteger(L, 3, 1);
+	j = luaL_optinteger(L, 4, lua_rawlen(L, 2));
+
+	if ((error = lso_prepsnd(L, S)))
+		goto error;
+
+	so_clear(S->socket);
+
+	if ((error = lso_doflush(S, LSO_NOBUF)))
+		goto error;
+
+	while (i <= j) {
+		for (k = 0; k < countof(msgv) && i + (lua_Integer)k <= j; k++) {
+			lua_rawgeti(L, 2, i + k);
+
+			/* numbers would be converted on the stack and lost on pop */
+			if (lua_type(L, -1) != LUA_TSTRING)
+				return luaL_argerror(L, 2, lua_pushfstring(L, "message %d is not a string", (int)(i + k)));
+
+			msgv[k].iov_base = (void *)lua_tolstring(L, -1, &msgv[k].iov_len);
+			lua_pop(L, 1); /* still anchored by the table */
+		}
+
+		n = so_sendmmsg(S->socket, msgv, k, &error);
+		sent += n;
+		i += n;
+
+		if (n < k)
+			goto error;
+	}
+
+	lua_pushinteger(L, sent);
+
+	return 1;
+error:
+	lua_pushinteger(L, sent);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_sendmany4() */
+
+
+/*
+ * Datagram batches. A batch is a fixed receive arena of count slots of
+ * size bytes each, filled by socket:recvmany. Nothing is copied into Lua
+ * strings until a datagram is fetched, and a batch may be passed back to
+ * socket:recvmany to be refilled without reallocating.
+ */
+#define LSO_BATCH      "CQS Socket Batch"
+#define LSO_DGRAMSIZ   2048
+#define LSO_MAXBATCH   1024
+
+struct lso_batch {
+	size_t count, size, nrecv;
+
+	struct sockaddr_storage *name;
+	struct msghdr *msg;
+	struct iovec *iov;
+	unsigned char *arena;
+}; /* struct lso_batch */
+
+static struct lso_batch *lso_newbatch(lua_State *L, size_t count, size_t size) {
+	size_t hdrsiz = (sizeof (struct lso_batch) + 15) & ~(size_t)15;
+	struct lso_batch *B;
+
+	B = lua_newuserdata(L, hdrsiz + count * (sizeof *B->name + sizeof *B->msg + sizeof *B->iov + size));
+	B->count = count;
+	B->size = size;
+	B->nrecv = 0;
+	B->name = (void *)((char *)B + hdrsiz);
+	B->msg = (void *)&B->name[count];
+	B->iov = (void *)&B->msg[count];
+	B->arena = (void *)&B->iov[count];
+
+	luaL_getmetatable(L, LSO_BATCH);
+	lua_setmetatable(L, -2);
+
+	return B;
+} /* lso_newbatch() */
+
+static size_t lso_checkbatchsize(lua_State *L, int index, lua_Integer def, lua_Integer max) {
+	lua_Integer n = luaL_optinteger(L, index, def);
+
+	luaL_argcheck(L, n > 0 && n <= max, index, "batch size out of range");
+
+	return n;
+} /* lso_checkbatchsize() */
+
+static struct lso_batch *lso_checkbatch(lua_State *L, int index) {
+	return luaL_checkudata(L, index, LSO_BATCH);
+} /* lso_checkbatch() */
+
+static size_t lso_checkslot(lua_State *L, struct lso_batch *B, int index) {
+	lua_Integer i = luaL_checkinteger(L, index);
+
+	luaL_argcheck(L, i >= 1 && (size_t)i <= B->nrecv, index, "datagram index out of range");
+
+	return i - 1;
+} /* lso_checkslot() */
+
+static lso_nargs_t lso_batch2(lua_State *L) {
+	size_t count = lso_checkbatchsize(L, 1, 0, LSO_MAXBATCH);
+	size_t size = lso_checkbatchsize(L, 2, LSO_DGRAMSIZ, 65536);
+
+	lso_newbatch(L, count, size);
+
+	return 1;
+} /* lso_batch2() */
+
+static lso_nargs_t lso_batch__len(lua_State *L) {
+	lua_pushinteger(L, lso_checkbatch(L, 1)->nrecv);
+
+	return 1;
+} /* lso_batch__len() */
+
+/* returns data and a truncation flag */
+static lso_nargs_t lso_batch_get(lua_State *L) {
+	struct lso_batch *B = lso_checkbatch(L, 1);
+	size_t i = lso_checkslot(L, B, 2);
+
+	lua_pushlstring(L, B->iov[i].iov_base, B->iov[i].iov_len);
+	lua_pushboolean(L, !!(B->msg[i].msg_flags & MSG_TRUNC));
+
+	return 2;
+} /* lso_batch_get() */
+
+static lso_nargs_t lso_batch_size(lua_State *L) {
+	struct lso_batch *B = lso_checkbatch(L, 1);
+	size_t i = lso_checkslot(L, B, 2);
+
+	lua_pushinteger(L, B->iov[i].iov_len);
+
+	return 1;
+} /* lso_batch_size() */
+
+static lso_nargs_t lso_pushname(lua_State *, struct sockaddr_storage *, socklen_t);
+
+static lso_nargs_t lso_batch_peer(lua_State *L) {
+	struct lso_batch *B = lso_checkbatch(L, 1);
+	size_t i = lso_checkslot(L, B, 2);
+
+	if (!B->msg[i].msg_namelen)
+		return 0;
+
+	return lso_pushname(L, &B->name[i], B->msg[i].msg_namelen);
+} /* lso_batch_peer() */
+
+static luaL_Reg lso_batch_methods[] = {
+	{ "get",  &lso_batch_get },
+	{ "size", &lso_batch_size },
+	{ "peer", &lso_batch_peer },
+	{ 0, 0 }
+}; /* lso_batch_methods[] */
+
+static luaL_Reg lso_batch_metamethods[] = {
+	{ "__len", &lso_batch__len },
+	{ 0, 0 }
+}; /* lso_batch_metamethods[] */
+
+
+static void lso_consume(struct luasocket *, size_t);
+
+/*
+ * Copy a datagram already read into the input buffer, e.g. by a short
+ * socket:read, to the first slot. Its sender is no longer known.
+ */
+static void lso_unbuffer(struct luasocket *S, struct lso_batch *B) {
+	size_t len = fifo_rlen(&S->ibuf.fifo), k = 0;
+	struct iovec iov[2];
+	int iovcnt, i;
+
+	iovcnt = fifo_rvecs(&S->ibuf.fifo, iov, B->size);
+
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(&B->arena[k], iov[i].iov_base, iov[i].iov_len);
+		k += iov[i].iov_len;
+	}
+
+	B->iov[0].iov_len = k;
+	B->msg[0].msg_namelen = 0;
+	B->msg[0].msg_flags = (len > k)? MSG_TRUNC : 0;
+	B->nrecv = 1;
+
+	/* the rest of a truncated datagram is discarded, as by the kernel */
+	lso_consume(S, len);
+} /* lso_unbuffer() */
+
+/*
+ * Non-blocking. Receives up to the size of the batch (or max, creating a
+ * new batch) in as few system calls as possible. A datagram left in the
+ * input buffer is returned first; otherwise buffering is bypassed. Only
+ * for message sockets without TLS. Returns the batch, or nil and an error
+ * code.
+ */
+static lso_nargs_t lso_recvmany2(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	struct lso_batch *B;
+	size_t n, i;
+	int error;
+
+	if ((error = lso_preprcv(L, S)))
+		goto error;
+
+	if ((S->type != SOCK_DGRAM && S->type != SOCK_SEQPACKET) || so_checktls(S->socket)) {
+		error = EOPNOTSUPP;
+		goto error;
+	}
+
+	if (so_pollfd(S->socket) == -1) {
+		error = EBADF;
+		goto error;
+	}
+
+	if (!(B = luaL_testudata(L, 2, LSO_BATCH)))
+		B = lso_newbatch(L, lso_checkbatchsize(L, 2, 32, LSO_MAXBATCH), LSO_DGRAMSIZ);
+	else
+		lua_pushvalue(L, 2);
+
+	for (i = 0; i < B->count; i++) {
+		B->iov[i].iov_base = &B->arena[i * B->size];
+		B->iov[i].iov_len = B->size;
+
+		memset(&B->msg[i], 0, sizeof B->msg[i]);
+		B->msg[i].msg_name = &B->name[i];
+		B->msg[i].msg_namelen = sizeof B->name[i];
+		B->msg[i].msg_iov = &B->iov[i];
+		B->msg[i].msg_iovlen = 1;
+	}
+
+	B->nrecv = 0;
+
+	if (fifo_rlen(&S->ibuf.fifo))
+		lso_unbuffer(S, B);
+
+	so_clear(S->socket);
+
+	if (B->nrecv < B->count) {
+		/* with a buffered datagram any error can wait for the next call */
+		if ((n = so_recvmany(S->socket, &B->msg[B->nrecv], B->count - B->nrecv, &error)))
+			B->nrecv += n;
+		else if (!B->nrecv)
+			goto error;
+	}
+
+	return 1;
+error:
+	lua_pushnil(L);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_recvmany2() */
+
+
+/*
+ * Buffer views. A view names the first len bytes of a socket's input
+ * buffer without copying them into a Lua string. Any operation which
+ * consumes input bumps ibuf.seq, invalidating outstanding views, so a
+ * view never has to pin memory; it's read through the fifo on each use.
+ */
+#define LSO_VIEW "CQS Socket View"
+
+struct lso_view {
+	struct luasocket *S;
+	unsigned long long seq;
+	size_t len;
+}; /* struct lso_view */
+
+static struct lso_view *lso_checkview(lua_State *L, int index) {
+	struct lso_view *V = luaL_checkudata(L, index, LSO_VIEW);
+
+	luaL_argcheck(L, V->S->socket && V->seq == V->S->ibuf.seq, index, "stale buffer view");
+
+	return V;
+} /* lso_checkview() */
+
+static struct luasocket *lso_checkpeer(lua_State *L, int index) {
+	return lso_checkvalid(L, index, luaL_checkudata(L, index, LSO_CLASS));
+} /* lso_checkpeer() */
+
+static void lso_consume(struct luasocket *S, size_t n) {
+	fifo_discard(&S->ibuf.fifo, n);
+	S->ibuf.seq++;
+
+	if (!fifo_rlen(&S->ibuf.fifo)) {
+		S->ibuf.eom = 0;
+		lso_ibufput(S);
+	}
+} /* lso_consume() */
+
+/*
+ * Move len bytes from the front of S's input buffer to D. If D has
+ * nothing queued we write straight from S's buffer, and only whatever
+ * the kernel won't take is copied into D's output buffer.
+ */
+static lso_error_t lso_transfer(struct luasocket *S, struct luasocket *D, size_t len) {
+	struct iovec iov[2];
+	size_t n;
+	int iovcnt, i, error = 0;
+
+	so_clear(D->socket);
+
+	if (!fifo_rlen(&D->obuf.fifo) && (iovcnt = fifo_rvecs(&S->ibuf.fifo, iov, len))) {
+		if ((n = so_writev(D->socket, iov, iovcnt, &error))) {
+			lso_consume(S, n);
+			len -= n;
+		} else if (error != EAGAIN) {
+			goto error;
+		}
+	}
+
+	if (len) {
+		if ((error = lso_bufget(&D->obuf.fifo, &D->obuf.charged, lso_bufsize(D->obuf.bufsiz), 0)))
+			goto error;
+
+		iovcnt = fifo_rvecs(&S->ibuf.fifo, iov, len);
+
+		for (i = 0; i < iovcnt; i++) {
+			if ((error = fifo_write(&D->obuf.fifo, iov[i].iov_base, iov[i].iov_len)))
+				goto error;
+		}
+
+		lso_consume(S, len);
+	}
+
+	return 0;
+error:
+	if (error == EPIPE)
+		D->obuf.eof = 1;
+
+	return error;
+} /* lso_transfer() */
+
+
+/*
+ * Non-blocking. Like socket:recv, but returns a view of the matching
+ * input instead of a string. Supports a byte count, a negative byte
+ * count (up to n bytes), and "*L". The input isn't consumed until the
+ * view is moved or discarded.
+ */
+static lso_nargs_t lso_view2(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	struct lso_view *V;
+	struct iovec iov;
+	int error;
+
+	if ((error = lso_preprcv(L, S)))
+		goto error;
+
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		lua_Number n = luaL_checknumber(L, 2);
+		size_t size;
+
+		/* NB: a NaN fails both comparisons */
+		luaL_argcheck(L, fabs(n) >= 1 && fabs(n) < (lua_Number)LSO_INFSIZ, 2, "invalid view size");
+		size = (size_t)fabs(n);
+
+		if ((error = lso_getblock(S, &iov, (n < 0)? 1 : size, size, 0)))
+			goto error;
+	} else {
+		luaL_argcheck(L, !strcmp(luaL_optstring(L, 2, "*L"), "*L"), 2, "invalid view format");
+
+		if ((error = lso_getline(S, &iov)))
+			goto error;
+	}
+
+	V = lua_newuserdata(L, sizeof *V);
+	V->S = S;
+	V->seq = S->ibuf.seq;
+	V->len = iov.iov_len;
+
+	luaL_getmetatable(L, LSO_VIEW);
+	lua_setmetatable(L, -2);
+
+	/* keep the socket alive for as long as the view */
+	lua_pushvalue(L, 1);
+	cqs_setuservalue(L, -2);
+
+	return 1;
+error:
+	lua_pushnil(L);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_view2() */
+
+static lso_nargs_t lso_view__len(lua_State *L) {
+	lua_pushinteger(L, lso_checkview(L, 1)->len);
+
+	return 1;
+} /* lso_view__len() */
+
+static lso_nargs_t lso_view__tostring(lua_State *L) {
+	struct lso_view *V = lso_checkview(L, 1);
+	struct iovec iov[2];
+	int iovcnt, i;
+	luaL_Buffer B;
+
+	iovcnt = fifo_rvecs(&V->S->ibuf.fifo, iov, V->len);
+
+	luaL_buffinit(L, &B);
+
+	for (i = 0; i < iovcnt; i++)
+		luaL_addlstring(&B, iov[i].iov_base, iov[i].iov_len);
+
+	luaL_pushresult(&B);
+
+	return 1;
+} /* lso_view__tostring() */
+
+static lso_nargs_t lso_view_valid(lua_State *L) {
+	struct lso_view *V = luaL_checkudata(L, 1, LSO_VIEW);
+
+	lua_pushboolean(L, V->S->socket && V->seq == V->S->ibuf.seq);
+
+	return 1;
+} /* lso_view_valid() */
+
+static lso_nargs_t lso_view_byte(lua_State *L) {
+	struct lso_view *V = lso_checkview(L, 1);
+	lua_Integer i = luaL_optinteger(L, 2, 1);
+	struct iovec iov;
+
+	if (i < 0)
+		i += (lua_Integer)V->len + 1;
+
+	if (i < 1 || (size_t)i > V->len)
+		return 0;
+
+	fifo_slice(&V->S->ibuf.fifo, &iov, i - 1, 1);
+	lua_pushinteger(L, *(unsigned char *)iov.iov_base);
+
+	return 1;
+} /* lso_view_byte() */
+
+/* plain substring search; returns the start and end indices or nil */
+static lso_nargs_t lso_view_find(lua_State *L) {
+	struct lso_view *V = lso_checkview(L, 1);
+	size_t plen;
+	const char *pat = luaL_checklstring(L, 2, &plen);
+	lua_Integer init = luaL_optinteger(L, 3, 1);
+	struct iovec iov;
+	const char *p, *pe;
+
+	if (init < 0)
+		init = MAX(1, init + (lua_Integer)V->len + 1);
+	else if (init == 0)
+		init = 1;
+
+	if ((size_t)init - 1 + plen > V->len)
+		goto nomatch;
+
+	/* contiguous slice; at worst this realigns the buffer in place */
+	fifo_slice(&V->S->ibuf.fifo, &iov, 0, V->len);
+
+	p = (char *)iov.iov_base + (init - 1);
+	pe = (char *)iov.iov_base + V->len - plen;
+
+	if (!plen)
+		goto match;
+
+	for (; p <= pe && (p = memchr(p, *pat, pe - p + 1)); p++) {
+		if (!memcmp(p, pat, plen))
+			goto match;
+	}
+
+nomatch:
+	lua_pushnil(L);
+
+	return 1;
+match:
+	lua_pushinteger(L, p - (char *)iov.iov_base + 1);
+	lua_pushinteger(L, p - (char *)iov.iov_base + plen);
+
+	return 2;
+} /* lso_view_find() */
+
+static lso_nargs_t lso_view_discard(lua_State *L) {
+	struct lso_view *V = lso_checkview(L, 1);
+
+	lso_consume(V->S, V->len);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* lso_view_discard() */
+
+/*
+ * Non-blocking. Moves the viewed bytes to dst, consuming them from the
+ * source socket and invalidating the view. Bytes the kernel won't take
+ * immediately are queued on dst, so this never partially succeeds.
+ */
+static lso_nargs_t lso_view_move(lua_State *L) {
+	struct lso_view *V = lso_checkview(L, 1);
+	struct luasocket *D = lso_checkpeer(L, 2);
+	int error;
+
+	if ((error = lso_prepsnd(L, D)))
+		goto error;
+
+	if ((error = lso_transfer(V->S, D, V->len)))
+		goto error;
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+error:
+	lua_pushboolean(L, 0);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_view_move() */
+
+static luaL_Reg lso_view_methods[] = {
+	{ "tostring", &lso_view__tostring },
+	{ "valid",    &lso_view_valid },
+	{ "byte",     &lso_view_byte },
+	{ "find",     &lso_view_find },
+	{ "discard",  &lso_view_discard },
+	{ "move",     &lso_view_move },
+	{ 0, 0 }
+}; /* lso_view_methods[] */
+
+static luaL_Reg lso_view_metamethods[] = {
+	{ "__len",      &lso_view__len },
+	{ "__tostring", &lso_view__tostring },
+	{ 0, 0 }
+}; /* lso_view_metamethods[] */
+
+
+/*
+ * Non-blocking. Relays up to n bytes (default: until EOF) from the
+ * input side of this socket to dst, writing directly from our input
+ * buffer. Returns the number of bytes relayed and, if short of n and not
+ * at EOF, an error code. On EAGAIN the stalled socket has its events set.
+ */
+static lso_nargs_t lso_relay3(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	struct luasocket *D = lso_checkpeer(L, 2);
+	size_t limit = (lua_isnoneornil(L, 3))? LSO_INFSIZ : lso_checksize(L, 3);
+	size_t moved = 0, n;
+	struct iovec iov[2];
+	int iovcnt, error;
+
+	if ((error = lso_preprcv(L, S)) || (error = lso_prepsnd(L, D)))
+		goto error;
+
+	so_clear(D->socket);
+
+	while (moved < limit) {
+		if (fifo_rlen(&D->obuf.fifo) && (error = lso_doflush(D, LSO_NOBUF)))
+			goto error;
+
+		if (!fifo_rlen(&S->ibuf.fifo)) {
+			if (S->ibuf.eof)
+				break;
+
+			if ((error = lso_fill(S, 1))) {
+				if (error == EPIPE)
+					break;
+
+				goto error;
+			}
+		}
+
+		iovcnt = fifo_rvecs(&S->ibuf.fifo, iov, limit - moved);
+
+		if (!(n = so_writev(D->socket, iov, iovcnt, &error))) {
+			if (error == EPIPE)
+				D->obuf.eof = 1;
+
+			goto error;
+		}
+
+		lso_consume(S, n);
+		moved += n;
+	}
+
+	lua_pushinteger(L, moved);
+
+	return 1;
+error:
+	lua_pushinteger(L, moved);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_relay3() */
+
+
+static lso_nargs_t lso_recvfd2(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	size_t bufsiz = luaL_optunsigned(L, 2, S->ibuf.maxline);
+	struct msghdr *msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct so_options opts;
+	int fd = -1, error;
+
+	if ((error = lso_preprcv(L, S)))
+		goto error;
+
+	if ((error = fifo_grow(&S->ibuf.fifo, bufsiz)))
+		goto error;
+
+	fifo_wvec(&S->ibuf.fifo, &iov, 1);
+
+	msg = so_fdmsg(iov.iov_base, iov.iov_len, -1);
+
+#if defined MSG_CMSG_CLOEXEC
+	if ((error = so_recvmsg(S->socket, msg, MSG_CMSG_CLOEXEC)))
+		goto error;
+#else
+	if ((error = so_recvmsg(S->socket, msg, 0)))
+		goto error;
+#endif
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		cqs_closefd(&fd);
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof fd);
+	}
+
+	if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC))
+		goto trunc;
+
+	if (msg->msg_iovlen > 0 && msg->msg_iov[0].iov_len > 0)
+		lua_pushlstring(L, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+	else
+		lua_pushliteral(L, "");
+
+	if (fd == -1)
+		lua_pushnil(L);
 	else if ((error = cqs_socket_fdopen(L, fd, so_opts())))
 		goto error;
 
@@ -2545,6 +4169,8 @@ static lso_nargs_t lso_unpack2(lua_State *L) {
 	}
 
 	value = fifo_unpack(&S->ibuf.fifo, count);
+	S->ibuf.seq++;
+	lso_ibufput(S);
 
 	if (value == (unsigned long long)(lua_Integer)value)
 		lua_pushinteger(L, (lua_Integer)value);
@@ -2614,6 +4240,16 @@ int cqs_socket_events(lua_State *L, int index) {
 	return so_events(S->socket);
 } /* cqs_socket_events() */
 
+/*
+ * Subset of cqs_socket_events() for which the descriptor last returned
+ * EAGAIN, and so can be safely polled edge-triggered.
+ */
+int cqs_socket_drained(lua_State *L, int index) {
+	struct luasocket *S = lso_checkvalid(L, index, lua_touserdata(L, index));
+
+	return so_drained(S->socket);
+} /* cqs_socket_drained() */
+
 static lso_nargs_t lso_events(lua_State *L) {
 	struct luasocket *S = lso_checkself(L, 1);
 	short events = so_events(S->socket);
@@ -2707,6 +4343,235 @@ static lso_nargs_t lso_eof(lua_State *L) {
 } /* lso_eof() */
 
 
+static lso_nargs_t lso_throttled(lua_State *L) {
+	lua_pushboolean(L, lso_checkself(L, 1)->ibuf.throttled);
+
+	return 1;
+} /* lso_throttled() */
+
+
+/*
+ * socket.setbudget([budget][, cache]) - cap the bytes lent out to socket
+ * buffers process-wide (0 for no cap) and the bytes kept for reuse.
+ * Returns the previous values.
+ */
+static lso_nargs_t lso_setbudget(lua_State *L) {
+	_Bool setbudget = !lua_isnoneornil(L, 1), setcache = !lua_isnoneornil(L, 2);
+	size_t budget = (setbudget)? lso_checksize(L, 1) : 0;
+	size_t cache = (setcache)? lso_checksize(L, 2) : 0;
+	struct lso_tcache *tc;
+	size_t obudget, ocache;
+	int k;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	obudget = lso_load(&lso_pool.budget);
+	ocache = lso_load(&lso_pool.cachemax);
+
+	if (setbudget)
+		lso_store(&lso_pool.budget, (budget == LSO_INFSIZ)? 0 : budget);
+
+	if (setcache)
+		lso_store(&lso_pool.cachemax, cache);
+
+	pthread_mutex_unlock(&lso_pool.mutex);
+
+	/* only our own thread cache can be trimmed; others spill on overflow or exit */
+	if (setcache) {
+		if ((tc = lso_tcache(0))) {
+			for (k = 0; k < LSO_NCLASS; k++)
+				lso_tcachespill(tc, k, 0);
+		}
+
+		pthread_mutex_lock(&lso_pool.mutex);
+		lso_pooltrim();
+		pthread_mutex_unlock(&lso_pool.mutex);
+	}
+
+	/* a raised budget may have room for throttled readers */
+	if (setbudget && lso_xchg(&lso_pool.waiting, 0))
+		lso_poolsignal();
+
+	lua_pushinteger(L, obudget);
+	lua_pushinteger(L, ocache);
+
+	return 2;
+} /* lso_setbudget() */
+
+
+static lso_nargs_t lso_bufstats(lua_State *L) {
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, (lua_Integer)lso_load(&lso_pool.inuse));
+	lua_setfield(L, -2, "inuse");
+	lua_pushinteger(L, (lua_Integer)lso_load(&lso_pool.cached));
+	lua_setfield(L, -2, "cached");
+	lua_pushinteger(L, (lua_Integer)lso_load(&lso_pool.budget));
+	lua_setfield(L, -2, "budget");
+	lua_pushinteger(L, (lua_Integer)lso_load(&lso_pool.borrowed));
+	lua_setfield(L, -2, "borrowed");
+	lua_pushinteger(L, (lua_Integer)lso_load(&lso_pool.reused));
+	lua_setfield(L, -2, "reused");
+	lua_pushinteger(L, (lua_Integer)lso_load(&lso_pool.throttled));
+	lua_setfield(L, -2, "throttled");
+
+	return 1;
+} /* lso_bufstats() */
+
+
+/*
+ * socket.bufwaitfd() - descriptor polling readable once buffer memory has
+ * been handed back after a fill was refused by the budget. Created on
+ * first use and never closed.
+ */
+static lso_nargs_t lso_bufwaitfd(lua_State *L) {
+	int fd[2], error = 0;
+
+	pthread_mutex_lock(&lso_pool.mutex);
+
+	if (lso_pool.wake[0] == -1) {
+		if ((error = cqs_pipe(fd, O_CLOEXEC|O_NONBLOCK)))
+			goto unlock;
+
+		lso_pool.wake[0] = fd[0];
+		lso_pool.wake[1] = fd[1];
+	}
+
+	fd[0] = lso_pool.wake[0];
+unlock:
+	pthread_mutex_unlock(&lso_pool.mutex);
+
+	if (error) {
+		lua_pushnil(L);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+
+	lua_pushinteger(L, fd[0]);
+
+	return 1;
+} /* lso_bufwaitfd() */
+
+
+static lso_nargs_t lso_sessioncache(lua_State *L) {
+	SSL_CTX **ctx;
+	int error;
+
+	if (!(ctx = luaL_testudata(L, 1, "SSL_CTX*")) && !(ctx = luaL_testudata(L, 1, "SSL:Context")))
+		return luaL_argerror(L, 1, "SSL context expected");
+
+	luaL_argcheck(L, *ctx != NULL, 1, "SSL context expected");
+
+	if ((error = lso_sessattach(*ctx))) {
+		lua_pushnil(L);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+
+	lua_pushvalue(L, 1);
+
+	return 1;
+} /* lso_sessioncache() */
+
+
+static time_t lso_checkseconds(lua_State *L, int index) {
+	lua_Number n = luaL_checknumber(L, index);
+
+	luaL_argcheck(L, n >= 1, index, "duration must be at least one second");
+
+	return (n < (lua_Number)INT_MAX)? (time_t)n : INT_MAX;
+} /* lso_checkseconds() */
+
+
+static lso_nargs_t lso_setsessioncache(lua_State *L) {
+	_Bool setsize = !lua_isnoneornil(L, 1), setttl = !lua_isnoneornil(L, 2), setrotate = !lua_isnoneornil(L, 3);
+	size_t size = (setsize)? lso_checksize(L, 1) : 0;
+	time_t ttl = (setttl)? lso_checkseconds(L, 2) : 0;
+	time_t rotate = (setrotate)? lso_checkseconds(L, 3) : 0;
+
+	struct lso_sessctx *ent;
+	size_t osize;
+	time_t ottl, orotate;
+
+	pthread_mutex_lock(&lso_sess.mutex);
+
+	osize = lso_sess.size;
+	ottl = lso_sess.ttl;
+	orotate = lso_sess.rotate;
+
+	if (setsize)
+		lso_sess.size = size;
+
+	if (setttl) {
+		lso_sess.ttl = ttl;
+
+		TAILQ_FOREACH(ent, &lso_sessctxs, tqe)
+			SSL_CTX_set_timeout(ent->ctx, (long)ttl);
+	}
+
+	if (setrotate)
+		lso_sess.rotate = rotate;
+
+	lso_sesstrim(time(NULL));
+
+	pthread_mutex_unlock(&lso_sess.mutex);
+
+	lso_pushsize(L, osize);
+	lua_pushinteger(L, ottl);
+	lua_pushinteger(L, orotate);
+
+	return 3;
+} /* lso_setsessioncache() */
+
+
+static lso_nargs_t lso_sessionstats(lua_State *L) {
+	size_t count, size;
+	unsigned long long hits, misses, stored, evicted, expired;
+	unsigned long long issued, renewed, rejected, rotated;
+
+	pthread_mutex_lock(&lso_sess.mutex);
+	count = lso_sess.count;
+	size = lso_sess.size;
+	hits = lso_sess.hits;
+	misses = lso_sess.misses;
+	stored = lso_sess.stored;
+	evicted = lso_sess.evicted;
+	expired = lso_sess.expired;
+	issued = lso_sess.issued;
+	renewed = lso_sess.renewed;
+	rejected = lso_sess.rejected;
+	rotated = lso_sess.rotated;
+	pthread_mutex_unlock(&lso_sess.mutex);
+
+	lua_createtable(L, 0, 11);
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "count");
+	lso_pushsize(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, (lua_Integer)hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushinteger(L, (lua_Integer)misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, (lua_Integer)stored);
+	lua_setfield(L, -2, "stored");
+	lua_pushinteger(L, (lua_Integer)evicted);
+	lua_setfield(L, -2, "evicted");
+	lua_pushinteger(L, (lua_Integer)expired);
+	lua_setfield(L, -2, "expired");
+	lua_pushinteger(L, (lua_Integer)issued);
+	lua_setfield(L, -2, "issued");
+	lua_pushinteger(L, (lua_Integer)renewed);
+	lua_setfield(L, -2, "renewed");
+	lua_pushinteger(L, (lua_Integer)rejected);
+	lua_setfield(L, -2, "rejected");
+	lua_pushinteger(L, (lua_Integer)rotated);
+	lua_setfield(L, -2, "rotated");
+
+	return 1;
+} /* lso_sessionstats() */
+
+
 static lso_nargs_t lso_accept(lua_State *L) {
 	struct luasocket *A = lso_checkself(L, 1);
 	struct so_options opts;
@@ -2735,6 +4600,53 @@ error:
 } /* lso_accept() */
 
 
+/*
+ * Accept up to n queued connections, returning them in an array, so one
+ * readiness event drains the backlog instead of costing a poll round
+ * trip per connection. Returns nil and an error only if none were
+ * accepted.
+ */
+static lso_nargs_t lso_acceptmany3(lua_State *L) {
+	struct luasocket *A = lso_checkself(L, 1);
+	lua_Integer max = luaL_optinteger(L, 2, 64);
+	struct so_options opts;
+	int n = 0, fd, error;
+
+	luaL_argcheck(L, max > 0 && max <= INT_MAX, 2, "connection count out of range");
+
+	if (lua_istable(L, 3)) {
+		opts = lso_checkopts(L, 3);
+	} else {
+		opts = *so_opts();
+	}
+
+	so_clear(A->socket);
+
+	lua_createtable(L, (int)SO_MIN(max, 64), 0);
+
+	while (n < max) {
+		if (-1 == (fd = so_accept(A->socket, 0, 0, &error)))
+			break;
+
+		if ((error = cqs_socket_fdopen(L, fd, &opts))) {
+			so_closesocket(&fd, NULL);
+			break;
+		}
+
+		lua_rawseti(L, -2, ++n);
+	}
+
+	if (n > 0)
+		return 1;
+
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* lso_acceptmany3() */
+
+
 static lso_nargs_t lso_pushname(lua_State *L, struct sockaddr_storage *ss, socklen_t salen) {
 	switch (ss->ss_family) {
 	case AF_INET:
@@ -2875,10 +4787,43 @@ static lso_nargs_t lso_stat(lua_State *L) {
 	lua_setfield(L, -2, "time");
 	lua_setfield(L, -2, "rcvd");
 
+	lua_newtable(L);
+	lua_pushinteger(L, st->connect.attempts);
+	lua_setfield(L, -2, "attempts");
+	if (st->connect.winner) {
+		lua_pushinteger(L, st->connect.winner);
+		lua_setfield(L, -2, "winner");
+		lua_pushinteger(L, st->connect.addr.ss_family);
+		lua_setfield(L, -2, "family");
+
+		if (st->connect.addr.ss_family == AF_INET || st->connect.addr.ss_family == AF_INET6) {
+			struct sockaddr_storage ss = st->connect.addr;
+
+			lua_pushstring(L, sa_ntoa(&ss));
+			lua_setfield(L, -2, "addr");
+			lua_pushinteger(L, ntohs(*sa_port(&ss, SA_PORT_NONE, NULL)));
+			lua_setfield(L, -2, "port");
+		}
+	}
+	lua_setfield(L, -2, "connect");
+
 	return 1;
 } /* lso_stat() */
 
 
+static lso_nargs_t lso_racetimeout(lua_State *L) {
+	struct luasocket *S = lso_checkself(L, 1);
+	int timeout = so_racetimeout(S->socket);
+
+	if (timeout < 0)
+		return 0;
+
+	lua_pushnumber(L, (double)timeout / 1000);
+
+	return 1;
+} /* lso_racetimeout() */
+
+
 static void lso_destroy(lua_State *L, struct luasocket *S) {
 	cqs_unref(L, &S->onerror);
 
@@ -2892,8 +4837,13 @@ static void lso_destroy(lua_State *L, struct luasocket *S) {
 		S->tls.config.context = NULL;
 	}
 
+	fifo_purge(&S->ibuf.fifo);
+	fifo_purge(&S->obuf.fifo);
+	lso_ibufput(S);
+	lso_obufput(S);
 	fifo_reset(&S->ibuf.fifo);
 	fifo_reset(&S->obuf.fifo);
+	S->ibuf.seq++;
 
 	/* Hack for Lua 5.1 and LuaJIT */
 	if (!S->mainthread) {
@@ -2950,6 +4900,7 @@ static luaL_Reg lso_methods[] = {
 	{ "listen",     &lso_listen1 },
 	{ "starttls",   &lso_starttls },
 	{ "checktls",   &lso_checktls },
+	{ "ktls",       &lso_ktls },
 	{ "setvbuf",    &lso_setvbuf3 },
 	{ "setmode",    &lso_setmode3 },
 	{ "setbufsiz",  &lso_setbufsiz3 },
@@ -2967,7 +4918,12 @@ static luaL_Reg lso_methods[] = {
 	{ "uncork",     &lso_uncork },
 	{ "pending",    &lso_pending },
 	{ "sendfd",     &lso_sendfd3 },
+	{ "sendfile",   &lso_sendfile4 },
+	{ "sendmany",   &lso_sendmany4 },
 	{ "recvfd",     &lso_recvfd2 },
+	{ "recvmany",   &lso_recvmany2 },
+	{ "view",       &lso_view2 },
+	{ "relay",      &lso_relay3 },
 	{ "pack",       &lso_pack4 },
 	{ "unpack",     &lso_unpack2 },
 	{ "fill",       &lso_fill2 },
@@ -2977,12 +4933,15 @@ static luaL_Reg lso_methods[] = {
 	{ "timeout",    &lso_timeout },
 	{ "shutdown",   &lso_shutdown },
 	{ "eof",        &lso_eof },
+	{ "throttled",  &lso_throttled },
 	{ "accept",     &lso_accept },
+	{ "acceptmany", &lso_acceptmany3 },
 	{ "peername",   &lso_peername },
 	{ "peereid",    &lso_peereid },
 	{ "peerpid",    &lso_peerpid },
 	{ "localname",  &lso_localname },
 	{ "stat",       &lso_stat },
+	{ "racetimeout", &lso_racetimeout },
 	{ "close",      &lso_close },
 	{ 0, 0 }
 }; /* lso_methods[] */
@@ -3000,6 +4959,13 @@ static luaL_Reg lso_globals[] = {
 	{ "dup",        &lso_dup },
 	{ "fdopen",     &lso_fdopen },
 	{ "pair",       &lso_pair },
+	{ "batch",      &lso_batch2 },
+	{ "setbudget",  &lso_setbudget },
+	{ "bufstats",   &lso_bufstats },
+	{ "bufwaitfd",  &lso_bufwaitfd },
+	{ "sessioncache", &lso_sessioncache },
+	{ "setsessioncache", &lso_setsessioncache },
+	{ "sessionstats", &lso_sessionstats },
 	{ "type",       &lso_type },
 	{ "interpose",  &lso_interpose },
 	{ "setvbuf",    &lso_setvbuf2 },
@@ -3024,6 +4990,14 @@ lso_nargs_t luaopen__cqueues_socket(lua_State *L) {
 		{ "SOCK_DGRAM",     SOCK_DGRAM },
 	};
 
+	iov_kernel = memscan_best();
+
+	cqs_newmetatable(L, LSO_BATCH, lso_batch_methods, lso_batch_metamethods, 0);
+	lua_pop(L, 1);
+
+	cqs_newmetatable(L, LSO_VIEW, lso_view_methods, lso_view_metamethods, 0);
+	lua_pop(L, 1);
+
 	cqs_pushnils(L, LSO_UPVALUES); /* initial upvalues */
 	cqs_newmetatable(L, LSO_CLASS, lso_methods, lso_metamethods, LSO_UPVALUES);
 	lua_pushvalue(L, -1); /* push self as replacement upvalue */
@@ -3069,6 +5043,46 @@ static struct iovec dbg_checkstring(lua_State *L, int index) {
 } /* dbg_checkstring() */
 
 
+/* optional kernel name; defaults to the kernels selected at load time */
+static const struct memscan *dbg_optkernel(lua_State *L, int index) {
+	const struct memscan *list[4];
+	const char *name;
+	int i, n;
+
+	if (lua_isnoneornil(L, index))
+		return iov_kernel;
+
+	name = luaL_checkstring(L, index);
+	n = memscan_list(list);
+
+	for (i = 0; i < n; i++) {
+		if (!strcmp(name, list[i]->name))
+			return list[i];
+	}
+
+	luaL_argerror(L, index, lua_pushfstring(L, "%s: kernel not available", name));
+
+	return NULL;
+} /* dbg_optkernel() */
+
+
+static int dbg_iov_kernels(lua_State *L) {
+	const struct memscan *list[4];
+	int i, n = memscan_list(list);
+
+	lua_createtable(L, n, 0);
+
+	for (i = 0; i < n; i++) {
+		lua_pushstring(L, list[i]->name);
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	lua_pushstring(L, iov_kernel->name);
+
+	return 2;
+} /* dbg_iov_kernels() */
+
+
 static int dbg_iov_eoh(lua_State *L) {
 	struct iovec iov = dbg_checkstring(L, 1);
 	_Bool eof = dbg_checkbool(L, 2);
@@ -3092,13 +5106,54 @@ static int dbg_iov_eoh(lua_State *L) {
 static int dbg_iov_eob(lua_State *L) {
 	struct iovec haystack = dbg_checkstring(L, 1);
 	struct iovec needle = dbg_checkstring(L, 2);
+	const struct memscan *K = dbg_optkernel(L, 3);
 
-	lua_pushinteger(L, iov_eob(&haystack, needle.iov_base, needle.iov_len));
+	lua_pushinteger(L, iov_eob(&haystack, needle.iov_base, needle.iov_len, K));
 
 	return 1;
 } /* dbg_iov_eob() */
 
 
+static int dbg_iov_eol(lua_State *L) {
+	struct iovec iov = dbg_checkstring(L, 1);
+	const struct memscan *K = dbg_optkernel(L, 2);
+
+	lua_pushinteger(L, iov_eol(&iov, K));
+
+	return 1;
+} /* dbg_iov_eol() */
+
+
+/*
+ * Run a kernel count times over text and return the elapsed CPU time in
+ * seconds, so kernels can be compared without Lua call overhead.
+ */
+static int dbg_iov_bench(lua_State *L) {
+	const struct memscan *K = dbg_optkernel(L, 1);
+	const char *op = luaL_checkstring(L, 2);
+	struct iovec iov = dbg_checkstring(L, 3);
+	_Bool eob = !strcmp(op, "eob");
+	struct iovec sub = { "", 0 };
+	lua_Integer i, count = luaL_optinteger(L, 5, 1000);
+	volatile size_t sink = 0;
+	clock_t begin;
+
+	if (eob)
+		sub = dbg_checkstring(L, 4);
+	else
+		luaL_argcheck(L, !strcmp(op, "eol"), 2, "expected \"eol\" or \"eob\"");
+
+	begin = clock();
+
+	for (i = 0; i < count; i++)
+		sink += (eob)? iov_eob(&iov, sub.iov_base, sub.iov_len, K) : iov_eol(&iov, K);
+
+	lua_pushnumber(L, (double)(clock() - begin) / CLOCKS_PER_SEC);
+
+	return 1;
+} /* dbg_iov_bench() */
+
+
 static int dbg_iov_eot(lua_State *L) {
 	struct iovec iov = dbg_checkstring(L, 1);
 	size_t minbuf = dbg_checksize(L, 2);
@@ -3150,6 +5205,9 @@ static int dbg_iov_trimcrlf(lua_State *L) {
 static luaL_Reg dbg_globals[] = {
 	{ "iov_eoh",      &dbg_iov_eoh },
 	{ "iov_eob",      &dbg_iov_eob },
+	{ "iov_eol",      &dbg_iov_eol },
+	{ "iov_kernels",  &dbg_iov_kernels },
+	{ "iov_bench",    &dbg_iov_bench },
 	{ "iov_eot",      &dbg_iov_eot },
 	{ "iov_trimcr",   &dbg_iov_trimcr },
 	{ "iov_trimcrlf", &dbg_iov_trimcrlf },
@@ -3158,6 +5216,8 @@ static luaL_Reg dbg_globals[] = {
 
 
 lso_nargs_t luaopen__cqueues_socket_debug(lua_State *L) {
+	iov_kernel = memscan_best();
+
 	luaL_newlib(L, dbg_globals);
 
 	return 1;
@@ -184,6 +184,78 @@ debug.units.new("iov_eob", function()
 end)
 
 
+--
+-- iov_eol returns the prefix length up to and including the last \n, or
+-- #text if there's no \n.
+--
+debug.units.new("iov_eol", function()
+	local iov_eol = debug.iov_eol -- (text[, kernel])
+
+	assert(iov_eol("") == 0)
+	assert(iov_eol("abc") == 3)
+	assert(iov_eol("a\nb\nc") == 4)
+	assert(iov_eol(string.rep("x", 100) .. "\n" .. string.rep("y", 100)) == 101)
+end)
+
+
+--
+-- iov.kernels checks each vectorized scanning kernel supported by this CPU
+-- against the scalar kernel on random text. debug.iov_kernels returns the
+-- list of kernel names and the name of the kernel chosen at load time.
+--
+local function randtext(n, alphabet)
+	local t = {}
+
+	for i = 1, n do
+		local j = math.random(#alphabet)
+		t[i] = alphabet:sub(j, j)
+	end
+
+	return table.concat(t)
+end -- randtext
+
+debug.units.new("iov.kernels", function()
+	local kernels = debug.iov_kernels()
+
+	for _ = 1, 1000 do
+		local txt = randtext(math.random(0, 300), "\r\n-AB")
+		local eob = randtext(math.random(1, 12), "\r\n-AB")
+
+		if #txt > #eob and math.random(2) == 1 then
+			local i = math.random(#txt - #eob)
+			txt = txt:sub(1, i - 1) .. eob .. txt:sub(i + #eob)
+		end
+
+		local eol = debug.iov_eol(txt, "scalar")
+		local n = debug.iov_eob(txt, eob, "scalar")
+
+		for _, k in ipairs(kernels) do
+			assert(debug.iov_eol(txt, k) == eol, string.format("%s: iov_eol(%s)", k, toviz(txt)))
+			assert(debug.iov_eob(txt, eob, k) == n, string.format("%s: iov_eob(%s, %s)", k, toviz(txt), toviz(eob)))
+		end
+	end
+end)
+
+
+--
+-- debug.bench - time each scanning kernel over size bytes of text. Not a
+-- unit test, so it's only run when called by hand.
+--
+function debug.bench(size, count)
+	local txt = randtext(size or 65536, "abcdefghijklmnopqrstuvwxyz-")
+	local kernels, best = debug.iov_kernels()
+
+	count = count or 10000
+
+	for _, k in ipairs(kernels) do
+		io.stderr:write(string.format("%-8s eol %.3fs  eob %.3fs%s\n", k,
+			debug.iov_bench(k, "eol", txt, nil, count),
+			debug.iov_bench(k, "eob", txt, "--boundary", count),
+			(k == best) and " (selected)" or ""))
+	end
+end -- debug.bench
+
+
 --
 -- iov_eot attempts to fit \r\n:\n translated text into the specified lower
 -- and upper output string length bounds, without leaving any trailing \r,
@@ -245,7 +317,7 @@ end)
 debug.units.new("iov_trimcrlf", function()
 	local iov_trimcrlf = debug.iov_trimcrlf -- (text, chomp)
 
-	for _, txt in pairs{ "\r\n.\r\r\r\n", "\r\n\r\r\r", "\r\r.\n\n" } do
+	for _, txt in pairs{ "\r\n.\r\r\r\n", "\r\n\r\r\r", "\r\r.\n\n", "\r\n\n\n" } do
 		local gs = string.gsub(txt, "\r?\n", "")
 		assert(gs == iov_trimcrlf(txt, false), string.format("%s != %s", toviz(gs), toviz(txt)))
 	end
@@ -28,7 +28,35 @@ local format = string.format
 --
 -- ========================================================================
 
-local function timed_poll(self, deadline)
+-- reads refused by the buffer pool budget have nothing to poll on the
+-- socket, so they poll the pool's wake descriptor instead, which turns
+-- readable once memory is handed back. BACKOFF only bounds the wait
+-- should a wakeup be missed; without the descriptor they sleep SLEEP.
+local BACKOFF = 1
+local SLEEP = 0.01
+
+local bufwait
+
+local function throttled_poll(timeout)
+	if bufwait == nil then
+		local fd = socket.bufwaitfd()
+
+		bufwait = fd and { pollfd = fd, events = "r" } or false
+	end
+
+	if bufwait then
+		poll(bufwait, math.min(BACKOFF, timeout or BACKOFF))
+	else
+		poll(math.min(SLEEP, timeout or SLEEP))
+	end
+end -- throttled_poll
+
+-- cap bounds a single wait for callers that must act on a timer of their
+-- own even when the descriptor stays quiet, e.g. a connection race;
+-- other is polled alongside self, e.g. the far end of a relay
+local function timed_poll(self, deadline, cap, other)
+	local throttled = self:throttled()
+
 	if deadline then
 		local curtime = monotime()
 
@@ -36,11 +64,23 @@ local function timed_poll(self, deadline)
 			return false
 		end
 
-		poll(self, deadline - curtime)
+		if throttled then
+			throttled_poll(deadline - curtime)
+		elseif cap then
+			poll(self, other, math.min(cap, deadline - curtime))
+		else
+			poll(self, other, deadline - curtime)
+		end
 
 		return true
 	else
-		poll(self)
+		if throttled then
+			throttled_poll()
+		elseif cap then
+			poll(self, other, cap)
+		else
+			poll(self, other)
+		end
 
 		return true
 	end
@@ -127,7 +167,8 @@ local preserve = {
 
 -- drop EPIPE errors on input channel
 local nopipe = {
-	read = true, lines = true, fill = true, unpack = true, recvfd = true
+	read = true, lines = true, fill = true, unpack = true, recvfd = true,
+	view = true,
 }
 
 local function oops(self, op, why, level)
@@ -238,11 +279,62 @@ local _accept; _accept = socket.interpose("accept", function(self, opts, timeout
 end)
 
 
+--
+-- Yielding socket:acceptmany
+--
+local _acceptmany; _acceptmany = socket.interpose("acceptmany", function(self, n, opts, timeout)
+	timeout = timeout or self:timeout()
+	local deadline = timeout and (monotime() + timeout)
+	local cons, why = _acceptmany(self, n, opts)
+
+	while not cons do
+		if why == EAGAIN then
+			if not timed_poll(self, deadline) then
+				return nil, oops(self, "acceptmany", ETIMEDOUT)
+			end
+		else
+			return nil, oops(self, "acceptmany", why)
+		end
+
+		cons, why = _acceptmany(self, n, opts)
+	end
+
+	return cons
+end)
+
+
 --
 -- Add socket:clients
 --
+-- With opts.batch, each wakeup drains up to that many queued
+-- connections, which the iterator then hands out one at a time.
+--
 socket.interpose("clients", function(self, opts, timeout)
-	return function() return self:accept(opts, timeout) end
+	local batch = opts and opts.batch
+
+	if not batch then
+		return function() return self:accept(opts, timeout) end
+	end
+
+	local queue, head = {}, 1
+
+	return function()
+		if not queue[head] then
+			local cons, why = self:acceptmany(batch, opts, timeout)
+
+			if not cons then
+				return nil, why
+			end
+
+			queue, head = cons, 1
+		end
+
+		local con = queue[head]
+
+		queue[head], head = nil, head + 1
+
+		return con
+	end
 end)
 
 
@@ -256,7 +348,7 @@ local _connect; _connect = socket.interpose("connect", function(self, timeout)
 
 	while not ok do
 		if why == EAGAIN then
-			if not timed_poll(self, deadline) then
+			if not timed_poll(self, deadline, self:racetimeout()) then
 				return nil, oops(self, "connect", ETIMEDOUT)
 			end
 		else
@@ -276,7 +368,7 @@ end)
 local _starttls; _starttls = socket.interpose("starttls", function(self, arg1, arg2)
 	local ctx, timeout
 
-	if type(arg1) == "userdata" then
+	if type(arg1) == "userdata" or type(arg1) == "table" then
 		ctx = arg1
 	elseif type(arg2) == "userdata" then
 		ctx = arg2
@@ -286,6 +378,8 @@ local _starttls; _starttls = socket.interpose("starttls", function(self, arg1, a
 		timeout = arg1
 	elseif type(arg2) == "number" then
 		timeout = arg2
+	elseif type(arg1) == "table" and arg1.timeout then
+		timeout = arg1.timeout
 	else
 		timeout = self:timeout()
 	end
@@ -641,6 +735,183 @@ local _sendfd; _sendfd = socket.interpose("sendfd", function (self, msg, fd, tim
 end)
 
 
+--
+-- Yielding socket:sendfile
+--
+-- A stall can be on either end. A stalled write leaves "w" in our own
+-- events, so we wait on just our descriptor; otherwise the source ran
+-- dry, which only pipes and sockets can do, and we wait for it to become
+-- readable. Regular files are never polled. TLS sources can't be read
+-- from their descriptor and are relayed through socket:xread instead.
+--
+local EOPNOTSUPP = errno.EOPNOTSUPP
+
+local function relay(self, src, total, count, deadline)
+	while not count or total < count do
+		local want = count and math.min(count - total, 16384) or 16384
+		local data, why = src:xread(-want, deadline and math.max(0, deadline - monotime()))
+
+		if not data then
+			if why then
+				return nil, why, total
+			else
+				return total --> EOF
+			end
+		end
+
+		local ok, why = self:xwrite(data, "n", deadline and math.max(0, deadline - monotime()))
+
+		if not ok then
+			return nil, why, total
+		end
+
+		total = total + #data
+	end
+
+	return total
+end -- relay
+
+local _sendfile; _sendfile = socket.interpose("sendfile", function (self, src, offset, count, timeout)
+	local timeout = timeout or self:timeout()
+	local deadline = timeout and (monotime() + timeout)
+	local total = 0
+	local watch
+
+	if socket.type(src) then
+		watch = { pollfd = src:pollfd(), events = "r" }
+	elseif type(src) == "number" then
+		watch = { pollfd = src, events = "r" }
+	end
+
+	repeat
+		local n, why = _sendfile(self, src, offset, count and (count - total))
+
+		total = total + n
+		offset = offset and (offset + n)
+
+		if not why then
+			return total
+		elseif why == EAGAIN then
+			local other = not self:events():find("w", 1, true) and watch or nil
+
+			if not timed_poll(self, deadline, nil, other) then
+				return nil, oops(self, "sendfile", ETIMEDOUT), total
+			end
+		elseif why == EOPNOTSUPP and socket.type(src) then
+			return relay(self, src, total, count, deadline)
+		else
+			return nil, oops(self, "sendfile", why), total
+		end
+	until false
+end)
+
+
+--
+-- Yielding socket:sendmany
+--
+local _sendmany; _sendmany = socket.interpose("sendmany", function (self, msgs, timeout)
+	local timeout = timeout or self:timeout()
+	local deadline = timeout and (monotime() + timeout)
+	local i, total = 1, 0
+
+	while i <= #msgs do
+		local n, why = _sendmany(self, msgs, i)
+
+		i = i + n
+		total = total + n
+
+		if why then
+			if why == EAGAIN then
+				if not timed_poll(self, deadline) then
+					return nil, oops(self, "sendmany", ETIMEDOUT), total
+				end
+			else
+				return nil, oops(self, "sendmany", why), total
+			end
+		end
+	end
+
+	return total
+end)
+
+
+--
+-- Yielding socket:recvmany
+--
+local _recvmany; _recvmany = socket.interpose("recvmany", function (self, batch, timeout)
+	local timeout = timeout or self:timeout()
+	local deadline = timeout and (monotime() + timeout)
+
+	repeat
+		local res, why = _recvmany(self, batch)
+
+		if res then
+			return res
+		elseif why == EAGAIN then
+			if not timed_poll(self, deadline) then
+				return nil, oops(self, "recvmany", ETIMEDOUT)
+			end
+		else
+			return nil, oops(self, "recvmany", why)
+		end
+	until false
+end)
+
+
+--
+-- Yielding socket:view
+--
+local _view; _view = socket.interpose("view", function (self, what, timeout)
+	local timeout = timeout or self:timeout()
+	local deadline = timeout and (monotime() + timeout)
+
+	repeat
+		local view, why = _view(self, what)
+
+		if view then
+			return view
+		elseif why == EAGAIN then
+			if not timed_poll(self, deadline) then
+				return nil, oops(self, "view", ETIMEDOUT)
+			end
+		else
+			return nil, oops(self, "view", why)
+		end
+	until false
+end)
+
+
+--
+-- Yielding socket:relay
+--
+-- Either end can stall. Only the stalled socket has pending events, so
+-- polling both is enough to wake up on whichever becomes ready. A read
+-- refused by the buffer budget has no events and backs off instead. See
+-- timed_poll.
+--
+local _relay; _relay = socket.interpose("relay", function (self, dst, count, timeout)
+	local timeout = timeout or self:timeout()
+	local deadline = timeout and (monotime() + timeout)
+	local total = 0
+
+	repeat
+		local n, why = _relay(self, dst, count and (count - total))
+
+		total = total + n
+
+		if not why then
+			return total
+		elseif why == EAGAIN then
+			if not timed_poll(self, deadline, nil, dst) then
+				return nil, oops(self, "relay", ETIMEDOUT), total
+			end
+		else
+			return nil, oops(self, "relay", why), total
+		end
+	until false
+end)
+
+
 --
 -- Yielding socket:recvfd
 --
@@ -0,0 +1,336 @@
+local loader = function(loader, ...)
+	local cqueues = require"cqueues"
+	local socket = require"cqueues.socket"
+	local condition = require"cqueues.condition"
+	local errno = require"cqueues.errno"
+	local monotime = cqueues.monotime
+	local EPIPE = errno.EPIPE
+	local ETIMEDOUT = errno.ETIMEDOUT
+
+	local pool = {}
+
+	pool.__index = pool
+
+	local function timeleft(deadline)
+		return deadline and math.max(0, deadline - monotime())
+	end -- timeleft
+
+	--
+	-- keyof
+	--
+	-- Connections are interchangeable only if they reach the same
+	-- endpoint with the same TLS configuration. Contexts compare by
+	-- identity.
+	--
+	local function keyof(opts)
+		if opts.key then
+			return opts.key
+		end
+
+		local tls = opts.tls
+
+		if tls == true then
+			tls = "tls"
+		elseif tls then
+			tls = tostring(tls)
+		else
+			tls = ""
+		end
+
+		return string.format("%s|%s|%s|%s|%s", tostring(opts.host or opts.path), tostring(opts.port), tostring(opts.family or ""), tls, tostring(opts.sendname or ""))
+	end -- keyof
+
+	local function getgroup(self, key)
+		local group = self.groups[key]
+
+		if not group then
+			group = { count = 0, idle = {}, cond = condition.new() }
+			self.groups[key] = group
+		end
+
+		return group
+	end -- getgroup
+
+	--
+	-- alive
+	--
+	-- An idle connection should have nothing to say. Probe with a
+	-- zero-timeout fill: a timeout means the peer is quiet and the
+	-- connection still open, EOF means it was closed, and data means
+	-- the protocol state is unknown. Either of the latter disqualifies
+	-- it. The probe's timeout is cleared so the caller doesn't inherit
+	-- it.
+	--
+	local function alive(con)
+		local ok, why = con:fill(1, 0)
+
+		if ok then
+			return false
+		end
+
+		con:clearerr("r")
+
+		return why == ETIMEDOUT
+	end -- alive
+
+	local function release(self, group)
+		group.count = group.count - 1
+		group.cond:signal(1)
+	end -- release
+
+	local function open(self, opts, deadline)
+		local con, why = socket.connect(opts)
+
+		if not con then
+			return nil, why
+		end
+
+		local ok, why = con:connect(timeleft(deadline))
+
+		if ok and opts.tls then
+			ok, why = con:starttls((opts.tls ~= true) and opts.tls or nil, timeleft(deadline))
+		end
+
+		if not ok then
+			con:close()
+
+			return nil, why
+		end
+
+		return con
+	end -- open
+
+	--
+	-- pool.new
+	--
+	-- opts.max caps connections per key, both lent and idle (default
+	-- 8); opts.idle is how long an idle connection is kept, in seconds
+	-- (default 30). When opts.cq is given a sweeper runs on that
+	-- controller; otherwise idle connections are only expired when the
+	-- pool is next used.
+	--
+	function pool.new(opts)
+		opts = opts or {}
+
+		local self = setmetatable({
+			max = opts.max or 8,
+			idle = opts.idle or 30,
+			timeout = opts.timeout,
+			groups = {},
+			owner = setmetatable({}, { __mode = "k" }),
+			wakeup = condition.new(),
+			closed = false,
+			counts = { created = 0, reused = 0, dead = 0, expired = 0, waited = 0, timeouts = 0 },
+		}, pool)
+
+		if opts.cq then
+			opts.cq:wrap(function ()
+				while not self.closed do
+					self.wakeup:wait(self.idle / 2)
+					self:sweep()
+				end
+			end)
+		end
+
+		return self
+	end -- pool.new
+
+	--
+	-- pool:get
+	--
+	-- Borrow a connection for opts, which also carries the arguments
+	-- for socket.connect. opts.tls is true or a context to start TLS.
+	-- A warm idle connection is preferred; otherwise a new one is
+	-- opened unless the key is at capacity, in which case we wait for
+	-- one to be returned, up to opts.timeout.
+	--
+	function pool:get(opts, timeout)
+		timeout = timeout or opts.timeout or self.timeout
+
+		local deadline = timeout and monotime() + timeout
+		local key = keyof(opts)
+
+		while true do
+			if self.closed then
+				return nil, EPIPE
+			end
+
+			local group = getgroup(self, key)
+			local now = monotime()
+
+			while #group.idle > 0 do
+				local ent = table.remove(group.idle)
+
+				if now - ent.since < self.idle and alive(ent.con) then
+					self.owner[ent.con] = key
+					self.counts.reused = self.counts.reused + 1
+
+					return ent.con
+				end
+
+				if now - ent.since < self.idle then
+					self.counts.dead = self.counts.dead + 1
+				else
+					self.counts.expired = self.counts.expired + 1
+				end
+
+				ent.con:close()
+				group.count = group.count - 1
+			end
+
+			if group.count < self.max then
+				group.count = group.count + 1
+
+				local con, why = open(self, opts, deadline)
+
+				if not con then
+					release(self, group)
+
+					return nil, why
+				end
+
+				self.owner[con] = key
+				self.counts.created = self.counts.created + 1
+
+				return con
+			end
+
+			self.counts.waited = self.counts.waited + 1
+
+			if not group.cond:wait(timeleft(deadline)) then
+				self.counts.timeouts = self.counts.timeouts + 1
+
+				return nil, ETIMEDOUT
+			end
+		end
+	end -- pool:get
+
+	--
+	-- pool:put
+	--
+	-- Return a borrowed connection for reuse. It must be at a message
+	-- boundary: anything unread or unflushed would leak into the next
+	-- borrower's exchange, so such connections are discarded instead.
+	--
+	function pool:put(con)
+		local key = self.owner[con]
+
+		if not key then
+			return con:close()
+		end
+
+		self.owner[con] = nil
+
+		local group = getgroup(self, key)
+		local input, output = con:pending()
+
+		if self.closed or input > 0 or output > 0 or not alive(con) then
+			con:close()
+
+			return release(self, group)
+		end
+
+		group.idle[#group.idle + 1] = { con = con, since = monotime() }
+		group.cond:signal(1)
+	end -- pool:put
+
+	--
+	-- pool:discard
+	--
+	-- Close a borrowed connection that can't be reused, e.g. after an
+	-- error, freeing its slot.
+	--
+	function pool:discard(con)
+		local key = self.owner[con]
+
+		con:close()
+
+		if key then
+			self.owner[con] = nil
+			release(self, getgroup(self, key))
+		end
+	end -- pool:discard
+
+	--
+	-- pool:sweep
+	--
+	-- Close idle connections older than the idle limit. Idle lists are
+	-- kept in order of return, so the oldest are at the front.
+	--
+	function pool:sweep()
+		local now = monotime()
+
+		for key, group in pairs(self.groups) do
+			local n = 0
+
+			for i = 1, #group.idle do
+				if now - group.idle[i].since < self.idle then
+					break
+				end
+
+				group.idle[i].con:close()
+				n = i
+			end
+
+			if n > 0 then
+				for i = 1, #group.idle do
+					group.idle[i] = group.idle[i + n]
+				end
+
+				group.count = group.count - n
+				group.cond:signal(n)
+				self.counts.expired = self.counts.expired + n
+			end
+
+			if group.count == 0 then
+				self.groups[key] = nil
+			end
+		end
+	end -- pool:sweep
+
+	--
+	-- pool:stats
+	--
+	function pool:stats()
+		local stats = { idle = 0, busy = 0 }
+
+		for k, v in pairs(self.counts) do
+			stats[k] = v
+		end
+
+		for _, group in pairs(self.groups) do
+			stats.idle = stats.idle + #group.idle
+			stats.busy = stats.busy + group.count - #group.idle
+		end
+
+		return stats
+	end -- pool:stats
+
+	--
+	-- pool:close
+	--
+	-- Close idle connections and stop the sweeper. Connections still
+	-- lent out are closed when they're returned.
+	--
+	function pool:close()
+		self.closed = true
+
+		for key, group in pairs(self.groups) do
+			for i = 1, #group.idle do
+				group.idle[i].con:close()
+			end
+
+			group.count = group.count - #group.idle
+			group.idle = {}
+			group.cond:signal()
+		end
+
+		self.wakeup:signal()
+	end -- pool:close
+
+	pool.loader = loader
+
+	return pool
+end -- loader
+
+return loader(loader, ...)
@@ -31,10 +31,18 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <errno.h>
+#include <unistd.h>
 
+#include <sched.h> /* CPU_SET CPU_ZERO cpu_set_t sched_yield(2) */
+
+#include <sys/queue.h> /* TAILQ_* */
 #include <sys/uio.h>
 #include <sys/socket.h>
 
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h> /* eventfd(2) */
+#endif
+
 #include <pthread.h>
 
 #include <dlfcn.h>
@@ -127,10 +135,10 @@ static void atpanic_once(void) {
 } /* atpanic_once() */
 
 static int atpanic_trap(lua_State *L NOTUSED) {
-	struct cthread *ct;
+	jmp_buf *trap;
 
-	if ((ct = pthread_getspecific(atpanic.key)))
-		_longjmp(ct->trap, EINVAL);
+	if ((trap = pthread_getspecific(atpanic.key)))
+		_longjmp(*trap, EINVAL);
 
 	return 0;
 } /* atpanic_trap() */
@@ -188,6 +196,13 @@ static int hdl_hold(struct cthread_handle *h) {
 	return 0;
 } /* hdl_hold() */
 
+static void hdl_drop(struct cthread_handle *h) {
+	h->held = 0;
+#if ENABLE_PTHREAD_MUTEX_ROBUST
+	pthread_mutex_unlock(&h->hold);
+#endif
+} /* hdl_drop() */
+
 static _Bool hdl_isheld(struct cthread_handle *h) {
 #if ENABLE_PTHREAD_MUTEX_ROBUST
 	int error;
@@ -299,60 +314,124 @@ static void ct_release(struct cthread *ct) {
 } /* ct_release() */
 
 
-static void *ct_enter(void *arg) {
-	struct cthread *ct = arg, **ud;
-	lua_State *L = NULL;
-	int error;
+/*
+ * W A R M  T H R E A D S
+ *
+ * thread.prewarm(count) keeps up to count idle LWP threads whose Lua VMs
+ * have already opened the standard and cqueues libraries. ct_start hands
+ * a new thread object to an idle thread, if any, instead of creating one,
+ * and when a start routine returns its thread collects garbage and goes
+ * back to the idle list rather than closing the VM. Modules loaded by
+ * earlier start routines stay in package.loaded; so do any globals they
+ * set, which later start routines must not rely on either way.
+ */
+struct ctwarm {
+	pthread_t id;
+	pthread_cond_t cond;
+	jmp_buf trap;
 
-	/*
-	 * Hold down deadman switch so ct_join can detect (on some systems)
-	 * whether thread was killed or cancelled.
-	 */
-	hdl_hold(&ct->handle);
+	struct cthread *ct; /* start routine handed to us */
+	_Bool retire;
 
-	/*
-	 * Procedure for bootstrapping into a new Lua VM. Order is important
-	 * because arg[0..N] are interned strings from the parent Lua VM.
-	 *
-	 *  1) Acquire lock.
-	 *  -- BEGIN CRITICAL SECTION --
-	 *  2) Grab struct cthread reference.
-	 *  3) Open new main Lua thread.
-	 *  4) Set Lua panic trap.
-	 *  5) Load low-level components from memory as we might be
-	 *     chroot'd and unable to load them from disk.
-	 *  6) Load arg[0] as our Lua start routine.
-	 *  7) Push reference to struct cthread.
-	 *  8) Push reference to our socket.
-	 *  9) Push strings arg[1..N].
-	 *  -- END CRITICAL SECTION --
-	 * 10) Release lock and signal parent.
-	 * 11) Reset Lua panic trap.
-	 * 12) Call Lua start routine.
-	 *
-	 * NOTE: Lua user code perceives this process differently. See
-	 * thread.lua.
-	 */
-	pthread_mutex_lock(&ct->mutex);
+	struct ctwarm *next;
+}; /* struct ctwarm */
 
-	ct->refs++;
+static struct {
+	pthread_mutex_t mutex;
+	struct ctwarm *idle;
+	unsigned count, starting, target;
 
-	if (!(L = luaL_newstate()))
-		goto syerr;
+	struct {
+		unsigned long created, reused, retired;
+	} stats;
+} ctwarm = {
+	PTHREAD_MUTEX_INITIALIZER,
+};
 
-	if ((error = pthread_once(&atpanic.once, &atpanic_once)))
-		goto error;
 
-	if ((error = pthread_setspecific(atpanic.key, ct)))
-		goto error;
+static _Bool warm_wanted(void) {
+	_Bool wanted;
 
-	lua_atpanic(L, &atpanic_trap);
+	pthread_mutex_lock(&ctwarm.mutex);
+	wanted = ctwarm.count < ctwarm.target;
+	pthread_mutex_unlock(&ctwarm.mutex);
 
-	if ((error = _setjmp(ct->trap)))
-		goto error;
+	return wanted;
+} /* warm_wanted() */
 
-	luaL_openlibs(L);
-	cqs_openlibs(L);
+
+/* hand ct to an idle thread; caller holds ct->mutex */
+static _Bool warm_take(struct cthread *ct) {
+	struct ctwarm *W;
+
+	pthread_mutex_lock(&ctwarm.mutex);
+
+	if ((W = ctwarm.idle)) {
+		ctwarm.idle = W->next;
+		ctwarm.count--;
+		ctwarm.stats.reused++;
+
+		ct->id = W->id;
+		W->ct = ct;
+		pthread_cond_signal(&W->cond);
+	}
+
+	pthread_mutex_unlock(&ctwarm.mutex);
+
+	return W != NULL;
+} /* warm_take() */
+
+
+/*
+ * Idle threads execute from our module image, so it must never be
+ * unloaded once any exist.
+ */
+static int warm_pin(void) {
+	static void *ref;
+	Dl_info info;
+
+	if (ref)
+		return 0;
+
+	if (!dladdr(EXTENSION (void *)&warm_pin, &info) || !(ref = dlopen(info.dli_fname, RTLD_NOW|RTLD_LOCAL)))
+		return -1;
+
+	return 0;
+} /* warm_pin() */
+
+
+static int warm_collect(lua_State *L) {
+	lua_gc(L, LUA_GCCOLLECT, 0);
+
+	return 0;
+} /* warm_collect() */
+
+
+/* drop what the last start routine left on the stack, and its garbage */
+static int warm_reset(lua_State *L) {
+	lua_settop(L, 0);
+
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &selfindex);
+
+	lua_pushcfunction(L, &warm_collect);
+
+	return lua_pcall(L, 0, 0, 0);
+} /* warm_reset() */
+
+
+/*
+ * Steps 6-12 of the bootstrap described in ct_enter. Called with
+ * ct->mutex held, which is released before calling the start routine.
+ * Returns non-zero if the VM panicked, after which it must be abandoned
+ * rather than reused or closed.
+ */
+static int ct_run(struct cthread *ct, lua_State *L) {
+	struct cthread **ud;
+	int error;
+
+	if ((error = _setjmp(ct->trap)))
+		goto panic;
 
 	if (ct->tmp.arg[0].iscfunction) {
 		lua_pushcfunction(L, EXTENSION (lua_CFunction)ct->tmp.arg[0].v.pointer);
@@ -417,7 +496,8 @@ static void *ct_enter(void *arg) {
 
 	if ((error = _setjmp(ct->trap))) {
 		ct->error = error;
-		goto close;
+
+		return error;
 	}
 
 	ct->status = lua_pcall(L, lua_gettop(L) - 1, 0, 0);
@@ -427,376 +507,2337 @@ static void *ct_enter(void *arg) {
 			ct->error = errno;
 		}
 	}
-close:
-	if (L) {
-		if (!(error = _setjmp(ct->trap))) {
-			lua_close(L);
-		} else if (!ct->error) {
-			ct->error = error;
-		}
-	}
-
-	cqs_closefd(&ct->pipe[1]);
-
-	ct_release(ct);
 
 	return 0;
-syerr:
-	error = errno;
-error: /* NOTE: Only critical section errors reach here. */
+panic:
 	ct->error = error;
 
 	pthread_mutex_unlock(&ct->mutex);
 	pthread_cond_signal(&ct->cond);
 
-	goto close;
-} /* ct_enter() */
+	return error;
+error: /* NOTE: Only critical section errors reach here. */
+	ct->error = error;
 
+	pthread_mutex_unlock(&ct->mutex);
+	pthread_cond_signal(&ct->cond);
 
-static int dump_add(lua_State *L NOTUSED, const void *p, size_t sz, void *ud) {
-	luaL_addlstring(((luaL_Buffer *)ud), p, sz);
 	return 0;
-} /* dump_add() */
+} /* ct_run() */
 
-static int ct_setfarg(lua_State *L, struct cthread *ct, struct cthread_arg *arg, int index) {
-	lua_Debug info;
-	lua_CFunction f;
+
+/*
+ * The panic trap is armed in frames of their own so that no caller state
+ * is live across _setjmp. Each returns the panic error, if any.
+ */
+static int ct_openlibs(struct cthread *ct, lua_State *L) {
 	int error;
 
-	lua_pushvalue(L, index);
-	lua_getinfo(L, ">u", &info);
+	if ((error = _setjmp(ct->trap)))
+		return error;
 
-	if ((f = lua_tocfunction(L, index))) {
-		if (info.nups > 0)
-			goto uperr;
+	luaL_openlibs(L);
+	cqs_openlibs(L);
 
-		if ((error = ct_addfunc(ct, f))) {
-			if (error == -1)
-				return luaL_argerror(L, index, dlerror());
+	return 0;
+} /* ct_openlibs() */
 
-			return error;
-		}
+static int ct_reset(struct cthread *ct, lua_State *L, int *status) {
+	int error;
 
-		arg->v.pointer = EXTENSION (void *)f;
-		arg->iscfunction = 1;
-	} else {
-		lua_State *T;
-		luaL_Buffer B;
+	if ((error = _setjmp(ct->trap)))
+		return error;
 
-		/* _ENV is always first upvalue (if any) in Lua 5.2+ */
-		if ((LUA_VERSION_NUM < 502 && info.nups > 0) || info.nups > 1)
-			goto uperr;
+	*status = warm_reset(L);
 
-		luaL_checkstack(L, 2, "too many arguments");
+	return 0;
+} /* ct_reset() */
 
-		/*
-		 * NOTE: Must put luaL_Buffer on a different stack because
-		 * luaL_Buffer has stack constraints that lua_dump is not
-		 * guaranteed to meet--we don't know if and how lua_dump
-		 * will keep intermediate objects on top of the stack.
-		 */
-		T = lua_newthread(L);
-		luaL_buffinit(T, &B);
-		lua_pushvalue(L, index);
-		lua_dump(L, &dump_add, &B, 0);
-		luaL_pushresult(&B);
+static int ct_close(jmp_buf *trap, lua_State *L) {
+	int error;
 
-		arg->v.string.iov_base = (char *)luaL_checklstring(T, -1, &arg->v.string.iov_len);
-	}
+	if ((error = _setjmp(*trap)))
+		return error;
 
-	arg->type = LUA_TFUNCTION;
+	lua_close(L);
 
 	return 0;
-uperr:
-	return luaL_argerror(L, index, "function has upvalues");
-} /* ct_setfarg() */
+} /* ct_close() */
 
 
-/* on success destroy object with ct_release(); on failure use free(3) */
-static int ct_init(struct cthread *ct) {
-	int progress = 0;
-	int error;
+/*
+ * Signal joiners that the start routine is done. Returns L if it was
+ * reset for another start routine, otherwise closes it and returns NULL.
+ * A VM that panicked here or earlier (see ct_run) is abandoned instead:
+ * unwinding it further isn't safe, so its memory is leaked.
+ */
+static lua_State *ct_done(struct cthread *ct, lua_State *L, _Bool reuse, _Bool panicked) {
+	int status, error = 0;
 
-	ct->refs = 1;
+	if (L && !panicked && reuse) {
+		if (!(error = ct_reset(ct, L, &status)) && status == LUA_OK)
+			goto exit;
+	}
 
-	ct->pipe[0] = -1;
-	ct->pipe[1] = -1;
+	if (L && !panicked && !error)
+		error = ct_close(&ct->trap, L);
 
-	ct->tmp.fd[0] = -1;
-	ct->tmp.fd[1] = -1;
+	if (error && !ct->error)
+		ct->error = error;
 
-	if ((error = pthread_mutex_init(&ct->mutex, NULL)))
-		goto error;
+	L = NULL;
+exit:
+	cqs_closefd(&ct->pipe[1]);
+	hdl_drop(&ct->handle);
 
-	progress++;
+	ct_release(ct);
 
-	if ((error = pthread_cond_init(&ct->cond, NULL)))
-		goto error;
+	return L;
+} /* ct_done() */
 
-	progress++;
 
-	if ((error = pthread_attr_init(&ct->attr)))
-		goto error;
+static lua_State *ct_job(struct cthread *ct, lua_State *L) {
+	int error;
 
-	progress++;
+	hdl_hold(&ct->handle);
 
-	if ((error = hdl_init(&ct->handle)))
-		goto error;
+	pthread_mutex_lock(&ct->mutex);
 
-	progress++;
+	ct->refs++;
 
-	return 0;
-error:
-	switch (progress) {
-	case 4:
-		hdl_destroy(&ct->handle);
-	case 3:
-		pthread_attr_destroy(&ct->attr);
-	case 2:
-		pthread_cond_destroy(&ct->cond);
-	case 1:
-		pthread_mutex_destroy(&ct->mutex);
-	case 0:
-		break;
+	if ((error = pthread_setspecific(atpanic.key, &ct->trap))) {
+		ct->error = error;
+
+		pthread_mutex_unlock(&ct->mutex);
+		pthread_cond_signal(&ct->cond);
+
+		return ct_done(ct, L, 0, 0);
 	}
 
-	return error;
-} /* ct_init() */
+	error = ct_run(ct, L);
 
-static struct cthread *ct_create(int *_error) {
-	struct cthread *ct = NULL;
-	int error;
+	return ct_done(ct, L, 1, !!error);
+} /* ct_job() */
 
-	if (!(ct = calloc(1, sizeof *ct)))
-		goto syerr;
 
-	if ((error = ct_init(ct))) {
-		free(ct);
-		ct = NULL;
-		goto error;
-	}
+/* wait on the idle list for start routines until no longer wanted */
+static void ct_idle(lua_State *L) {
+	struct ctwarm W;
+	struct cthread *ct;
 
-	if ((error = pthread_attr_setdetachstate(&ct->attr, PTHREAD_CREATE_DETACHED)))
-		goto error;
+	memset(&W, 0, sizeof W);
+	W.id = pthread_self();
 
-	if ((error = cqs_pipe(ct->pipe, O_NONBLOCK|O_CLOEXEC)))
-		goto error;
+	if (pthread_cond_init(&W.cond, NULL))
+		goto close;
 
-	return ct;
-syerr:
-	error = errno;
-error:
-	*_error = error;
+	while (L) {
+		pthread_mutex_lock(&ctwarm.mutex);
 
-	ct_release(ct);
+		if (ctwarm.count >= ctwarm.target) {
+			ctwarm.stats.retired++;
+			pthread_mutex_unlock(&ctwarm.mutex);
 
-	return NULL;
-} /* ct_create() */
+			break;
+		}
 
-static int ct_start(lua_State *L) {
-	struct cthread **ud, *ct;
-	sigset_t mask, omask;
-	int top, error;
+		W.next = ctwarm.idle;
+		ctwarm.idle = &W;
+		ctwarm.count++;
 
-	top = lua_gettop(L);
+		while (!W.ct && !W.retire)
+			pthread_cond_wait(&W.cond, &ctwarm.mutex);
 
-	ud = lua_newuserdata(L, sizeof *ud);
-	*ud = NULL;
+		ct = W.ct;
+		W.ct = NULL;
+
+		pthread_mutex_unlock(&ctwarm.mutex);
+
+		if (!ct)
+			break;
+
+		L = ct_job(ct, L);
+	}
+
+	pthread_cond_destroy(&W.cond);
+close:
+	if (L && !pthread_setspecific(atpanic.key, &W.trap))
+		ct_close(&W.trap, L);
+} /* ct_idle() */
+
+
+static void *ct_warm(void *arg NOTUSED) {
+	jmp_buf trap;
+	lua_State *L = NULL;
+
+	pthread_mutex_lock(&ctwarm.mutex);
+	ctwarm.starting--;
+	pthread_mutex_unlock(&ctwarm.mutex);
+
+	if (pthread_once(&atpanic.once, &atpanic_once) || pthread_setspecific(atpanic.key, &trap))
+		return 0;
+
+	if (!(L = luaL_newstate()))
+		return 0;
+
+	lua_atpanic(L, &atpanic_trap);
+
+	if (_setjmp(trap))
+		return 0; /* abandon the VM; see ct_done */
+
+	luaL_openlibs(L);
+	cqs_openlibs(L);
+
+	ct_idle(L);
+
+	return 0;
+} /* ct_warm() */
+
+
+static void *ct_enter(void *arg) {
+	struct cthread *ct = arg;
+	lua_State *L = NULL;
+	int error;
+
+	/*
+	 * Hold down deadman switch so ct_join can detect (on some systems)
+	 * whether thread was killed or cancelled.
+	 */
+	hdl_hold(&ct->handle);
+
+	/*
+	 * Procedure for bootstrapping into a new Lua VM. Order is important
+	 * because arg[0..N] are interned strings from the parent Lua VM.
+	 *
+	 *  1) Acquire lock.
+	 *  -- BEGIN CRITICAL SECTION --
+	 *  2) Grab struct cthread reference.
+	 *  3) Open new main Lua thread.
+	 *  4) Set Lua panic trap.
+	 *  5) Load low-level components from memory as we might be
+	 *     chroot'd and unable to load them from disk.
+	 *  6) Load arg[0] as our Lua start routine.
+	 *  7) Push reference to struct cthread.
+	 *  8) Push reference to our socket.
+	 *  9) Push strings arg[1..N].
+	 *  -- END CRITICAL SECTION --
+	 * 10) Release lock and signal parent.
+	 * 11) Reset Lua panic trap.
+	 * 12) Call Lua start routine.
+	 *
+	 * Warm threads repeat steps 1, 2, 4 and 6-12 with their existing
+	 * VM. See ct_job.
+	 *
+	 * NOTE: Lua user code perceives this process differently. See
+	 * thread.lua.
+	 */
+	pthread_mutex_lock(&ct->mutex);
+
+	ct->refs++;
+
+	if (!(L = luaL_newstate()))
+		goto syerr;
+
+	if ((error = pthread_once(&atpanic.once, &atpanic_once)))
+		goto error;
+
+	if ((error = pthread_setspecific(atpanic.key, &ct->trap)))
+		goto error;
+
+	lua_atpanic(L, &atpanic_trap);
+
+	if ((error = ct_openlibs(ct, L)))
+		goto panic;
+
+	error = ct_run(ct, L);
+
+	if ((L = ct_done(ct, L, warm_wanted(), !!error)))
+		ct_idle(L);
+
+	return 0;
+syerr:
+	error = errno;
+error: /* NOTE: Only critical section errors reach here. */
+	ct->error = error;
+
+	pthread_mutex_unlock(&ct->mutex);
+	pthread_cond_signal(&ct->cond);
+
+	ct_done(ct, L, 0, 0);
+
+	return 0;
+panic:
+	ct->error = error;
+
+	pthread_mutex_unlock(&ct->mutex);
+	pthread_cond_signal(&ct->cond);
+
+	ct_done(ct, L, 0, 1);
+
+	return 0;
+} /* ct_enter() */
+
+
+static int dump_add(lua_State *L NOTUSED, const void *p, size_t sz, void *ud) {
+	luaL_addlstring(((luaL_Buffer *)ud), p, sz);
+	return 0;
+} /* dump_add() */
+
+static int ct_setfarg(lua_State *L, struct cthread *ct, struct cthread_arg *arg, int index) {
+	lua_Debug info;
+	lua_CFunction f;
+	int error;
+
+	lua_pushvalue(L, index);
+	lua_getinfo(L, ">u", &info);
+
+	if ((f = lua_tocfunction(L, index))) {
+		if (info.nups > 0)
+			goto uperr;
+
+		if ((error = ct_addfunc(ct, f))) {
+			if (error == -1)
+				return luaL_argerror(L, index, dlerror());
+
+			return error;
+		}
+
+		arg->v.pointer = EXTENSION (void *)f;
+		arg->iscfunction = 1;
+	} else {
+		lua_State *T;
+		luaL_Buffer B;
+
+		/* _ENV is always first upvalue (if any) in Lua 5.2+ */
+		if ((LUA_VERSION_NUM < 502 && info.nups > 0) || info.nups > 1)
+			goto uperr;
+
+		luaL_checkstack(L, 2, "too many arguments");
+
+		/*
+		 * NOTE: Must put luaL_Buffer on a different stack because
+		 * luaL_Buffer has stack constraints that lua_dump is not
+		 * guaranteed to meet--we don't know if and how lua_dump
+		 * will keep intermediate objects on top of the stack.
+		 */
+		T = lua_newthread(L);
+		luaL_buffinit(T, &B);
+		lua_pushvalue(L, index);
+		lua_dump(L, &dump_add, &B, 0);
+		luaL_pushresult(&B);
+
+		arg->v.string.iov_base = (char *)luaL_checklstring(T, -1, &arg->v.string.iov_len);
+	}
+
+	arg->type = LUA_TFUNCTION;
+
+	return 0;
+uperr:
+	return luaL_argerror(L, index, "function has upvalues");
+} /* ct_setfarg() */
+
+
+/* on success destroy object with ct_release(); on failure use free(3) */
+static int ct_init(struct cthread *ct) {
+	int progress = 0;
+	int error;
+
+	ct->refs = 1;
+
+	ct->pipe[0] = -1;
+	ct->pipe[1] = -1;
+
+	ct->tmp.fd[0] = -1;
+	ct->tmp.fd[1] = -1;
+
+	if ((error = pthread_mutex_init(&ct->mutex, NULL)))
+		goto error;
+
+	progress++;
+
+	if ((error = pthread_cond_init(&ct->cond, NULL)))
+		goto error;
+
+	progress++;
+
+	if ((error = pthread_attr_init(&ct->attr)))
+		goto error;
+
+	progress++;
+
+	if ((error = hdl_init(&ct->handle)))
+		goto error;
+
+	progress++;
+
+	return 0;
+error:
+	switch (progress) {
+	case 4:
+		hdl_destroy(&ct->handle);
+	case 3:
+		pthread_attr_destroy(&ct->attr);
+	case 2:
+		pthread_cond_destroy(&ct->cond);
+	case 1:
+		pthread_mutex_destroy(&ct->mutex);
+	case 0:
+		break;
+	}
+
+	return error;
+} /* ct_init() */
+
+static struct cthread *ct_create(int *_error) {
+	struct cthread *ct = NULL;
+	int error;
+
+	if (!(ct = calloc(1, sizeof *ct)))
+		goto syerr;
+
+	if ((error = ct_init(ct))) {
+		free(ct);
+		ct = NULL;
+		goto error;
+	}
+
+	if ((error = pthread_attr_setdetachstate(&ct->attr, PTHREAD_CREATE_DETACHED)))
+		goto error;
+
+	if ((error = cqs_pipe(ct->pipe, O_NONBLOCK|O_CLOEXEC)))
+		goto error;
+
+	return ct;
+syerr:
+	error = errno;
+error:
+	*_error = error;
+
+	ct_release(ct);
+
+	return NULL;
+} /* ct_create() */
+
+static int ct_start(lua_State *L) {
+	struct cthread **ud, *ct;
+	sigset_t mask, omask;
+	int top, error;
+
+	top = lua_gettop(L);
+
+	ud = lua_newuserdata(L, sizeof *ud);
+	*ud = NULL;
 
 	luaL_getmetatable(L, CQS_THREAD);
 	lua_setmetatable(L, -2);
 
-	if (!(ct = *ud = ct_create(&error)))
+	if (!(ct = *ud = ct_create(&error)))
+		goto error;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	if (!(ct->tmp.arg = calloc(sizeof *ct->tmp.arg, top)))
+		goto syerr;
+
+	for (int index = 1; index <= top; index++) {
+		struct cthread_arg *arg = &ct->tmp.arg[ct->tmp.argc];
+
+		switch (lua_type(L, index)) {
+		case LUA_TNIL:
+			arg->type = LUA_TNIL;
+			break;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(L, index)) {
+				arg->v.integer = lua_tointeger(L, index);
+				arg->isinteger = 1;
+				arg->type = LUA_TNUMBER;
+				break;
+			}
+#endif
+			arg->v.number = lua_tonumber(L, index);
+			arg->type = LUA_TNUMBER;
+			break;
+		case LUA_TBOOLEAN:
+			arg->v.boolean = lua_toboolean(L, index);
+			arg->type = LUA_TBOOLEAN;
+			break;
+		case LUA_TLIGHTUSERDATA:
+			arg->v.pointer = lua_touserdata(L, index);
+			arg->type = LUA_TLIGHTUSERDATA;
+			break;
+		case LUA_TFUNCTION:
+			if ((error = ct_setfarg(L, ct, arg, index)))
+				goto error;
+			break;
+		default:
+			/* FALL THROUGH (maybe has __tostring metamethod) */
+		case LUA_TSTRING:
+			arg->v.string.iov_base = (char *)luaL_checklstring(L, index, &arg->v.string.iov_len);
+			arg->type = LUA_TSTRING;
+			break;
+		}
+
+		ct->tmp.argc++;
+	}
+
+	/* we may have added more stack objects above the thread object */
+	luaL_checkstack(L, 2, "too many arguments");
+	lua_pushvalue(L, top + 1);
+
+	if (0 != cqs_socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, ct->tmp.fd, O_NONBLOCK|O_CLOEXEC))
+		goto syerr;
+
+	if ((error = cqs_socket_fdopen(L, ct->tmp.fd[0], NULL)))
+		goto error;
+
+	ct->tmp.fd[0] = -1;
+
+	sigfillset(&mask);
+	sigemptyset(&omask);
+	if ((error = pthread_sigmask(SIG_SETMASK, &mask, &omask)))
+		goto error;
+
+	pthread_mutex_lock(&ct->mutex);
+
+	if (warm_take(ct) || !(error = pthread_create(&ct->id, &ct->attr, &ct_enter, ct)))
+		pthread_cond_wait(&ct->cond, &ct->mutex);
+
+	pthread_mutex_unlock(&ct->mutex);
+
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	if (error)
+		goto error;
+
+	return 2;
+syerr:
+	error = errno;
+error:
+	lua_settop(L, 0);
+
+	lua_pushnil(L);
+	lua_pushnil(L);
+	lua_pushinteger(L, error);
+
+	return 3;
+} /* ct_start() */
+
+
+/*
+ * thread.prewarm(count) keeps up to count idle threads, starting any
+ * missing ones now. Lowering the count retires idle threads.
+ */
+static int ct_prewarm(lua_State *L) {
+	lua_Integer count = luaL_checkinteger(L, 1);
+	struct ctwarm *W;
+	pthread_attr_t attr;
+	pthread_t id;
+	sigset_t mask, omask;
+	unsigned missing;
+	int error;
+
+	luaL_argcheck(L, count >= 0 && count <= 1024, 1, "thread count out of range");
+
+	if (count > 0 && warm_pin())
+		return luaL_error(L, "thread.prewarm: %s", dlerror());
+
+	pthread_mutex_lock(&ctwarm.mutex);
+
+	ctwarm.target = count;
+
+	while (ctwarm.count > ctwarm.target && (W = ctwarm.idle)) {
+		ctwarm.idle = W->next;
+		ctwarm.count--;
+		ctwarm.stats.retired++;
+
+		W->retire = 1;
+		pthread_cond_signal(&W->cond);
+	}
+
+	missing = (ctwarm.target > ctwarm.count + ctwarm.starting)? ctwarm.target - (ctwarm.count + ctwarm.starting) : 0;
+	ctwarm.starting += missing;
+
+	pthread_mutex_unlock(&ctwarm.mutex);
+
+	if (!missing)
+		goto done;
+
+	if ((error = pthread_attr_init(&attr)))
+		goto error;
+
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	/* like thread.start, threads start with all signals blocked */
+	sigfillset(&mask);
+	sigemptyset(&omask);
+	pthread_sigmask(SIG_SETMASK, &mask, &omask);
+
+	for (error = 0; missing > 0; missing--) {
+		if ((error = pthread_create(&id, &attr, &ct_warm, NULL)))
+			break;
+
+		pthread_mutex_lock(&ctwarm.mutex);
+		ctwarm.stats.created++;
+		pthread_mutex_unlock(&ctwarm.mutex);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (error)
+		goto error;
+done:
+	lua_pushboolean(L, 1);
+
+	return 1;
+error:
+	pthread_mutex_lock(&ctwarm.mutex);
+	ctwarm.starting -= missing;
+	pthread_mutex_unlock(&ctwarm.mutex);
+
+	lua_pushboolean(L, 0);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* ct_prewarm() */
+
+
+static int ct_warmstats(lua_State *L) {
+	pthread_mutex_lock(&ctwarm.mutex);
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, ctwarm.target);
+	lua_setfield(L, -2, "target");
+	lua_pushinteger(L, ctwarm.count);
+	lua_setfield(L, -2, "idle");
+	lua_pushinteger(L, ctwarm.starting);
+	lua_setfield(L, -2, "starting");
+	lua_pushinteger(L, (lua_Integer)ctwarm.stats.created);
+	lua_setfield(L, -2, "created");
+	lua_pushinteger(L, (lua_Integer)ctwarm.stats.reused);
+	lua_setfield(L, -2, "reused");
+	lua_pushinteger(L, (lua_Integer)ctwarm.stats.retired);
+	lua_setfield(L, -2, "retired");
+
+	pthread_mutex_unlock(&ctwarm.mutex);
+
+	return 1;
+} /* ct_warmstats() */
+
+
+static int ct_join(lua_State *L) {
+	struct cthread *ct = ct_checkthread(L, 1);
+	int error;
+
+	if (pthread_equal(ct->id, pthread_self()))
+		return luaL_error(L, "thread.join: cannot join self");
+
+	if (0 == read(ct->pipe[0], &(char){ 0 }, 1)) {
+		lua_pushboolean(L, 1);
+
+		if (ct->error)
+			lua_pushinteger(L, ct->error);
+		else if (ct->msg)
+			lua_pushstring(L, ct->msg);
+		else
+			lua_pushnil(L);
+
+		return 2;
+	} else {
+		error = errno;
+
+		if (error == EAGAIN && !hdl_isheld(&ct->handle))
+			error = CT_EOWNERDEAD;
+
+		lua_pushboolean(L, 0);
+		lua_pushinteger(L, error);
+
+		return 2;
+	}
+} /* ct_join() */
+
+
+static int ct_pollfd(lua_State *L) {
+	struct cthread *ct = ct_checkthread(L, 1);
+
+	lua_pushinteger(L, ct->pipe[0]);
+
+	return 1;
+} /* ct_pollfd() */
+
+
+static int ct_events(lua_State *L) {
+	ct_checkthread(L, 1);
+
+	lua_pushliteral(L, "r");
+
+	return 1;
+} /* ct_events() */
+
+
+static int ct_timeout(lua_State *L) {
+	ct_checkthread(L, 1);
+
+	return 0;
+} /* ct_timeout() */
+
+
+static int ct__eq(lua_State *L) {
+	struct cthread **a = luaL_testudata(L, 1, CQS_THREAD);
+	struct cthread **b = luaL_testudata(L, 2, CQS_THREAD);
+
+	lua_pushboolean(L, a && b && (*a == *b));
+
+	return 1;
+} /* ct__eq() */
+
+
+static int ct__gc(lua_State *L) {
+	struct cthread **ud = luaL_checkudata(L, 1, CQS_THREAD);
+
+	ct_release(*ud);
+	*ud = NULL;
+
+	return 0;
+} /* ct__gc() */
+
+
+static int ct_type(lua_State *L) {
+	if (luaL_testudata(L, 1, CQS_THREAD)) {
+		lua_pushstring(L, "thread");
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+} /* ct_type() */
+
+
+static int ct_interpose(lua_State *L) {
+	return cqs_interpose(L, CQS_THREAD);
+} /* ct_interpose() */
+
+
+static int ct_self(lua_State *L) {
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &selfindex);
+
+	return 1;
+} /* ct_self() */
+
+
+/*
+ * Pin the calling LWP thread to a single CPU. Only supported on Linux;
+ * elsewhere returns ENOTSUP.
+ */
+static int ct_setaffinity(lua_State *L) {
+	lua_Integer cpu = luaL_checkinteger(L, 1);
+	int error;
+#if __linux__
+	cpu_set_t set;
+
+	luaL_argcheck(L, cpu >= 0 && cpu < CPU_SETSIZE, 1, "cpu out of range");
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (!(error = pthread_setaffinity_np(pthread_self(), sizeof set, &set))) {
+		lua_pushboolean(L, 1);
+
+		return 1;
+	}
+#else
+	(void)cpu;
+	error = ENOTSUP;
+#endif
+	lua_pushboolean(L, 0);
+	lua_pushinteger(L, error);
+
+	return 2;
+} /* ct_setaffinity() */
+
+
+static int ct_ncpu(lua_State *L) {
+	long n = -1;
+
+#if defined _SC_NPROCESSORS_ONLN
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (n > 0)
+		lua_pushinteger(L, n);
+	else
+		lua_pushnil(L);
+
+	return 1;
+} /* ct_ncpu() */
+
+
+/*
+ * S H A R E D  O B J E C T S
+ *
+ * Schedulers and channels are shared between LWP threads. Where the
+ * compiler has the __atomic builtins the lf_ macros map onto them;
+ * otherwise they're plain accesses and lf_lock and lf_unlock serialize
+ * on the object's mutex instead.
+ *
+ * Objects cross Lua states as light userdata produced by :handle(). A
+ * live object is registered with its type, so a handle is looked up
+ * before it's dereferenced and a forged or stale pointer is refused.
+ * Each handle carries one reference, which is taken over by adopting
+ * it, so a handle can be adopted only once and one never adopted keeps
+ * its object alive.
+ */
+#ifndef HAVE___ATOMIC_COMPARE_EXCHANGE_N
+#define HAVE___ATOMIC_COMPARE_EXCHANGE_N (defined __ATOMIC_SEQ_CST)
+#endif
+
+#if HAVE___ATOMIC_COMPARE_EXCHANGE_N
+#define lf_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define lf_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define lf_cas(p, ep, v) __atomic_compare_exchange_n((p), (ep), (v), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define lf_xchg(p, v) __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define lf_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define lf_count(p) ((void)__atomic_fetch_add((p), 1, __ATOMIC_RELAXED))
+#define lf_add(p, n) __atomic_fetch_add((p), (n), __ATOMIC_SEQ_CST)
+#define lf_lock(C) ((void)0)
+#define lf_unlock(C) ((void)0)
+#else
+/* no lock-free primitives; serialize on the object's mutex instead */
+#define lf_load(p) (*(p))
+#define lf_store(p, v) ((void)(*(p) = (v)))
+#define lf_cas(p, ep, v) ((*(p) == *(ep))? (*(p) = (v), 1) : (*(ep) = *(p), 0))
+#define lf_xchg(p, v) lf_xchg_((p), (v))
+#define lf_fence() ((void)0)
+#define lf_count(p) ((void)(*(p))++)
+#define lf_add(p, n) ((*(p) += (n)) - (n))
+#define lf_lock(C) pthread_mutex_lock(&(C)->mutex)
+#define lf_unlock(C) pthread_mutex_unlock(&(C)->mutex)
+
+static inline int lf_xchg_(int *p, int v) {
+	int o = *p;
+
+	*p = v;
+
+	return o;
+} /* lf_xchg_() */
+#endif
+
+
+struct ctref {
+	const char *type;
+	void *obj;
+	int refs;
+	unsigned handles; /* issued and not yet adopted */
+
+	struct ctref *next;
+}; /* struct ctref */
+
+static struct {
+	pthread_mutex_t mutex;
+	struct ctref *live;
+} ctref = {
+	PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static void ref_init(struct ctref *ref, const char *type, void *obj) {
+	ref->type = type;
+	ref->obj = obj;
+	ref->refs = 1;
+	ref->handles = 0;
+
+	pthread_mutex_lock(&ctref.mutex);
+	ref->next = ctref.live;
+	ctref.live = ref;
+	pthread_mutex_unlock(&ctref.mutex);
+} /* ref_init() */
+
+
+/* returns true if that was the last reference */
+static _Bool ref_drop(struct ctref *ref) {
+	struct ctref **pp;
+	_Bool last;
+
+	pthread_mutex_lock(&ctref.mutex);
+
+	if ((last = !--ref->refs)) {
+		for (pp = &ctref.live; *pp; pp = &(*pp)->next) {
+			if (*pp == ref) {
+				*pp = ref->next;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&ctref.mutex);
+
+	return last;
+} /* ref_drop() */
+
+
+/* take a reference for transfer to another Lua state */
+static void *ref_handle(struct ctref *ref) {
+	pthread_mutex_lock(&ctref.mutex);
+	ref->refs++;
+	ref->handles++;
+	pthread_mutex_unlock(&ctref.mutex);
+
+	return ref->obj;
+} /* ref_handle() */
+
+
+/* take over the reference of handle; NULL if it's not a live type */
+static void *ref_adopt(void *handle, const char *type) {
+	struct ctref *ref;
+	void *obj = NULL;
+
+	pthread_mutex_lock(&ctref.mutex);
+
+	for (ref = ctref.live; ref; ref = ref->next) {
+		if (ref->obj == handle && !strcmp(ref->type, type) && ref->handles > 0) {
+			ref->handles--;
+			obj = ref->obj;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&ctref.mutex);
+
+	return obj;
+} /* ref_adopt() */
+
+
+/*
+ * S C H E D U L E R
+ *
+ * Shares serialized work items--a function dump plus arguments, with the
+ * same restrictions as thread.start--between controllers running in
+ * different LWP threads. Each attached worker owns a slot with a deque.
+ * Submitted items are dealt to idle slots first, then round-robin; a
+ * worker whose own deque is empty steals the oldest item from the
+ * others. Results are queued for the submitter, which polls the reply
+ * pipe, while workers poll their slot's wakeup pipe.
+ *
+ * Deques are bounded rings of work pointers with per-cell sequence
+ * numbers, like the channel below, so submitters push and the owner and
+ * thieves pop without taking a lock. Items which don't fit go to the
+ * overflow list under the scheduler mutex, which also guards the (much
+ * less busy) result list. A worker about to go idle raises .idle and
+ * looks for work once more, and a submitter clears the flag after
+ * publishing, so one of them always sees the other.
+ */
+#define SCHED_DEQUESIZE 256
+
+struct ctwork {
+	TAILQ_ENTRY(ctwork) tqe;
+	lua_Integer id;
+	unsigned argc;
+	struct cthread_arg arg[];
+}; /* struct ctwork */
+
+TAILQ_HEAD(ctworks, ctwork);
+
+struct ctdeque {
+	size_t tail; /* written by submitters */
+	char pad0[64 - sizeof (size_t)];
+
+	size_t head; /* written by the owner and thieves */
+	char pad1[64 - sizeof (size_t)];
+
+	struct {
+		size_t seq;
+		struct ctwork *work;
+	} cell[SCHED_DEQUESIZE];
+}; /* struct ctdeque */
+
+struct ctslot {
+	struct ctdeque deque;
+	int idle;
+	int pipe[2];
+}; /* struct ctslot */
+
+struct ctsched {
+	struct ctref ref;
+	pthread_mutex_t mutex;
+
+	int closed;     /* refusing new work */
+	int submitting; /* submits which saw .closed unset and haven't finished */
+	int sealed;     /* closed, and every item accepted is in a deque */
+
+	lua_Integer nextid;
+	unsigned cursor;
+
+	struct ctworks overflow;
+	size_t noverflow;
+
+	struct ctworks done;
+	int pipe[2];
+
+	struct {
+		unsigned long long submitted, completed, stolen;
+	} stats;
+
+	unsigned nslot;
+	struct ctslot slot[];
+}; /* struct ctsched */
+
+struct ctsched_ud {
+	struct ctsched *S;
+	int slot; /* -1 if not attached to a worker slot */
+}; /* struct ctsched_ud */
+
+
+static void sched_poke(int fd) {
+	while (-1 == write(fd, "!", 1)) {
+		if (errno != EINTR)
+			break; /* EAGAIN: already readable */
+	}
+} /* sched_poke() */
+
+
+static void sched_calm(int fd) {
+	char buf[64];
+	ssize_t n;
+
+	for (;;) {
+		if (sizeof buf == (n = read(fd, buf, sizeof buf)))
+			continue;
+		if (n == -1 && errno == EINTR)
+			continue;
+
+		break;
+	}
+} /* sched_calm() */
+
+
+static void sched_freeall(struct ctworks *list) {
+	struct ctwork *w;
+
+	while ((w = TAILQ_FIRST(list))) {
+		TAILQ_REMOVE(list, w, tqe);
+		free(w);
+	}
+} /* sched_freeall() */
+
+
+static _Bool deque_push(struct ctsched *S, struct ctdeque *D, struct ctwork *w) {
+	size_t pos, seq;
+	_Bool ok = 0;
+
+	lf_lock(S);
+
+	pos = lf_load(&D->tail);
+
+	for (;;) {
+		seq = lf_load(&D->cell[pos % SCHED_DEQUESIZE].seq);
+
+		if (seq == pos) {
+			if (lf_cas(&D->tail, &pos, pos + 1))
+				break;
+		} else if ((ptrdiff_t)(seq - pos) < 0) {
+			goto leave; /* full */
+		} else {
+			pos = lf_load(&D->tail);
+		}
+	}
+
+	D->cell[pos % SCHED_DEQUESIZE].work = w;
+	lf_store(&D->cell[pos % SCHED_DEQUESIZE].seq, pos + 1);
+	ok = 1;
+leave:
+	lf_unlock(S);
+
+	return ok;
+} /* deque_push() */
+
+
+/* takes the oldest item, whether we're the owner or a thief */
+static struct ctwork *deque_pop(struct ctsched *S, struct ctdeque *D) {
+	struct ctwork *w = NULL;
+	size_t pos, seq;
+
+	lf_lock(S);
+
+	pos = lf_load(&D->head);
+
+	for (;;) {
+		seq = lf_load(&D->cell[pos % SCHED_DEQUESIZE].seq);
+
+		if (seq == pos + 1) {
+			if (lf_cas(&D->head, &pos, pos + 1))
+				break;
+		} else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+			goto leave; /* empty */
+		} else {
+			pos = lf_load(&D->head);
+		}
+	}
+
+	w = D->cell[pos % SCHED_DEQUESIZE].work;
+	lf_store(&D->cell[pos % SCHED_DEQUESIZE].seq, pos + SCHED_DEQUESIZE);
+leave:
+	lf_unlock(S);
+
+	return w;
+} /* deque_pop() */
+
+
+static size_t deque_count(struct ctsched *S, struct ctdeque *D) {
+	size_t head, tail;
+
+	lf_lock(S);
+	head = lf_load(&D->head);
+	tail = lf_load(&D->tail);
+	lf_unlock(S);
+
+	return (tail > head)? tail - head : 0;
+} /* deque_count() */
+
+
+static void sched_release(struct ctsched *S) {
+	struct ctwork *w;
+
+	if (!S || !ref_drop(&S->ref))
+		return;
+
+	for (unsigned i = 0; i < S->nslot; i++) {
+		while ((w = deque_pop(S, &S->slot[i].deque)))
+			free(w);
+
+		cqs_closefd(&S->slot[i].pipe[0]);
+		cqs_closefd(&S->slot[i].pipe[1]);
+	}
+
+	sched_freeall(&S->overflow);
+
+	sched_freeall(&S->done);
+	cqs_closefd(&S->pipe[0]);
+	cqs_closefd(&S->pipe[1]);
+
+	pthread_mutex_destroy(&S->mutex);
+
+	free(S);
+} /* sched_release() */
+
+
+static struct ctsched *sched_create(unsigned nslot, int *_error) {
+	struct ctsched *S;
+	int error;
+
+	if (!(S = calloc(1, sizeof *S + nslot * sizeof *S->slot))) {
+		*_error = errno;
+		return NULL;
+	}
+
+	if ((error = pthread_mutex_init(&S->mutex, NULL))) {
+		free(S);
+		*_error = error;
+		return NULL;
+	}
+
+	ref_init(&S->ref, CQS_SCHED, S);
+	S->nslot = nslot;
+	TAILQ_INIT(&S->overflow);
+	TAILQ_INIT(&S->done);
+	S->pipe[0] = -1;
+	S->pipe[1] = -1;
+
+	for (unsigned i = 0; i < nslot; i++) {
+		for (size_t j = 0; j < SCHED_DEQUESIZE; j++)
+			S->slot[i].deque.cell[j].seq = j;
+
+		S->slot[i].pipe[0] = -1;
+		S->slot[i].pipe[1] = -1;
+	}
+
+	if ((error = cqs_pipe(S->pipe, O_NONBLOCK|O_CLOEXEC)))
+		goto error;
+
+	for (unsigned i = 0; i < nslot; i++) {
+		if ((error = cqs_pipe(S->slot[i].pipe, O_NONBLOCK|O_CLOEXEC)))
+			goto error;
+	}
+
+	return S;
+error:
+	*_error = error;
+
+	sched_release(S);
+
+	return NULL;
+} /* sched_create() */
+
+
+/*
+ * Copy stack values [from, to] into a single allocation. Validates
+ * everything before allocating so argument errors never leak.
+ */
+static struct ctwork *sched_pack(lua_State *L, int from, int to) {
+	unsigned argc = (to >= from)? to - from + 1 : 0;
+	size_t size = sizeof (struct ctwork) + argc * sizeof (struct cthread_arg);
+	struct ctwork *w;
+	lua_State *T;
+	char *p;
+	int nfn = 0;
+
+	luaL_checkstack(L, 2, "too many arguments");
+	T = lua_newthread(L);
+
+	for (int index = from; index <= to; index++) {
+		switch (lua_type(L, index)) {
+		case LUA_TNIL:
+		case LUA_TNUMBER:
+		case LUA_TBOOLEAN:
+		case LUA_TLIGHTUSERDATA:
+			break;
+		case LUA_TSTRING:
+			size += lua_rawlen(L, index);
+			break;
+		case LUA_TFUNCTION: {
+			lua_Debug info;
+			luaL_Buffer B;
+
+			if (lua_iscfunction(L, index))
+				return luaL_argerror(L, index, "C functions cannot be scheduled"), NULL;
+
+			lua_pushvalue(L, index);
+			lua_getinfo(L, ">u", &info);
+
+			/* _ENV is always first upvalue (if any) in Lua 5.2+ */
+			if ((LUA_VERSION_NUM < 502 && info.nups > 0) || info.nups > 1)
+				return luaL_argerror(L, index, "function has upvalues"), NULL;
+
+			luaL_checkstack(T, LUA_MINSTACK, "too many arguments");
+			luaL_buffinit(T, &B);
+			lua_pushvalue(L, index);
+			lua_dump(L, &dump_add, &B, 0);
+			lua_pop(L, 1);
+			luaL_pushresult(&B);
+
+			size += lua_rawlen(T, ++nfn);
+
+			break;
+		}
+		default:
+			return luaL_argerror(L, index, lua_pushfstring(L, "%s cannot be scheduled", luaL_typename(L, index))), NULL;
+		}
+	}
+
+	if (!(w = calloc(1, size)))
+		return luaL_error(L, "%s", cqs_strerror(errno)), NULL;
+
+	w->argc = argc;
+	p = (char *)&w->arg[argc];
+	nfn = 0;
+
+	for (unsigned i = 0; i < argc; i++) {
+		struct cthread_arg *arg = &w->arg[i];
+		int index = from + i;
+		const char *src;
+		size_t len;
+
+		switch ((arg->type = lua_type(L, index))) {
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(L, index)) {
+				arg->v.integer = lua_tointeger(L, index);
+				arg->isinteger = 1;
+				break;
+			}
+#endif
+			arg->v.number = lua_tonumber(L, index);
+			break;
+		case LUA_TBOOLEAN:
+			arg->v.boolean = lua_toboolean(L, index);
+			break;
+		case LUA_TLIGHTUSERDATA:
+			arg->v.pointer = lua_touserdata(L, index);
+			break;
+		case LUA_TSTRING:
+		case LUA_TFUNCTION:
+			src = (arg->type == LUA_TSTRING)? lua_tolstring(L, index, &len) : lua_tolstring(T, ++nfn, &len);
+			memcpy(p, src, len);
+			arg->v.string.iov_base = p;
+			arg->v.string.iov_len = len;
+			p += len;
+			break;
+		default:
+			break;
+		}
+	}
+
+	lua_pop(L, 1); /* T */
+
+	return w;
+} /* sched_pack() */
+
+
+static int sched_unpack(lua_State *L, struct ctwork *w) {
+	luaL_checkstack(L, w->argc, "too many results");
+
+	for (unsigned i = 0; i < w->argc; i++) {
+		struct cthread_arg *arg = &w->arg[i];
+
+		switch (arg->type) {
+		case LUA_TNUMBER:
+			if (arg->isinteger) {
+				lua_pushinteger(L, arg->v.integer);
+			} else {
+				lua_pushnumber(L, arg->v.number);
+			}
+			break;
+		case LUA_TBOOLEAN:
+			lua_pushboolean(L, arg->v.boolean);
+			break;
+		case LUA_TLIGHTUSERDATA:
+			lua_pushlightuserdata(L, arg->v.pointer);
+			break;
+		case LUA_TSTRING:
+			lua_pushlstring(L, arg->v.string.iov_base, arg->v.string.iov_len);
+			break;
+		case LUA_TFUNCTION:
+			if (LUA_OK != luaL_loadbuffer(L, arg->v.string.iov_base, arg->v.string.iov_len, "=(scheduler)"))
+				lua_pushnil(L);
+			break;
+		default:
+			lua_pushnil(L);
+			break;
+		}
+	}
+
+	return w->argc;
+} /* sched_unpack() */
+
+
+/* wake the worker of slot if it announced it was going idle */
+static _Bool sched_signal(struct ctsched *S, struct ctslot *slot) {
+	_Bool idle;
+
+	lf_fence();
+
+	lf_lock(S);
+	idle = lf_load(&slot->idle) && lf_xchg(&slot->idle, 0);
+	lf_unlock(S);
+
+	if (idle)
+		sched_poke(slot->pipe[1]);
+
+	return idle;
+} /* sched_signal() */
+
+
+/* wake one idle worker */
+static void sched_wake(struct ctsched *S, unsigned from) {
+	for (unsigned i = 0; i < S->nslot; i++) {
+		if (sched_signal(S, &S->slot[(from + i) % S->nslot]))
+			return;
+	}
+} /* sched_wake() */
+
+
+/* look for work in our own deque, then steal, then try the overflow */
+static struct ctwork *sched_find(struct ctsched *S, unsigned self) {
+	struct ctwork *w;
+
+	if ((w = deque_pop(S, &S->slot[self].deque)))
+		return w;
+
+	for (unsigned i = 1; i < S->nslot; i++) {
+		struct ctdeque *victim = &S->slot[(self + i) % S->nslot].deque;
+
+		if ((w = deque_pop(S, victim))) {
+			lf_count(&S->stats.stolen);
+
+			/* more left behind; let another idler help */
+			if (deque_count(S, victim))
+				sched_wake(S, self + 1);
+
+			return w;
+		}
+	}
+
+	if (lf_load(&S->noverflow)) {
+		pthread_mutex_lock(&S->mutex);
+
+		if ((w = TAILQ_FIRST(&S->overflow))) {
+			TAILQ_REMOVE(&S->overflow, w, tqe);
+			lf_store(&S->noverflow, S->noverflow - 1);
+		}
+
+		pthread_mutex_unlock(&S->mutex);
+	}
+
+	return w;
+} /* sched_find() */
+
+
+static struct ctsched_ud *sched_checkud(lua_State *L, int index) {
+	struct ctsched_ud *ud = luaL_checkudata(L, index, CQS_SCHED);
+
+	luaL_argcheck(L, ud->S, index, CQS_SCHED " expected, got NULL");
+
+	return ud;
+} /* sched_checkud() */
+
+
+static struct ctsched_ud *sched_checkslot(lua_State *L, int index) {
+	struct ctsched_ud *ud = sched_checkud(L, index);
+
+	luaL_argcheck(L, ud->slot >= 0, index, "scheduler not attached to a worker slot");
+
+	return ud;
+} /* sched_checkslot() */
+
+
+/*
+ * thread.scheduler(count) creates a scheduler with count worker slots.
+ * thread.scheduler(handle[, slot]) adopts the reference produced by
+ * scheduler:handle() in another Lua state, optionally attaching to slot.
+ */
+static int sched_new(lua_State *L) {
+	struct ctsched_ud *ud;
+	int error;
+
+	ud = lua_newuserdata(L, sizeof *ud);
+	ud->S = NULL;
+	ud->slot = -1;
+
+	luaL_getmetatable(L, CQS_SCHED);
+	lua_setmetatable(L, -2);
+
+	if (lua_islightuserdata(L, 1)) {
+		ud->S = ref_adopt(lua_touserdata(L, 1), CQS_SCHED);
+
+		luaL_argcheck(L, ud->S, 1, "invalid or already adopted scheduler handle");
+
+		if (!lua_isnoneornil(L, 2)) {
+			lua_Integer slot = luaL_checkinteger(L, 2);
+
+			luaL_argcheck(L, slot >= 1 && slot <= (lua_Integer)ud->S->nslot, 2, "slot out of range");
+			ud->slot = slot - 1;
+		}
+	} else {
+		lua_Integer count = luaL_checkinteger(L, 1);
+
+		luaL_argcheck(L, count >= 1 && count <= 1024, 1, "slot count out of range");
+
+		if (!(ud->S = sched_create(count, &error))) {
+			lua_pushnil(L);
+			lua_pushinteger(L, error);
+
+			return 2;
+		}
+	}
+
+	return 1;
+} /* sched_new() */
+
+
+/* take a reference for transfer to another Lua state via sched_new */
+static int sched_handle(lua_State *L) {
+	struct ctsched *S = sched_checkud(L, 1)->S;
+
+	lua_pushlightuserdata(L, ref_handle(&S->ref));
+
+	return 1;
+} /* sched_handle() */
+
+
+static int sched_submit(lua_State *L) {
+	struct ctsched *S = sched_checkud(L, 1)->S;
+	struct ctslot *slot = NULL;
+	struct ctwork *w;
+	unsigned cursor;
+	lua_Integer id;
+
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	w = sched_pack(L, 2, lua_gettop(L));
+
+	/* pairs with the store and load in sched_close */
+	lf_lock(S);
+	lf_add(&S->submitting, 1);
+	lf_unlock(S);
+
+	if (lf_load(&S->closed)) {
+		lf_lock(S);
+		lf_add(&S->submitting, -1);
+		lf_unlock(S);
+
+		free(w);
+
+		lua_pushnil(L);
+		lua_pushinteger(L, EPIPE);
+
+		return 2;
+	}
+
+	lf_lock(S);
+	id = w->id = lf_add(&S->nextid, 1) + 1;
+	cursor = lf_add(&S->cursor, 1);
+	lf_unlock(S);
+
+	for (unsigned i = 0; i < S->nslot; i++) {
+		if (lf_load(&S->slot[(cursor + i) % S->nslot].idle)) {
+			slot = &S->slot[(cursor + i) % S->nslot];
+			break;
+		}
+	}
+
+	if (!slot)
+		slot = &S->slot[cursor % S->nslot];
+
+	lf_count(&S->stats.submitted);
+
+	if (!deque_push(S, &slot->deque, w)) {
+		pthread_mutex_lock(&S->mutex);
+		TAILQ_INSERT_TAIL(&S->overflow, w, tqe);
+		lf_store(&S->noverflow, S->noverflow + 1);
+		pthread_mutex_unlock(&S->mutex);
+
+		/* anybody may take it from the overflow */
+		sched_wake(S, cursor);
+	} else if (!sched_signal(S, slot)) {
+		/* the owner is busy; an idle thief can start on it sooner */
+		sched_wake(S, cursor + 1);
+	}
+
+	lf_lock(S);
+	lf_add(&S->submitting, -1);
+	lf_unlock(S);
+
+	/* NB: w may already be gone */
+	lua_pushinteger(L, id);
+
+	return 1;
+} /* sched_submit() */
+
+
+/*
+ * Returns id, function, args... for the next item; nil if nothing is
+ * queued; or false once the scheduler is closed and fully drained.
+ */
+static int sched_take(lua_State *L) {
+	struct ctsched_ud *ud = sched_checkslot(L, 1);
+	struct ctsched *S = ud->S;
+	struct ctslot *self = &S->slot[ud->slot];
+	struct ctwork *w;
+	_Bool sealed;
+	int nret;
+
+	sched_calm(self->pipe[0]);
+
+	if (!(w = sched_find(S, ud->slot))) {
+		/* announce, then look again in case a submitter missed us */
+		lf_lock(S);
+		lf_xchg(&self->idle, 1);
+		lf_unlock(S);
+
+		lf_fence();
+
+		/* once sealed, anything not found below never will be */
+		sealed = lf_load(&S->sealed);
+
+		if (!(w = sched_find(S, ud->slot))) {
+			if (sealed)
+				lua_pushboolean(L, 0);
+			else
+				lua_pushnil(L);
+
+			return 1;
+		}
+	}
+
+	lf_lock(S);
+	lf_xchg(&self->idle, 0);
+	lf_unlock(S);
+
+	lua_pushinteger(L, w->id);
+	nret = 1 + sched_unpack(L, w);
+	free(w);
+
+	return nret;
+} /* sched_take() */
+
+
+static int sched_reply(lua_State *L) {
+	struct ctsched *S = sched_checkslot(L, 1)->S;
+	lua_Integer id = luaL_checkinteger(L, 2);
+	struct ctwork *w;
+
+	w = sched_pack(L, 3, lua_gettop(L));
+	w->id = id;
+
+	pthread_mutex_lock(&S->mutex);
+	TAILQ_INSERT_TAIL(&S->done, w, tqe);
+	lf_count(&S->stats.completed);
+	sched_poke(S->pipe[1]);
+	pthread_mutex_unlock(&S->mutex);
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* sched_reply() */
+
+
+/* returns id, results... for the next completed item, or nil */
+static int sched_result(lua_State *L) {
+	struct ctsched *S = sched_checkud(L, 1)->S;
+	struct ctwork *w;
+	int nret;
+
+	pthread_mutex_lock(&S->mutex);
+
+	if ((w = TAILQ_FIRST(&S->done)))
+		TAILQ_REMOVE(&S->done, w, tqe);
+
+	if (TAILQ_EMPTY(&S->done))
+		sched_calm(S->pipe[0]);
+
+	pthread_mutex_unlock(&S->mutex);
+
+	if (!w) {
+		lua_pushnil(L);
+
+		return 1;
+	}
+
+	lua_pushinteger(L, w->id);
+	nret = 1 + sched_unpack(L, w);
+	free(w);
+
+	return nret;
+} /* sched_result() */
+
+
+/*
+ * Refuse new work and wake every worker so they drain and exit. Workers
+ * only give up once submits already under way have published their
+ * items, which takes no longer than a push.
+ */
+static int sched_close(lua_State *L) {
+	struct ctsched *S = sched_checkud(L, 1)->S;
+	int submitting;
+
+	lf_lock(S);
+	lf_xchg(&S->closed, 1);
+	lf_unlock(S);
+
+	lf_fence();
+
+	for (;;) {
+		lf_lock(S);
+		submitting = lf_load(&S->submitting);
+		lf_unlock(S);
+
+		if (!submitting)
+			break;
+
+		sched_yield();
+	}
+
+	lf_lock(S);
+	lf_xchg(&S->sealed, 1);
+	lf_unlock(S);
+
+	for (unsigned i = 0; i < S->nslot; i++) {
+		lf_lock(S);
+		lf_xchg(&S->slot[i].idle, 0);
+		lf_unlock(S);
+
+		sched_poke(S->slot[i].pipe[1]);
+	}
+
+	lua_pushboolean(L, 1);
+
+	return 1;
+} /* sched_close() */
+
+
+static int sched_stats(lua_State *L) {
+	struct ctsched *S = sched_checkud(L, 1)->S;
+	unsigned long long submitted, completed, stolen;
+	lua_Integer queued = 0;
+
+	lf_lock(S);
+	submitted = lf_load(&S->stats.submitted);
+	completed = lf_load(&S->stats.completed);
+	stolen = lf_load(&S->stats.stolen);
+	lf_unlock(S);
+
+	for (unsigned i = 0; i < S->nslot; i++)
+		queued += deque_count(S, &S->slot[i].deque);
+
+	pthread_mutex_lock(&S->mutex);
+	queued += S->noverflow;
+	pthread_mutex_unlock(&S->mutex);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, submitted);
+	lua_setfield(L, -2, "submitted");
+	lua_pushinteger(L, completed);
+	lua_setfield(L, -2, "completed");
+	lua_pushinteger(L, stolen);
+	lua_setfield(L, -2, "stolen");
+	lua_pushinteger(L, queued);
+	lua_setfield(L, -2, "queued");
+
+	return 1;
+} /* sched_stats() */
+
+
+static int sched_slot(lua_State *L) {
+	struct ctsched_ud *ud = sched_checkud(L, 1);
+
+	if (ud->slot >= 0)
+		lua_pushinteger(L, ud->slot + 1);
+	else
+		lua_pushnil(L);
+
+	return 1;
+} /* sched_slot() */
+
+
+static int sched_pollfd(lua_State *L) {
+	struct ctsched_ud *ud = sched_checkud(L, 1);
+
+	if (ud->slot >= 0)
+		lua_pushinteger(L, ud->S->slot[ud->slot].pipe[0]);
+	else
+		lua_pushinteger(L, ud->S->pipe[0]);
+
+	return 1;
+} /* sched_pollfd() */
+
+
+static int sched_events(lua_State *L) {
+	sched_checkud(L, 1);
+
+	lua_pushliteral(L, "r");
+
+	return 1;
+} /* sched_events() */
+
+
+static int sched_timeout(lua_State *L) {
+	sched_checkud(L, 1);
+
+	return 0;
+} /* sched_timeout() */
+
+
+static int sched__gc(lua_State *L) {
+	struct ctsched_ud *ud = luaL_checkudata(L, 1, CQS_SCHED);
+
+	sched_release(ud->S);
+	ud->S = NULL;
+
+	return 0;
+} /* sched__gc() */
+
+
+/*
+ * C H A N N E L
+ *
+ * A bounded ring of messages between LWP threads which doesn't take a
+ * lock or make a system call to pass a message. Cells carry a sequence
+ * number as in Dmitry Vyukov's bounded MPMC queue, so any number of
+ * senders and receivers may share a channel, though one receiver is the
+ * intended use. A message of a single nil, boolean, number or light
+ * userdata value lives in the cell; anything else is serialized like
+ * scheduler work items.
+ *
+ * Each direction has a wakeup descriptor which is only signaled when
+ * the other side has said it's about to sleep: a receiver finding the
+ * ring empty raises .recv.waiting and retries once before polling, and
+ * a sender checks the flag after publishing. The sequentially
+ * consistent fences order the flag against the ring so one of them
+ * always sees the other. Senders waiting for space use .send likewise.
+ */
+#define CHAN_MAXSIZE (1U << 20)
+#define CHAN_CACHELINE 64
+
+struct ctmsg {
+	struct ctwork *work; /* NULL if .arg holds the message */
+	struct cthread_arg arg;
+}; /* struct ctmsg */
+
+struct ctcell {
+	size_t seq;
+	struct ctmsg msg;
+}; /* struct ctcell */
+
+struct ctwake {
+	int waiting;
+	int fd[2]; /* fd[0] == fd[1] with eventfd */
+}; /* struct ctwake */
+
+struct ctchan {
+	/* written by senders */
+	size_t tail;
+	char pad0[CHAN_CACHELINE - sizeof (size_t)];
+
+	/* written by receivers */
+	size_t head;
+	char pad1[CHAN_CACHELINE - sizeof (size_t)];
+
+	struct ctwake recv, send;
+	int closed;
+
+	struct {
+		unsigned long sent, received, full, wakeups;
+	} stats;
+
+	pthread_mutex_t mutex;
+	struct ctref ref;
+
+	size_t mask;
+	struct ctcell cell[];
+}; /* struct ctchan */
+
+
+static int wake_init(struct ctwake *wake) {
+	wake->waiting = 0;
+#if HAVE_EVENTFD
+	if (-1 == (wake->fd[0] = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK)))
+		return errno;
+
+	wake->fd[1] = wake->fd[0];
+
+	return 0;
+#else
+	return cqs_pipe(wake->fd, O_NONBLOCK|O_CLOEXEC);
+#endif
+} /* wake_init() */
+
+
+static void wake_destroy(struct ctwake *wake) {
+	if (wake->fd[1] != wake->fd[0])
+		cqs_closefd(&wake->fd[1]);
+
+	wake->fd[1] = -1;
+	cqs_closefd(&wake->fd[0]);
+} /* wake_destroy() */
+
+
+static void wake_poke(struct ctwake *wake) {
+#if HAVE_EVENTFD
+	static const uint64_t one = 1;
+
+	while (-1 == write(wake->fd[1], &one, sizeof one)) {
+		if (errno != EINTR)
+			break;
+	}
+#else
+	sched_poke(wake->fd[1]);
+#endif
+} /* wake_poke() */
+
+
+static void wake_calm(struct ctwake *wake) {
+#if HAVE_EVENTFD
+	uint64_t n;
+
+	while (-1 == read(wake->fd[0], &n, sizeof n)) {
+		if (errno != EINTR)
+			break;
+	}
+#else
+	sched_calm(wake->fd[0]);
+#endif
+} /* wake_calm() */
+
+
+/* signal the other side if it announced it was going to sleep */
+static _Bool wake_signal(struct ctchan *C, struct ctwake *wake) {
+	_Bool waiting;
+
+	lf_fence();
+
+	lf_lock(C);
+	if ((waiting = lf_load(&wake->waiting) && lf_xchg(&wake->waiting, 0)))
+		lf_count(&C->stats.wakeups);
+	lf_unlock(C);
+
+	if (waiting)
+		wake_poke(wake);
+
+	return waiting;
+} /* wake_signal() */
+
+
+/* announce we're going to sleep; caller must retry before polling */
+static void wake_wait(struct ctchan *C, struct ctwake *wake) {
+	wake_calm(wake);
+
+	lf_lock(C);
+	lf_xchg(&wake->waiting, 1);
+	lf_unlock(C);
+
+	lf_fence();
+} /* wake_wait() */
+
+
+static void msg_free(struct ctmsg *msg) {
+	free(msg->work);
+	msg->work = NULL;
+} /* msg_free() */
+
+
+static _Bool chan_trypush(struct ctchan *C, struct ctmsg *msg) {
+	struct ctcell *cell;
+	size_t pos, seq;
+	_Bool ok = 0;
+
+	lf_lock(C);
+
+	pos = lf_load(&C->tail);
+
+	for (;;) {
+		cell = &C->cell[pos & C->mask];
+		seq = lf_load(&cell->seq);
+
+		if (seq == pos) {
+			if (lf_cas(&C->tail, &pos, pos + 1))
+				break;
+		} else if ((ptrdiff_t)(seq - pos) < 0) {
+			goto leave; /* full */
+		} else {
+			pos = lf_load(&C->tail);
+		}
+	}
+
+	cell->msg = *msg;
+	lf_store(&cell->seq, pos + 1);
+	ok = 1;
+leave:
+	lf_count((ok)? &C->stats.sent : &C->stats.full);
+	lf_unlock(C);
+
+	return ok;
+} /* chan_trypush() */
+
+
+static _Bool chan_trypop(struct ctchan *C, struct ctmsg *msg) {
+	struct ctcell *cell;
+	size_t pos, seq;
+	_Bool ok = 0;
+
+	lf_lock(C);
+
+	pos = lf_load(&C->head);
+
+	for (;;) {
+		cell = &C->cell[pos & C->mask];
+		seq = lf_load(&cell->seq);
+
+		if (seq == pos + 1) {
+			if (lf_cas(&C->head, &pos, pos + 1))
+				break;
+		} else if ((ptrdiff_t)(seq - (pos + 1)) < 0) {
+			goto leave; /* empty */
+		} else {
+			pos = lf_load(&C->head);
+		}
+	}
+
+	*msg = cell->msg;
+	lf_store(&cell->seq, pos + C->mask + 1);
+	lf_count(&C->stats.received);
+	ok = 1;
+leave:
+	lf_unlock(C);
+
+	return ok;
+} /* chan_trypop() */
+
+
+static void chan_release(struct ctchan *C) {
+	struct ctmsg msg;
+
+	if (!C || !ref_drop(&C->ref))
+		return;
+
+	while (chan_trypop(C, &msg))
+		msg_free(&msg);
+
+	wake_destroy(&C->recv);
+	wake_destroy(&C->send);
+
+	pthread_mutex_destroy(&C->mutex);
+
+	free(C);
+} /* chan_release() */
+
+
+static struct ctchan *chan_create(size_t size, int *_error) {
+	struct ctchan *C;
+	size_t n = 1, i;
+	int error;
+
+	while (n < size)
+		n <<= 1;
+
+	if ((error = posix_memalign((void **)&C, CHAN_CACHELINE, sizeof *C + n * sizeof *C->cell))) {
+		*_error = error;
+		return NULL;
+	}
+
+	memset(C, 0, sizeof *C);
+
+	if ((error = pthread_mutex_init(&C->mutex, NULL))) {
+		free(C);
+		*_error = error;
+		return NULL;
+	}
+
+	ref_init(&C->ref, CQS_CHANNEL, C);
+	C->mask = n - 1;
+	C->recv.fd[0] = C->recv.fd[1] = -1;
+	C->send.fd[0] = C->send.fd[1] = -1;
+
+	for (i = 0; i < n; i++) {
+		C->cell[i].seq = i;
+		C->cell[i].msg.work = NULL;
+	}
+
+	if ((error = wake_init(&C->recv)) || (error = wake_init(&C->send)))
 		goto error;
 
-	luaL_checktype(L, 1, LUA_TFUNCTION);
+	return C;
+error:
+	*_error = error;
 
-	if (!(ct->tmp.arg = calloc(sizeof *ct->tmp.arg, top)))
-		goto syerr;
+	chan_release(C);
 
-	for (int index = 1; index <= top; index++) {
-		struct cthread_arg *arg = &ct->tmp.arg[ct->tmp.argc];
+	return NULL;
+} /* chan_create() */
 
-		switch (lua_type(L, index)) {
-		case LUA_TNIL:
-			arg->type = LUA_TNIL;
-			break;
+
+struct ctchan_ud {
+	struct ctchan *C;
+}; /* struct ctchan_ud */
+
+
+static struct ctchan *chan_check(lua_State *L, int index) {
+	struct ctchan_ud *ud = luaL_checkudata(L, index, CQS_CHANNEL);
+
+	luaL_argcheck(L, ud->C, index, CQS_CHANNEL " expected, got NULL");
+
+	return ud->C;
+} /* chan_check() */
+
+
+/*
+ * channel.new(size) creates a channel holding up to size messages,
+ * rounded up to a power of 2. channel.new(handle) adopts the reference
+ * produced by channel:handle() in another Lua state.
+ */
+static int chan_new(lua_State *L) {
+	struct ctchan_ud *ud;
+	int error;
+
+	ud = lua_newuserdata(L, sizeof *ud);
+	ud->C = NULL;
+
+	luaL_getmetatable(L, CQS_CHANNEL);
+	lua_setmetatable(L, -2);
+
+	if (lua_islightuserdata(L, 1)) {
+		ud->C = ref_adopt(lua_touserdata(L, 1), CQS_CHANNEL);
+
+		luaL_argcheck(L, ud->C, 1, "invalid or already adopted channel handle");
+	} else {
+		lua_Integer size = luaL_optinteger(L, 1, 256);
+
+		luaL_argcheck(L, size >= 1 && size <= CHAN_MAXSIZE, 1, "channel size out of range");
+
+		if (!(ud->C = chan_create(size, &error))) {
+			lua_pushnil(L);
+			lua_pushinteger(L, error);
+
+			return 2;
+		}
+	}
+
+	return 1;
+} /* chan_new() */
+
+
+static int chan_type(lua_State *L) {
+	if (luaL_testudata(L, 1, CQS_CHANNEL)) {
+		lua_pushstring(L, "channel");
+	} else {
+		lua_pushnil(L);
+	}
+
+	return 1;
+} /* chan_type() */
+
+
+static int chan_interpose(lua_State *L) {
+	return cqs_interpose(L, CQS_CHANNEL);
+} /* chan_interpose() */
+
+
+/* take a reference for transfer to another Lua state via chan_new */
+static int chan_handle(lua_State *L) {
+	struct ctchan *C = chan_check(L, 1);
+
+	lua_pushlightuserdata(L, ref_handle(&C->ref));
+
+	return 1;
+} /* chan_handle() */
+
+
+/*
+ * Non-blocking. Returns true; false and EAGAIN if the channel is full;
+ * or nil and EPIPE once it's closed.
+ */
+static int chan_trysend(lua_State *L) {
+	struct ctchan *C = chan_check(L, 1);
+	int top = lua_gettop(L);
+	struct ctmsg msg = { NULL };
+	int error;
+
+	luaL_argcheck(L, top >= 2 && !lua_isnil(L, 2), 2, "message expected");
+
+	if (lf_load(&C->closed)) {
+		error = EPIPE;
+		goto error;
+	}
+
+	if (top == 2 && lua_type(L, 2) != LUA_TSTRING && lua_type(L, 2) != LUA_TFUNCTION) {
+		msg.arg.type = lua_type(L, 2);
+
+		switch (msg.arg.type) {
 		case LUA_TNUMBER:
 #if LUA_VERSION_NUM >= 503
-			if (lua_isinteger(L, index)) {
-				arg->v.integer = lua_tointeger(L, index);
-				arg->isinteger = 1;
-				arg->type = LUA_TNUMBER;
+			if (lua_isinteger(L, 2)) {
+				msg.arg.v.integer = lua_tointeger(L, 2);
+				msg.arg.isinteger = 1;
 				break;
 			}
 #endif
-			arg->v.number = lua_tonumber(L, index);
-			arg->type = LUA_TNUMBER;
+			msg.arg.v.number = lua_tonumber(L, 2);
 			break;
 		case LUA_TBOOLEAN:
-			arg->v.boolean = lua_toboolean(L, index);
-			arg->type = LUA_TBOOLEAN;
+			msg.arg.v.boolean = lua_toboolean(L, 2);
 			break;
 		case LUA_TLIGHTUSERDATA:
-			arg->v.pointer = lua_touserdata(L, index);
-			arg->type = LUA_TLIGHTUSERDATA;
-			break;
-		case LUA_TFUNCTION:
-			if ((error = ct_setfarg(L, ct, arg, index)))
-				goto error;
+			msg.arg.v.pointer = lua_touserdata(L, 2);
 			break;
 		default:
-			/* FALL THROUGH (maybe has __tostring metamethod) */
-		case LUA_TSTRING:
-			arg->v.string.iov_base = (char *)luaL_checklstring(L, index, &arg->v.string.iov_len);
-			arg->type = LUA_TSTRING;
-			break;
+			return luaL_argerror(L, 2, lua_pushfstring(L, "%s cannot be sent", luaL_typename(L, 2)));
 		}
-
-		ct->tmp.argc++;
+	} else {
+		msg.work = sched_pack(L, 2, top);
 	}
 
-	/* we may have added more stack objects above the thread object */
-	luaL_checkstack(L, 2, "too many arguments");
-	lua_pushvalue(L, top + 1);
-
-	if (0 != cqs_socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, ct->tmp.fd, O_NONBLOCK|O_CLOEXEC))
-		goto syerr;
-
-	if ((error = cqs_socket_fdopen(L, ct->tmp.fd[0], NULL)))
-		goto error;
-
-	ct->tmp.fd[0] = -1;
-
-	sigfillset(&mask);
-	sigemptyset(&omask);
-	if ((error = pthread_sigmask(SIG_SETMASK, &mask, &omask)))
-		goto error;
-
-	pthread_mutex_lock(&ct->mutex);
+	if (!chan_trypush(C, &msg)) {
+		/* announce, then retry in case a receiver just made room */
+		wake_wait(C, &C->send);
 
-	if (!(error = pthread_create(&ct->id, &ct->attr, &ct_enter, ct)))
-		pthread_cond_wait(&ct->cond, &ct->mutex);
+		if (!chan_trypush(C, &msg)) {
+			msg_free(&msg);
+			lua_pushboolean(L, 0);
+			lua_pushinteger(L, EAGAIN);
 
-	pthread_mutex_unlock(&ct->mutex);
+			return 2;
+		}
+	}
 
-	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+	wake_signal(C, &C->recv);
 
-	if (error)
-		goto error;
+	lua_pushboolean(L, 1);
 
-	return 2;
-syerr:
-	error = errno;
+	return 1;
 error:
-	lua_settop(L, 0);
-
-	lua_pushnil(L);
 	lua_pushnil(L);
 	lua_pushinteger(L, error);
 
-	return 3;
-} /* ct_start() */
-
+	return 2;
+} /* chan_trysend() */
 
-static int ct_join(lua_State *L) {
-	struct cthread *ct = ct_checkthread(L, 1);
-	int error;
 
-	if (pthread_equal(ct->id, pthread_self()))
-		return luaL_error(L, "thread.join: cannot join self");
+/*
+ * Non-blocking. Returns the values of the next message; nil and EAGAIN
+ * if there's none; or nil and EPIPE once the channel is closed and
+ * drained.
+ */
+static int chan_tryrecv(lua_State *L) {
+	struct ctchan *C = chan_check(L, 1);
+	struct ctmsg msg;
+	int nret;
 
-	if (0 == read(ct->pipe[0], &(char){ 0 }, 1)) {
-		lua_pushboolean(L, 1);
+	if (!chan_trypop(C, &msg)) {
+		/* announce, then retry in case a sender just published */
+		wake_wait(C, &C->recv);
 
-		if (ct->error)
-			lua_pushinteger(L, ct->error);
-		else if (ct->msg)
-			lua_pushstring(L, ct->msg);
-		else
+		if (!chan_trypop(C, &msg)) {
 			lua_pushnil(L);
+			lua_pushinteger(L, (lf_load(&C->closed))? EPIPE : EAGAIN);
 
-		return 2;
-	} else {
-		error = errno;
+			return 2;
+		}
+	}
 
-		if (error == EAGAIN && !hdl_isheld(&ct->handle))
-			error = CT_EOWNERDEAD;
+	wake_signal(C, &C->send);
 
-		lua_pushboolean(L, 0);
-		lua_pushinteger(L, error);
+	if (msg.work) {
+		nret = sched_unpack(L, msg.work);
+		msg_free(&msg);
 
-		return 2;
+		return nret;
+	}
+
+	switch (msg.arg.type) {
+	case LUA_TNUMBER:
+		if (msg.arg.isinteger) {
+			lua_pushinteger(L, msg.arg.v.integer);
+		} else {
+			lua_pushnumber(L, msg.arg.v.number);
+		}
+		break;
+	case LUA_TBOOLEAN:
+		lua_pushboolean(L, msg.arg.v.boolean);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		lua_pushlightuserdata(L, msg.arg.v.pointer);
+		break;
+	default:
+		lua_pushnil(L);
+		break;
 	}
-} /* ct_join() */
 
+	return 1;
+} /* chan_tryrecv() */
 
-static int ct_pollfd(lua_State *L) {
-	struct cthread *ct = ct_checkthread(L, 1);
 
-	lua_pushinteger(L, ct->pipe[0]);
+/* refuse new messages and wake both sides; queued messages remain */
+static int chan_close(lua_State *L) {
+	struct ctchan *C = chan_check(L, 1);
+
+	lf_xchg(&C->closed, 1);
+	wake_poke(&C->recv);
+	wake_poke(&C->send);
+
+	lua_pushboolean(L, 1);
 
 	return 1;
-} /* ct_pollfd() */
+} /* chan_close() */
+
+
+static int chan_stats(lua_State *L) {
+	struct ctchan *C = chan_check(L, 1);
+	size_t head = lf_load(&C->head), tail = lf_load(&C->tail);
+
+	lua_createtable(L, 0, 6);
+	lua_pushinteger(L, (lua_Integer)C->stats.sent);
+	lua_setfield(L, -2, "sent");
+	lua_pushinteger(L, (lua_Integer)C->stats.received);
+	lua_setfield(L, -2, "received");
+	lua_pushinteger(L, (lua_Integer)C->stats.full);
+	lua_setfield(L, -2, "full");
+	lua_pushinteger(L, (lua_Integer)C->stats.wakeups);
+	lua_setfield(L, -2, "wakeups");
+	lua_pushinteger(L, (lua_Integer)((tail > head)? tail - head : 0));
+	lua_setfield(L, -2, "queued");
+	lua_pushinteger(L, (lua_Integer)C->mask + 1);
+	lua_setfield(L, -2, "size");
 
+	return 1;
+} /* chan_stats() */
 
-static int ct_events(lua_State *L) {
-	ct_checkthread(L, 1);
 
-	lua_pushliteral(L, "r");
+/* descriptor a blocked sender polls for space */
+static int chan_spacefd(lua_State *L) {
+	lua_pushinteger(L, chan_check(L, 1)->send.fd[0]);
 
 	return 1;
-} /* ct_events() */
+} /* chan_spacefd() */
 
 
-static int ct_timeout(lua_State *L) {
-	ct_checkthread(L, 1);
+static int chan_pollfd(lua_State *L) {
+	lua_pushinteger(L, chan_check(L, 1)->recv.fd[0]);
 
-	return 0;
-} /* ct_timeout() */
+	return 1;
+} /* chan_pollfd() */
 
 
-static int ct__eq(lua_State *L) {
-	struct cthread **a = luaL_testudata(L, 1, CQS_THREAD);
-	struct cthread **b = luaL_testudata(L, 2, CQS_THREAD);
+static int chan_events(lua_State *L) {
+	chan_check(L, 1);
 
-	lua_pushboolean(L, a && b && (*a == *b));
+	lua_pushliteral(L, "r");
 
 	return 1;
-} /* ct__eq() */
+} /* chan_events() */
 
 
-static int ct__gc(lua_State *L) {
-	struct cthread **ud = luaL_checkudata(L, 1, CQS_THREAD);
+static int chan_timeout(lua_State *L) {
+	chan_check(L, 1);
 
-	ct_release(*ud);
-	*ud = NULL;
+	return 0;
+} /* chan_timeout() */
+
+
+static int chan__gc(lua_State *L) {
+	struct ctchan_ud *ud = luaL_checkudata(L, 1, CQS_CHANNEL);
+
+	chan_release(ud->C);
+	ud->C = NULL;
 
 	return 0;
-} /* ct__gc() */
+} /* chan__gc() */
+
+
+static const luaL_Reg sched_methods[] = {
+	{ "handle",  &sched_handle },
+	{ "submit",  &sched_submit },
+	{ "take",    &sched_take },
+	{ "reply",   &sched_reply },
+	{ "result",  &sched_result },
+	{ "close",   &sched_close },
+	{ "stats",   &sched_stats },
+	{ "slot",    &sched_slot },
+	{ "pollfd",  &sched_pollfd },
+	{ "events",  &sched_events },
+	{ "timeout", &sched_timeout },
+	{ NULL,      NULL }
+};
 
 
-static int ct_type(lua_State *L) {
-	if (luaL_testudata(L, 1, CQS_THREAD)) {
-		lua_pushstring(L, "thread");
-	} else {
-		lua_pushnil(L);
-	}
+static const luaL_Reg sched_metamethods[] = {
+	{ "__gc", &sched__gc },
+	{ NULL,   NULL }
+};
 
-	return 1;
-} /* ct_type() */
 
+static const luaL_Reg chan_methods[] = {
+	{ "handle",  &chan_handle },
+	{ "trysend", &chan_trysend },
+	{ "tryrecv", &chan_tryrecv },
+	{ "close",   &chan_close },
+	{ "stats",   &chan_stats },
+	{ "spacefd", &chan_spacefd },
+	{ "pollfd",  &chan_pollfd },
+	{ "events",  &chan_events },
+	{ "timeout", &chan_timeout },
+	{ NULL,      NULL }
+};
 
-static int ct_interpose(lua_State *L) {
-	return cqs_interpose(L, CQS_THREAD);
-} /* ct_interpose() */
 
+static const luaL_Reg chan_metamethods[] = {
+	{ "__gc", &chan__gc },
+	{ NULL,   NULL }
+};
 
-static int ct_self(lua_State *L) {
-	lua_rawgetp(L, LUA_REGISTRYINDEX, &selfindex);
 
-	return 1;
-} /* ct_self() */
+static const luaL_Reg chan_globals[] = {
+	{ "new",       &chan_new },
+	{ "type",      &chan_type },
+	{ "interpose", &chan_interpose },
+	{ NULL,        NULL }
+};
 
 
 static const luaL_Reg ct_methods[] = {
@@ -820,6 +2861,11 @@ static const luaL_Reg ct_globals[] = {
 	{ "type",      &ct_type },
 	{ "interpose", &ct_interpose },
 	{ "self",      &ct_self },
+	{ "setaffinity", &ct_setaffinity },
+	{ "ncpu",      &ct_ncpu },
+	{ "prewarm",   &ct_prewarm },
+	{ "warmstats", &ct_warmstats },
+	{ "scheduler", &sched_new },
 	{ NULL,        NULL }
 };
 
@@ -838,6 +2884,7 @@ int luaopen__cqueues_thread(lua_State *L) {
 	}
 
 	cqs_newmetatable(L, CQS_THREAD, ct_methods, ct_metamethods, 0);
+	cqs_newmetatable(L, CQS_SCHED, sched_methods, sched_metamethods, 0);
 
 	luaL_newlib(L, ct_globals);
 
@@ -845,6 +2892,15 @@ int luaopen__cqueues_thread(lua_State *L) {
 } /* luaopen__cqueues_thread() */
 
 
+int luaopen__cqueues_thread_channel(lua_State *L) {
+	cqs_newmetatable(L, CQS_CHANNEL, chan_methods, chan_metamethods, 0);
+
+	luaL_newlib(L, chan_globals);
+
+	return 1;
+} /* luaopen__cqueues_thread_channel() */
+
+
 /*
  * OpenSSL is not thread-safe without explicit locking handlers installed.
  */
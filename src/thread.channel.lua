@@ -0,0 +1,97 @@
+local loader = function(loader, ...)
+	local channel = require"_cqueues.thread.channel"
+	local cqueues = require"cqueues"
+	local errno = require"cqueues.errno"
+	local monotime = cqueues.monotime
+	local poll = cqueues.poll
+	local EAGAIN = errno.EAGAIN
+	local ETIMEDOUT = errno.ETIMEDOUT
+
+	--
+	-- channel:send, channel:xsend
+	--
+	-- Blocks while the ring is full, up to timeout seconds for :xsend.
+	-- Receivers only signal the space descriptor once a sender has
+	-- announced itself, so an uncontended channel never enters the
+	-- kernel.
+	--
+	local function send(self, timeout, ...)
+		local deadline = timeout and (monotime() + timeout)
+		local space
+
+		while true do
+			local ok, why = self:trysend(...)
+
+			if ok then
+				return true
+			elseif why ~= EAGAIN then
+				return false, why
+			end
+
+			space = space or { pollfd = self:spacefd(), events = "r" }
+
+			if deadline then
+				local curtime = monotime()
+
+				if curtime >= deadline then
+					return false, ETIMEDOUT
+				end
+
+				poll(space, deadline - curtime)
+			else
+				poll(space)
+			end
+		end
+	end -- send
+
+	channel.interpose("send", function (self, ...)
+		return send(self, nil, ...)
+	end)
+
+	channel.interpose("xsend", function (self, timeout, ...)
+		return send(self, timeout, ...)
+	end)
+
+	--
+	-- channel:recv
+	--
+	-- Returns the values of the next message, waiting up to timeout
+	-- seconds for one. Returns nil and EPIPE once the channel is closed
+	-- and drained, or nil and ETIMEDOUT.
+	--
+	local function retry(self, deadline, v, ...)
+		if v ~= nil or ... ~= EAGAIN then
+			return false, v, ...
+		elseif deadline then
+			local curtime = monotime()
+
+			if curtime >= deadline then
+				return false, nil, ETIMEDOUT
+			end
+
+			poll(self, deadline - curtime)
+		else
+			poll(self)
+		end
+
+		return true
+	end -- retry
+
+	local function recv(self, deadline, again, ...)
+		if again then
+			return recv(self, deadline, retry(self, deadline, self:tryrecv()))
+		else
+			return ...
+		end
+	end -- recv
+
+	channel.interpose("recv", function (self, timeout)
+		return recv(self, timeout and (monotime() + timeout), true)
+	end)
+
+	channel.loader = loader
+
+	return channel
+end -- loader
+
+return loader(loader, ...)
@@ -24,6 +24,7 @@ local loader = function(loader, ...)
 		"cqueues.socket",
 		"cqueues.signal",
 		"cqueues.thread",
+		"cqueues.thread.channel",
 		"cqueues.notify",
 	}
 
@@ -37,9 +38,12 @@ local loader = function(loader, ...)
 				end
 			end
 
+			-- warm threads (see thread.prewarm) already have them
 			local function preload(name, code)
-				local loader = loadblob(code, nil, "bt", _ENV)
-				package.loaded[name] = loader(loader, name)
+				if not package.loaded[name] then
+					local loader = loadblob(code, nil, "bt", _ENV)
+					package.loaded[name] = loader(loader, name)
+				end
 			end
 
 			local function unpack(n, ...)
@@ -108,6 +112,187 @@ local loader = function(loader, ...)
 	end)
 
 
+	--
+	-- thread.pool
+	--
+	-- Run serialized function calls on a pool of LWP threads, each with
+	-- its own controller, sharing a work-stealing scheduler. Functions and
+	-- arguments are subject to the same restrictions as thread.start, and
+	-- so are the results, which are returned pcall-style.
+	--
+	local unpack = assert(table.unpack or unpack) -- 5.1 compat
+
+	local function poolworker(pipe, handle, slot, cpu)
+		local cqueues = require"cqueues"
+		local thread = require"cqueues.thread"
+		local sched = thread.scheduler(handle, slot)
+
+		if cpu then
+			thread.setaffinity(cpu)
+		end
+
+		local function reply(id, ...)
+			if not pcall(sched.reply, sched, id, ...) then
+				sched:reply(id, false, "unable to serialize results")
+			end
+		end
+
+		local function run(id, f, ...)
+			if id then
+				reply(id, pcall(f, ...))
+			end
+
+			return id
+		end
+
+		local cq = cqueues.new()
+
+		cq:wrap(function ()
+			while true do
+				local id = run(sched:take())
+
+				if id == false then
+					break
+				elseif id == nil then
+					cqueues.poll(sched)
+				end
+			end
+		end)
+
+		assert(cq:loop())
+	end -- poolworker
+
+	local pool = {}
+
+	pool.__index = pool
+
+	function thread.pool(opts)
+		local condition = require"cqueues.condition"
+
+		opts = opts or {}
+
+		local count = opts.count or thread.ncpu() or 1
+		local sched, why = thread.scheduler(count)
+
+		if not sched then
+			return nil, why
+		end
+
+		local self = setmetatable({
+			sched = sched,
+			threads = {},
+			pipes = {},
+			results = {},
+			cond = condition.new(),
+		}, pool)
+
+		for i = 1, count do
+			local handle = sched:handle()
+			local cpu = opts.affinity and (i - 1) % (thread.ncpu() or 1)
+			local thr, pipe, why = thread.start(poolworker, handle, i, cpu)
+
+			if not thr then
+				thread.scheduler(handle) -- drop the transferred reference
+				self:close()
+
+				return nil, why
+			end
+
+			self.threads[i] = thr
+			self.pipes[i] = pipe
+		end
+
+		return self
+	end -- thread.pool
+
+	function pool:submit(f, ...)
+		return self.sched:submit(f, ...)
+	end -- pool:submit
+
+	local function stash(self, id, ...)
+		if id then
+			self.results[id] = { n = select("#", ...), ... }
+		end
+
+		return id
+	end -- stash
+
+	function pool:wait(id, timeout)
+		local deadline = timeout and (monotime() + timeout)
+		local r
+
+		repeat
+			local collected = false
+
+			while stash(self, self.sched:result()) do
+				collected = true
+			end
+
+			-- other waiters may have been sleeping on our drained pipe
+			if collected then
+				self.cond:signal()
+			end
+
+			r = self.results[id]
+
+			if not r then
+				if deadline then
+					local curtime = monotime()
+
+					if curtime >= deadline then
+						return nil, ETIMEDOUT
+					end
+
+					poll(self.sched, self.cond, deadline - curtime)
+				else
+					poll(self.sched, self.cond)
+				end
+			end
+		until r
+
+		self.results[id] = nil
+
+		return unpack(r, 1, r.n)
+	end -- pool:wait
+
+	function pool:run(f, ...)
+		local id, why = self.sched:submit(f, ...)
+
+		if not id then
+			return nil, why
+		end
+
+		return self:wait(id)
+	end -- pool:run
+
+	function pool:stats()
+		return self.sched:stats()
+	end -- pool:stats
+
+	function pool:close(timeout)
+		local deadline = timeout and (monotime() + timeout)
+		local ok, why = true
+
+		self.sched:close()
+
+		for i = 1, #self.threads do
+			local ok_, why_ = self.threads[i]:join(deadline and math.max(0, deadline - monotime()))
+
+			if not ok_ and ok then
+				ok, why = false, why_
+			end
+		end
+
+		for i = 1, #self.pipes do
+			self.pipes[i]:close()
+		end
+
+		self.pipes = {}
+
+		return ok, why
+	end -- pool:close
+
+
 	thread.loader = loader
 
 	return thread
@@ -0,0 +1,314 @@
+local loader = function(loader, ...)
+	local cqueues = require"cqueues"
+	local thread = require"cqueues.thread"
+	local errno = require"cqueues.errno"
+	local monotime = cqueues.monotime
+	local ETIMEDOUT = errno.ETIMEDOUT
+	local unpack = assert(table.unpack or unpack) -- 5.1 compat
+
+	local workers = {}
+
+	workers.__index = workers
+
+	--
+	-- worker
+	--
+	-- Thread entry point. Runs in a fresh Lua state with no access to
+	-- our upvalues, so everything is passed in as arguments. Each worker
+	-- binds its own SO_REUSEPORT listener, letting the kernel spread
+	-- incoming connections across threads, and runs main(srv, ...) on a
+	-- private controller. A worker of a reloaded generation is passed
+	-- the descriptor of its predecessor's listener instead, and takes
+	-- over a duplicate of it. The supervisor manages the worker over a
+	-- line protocol on the thread pipe:
+	--
+	--   worker -> supervisor: "ready <i> <fd>", "error <i> <why>",
+	--                         "stats <i> <count> <reused> <kept>"
+	--   supervisor -> worker: "stats", "stop"
+	--
+	-- EOF on the pipe is treated like "stop".
+	--
+	local function worker(pipe, index, host, port, listenfd, cpu, main, ...)
+		local cqueues = require"cqueues"
+		local socket = require"cqueues.socket"
+		local thread = require"cqueues.thread"
+
+		local function report(fmt, ...)
+			pipe:write(string.format(fmt, ...), "\n")
+		end
+
+		if cpu then
+			thread.setaffinity(tonumber(cpu))
+		end
+
+		local cq, why = cqueues.new()
+
+		if not cq then
+			return report("error %d %s", index, tostring(why))
+		end
+
+		local load = loadstring or load
+		local main, why = load(main)
+
+		if not main then
+			return report("error %d %s", index, tostring(why))
+		end
+
+		local srv, why
+
+		if listenfd then
+			-- connections queued on the old listener stay queued
+			srv, why = socket.dup(tonumber(listenfd))
+		else
+			srv, why = socket.listen{
+				host = host,
+				port = port,
+				reuseaddr = true,
+				reuseport = true,
+			}
+		end
+
+		if srv then
+			srv:onerror(function (_, _, why) return why end)
+			why = select(2, srv:listen())
+		end
+
+		if why then
+			return report("error %d %s", index, tostring(why))
+		end
+
+		cq:wrap(main, srv, ...)
+
+		cq:wrap(function ()
+			for line in pipe:lines() do
+				if line == "stats" then
+					local stats = cq:stats()
+
+					report("stats %d %d %d %d", index, cq:count(), stats.reused, stats.kept)
+				elseif line == "stop" then
+					break
+				end
+			end
+
+			-- stop accepting but let established connections drain
+			cq:cancel(srv)
+			srv:close()
+		end)
+
+		report("ready %d %d", index, srv:pollfd())
+
+		for err in cq:errors() do
+			report("error %d %s", index, (tostring(err):gsub("\n", " ")))
+		end
+	end -- worker
+
+	local function dump(fn)
+		if type(fn) == "string" then
+			return fn
+		else
+			return string.dump(fn)
+		end
+	end -- dump
+
+	local function timeleft(deadline)
+		return deadline and math.max(0, deadline - monotime())
+	end -- timeleft
+
+	local function readline(self, pipe, deadline)
+		local line, why = pipe:xread("*l", timeleft(deadline))
+
+		if not line then
+			return nil, why or "worker exited"
+		end
+
+		return line
+	end -- readline
+
+	local function spawn(self, deadline, old)
+		local group = {}
+
+		for i = 1, self.count do
+			local cpu = self.affinity and self.affinity[(i - 1) % #self.affinity + 1]
+			local listenfd = old and old[i] and old[i].fd
+			local thr, pipe = thread.start(worker, i, self.host, self.port, listenfd, cpu, self.main, unpack(self.args, 1, self.args.n))
+
+			if not thr then
+				return nil, pipe, group
+			end
+
+			group[i] = { thread = thr, pipe = pipe }
+		end
+
+		for i = 1, #group do
+			local line, why = readline(self, group[i].pipe, deadline)
+
+			if not line then
+				return nil, why, group
+			elseif not line:match"^ready " then
+				return nil, line:match"^error %d+ (.*)$" or line, group
+			end
+
+			group[i].fd = tonumber(line:match"^ready %d+ (%d+)$")
+		end
+
+		return group
+	end -- spawn
+
+	local function halt(group, deadline)
+		for i = 1, #group do
+			group[i].pipe:xwrite("stop\n", "n", timeleft(deadline))
+		end
+
+		local ok, why = true
+
+		for i = 1, #group do
+			local ok_, why_ = group[i].thread:join(timeleft(deadline))
+
+			if not ok_ and ok then
+				ok, why = false, why_
+			end
+
+			group[i].pipe:close()
+		end
+
+		return ok, why
+	end -- halt
+
+	--
+	-- workers.start
+	--
+	-- Spawn opts.count threads (default: one per online CPU), each with
+	-- its own controller and listener bound to opts.host and opts.port.
+	-- main must be a function without upvalues (other than _ENV), or a
+	-- string.dump of one, and extra arguments follow the usual
+	-- thread.start restrictions.
+	--
+	function workers.start(opts, main, ...)
+		opts = opts or {}
+
+		local self = setmetatable({
+			count = opts.count or thread.ncpu() or 1,
+			host = opts.host or "0.0.0.0",
+			port = assert(opts.port, "no port specified"),
+			main = dump(assert(main, "no main function specified")),
+			args = { n = select("#", ...), ... },
+		}, workers)
+
+		if opts.affinity == true then
+			self.affinity = {}
+
+			for cpu = 0, (thread.ncpu() or 1) - 1 do
+				self.affinity[#self.affinity + 1] = cpu
+			end
+		elseif type(opts.affinity) == "table" then
+			self.affinity = opts.affinity
+		end
+
+		local group, why, partial = spawn(self, opts.timeout and monotime() + opts.timeout)
+
+		if not group then
+			halt(partial, opts.timeout and monotime() + opts.timeout)
+
+			return nil, why
+		end
+
+		self.group = group
+
+		return self
+	end -- workers.start
+
+	--
+	-- workers:stats
+	--
+	-- Collect per-worker controller statistics in worker order.
+	--
+	function workers:stats(timeout)
+		local deadline = timeout and monotime() + timeout
+		local list = {}
+
+		for i = 1, #self.group do
+			self.group[i].pipe:xwrite("stats\n", "n", timeleft(deadline))
+		end
+
+		for i = 1, #self.group do
+			local line, why
+
+			repeat
+				line, why = readline(self, self.group[i].pipe, deadline)
+
+				if not line then
+					return nil, why
+				end
+			until line:match"^stats "
+
+			local _, count, reused, kept = line:match"^stats (%d+) (%d+) (%d+) (%d+)$"
+
+			list[i] = { count = tonumber(count), reused = tonumber(reused), kept = tonumber(kept) }
+		end
+
+		return list
+	end -- workers:stats
+
+	--
+	-- workers:reload
+	--
+	-- Start a new generation of workers and, once they're all listening,
+	-- stop the old generation. Closing a SO_REUSEPORT listener resets
+	-- the connections queued on it, so rather than binding afresh each
+	-- new worker duplicates its predecessor's listener, which therefore
+	-- never closes.
+	--
+	function workers:reload(timeout)
+		local deadline = timeout and monotime() + timeout
+		local group, why, partial = spawn(self, deadline, self.group)
+
+		if not group then
+			halt(partial, deadline)
+
+			return nil, why
+		end
+
+		local old = self.group
+		self.group = group
+
+		return halt(old, deadline)
+	end -- workers:reload
+
+	--
+	-- workers:stop
+	--
+	-- Ask every worker to close its listener. Workers exit once their
+	-- remaining coroutines finish.
+	--
+	function workers:stop(timeout)
+		local group = self.group
+		self.group = {}
+
+		return halt(group, timeout and monotime() + timeout)
+	end -- workers:stop
+
+	--
+	-- workers:join
+	--
+	-- Wait for workers to exit on their own, e.g. after main returns.
+	--
+	function workers:join(timeout)
+		local deadline = timeout and monotime() + timeout
+
+		for i = 1, #self.group do
+			local ok, why = self.group[i].thread:join(timeleft(deadline))
+
+			if not ok then
+				return false, why or ETIMEDOUT
+			end
+		end
+
+		return true
+	end -- workers:join
+
+	workers.loader = loader
+
+	return workers
+end -- loader
+
+return loader(loader, ...)